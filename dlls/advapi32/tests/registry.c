@@ -1612,6 +1612,76 @@ static void test_reg_unload_key(void)
     DeleteFileA("saved_key.LOG");
 }
 
+static void test_reg_load_key_sections(void)
+{
+    static const char data[] =
+        "WINE REGISTRY Version 2\n"
+        "\n"
+        "[Dup] 1\n"
+        "\"a\"=\"first\"\n"
+        "\"b\"=\"first\"\n"
+        "\n"
+        "[Other] 1\n"
+        "\"c\"=\"other\"\n"
+        "\n"
+        "[Dup] 1\n"
+        "\"b\"=\"second\"\n";
+    char buffer[16];
+    DWORD ret, size;
+    HANDLE file;
+    HKEY hkey;
+
+    /* the text format is specific to Wine */
+    file = CreateFileA("dup_key", GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 0, 0);
+    ok(file != INVALID_HANDLE_VALUE, "CreateFile failed, error %u\n", GetLastError());
+    WriteFile(file, data, sizeof(data) - 1, &size, NULL);
+    CloseHandle(file);
+
+    if (!set_privileges(SE_RESTORE_NAME, TRUE) ||
+        !set_privileges(SE_BACKUP_NAME, FALSE))
+    {
+        win_skip("Failed to set SE_RESTORE_NAME privileges, skipping tests\n");
+        DeleteFileA("dup_key");
+        return;
+    }
+
+    ret = RegLoadKeyA(HKEY_LOCAL_MACHINE, "TestDup", "dup_key");
+    if (ret != ERROR_SUCCESS)
+    {
+        skip("text registry files not supported, error %u\n", ret);
+        set_privileges(SE_RESTORE_NAME, FALSE);
+        DeleteFileA("dup_key");
+        return;
+    }
+
+    /* values of a repeated key section are merged, the last one wins */
+    ret = RegOpenKeyA(HKEY_LOCAL_MACHINE, "TestDup\\Dup", &hkey);
+    ok(ret == ERROR_SUCCESS, "expected ERROR_SUCCESS, got %d\n", ret);
+    size = sizeof(buffer);
+    ret = RegQueryValueExA(hkey, "a", NULL, NULL, (BYTE *)buffer, &size);
+    ok(ret == ERROR_SUCCESS, "expected ERROR_SUCCESS, got %d\n", ret);
+    ok(!strcmp(buffer, "first"), "got %s\n", buffer);
+    size = sizeof(buffer);
+    ret = RegQueryValueExA(hkey, "b", NULL, NULL, (BYTE *)buffer, &size);
+    ok(ret == ERROR_SUCCESS, "expected ERROR_SUCCESS, got %d\n", ret);
+    ok(!strcmp(buffer, "second"), "got %s\n", buffer);
+    RegCloseKey(hkey);
+
+    /* the sections after the repeated one are loaded too */
+    ret = RegOpenKeyA(HKEY_LOCAL_MACHINE, "TestDup\\Other", &hkey);
+    ok(ret == ERROR_SUCCESS, "expected ERROR_SUCCESS, got %d\n", ret);
+    size = sizeof(buffer);
+    ret = RegQueryValueExA(hkey, "c", NULL, NULL, (BYTE *)buffer, &size);
+    ok(ret == ERROR_SUCCESS, "expected ERROR_SUCCESS, got %d\n", ret);
+    ok(!strcmp(buffer, "other"), "got %s\n", buffer);
+    RegCloseKey(hkey);
+
+    ret = RegUnLoadKeyA(HKEY_LOCAL_MACHINE, "TestDup");
+    ok(ret == ERROR_SUCCESS, "expected ERROR_SUCCESS, got %d\n", ret);
+    set_privileges(SE_RESTORE_NAME, FALSE);
+    DeleteFileA("dup_key");
+}
+
 /* tests that show that RegConnectRegistry and 
    OpenSCManager accept computer names without the
    \\ prefix (what MSDN says).   */
@@ -3856,6 +3926,7 @@ START_TEST(registry)
     test_reg_save_key();
     test_reg_load_key();
     test_reg_unload_key();
+    test_reg_load_key_sections();
     test_reg_copy_tree();
     test_reg_delete_tree();
     test_rw_order();
@@ -39,6 +39,7 @@
 #define HEAP_VALIDATE_PARAMS  0x40000000
 
 static BOOL (WINAPI *pHeapQueryInformation)(HANDLE, HEAP_INFORMATION_CLASS, PVOID, SIZE_T, PSIZE_T);
+static BOOL (WINAPI *pHeapSetInformation)(HANDLE, HEAP_INFORMATION_CLASS, PVOID, SIZE_T);
 static BOOL (WINAPI *pGetPhysicallyInstalledSystemMemory)(ULONGLONG *);
 static ULONG (WINAPI *pRtlGetNtGlobalFlags)(void);
 
@@ -892,6 +893,91 @@ static void test_HeapQueryInformation(void)
     ok(info == 0 || info == 1 || info == 2, "expected 0, 1 or 2, got %u\n", info);
 }
 
+static void test_low_fragmentation_heap(void)
+{
+    BYTE *p[64], *p2;
+    HANDLE heap;
+    ULONG info;
+    SIZE_T size;
+    BOOL ret;
+    int i;
+
+    pHeapSetInformation = (void *)GetProcAddress(GetModuleHandleA("kernel32.dll"), "HeapSetInformation");
+    if (!pHeapSetInformation || !pHeapQueryInformation)
+    {
+        win_skip("HeapSetInformation is not available\n");
+        return;
+    }
+
+    heap = HeapCreate(HEAP_NO_SERIALIZE, 0, 0);
+    ok(heap != NULL, "HeapCreate failed\n");
+    info = 2;
+    SetLastError(0xdeadbeef);
+    ret = pHeapSetInformation(heap, HeapCompatibilityInformation, &info, sizeof(info));
+    ok(!ret, "HeapSetInformation should fail on a HEAP_NO_SERIALIZE heap\n");
+    HeapDestroy(heap);
+
+    heap = HeapCreate(0, 0, 0x100000);
+    ok(heap != NULL, "HeapCreate failed\n");
+    info = 2;
+    ret = pHeapSetInformation(heap, HeapCompatibilityInformation, &info, sizeof(info));
+    ok(!ret, "HeapSetInformation should fail on a fixed-size heap\n");
+    info = 0xdeadbeef;
+    ret = pHeapQueryInformation(heap, HeapCompatibilityInformation, &info, sizeof(info), NULL);
+    ok(ret, "HeapQueryInformation error %u\n", GetLastError());
+    ok(info != 2, "expected no low-fragmentation heap, got %u\n", info);
+    HeapDestroy(heap);
+
+    heap = HeapCreate(0, 0, 0);
+    ok(heap != NULL, "HeapCreate failed\n");
+    info = 2;
+    ret = pHeapSetInformation(heap, HeapCompatibilityInformation, &info, sizeof(info));
+    if (!ret)
+    {
+        /* fails when heap debugging is enabled */
+        skip("low-fragmentation heap not available\n");
+        HeapDestroy(heap);
+        return;
+    }
+
+    info = 0xdeadbeef;
+    ret = pHeapQueryInformation(heap, HeapCompatibilityInformation, &info, sizeof(info), NULL);
+    ok(ret, "HeapQueryInformation error %u\n", GetLastError());
+    ok(info == 2, "expected 2, got %u\n", info);
+
+    for (i = 0; i < ARRAY_SIZE(p); i++)
+    {
+        p[i] = HeapAlloc(heap, HEAP_ZERO_MEMORY, i * 37);
+        ok(p[i] != NULL, "HeapAlloc failed\n");
+        ok(!((ULONG_PTR)p[i] % (2 * sizeof(void *))), "%u: wrong alignment %p\n", i, p[i]);
+        size = HeapSize(heap, 0, p[i]);
+        ok(size == i * 37, "%u: wrong size %lu\n", i, size);
+        ok(!i || (!p[i][0] && !p[i][i * 37 - 1]), "%u: block not zeroed\n", i);
+        memset(p[i], i, i * 37);
+        ok(HeapValidate(heap, 0, p[i]), "%u: HeapValidate failed\n", i);
+    }
+
+    p2 = HeapReAlloc(heap, HEAP_ZERO_MEMORY, p[10], 5000);
+    ok(p2 != NULL, "HeapReAlloc failed\n");
+    ok(p2[0] == 10 && p2[369] == 10 && !p2[370] && !p2[4999], "wrong block contents\n");
+    size = HeapSize(heap, 0, p2);
+    ok(size == 5000, "wrong size %lu\n", size);
+    p[10] = p2;
+
+    p2 = HeapReAlloc(heap, HEAP_REALLOC_IN_PLACE_ONLY, p[20], 20);
+    ok(p2 == p[20], "HeapReAlloc moved the block\n");
+    size = HeapSize(heap, 0, p2);
+    ok(size == 20, "wrong size %lu\n", size);
+
+    for (i = 0; i < ARRAY_SIZE(p); i++)
+    {
+        ret = HeapFree(heap, 0, p[i]);
+        ok(ret, "%u: HeapFree failed\n", i);
+    }
+
+    HeapDestroy(heap);
+}
+
 static void test_heap_checks( DWORD flags )
 {
     BYTE old, *p, *p2;
@@ -1245,6 +1331,7 @@ START_TEST(heap)
     test_sized_HeapReAlloc((1 << 20), 1);
 
     test_HeapQueryInformation();
+    test_low_fragmentation_heap();
     test_GetPhysicallyInstalledSystemMemory();
 
     if (pRtlGetNtGlobalFlags)
@@ -3708,6 +3708,72 @@ static void test_multiple_instances(void)
     CloseHandle(server[0]);
 }
 
+static void test_duplicate_partial_read(void)
+{
+    HANDLE server, client, dup;
+    char buf[16];
+    DWORD size;
+    BOOL ret;
+
+    server = CreateNamedPipeA(PIPENAME, PIPE_ACCESS_DUPLEX, PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT,
+                              1, 1024, 1024, NMPWAIT_USE_DEFAULT_WAIT, NULL);
+    ok(server != INVALID_HANDLE_VALUE, "CreateNamedPipe failed, error %u\n", GetLastError());
+    client = CreateFileA(PIPENAME, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    ok(client != INVALID_HANDLE_VALUE, "CreateFile failed, error %u\n", GetLastError());
+    size = PIPE_READMODE_MESSAGE;
+    ret = SetNamedPipeHandleState(client, &size, NULL, NULL);
+    ok(ret, "SetNamedPipeHandleState failed, error %u\n", GetLastError());
+
+    ret = WriteFile(server, "abcdefghij", 10, &size, NULL);
+    ok(ret && size == 10, "WriteFile failed, error %u\n", GetLastError());
+    ret = WriteFile(server, "klm", 3, &size, NULL);
+    ok(ret && size == 3, "WriteFile failed, error %u\n", GetLastError());
+
+    SetLastError(0xdeadbeef);
+    ret = ReadFile(client, buf, 4, &size, NULL);
+    ok(!ret && GetLastError() == ERROR_MORE_DATA, "got %d, error %u\n", ret, GetLastError());
+    ok(size == 4 && !memcmp(buf, "abcd", 4), "got %u bytes %.*s\n", size, (int)size, buf);
+
+    /* the rest of the message belongs to the pipe end, not to the handle */
+    ret = DuplicateHandle(GetCurrentProcess(), client, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    ok(ret, "DuplicateHandle failed, error %u\n", GetLastError());
+    CloseHandle(client);
+
+    SetLastError(0xdeadbeef);
+    ret = ReadFile(dup, buf, 4, &size, NULL);
+    ok(!ret && GetLastError() == ERROR_MORE_DATA, "got %d, error %u\n", ret, GetLastError());
+    ok(size == 4 && !memcmp(buf, "efgh", 4), "got %u bytes %.*s\n", size, (int)size, buf);
+    ret = ReadFile(dup, buf, sizeof(buf), &size, NULL);
+    ok(ret, "ReadFile failed, error %u\n", GetLastError());
+    ok(size == 2 && !memcmp(buf, "ij", 2), "got %u bytes %.*s\n", size, (int)size, buf);
+    ret = ReadFile(dup, buf, sizeof(buf), &size, NULL);
+    ok(ret, "ReadFile failed, error %u\n", GetLastError());
+    ok(size == 3 && !memcmp(buf, "klm", 3), "got %u bytes %.*s\n", size, (int)size, buf);
+
+    CloseHandle(dup);
+    CloseHandle(server);
+}
+
+static void test_direct_pipes(char **argv)
+{
+    PROCESS_INFORMATION pi;
+    STARTUPINFOA si = { sizeof(si) };
+    char cmdline[MAX_PATH];
+    BOOL ret;
+
+    /* run the tests that depend on the data transport again with direct pipes */
+    SetEnvironmentVariableA("WINEPIPEDIRECT", "1");
+    sprintf(cmdline, "%s %s direct", argv[0], argv[1]);
+    ret = CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
+    ok(ret, "CreateProcess failed, error %u\n", GetLastError());
+    SetEnvironmentVariableA("WINEPIPEDIRECT", NULL);
+    if (!ret) return;
+
+    winetest_wait_child_process(pi.hProcess);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+}
+
 START_TEST(pipe)
 {
     char **argv;
@@ -3726,6 +3792,14 @@ START_TEST(pipe)
 
     argc = winetest_get_mainargs(&argv);
 
+    if (argc > 2 && !strcmp(argv[2], "direct"))
+    {
+        test_CreateNamedPipe(PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE);
+        test_duplicate_partial_read();
+        test_overlapped_transport(TRUE, FALSE);
+        test_TransactNamedPipe();
+        return;
+    }
     if (argc > 3)
     {
         if (!strcmp(argv[2], "writepipe"))
@@ -3774,4 +3848,6 @@ START_TEST(pipe)
     test_namedpipe_process_id();
     test_namedpipe_session_id();
     test_multiple_instances();
+    test_duplicate_partial_read();
+    test_direct_pipes(argv);
 }
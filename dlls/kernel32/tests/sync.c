@@ -1340,6 +1340,87 @@ static void test_WaitForMultipleObjects(void)
     todo_wine ok(status == STATUS_INVALID_HANDLE, "expected STATUS_INVALID_HANDLE, got %08x\n", status);
 }
 
+#define WAIT_ALL_LOOPS 500
+
+static HANDLE wait_all_objs[2];
+static LONG wait_all_owners;
+
+static DWORD WINAPI wait_all_thread(void *arg)
+{
+    BOOL alertable = arg != NULL;
+    DWORD r;
+    int i;
+
+    for (i = 0; i < WAIT_ALL_LOOPS; i++)
+    {
+        r = WaitForMultipleObjectsEx(2, wait_all_objs, TRUE, 10000, alertable);
+        ok(r == WAIT_OBJECT_0, "WaitForMultipleObjectsEx returned %u\n", r);
+        if (r != WAIT_OBJECT_0) break;
+        ok(InterlockedIncrement(&wait_all_owners) == 1, "mutex owned by several threads\n");
+        InterlockedDecrement(&wait_all_owners);
+        ok(ReleaseMutex(wait_all_objs[0]), "ReleaseMutex failed, error %u\n", GetLastError());
+        ok(ReleaseSemaphore(wait_all_objs[1], 1, NULL), "ReleaseSemaphore failed, error %u\n", GetLastError());
+    }
+    return 0;
+}
+
+static DWORD WINAPI wait_semaphore_thread(void *arg)
+{
+    DWORD r;
+    int i;
+
+    for (i = 0; i < WAIT_ALL_LOOPS; i++)
+    {
+        r = WaitForSingleObject(wait_all_objs[1], 10000);
+        ok(r == WAIT_OBJECT_0, "WaitForSingleObject returned %u\n", r);
+        if (r != WAIT_OBJECT_0) break;
+        ok(ReleaseSemaphore(wait_all_objs[1], 1, NULL), "ReleaseSemaphore failed, error %u\n", GetLastError());
+    }
+    return 0;
+}
+
+static void test_WaitForMultipleObjects_all(void)
+{
+    HANDLE threads[6];
+    LONG prev;
+    DWORD r;
+    int i;
+
+    wait_all_objs[0] = CreateMutexA(NULL, FALSE, NULL);
+    wait_all_objs[1] = CreateSemaphoreA(NULL, 2, 2, NULL);
+
+    /* alertable waits go through the server, the other ones may not */
+    threads[0] = CreateThread(NULL, 0, wait_all_thread, (void *)1, 0, NULL);
+    threads[1] = CreateThread(NULL, 0, wait_all_thread, (void *)1, 0, NULL);
+    threads[2] = CreateThread(NULL, 0, wait_all_thread, NULL, 0, NULL);
+    threads[3] = CreateThread(NULL, 0, wait_all_thread, NULL, 0, NULL);
+    threads[4] = CreateThread(NULL, 0, wait_semaphore_thread, NULL, 0, NULL);
+    threads[5] = CreateThread(NULL, 0, wait_semaphore_thread, NULL, 0, NULL);
+
+    r = WaitForMultipleObjects(ARRAY_SIZE(threads), threads, TRUE, 60000);
+    ok(r == WAIT_OBJECT_0, "threads didn't finish, got %u\n", r);
+    for (i = 0; i < ARRAY_SIZE(threads); i++) CloseHandle(threads[i]);
+
+    /* no semaphore unit may have been lost or duplicated */
+    r = WaitForSingleObject(wait_all_objs[1], 0);
+    ok(r == WAIT_OBJECT_0, "got %u\n", r);
+    r = WaitForSingleObject(wait_all_objs[1], 0);
+    ok(r == WAIT_OBJECT_0, "got %u\n", r);
+    r = WaitForSingleObject(wait_all_objs[1], 0);
+    ok(r == WAIT_TIMEOUT, "got %u\n", r);
+    ok(ReleaseSemaphore(wait_all_objs[1], 2, &prev), "ReleaseSemaphore failed, error %u\n", GetLastError());
+    ok(!prev, "got previous count %d\n", prev);
+
+    /* and the mutex must be free again */
+    ok(!ReleaseMutex(wait_all_objs[0]), "mutex still owned\n");
+    r = WaitForSingleObject(wait_all_objs[0], 0);
+    ok(r == WAIT_OBJECT_0, "got %u\n", r);
+    ReleaseMutex(wait_all_objs[0]);
+
+    CloseHandle(wait_all_objs[0]);
+    CloseHandle(wait_all_objs[1]);
+}
+
 static BOOL g_initcallback_ret, g_initcallback_called;
 static void *g_initctxt;
 
@@ -2687,6 +2768,7 @@ START_TEST(sync)
     test_timer_queue();
     test_WaitForSingleObject();
     test_WaitForMultipleObjects();
+    test_WaitForMultipleObjects_all();
     test_initonce();
     test_condvars_base();
     test_condvars_consumer_producer();
@@ -0,0 +1,590 @@
+/*
+ * In-process synchronization (esync)
+ *
+ * When enabled with WINEESYNC=1, events, semaphores and mutexes are
+ * backed by eventfds shared with the wineserver, so that waiting on
+ * them and signaling them can be done without a server round trip.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+#include "wine/port.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+# include <sys/poll.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+#include "wine/library.h"
+#include "wine/server.h"
+#include "wine/debug.h"
+#include "ntdll_misc.h"
+
+WINE_DEFAULT_DEBUG_CHANNEL(esync);
+
+#define TICKSPERSEC 10000000
+
+union esync_cache_entry
+{
+    LONG64 data;
+    struct
+    {
+        int             fd;          /* eventfd + 1 */
+        enum esync_type type : 3;
+        unsigned int    sync : 1;    /* handle has SYNCHRONIZE access */
+        unsigned int    modify : 1;  /* handle has *_MODIFY_STATE access */
+        unsigned int    shm_idx : 26;
+        unsigned int    valid : 1;   /* entry has been filled */
+    } s;
+};
+
+C_ASSERT( sizeof(union esync_cache_entry) == sizeof(LONG64) );
+
+#define ESYNC_CACHE_BLOCK_SIZE  (65536 / sizeof(union esync_cache_entry))
+#define ESYNC_CACHE_ENTRIES     128
+
+static union esync_cache_entry *esync_cache[ESYNC_CACHE_ENTRIES];
+static union esync_cache_entry esync_cache_initial_block[ESYNC_CACHE_BLOCK_SIZE];
+
+static struct esync_mutex_state *shm_mutexes;  /* shared area holding the mutex state */
+static int esync_unsupported;                  /* the server doesn't have esync enabled */
+
+/* an object being waited upon */
+struct esync_object
+{
+    enum esync_type type;
+    int             fd;
+    unsigned int    shm_idx;
+};
+
+
+int do_esync(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINEESYNC" );
+        enabled = env && atoi( env );
+    }
+    return enabled && !esync_unsupported;
+#else
+    return 0;
+#endif
+}
+
+static inline unsigned int handle_to_index( HANDLE handle, unsigned int *entry )
+{
+    unsigned int idx = (wine_server_obj_handle(handle) >> 2) - 1;
+    *entry = idx / ESYNC_CACHE_BLOCK_SIZE;
+    return idx % ESYNC_CACHE_BLOCK_SIZE;
+}
+
+static inline LONG64 exchange_cache_entry( union esync_cache_entry *entry, LONG64 val )
+{
+    LONG64 tmp = entry->data;
+    while (interlocked_cmpxchg64( &entry->data, val, tmp ) != tmp) tmp = entry->data;
+    return tmp;
+}
+
+/***********************************************************************
+ *           add_to_cache
+ *
+ * Caller must hold fd_cache_section.
+ */
+static BOOL add_to_cache( HANDLE handle, union esync_cache_entry cache )
+{
+    unsigned int entry, idx = handle_to_index( handle, &entry );
+
+    if (entry >= ESYNC_CACHE_ENTRIES) return FALSE;
+
+    if (!esync_cache[entry])  /* do we need to allocate a new block of entries? */
+    {
+        if (!entry) esync_cache[0] = esync_cache_initial_block;
+        else
+        {
+            void *ptr = wine_anon_mmap( NULL, ESYNC_CACHE_BLOCK_SIZE * sizeof(union esync_cache_entry),
+                                        PROT_READ | PROT_WRITE, 0 );
+            if (ptr == MAP_FAILED) return FALSE;
+            esync_cache[entry] = ptr;
+        }
+    }
+    cache.s.valid = 1;
+    cache.data = exchange_cache_entry( &esync_cache[entry][idx], cache.data );
+    assert( !cache.s.valid );
+    return TRUE;
+}
+
+static inline BOOL get_cached_entry( HANDLE handle, union esync_cache_entry *cache )
+{
+    unsigned int entry, idx = handle_to_index( handle, &entry );
+
+    if (entry >= ESYNC_CACHE_ENTRIES || !esync_cache[entry]) return FALSE;
+    cache->data = interlocked_cmpxchg64( &esync_cache[entry][idx].data, 0, 0 );
+    return cache->s.valid;
+}
+
+/***********************************************************************
+ *           esync_close
+ *
+ * Remove a handle from the cache when it is closed.
+ */
+void esync_close( HANDLE handle )
+{
+    unsigned int entry, idx = handle_to_index( handle, &entry );
+    union esync_cache_entry cache;
+
+    if (entry >= ESYNC_CACHE_ENTRIES || !esync_cache[entry]) return;
+    cache.data = exchange_cache_entry( &esync_cache[entry][idx], 0 );
+    if (cache.s.valid && cache.s.type != ESYNC_NONE) close( cache.s.fd - 1 );
+}
+
+/* retrieve the esync information for a handle, asking the server if needed */
+static BOOL get_esync( HANDLE handle, union esync_cache_entry *ret )
+{
+    union esync_cache_entry cache;
+    obj_handle_t fd_handle;
+    unsigned int entry;
+    sigset_t sigset;
+    NTSTATUS status;
+    int fd = -1;
+
+    if (get_cached_entry( handle, ret )) return ret->s.type != ESYNC_NONE;
+
+    /* pseudo-handles and handles beyond the cache always go through the server */
+    handle_to_index( handle, &entry );
+    if (entry >= ESYNC_CACHE_ENTRIES) return FALSE;
+
+    server_enter_uninterrupted_section( &fd_cache_section, &sigset );
+    if (!get_cached_entry( handle, ret ))
+    {
+        cache.data = 0;
+        SERVER_START_REQ( get_esync_fd )
+        {
+            req->handle = wine_server_obj_handle( handle );
+            if (!(status = wine_server_call( req )))
+            {
+                cache.s.type    = reply->type;
+                cache.s.shm_idx = reply->shm_idx;
+                cache.s.sync    = !!(reply->access & SYNCHRONIZE);
+                switch (reply->type)
+                {
+                case ESYNC_AUTO_EVENT:
+                case ESYNC_MANUAL_EVENT:
+                    cache.s.modify = !!(reply->access & EVENT_MODIFY_STATE);
+                    break;
+                case ESYNC_SEMAPHORE:
+                    cache.s.modify = !!(reply->access & SEMAPHORE_MODIFY_STATE);
+                    break;
+                default:
+                    break;
+                }
+                if (reply->type != ESYNC_NONE)
+                {
+                    fd = receive_fd( &fd_handle );
+                    assert( wine_server_ptr_handle(fd_handle) == handle );
+                    cache.s.fd = fd + 1;
+                }
+            }
+        }
+        SERVER_END_REQ;
+
+        if (status == STATUS_NOT_IMPLEMENTED) esync_unsupported = 1;
+
+        if (status) ret->data = 0;
+        else if (add_to_cache( handle, cache )) *ret = cache;
+        else
+        {
+            if (fd != -1) close( fd );
+            ret->data = 0;
+        }
+    }
+    server_leave_uninterrupted_section( &fd_cache_section, &sigset );
+    return ret->s.type != ESYNC_NONE;
+}
+
+/* map the shared area holding the mutex state */
+static struct esync_mutex_state *get_mutex_state( unsigned int idx )
+{
+    obj_handle_t fd_handle;
+    sigset_t sigset;
+    NTSTATUS status;
+    data_size_t size = 0;
+    int fd = -1;
+
+    if (shm_mutexes) return &shm_mutexes[idx];
+
+    server_enter_uninterrupted_section( &fd_cache_section, &sigset );
+    if (!shm_mutexes)
+    {
+        SERVER_START_REQ( get_esync_shm )
+        {
+            if (!(status = wine_server_call( req )))
+            {
+                size = reply->size;
+                fd = receive_fd( &fd_handle );
+            }
+        }
+        SERVER_END_REQ;
+
+        if (fd != -1)
+        {
+            void *ptr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            if (ptr != MAP_FAILED) shm_mutexes = ptr;
+            else ERR( "failed to map esync shared area: %s\n", strerror( errno ));
+            close( fd );
+        }
+    }
+    server_leave_uninterrupted_section( &fd_cache_section, &sigset );
+    return shm_mutexes ? &shm_mutexes[idx] : NULL;
+}
+
+static inline thread_id_t current_tid(void)
+{
+    return HandleToULong( NtCurrentTeb()->ClientId.UniqueThread );
+}
+
+static inline BOOL eventfd_grab( int fd )
+{
+    ULONG64 value;
+    return read( fd, &value, sizeof(value) ) == sizeof(value);
+}
+
+static inline void eventfd_wake( int fd, ULONG64 value )
+{
+    if (write( fd, &value, sizeof(value) ) == -1)
+        ERR( "write to eventfd %d failed: %s\n", fd, strerror( errno ));
+}
+
+static inline BOOL eventfd_is_signaled( int fd )
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll( &pfd, 1, 0 ) > 0 && (pfd.revents & POLLIN);
+}
+
+/* try to acquire an object for the current thread; return the wait status or STATUS_PENDING */
+static NTSTATUS try_grab( const struct esync_object *obj, unsigned int index )
+{
+    struct esync_mutex_state *state;
+
+    switch (obj->type)
+    {
+    case ESYNC_MANUAL_EVENT:
+        return eventfd_is_signaled( obj->fd ) ? STATUS_WAIT_0 + index : STATUS_PENDING;
+    case ESYNC_AUTO_EVENT:
+    case ESYNC_SEMAPHORE:
+        return eventfd_grab( obj->fd ) ? STATUS_WAIT_0 + index : STATUS_PENDING;
+    case ESYNC_MUTEX:
+        state = get_mutex_state( obj->shm_idx );
+        if (state->tid == current_tid())
+        {
+            state->count++;
+            return STATUS_WAIT_0 + index;
+        }
+        if (!eventfd_grab( obj->fd )) return STATUS_PENDING;
+        state->tid = current_tid();
+        state->count = 1;
+        if (!state->abandoned) return STATUS_WAIT_0 + index;
+        state->abandoned = 0;
+        return STATUS_ABANDONED_WAIT_0 + index;
+    default:
+        assert(0);
+        return STATUS_PENDING;
+    }
+}
+
+/* undo a successful try_grab */
+static void put_back( const struct esync_object *obj, NTSTATUS grab_status )
+{
+    struct esync_mutex_state *state;
+
+    switch (obj->type)
+    {
+    case ESYNC_AUTO_EVENT:
+    case ESYNC_SEMAPHORE:
+        eventfd_wake( obj->fd, 1 );
+        break;
+    case ESYNC_MUTEX:
+        state = get_mutex_state( obj->shm_idx );
+        if (--state->count) break;
+        state->tid = 0;
+        if (grab_status >= STATUS_ABANDONED_WAIT_0) state->abandoned = 1;
+        eventfd_wake( obj->fd, 1 );
+        break;
+    default:
+        break;
+    }
+}
+
+/* is the object signaled for the current thread, without acquiring it */
+static BOOL is_signaled( const struct esync_object *obj, const struct pollfd *pfd )
+{
+    if (obj->type == ESYNC_MUTEX && get_mutex_state( obj->shm_idx )->tid == current_tid()) return TRUE;
+    return (pfd->revents & POLLIN) != 0;
+}
+
+/* compute the poll() timeout in milliseconds for an absolute end time */
+static int get_poll_timeout( const LARGE_INTEGER *end )
+{
+    LARGE_INTEGER now;
+    LONGLONG ms;
+
+    if (!end) return -1;
+    NtQuerySystemTime( &now );
+    if (now.QuadPart >= end->QuadPart) return 0;
+    ms = (end->QuadPart - now.QuadPart + TICKSPERSEC / 1000 - 1) / (TICKSPERSEC / 1000);
+    return ms > INT_MAX ? INT_MAX : ms;
+}
+
+/* wait for one of the fds to become readable; return STATUS_PENDING if one did */
+static NTSTATUS do_poll( struct pollfd *fds, unsigned int count, const LARGE_INTEGER *end )
+{
+    unsigned int i;
+    int ret;
+
+    for (;;)
+    {
+        if ((ret = poll( fds, count, get_poll_timeout( end ))) != -1) break;
+        if (errno != EINTR) return STATUS_INTERNAL_ERROR;
+    }
+    if (!ret) return STATUS_TIMEOUT;
+    /* the handle may have been closed by another thread */
+    for (i = 0; i < count; i++) if (fds[i].revents & POLLNVAL) return STATUS_INVALID_HANDLE;
+    return STATUS_PENDING;
+}
+
+/* gather the esync objects for a wait; return FALSE if the server must be used */
+static BOOL get_wait_objects( DWORD count, const HANDLE *handles, struct esync_object *objs )
+{
+    union esync_cache_entry cache;
+    DWORD i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (!get_esync( handles[i], &cache ) || !cache.s.sync) return FALSE;
+        if (cache.s.type == ESYNC_MUTEX && !get_mutex_state( cache.s.shm_idx )) return FALSE;
+        objs[i].type    = cache.s.type;
+        objs[i].fd      = cache.s.fd - 1;
+        objs[i].shm_idx = cache.s.shm_idx;
+    }
+    return TRUE;
+}
+
+static NTSTATUS wait_any( DWORD count, const struct esync_object *objs, const LARGE_INTEGER *end )
+{
+    struct pollfd fds[MAXIMUM_WAIT_OBJECTS];
+    NTSTATUS status;
+    DWORD i;
+
+    for (;;)
+    {
+        for (i = 0; i < count; i++)
+            if ((status = try_grab( &objs[i], i )) != STATUS_PENDING) return status;
+
+        for (i = 0; i < count; i++)
+        {
+            fds[i].fd = objs[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if ((status = do_poll( fds, count, end )) != STATUS_PENDING) return status;
+    }
+}
+
+static NTSTATUS wait_all( DWORD count, const struct esync_object *objs, const LARGE_INTEGER *end )
+{
+    struct pollfd fds[MAXIMUM_WAIT_OBJECTS], pending[MAXIMUM_WAIT_OBJECTS];
+    NTSTATUS grabbed[MAXIMUM_WAIT_OBJECTS], status = STATUS_WAIT_0;
+    DWORD i, j, nb_pending;
+
+    for (;;)
+    {
+        /* check the state of all the objects at once */
+        for (i = 0; i < count; i++)
+        {
+            fds[i].fd = objs[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+        }
+        if (poll( fds, count, 0 ) == -1 && errno != EINTR) return STATUS_INTERNAL_ERROR;
+
+        for (i = nb_pending = 0; i < count; i++)
+            if (!is_signaled( &objs[i], &fds[i] )) pending[nb_pending++] = fds[i];
+
+        if (!nb_pending)
+        {
+            /* everything looks signaled, try to acquire it all */
+            for (i = 0; i < count; i++)
+                if ((grabbed[i] = try_grab( &objs[i], 0 )) == STATUS_PENDING) break;
+            if (i == count)
+            {
+                for (i = 0; i < count; i++)
+                    if (grabbed[i] == STATUS_ABANDONED_WAIT_0) status = STATUS_ABANDONED_WAIT_0;
+                return status;
+            }
+            /* somebody else got one of them first, release what we got and start over */
+            for (j = 0; j < i; j++) put_back( &objs[j], grabbed[j] );
+            continue;
+        }
+
+        /* wait until one of the missing objects is signaled */
+        if ((status = do_poll( pending, nb_pending, end )) != STATUS_PENDING) return status;
+        status = STATUS_WAIT_0;
+    }
+}
+
+/* compute the absolute end time of a wait */
+static const LARGE_INTEGER *get_end_time( const LARGE_INTEGER *timeout, LARGE_INTEGER *end )
+{
+    if (!timeout || timeout->QuadPart == TIMEOUT_INFINITE) return NULL;
+    if (timeout->QuadPart > 0) *end = *timeout;
+    else
+    {
+        NtQuerySystemTime( end );
+        end->QuadPart -= timeout->QuadPart;
+    }
+    return end;
+}
+
+/***********************************************************************
+ *           esync_wait_objects
+ *
+ * Wait on objects without going through the server, if they all support it.
+ * Returns STATUS_NOT_IMPLEMENTED if the server must be used instead.
+ */
+NTSTATUS esync_wait_objects( DWORD count, const HANDLE *handles, BOOLEAN wait_any_obj,
+                             BOOLEAN alertable, const LARGE_INTEGER *timeout )
+{
+    struct esync_object objs[MAXIMUM_WAIT_OBJECTS];
+    LARGE_INTEGER end_time;
+    const LARGE_INTEGER *end;
+
+    /* user APCs are only delivered by the server */
+    if (alertable || !do_esync()) return STATUS_NOT_IMPLEMENTED;
+    if (!get_wait_objects( count, handles, objs )) return STATUS_NOT_IMPLEMENTED;
+
+    end = get_end_time( timeout, &end_time );
+    if (wait_any_obj || count == 1) return wait_any( count, objs, end );
+    return wait_all( count, objs, end );
+}
+
+/***********************************************************************
+ *           esync_signal_and_wait
+ */
+NTSTATUS esync_signal_and_wait( HANDLE signal, HANDLE wait, BOOLEAN alertable,
+                                const LARGE_INTEGER *timeout )
+{
+    union esync_cache_entry signal_cache, wait_cache;
+    NTSTATUS status;
+
+    if (alertable || !do_esync()) return STATUS_NOT_IMPLEMENTED;
+    if (!get_esync( signal, &signal_cache ) || !get_esync( wait, &wait_cache ))
+        return STATUS_NOT_IMPLEMENTED;
+
+    switch (signal_cache.s.type)
+    {
+    case ESYNC_AUTO_EVENT:
+    case ESYNC_MANUAL_EVENT:
+        status = NtSetEvent( signal, NULL );
+        break;
+    case ESYNC_SEMAPHORE:
+        status = NtReleaseSemaphore( signal, 1, NULL );
+        break;
+    case ESYNC_MUTEX:
+        status = NtReleaseMutant( signal, NULL );
+        break;
+    default:
+        status = STATUS_OBJECT_TYPE_MISMATCH;
+        break;
+    }
+    if (status) return status;
+    return esync_wait_objects( 1, &wait, TRUE, FALSE, timeout );
+}
+
+/***********************************************************************
+ *           esync_set_event
+ */
+NTSTATUS esync_set_event( HANDLE handle )
+{
+    union esync_cache_entry cache;
+
+    if (!do_esync() || !get_esync( handle, &cache )) return STATUS_NOT_IMPLEMENTED;
+    if (cache.s.type != ESYNC_AUTO_EVENT && cache.s.type != ESYNC_MANUAL_EVENT)
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    if (!cache.s.modify) return STATUS_ACCESS_DENIED;
+    eventfd_wake( cache.s.fd - 1, 1 );
+    return STATUS_SUCCESS;
+}
+
+/***********************************************************************
+ *           esync_reset_event
+ */
+NTSTATUS esync_reset_event( HANDLE handle )
+{
+    union esync_cache_entry cache;
+
+    if (!do_esync() || !get_esync( handle, &cache )) return STATUS_NOT_IMPLEMENTED;
+    if (cache.s.type != ESYNC_AUTO_EVENT && cache.s.type != ESYNC_MANUAL_EVENT)
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    if (!cache.s.modify) return STATUS_ACCESS_DENIED;
+    eventfd_grab( cache.s.fd - 1 );
+    return STATUS_SUCCESS;
+}
+
+/***********************************************************************
+ *           esync_release_mutex
+ */
+NTSTATUS esync_release_mutex( HANDLE handle, LONG *prev_count )
+{
+    union esync_cache_entry cache;
+    struct esync_mutex_state *state;
+
+    if (!do_esync() || !get_esync( handle, &cache )) return STATUS_NOT_IMPLEMENTED;
+    if (cache.s.type != ESYNC_MUTEX) return STATUS_OBJECT_TYPE_MISMATCH;
+    if (!(state = get_mutex_state( cache.s.shm_idx ))) return STATUS_NOT_IMPLEMENTED;
+
+    if (!state->count || state->tid != current_tid()) return STATUS_MUTANT_NOT_OWNED;
+    if (prev_count) *prev_count = 1 - state->count;
+    if (!--state->count)
+    {
+        state->tid = 0;
+        eventfd_wake( cache.s.fd - 1, 1 );
+    }
+    return STATUS_SUCCESS;
+}
@@ -102,6 +102,7 @@
 #include "wine/unicode.h"
 #include "wine/debug.h"
 #include "wine/server.h"
+#include "wine/list.h"
 #include "ntdll_misc.h"
 
 #include "winternl.h"
@@ -500,12 +501,251 @@ NTSTATUS FILE_GetNtStatus(void)
     }
 }
 
+/* data left over from a message that didn't fit in the read buffer of a direct named pipe */
+struct pipe_overflow
+{
+    struct list entry;
+    dev_t       dev;        /* identity of the pipe end socket, shared by all its handles */
+    ino_t       ino;
+    int         fd;         /* keeps the socket open, so that its identity isn't reused */
+    ULONG       size;       /* size of the left over data */
+    ULONG       pos;        /* current read position */
+    char        data[1];
+};
+
+#define PIPE_OVERFLOW_SIZE (1024 * 1024)  /* larger than any message that fits in the socket buffer */
+#define PIPE_LOCKS         64
+
+/* the message reads of a pipe end are serialized by a lock chosen from its socket identity */
+static struct pipe_lock
+{
+    RTL_SRWLOCK lock;
+    struct list overflows;  /* left over data of the pipe ends using this lock */
+    char       *buffer;     /* receive buffer for the part that doesn't fit */
+} pipe_locks[PIPE_LOCKS];
+
+static LONG pipe_overflow_count;
+
+static struct pipe_lock *get_pipe_lock( const struct stat *st )
+{
+    struct pipe_lock *lock = &pipe_locks[(ULONG_PTR)st->st_ino % PIPE_LOCKS];
+
+    if (!lock->overflows.next) list_init( &lock->overflows );
+    return lock;
+}
+
+static struct pipe_overflow *find_pipe_overflow( struct pipe_lock *lock, const struct stat *st )
+{
+    struct pipe_overflow *overflow;
+
+    LIST_FOR_EACH_ENTRY( overflow, &lock->overflows, struct pipe_overflow, entry )
+        if (overflow->dev == st->st_dev && overflow->ino == st->st_ino) return overflow;
+    return NULL;
+}
+
+static void free_pipe_overflow( struct pipe_overflow *overflow )
+{
+    list_remove( &overflow->entry );
+    interlocked_xchg_add( &pipe_overflow_count, -1 );
+    if (overflow->fd != -1) close( overflow->fd );
+    RtlFreeHeap( GetProcessHeap(), 0, overflow );
+}
+
+/* check whether new named pipes should exchange their data directly through a socket */
+static BOOL use_direct_pipes(void)
+{
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINEPIPEDIRECT" );
+        enabled = env && atoi( env );
+    }
+    return enabled;
+}
+
+extern ssize_t CDECL __wine_locked_recvmsg( int fd, struct msghdr *hdr, int flags );
+
+/* check whether a named pipe handle reads in message mode; assume it does if we can't tell */
+static BOOL is_pipe_read_message_mode( HANDLE handle )
+{
+    FILE_PIPE_INFORMATION info;
+    IO_STATUS_BLOCK io;
+
+    if (NtQueryInformationFile( handle, &io, &info, sizeof(info), FilePipeInformation )) return TRUE;
+    return info.ReadMode == FILE_PIPE_MESSAGE_MODE;
+}
+
+/***********************************************************************
+ *             read_pipe_message_part
+ *
+ * Read the left over data of the current message of a pipe end, or the
+ * next message from the socket of a direct pipe. The part that doesn't fit
+ * in the buffer is kept for the next read through any handle to the same
+ * pipe end in this process.
+ * Caller must hold the pipe lock.
+ */
+static NTSTATUS read_pipe_message_part( struct pipe_lock *lock, const struct stat *st, int fd,
+                                        char *buffer, ULONG length, ULONG *size, BOOL *partial )
+{
+    struct pipe_overflow *overflow;
+    struct iovec iov[2];
+    struct msghdr msg;
+    ssize_t result;
+
+    *size = 0;
+    *partial = FALSE;
+
+    if (pipe_overflow_count && (overflow = find_pipe_overflow( lock, st )))
+    {
+        *size = min( length, overflow->size - overflow->pos );
+        memcpy( buffer, overflow->data + overflow->pos, *size );
+        overflow->pos += *size;
+        if (overflow->pos < overflow->size) *partial = TRUE;
+        else free_pipe_overflow( overflow );
+        return STATUS_SUCCESS;
+    }
+
+    if (!lock->buffer && !(lock->buffer = RtlAllocateHeap( GetProcessHeap(), 0, PIPE_OVERFLOW_SIZE )))
+        return STATUS_NO_MEMORY;
+
+    iov[0].iov_base = buffer;
+    iov[0].iov_len  = length;
+    iov[1].iov_base = lock->buffer;
+    iov[1].iov_len  = PIPE_OVERFLOW_SIZE;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov     = iov;
+    msg.msg_iovlen  = 2;
+
+    while ((result = __wine_locked_recvmsg( fd, &msg, 0 )) == -1 && errno == EINTR);
+
+    if (result == -1) return (errno == EAGAIN) ? STATUS_PENDING : FILE_GetNtStatus();
+    if (!result) return STATUS_PIPE_BROKEN;  /* empty messages are never sent */
+    if (result <= length)
+    {
+        *size = result;
+        return STATUS_SUCCESS;
+    }
+
+    *size = length;
+    *partial = TRUE;
+    result -= length;
+    if ((overflow = RtlAllocateHeap( GetProcessHeap(), 0, offsetof( struct pipe_overflow, data[result] ))))
+    {
+        overflow->dev  = st->st_dev;
+        overflow->ino  = st->st_ino;
+        overflow->fd   = dup( fd );
+        overflow->size = result;
+        overflow->pos  = 0;
+        memcpy( overflow->data, lock->buffer, result );
+        list_add_tail( &lock->overflows, &overflow->entry );
+        interlocked_xchg_add( &pipe_overflow_count, 1 );
+    }
+    else ERR( "lost %u bytes of a pipe message\n", (ULONG)result );
+    return STATUS_SUCCESS;
+}
+
+/***********************************************************************
+ *             read_pipe_message
+ *
+ * Read from the socket of a direct message-mode pipe. In message read mode
+ * a single message is returned, in byte read mode consecutive messages are
+ * read until the buffer is full. Returns STATUS_PENDING if no data is
+ * available.
+ */
+static NTSTATUS read_pipe_message( HANDLE handle, int fd, char *buffer, ULONG length, ULONG *total )
+{
+    struct pipe_lock *lock;
+    struct stat st;
+    NTSTATUS status;
+    ULONG size;
+    BOOL partial;
+    int message_mode = -1, avail;
+
+    *total = 0;
+    if (fstat( fd, &st ) == -1) return FILE_GetNtStatus();
+    lock = get_pipe_lock( &st );
+    for (;;)
+    {
+        RtlAcquireSRWLockExclusive( &lock->lock );
+        status = read_pipe_message_part( lock, &st, fd, buffer + *total, length - *total, &size, &partial );
+        RtlReleaseSRWLockExclusive( &lock->lock );
+
+        if (status)
+        {
+            /* return the messages that were already read */
+            if (*total) status = STATUS_SUCCESS;
+            break;
+        }
+        *total += size;
+
+        /* the read mode requires a server call, only query it when it matters */
+        if (partial)
+        {
+            if (is_pipe_read_message_mode( handle )) status = STATUS_BUFFER_OVERFLOW;
+            break;
+        }
+        if (*total == length) break;
+        if (ioctl( fd, FIONREAD, &avail ) || !avail) break;
+        if (message_mode == -1) message_mode = is_pipe_read_message_mode( handle );
+        if (message_mode) break;
+    }
+    return status;
+}
+
+/* check whether a pipe end still has data left over from a message */
+static BOOL has_pipe_overflow( int fd )
+{
+    struct pipe_lock *lock;
+    struct stat st;
+    BOOL ret;
+
+    if (!pipe_overflow_count || fstat( fd, &st ) == -1) return FALSE;
+
+    lock = get_pipe_lock( &st );
+    RtlAcquireSRWLockExclusive( &lock->lock );
+    ret = find_pipe_overflow( lock, &st ) != NULL;
+    RtlReleaseSRWLockExclusive( &lock->lock );
+    return ret;
+}
+
+/***********************************************************************
+ *             pipe_message_close
+ *
+ * Discard the left over message data of a pipe end when its last handle
+ * is being closed. The data is only visible in this process, so it is
+ * kept as long as handles remain, even if they belong to other processes.
+ */
+void pipe_message_close( HANDLE handle )
+{
+    struct pipe_overflow *overflow;
+    OBJECT_BASIC_INFORMATION info;
+    enum server_fd_type type;
+    struct pipe_lock *lock;
+    int fd, needs_close;
+    struct stat st;
+
+    if (!pipe_overflow_count) return;
+    if (server_get_unix_fd( handle, 0, &fd, &needs_close, &type, NULL )) return;
+
+    if (type == FD_TYPE_MSG_PIPE && !fstat( fd, &st ) &&
+        (NtQueryObject( handle, ObjectBasicInformation, &info, sizeof(info), NULL ) || info.HandleCount <= 1))
+    {
+        lock = get_pipe_lock( &st );
+        RtlAcquireSRWLockExclusive( &lock->lock );
+        if ((overflow = find_pipe_overflow( lock, &st ))) free_pipe_overflow( overflow );
+        RtlReleaseSRWLockExclusive( &lock->lock );
+    }
+    if (needs_close) close( fd );
+}
+
 /***********************************************************************
  *             FILE_AsyncReadService      (INTERNAL)
  */
 static NTSTATUS FILE_AsyncReadService( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
 {
     struct async_fileio_read *fileio = user;
+    enum server_fd_type type;
     int fd, needs_close, result;
 
     switch (status)
@@ -513,8 +753,18 @@ static NTSTATUS FILE_AsyncReadService( void *user, IO_STATUS_BLOCK *iosb, NTSTAT
     case STATUS_ALERTED: /* got some new data */
         /* check to see if the data is ready (non-blocking) */
         if ((status = server_get_unix_fd( fileio->io.handle, FILE_READ_DATA, &fd,
-                                          &needs_close, NULL, NULL )))
+                                          &needs_close, &type, NULL )))
+            break;
+
+        if (type == FD_TYPE_MSG_PIPE)
+        {
+            ULONG size;
+
+            status = read_pipe_message( fileio->io.handle, fd, fileio->buffer, fileio->count, &size );
+            if (needs_close) close( fd );
+            fileio->already = size;
             break;
+        }
 
         result = virtual_locked_read(fd, &fileio->buffer[fileio->already], fileio->count-fileio->already);
         if (needs_close) close( fd );
@@ -708,6 +958,8 @@ static NTSTATUS get_io_timeouts( HANDLE handle, enum server_fd_type type, ULONG
         }
         break;
     case FD_TYPE_SOCKET:
+    case FD_TYPE_PIPE:
+    case FD_TYPE_MSG_PIPE:
     case FD_TYPE_CHAR:
         if (is_read) timeouts->interval = 0;  /* return as soon as we got something */
         break;
@@ -760,6 +1012,8 @@ static NTSTATUS get_io_avail_mode( HANDLE handle, enum server_fd_type type, BOOL
         break;
     case FD_TYPE_MAILSLOT:
     case FD_TYPE_SOCKET:
+    case FD_TYPE_PIPE:
+    case FD_TYPE_MSG_PIPE:
     case FD_TYPE_CHAR:
         *avail_mode = TRUE;
         break;
@@ -863,6 +1117,13 @@ NTSTATUS WINAPI NtReadFile(HANDLE hFile, HANDLE hEvent,
 
         if (offset && offset->QuadPart != FILE_USE_FILE_POINTER_POSITION)
         {
+            if (async_read && !apc)
+            {
+                status = uring_read_write( hFile, unix_handle, needs_close, hEvent, cvalue, io_status,
+                                           buffer, length, offset->QuadPart, FALSE );
+                if (status == STATUS_PENDING) return status;
+            }
+
             /* async I/O doesn't make sense on regular files */
             while ((result = virtual_locked_pread( unix_handle, buffer, length, offset->QuadPart )) == -1)
             {
@@ -906,7 +1167,13 @@ NTSTATUS WINAPI NtReadFile(HANDLE hFile, HANDLE hEvent,
 
     for (;;)
     {
-        if ((result = virtual_locked_read( unix_handle, (char *)buffer + total, length - total )) >= 0)
+        if (type == FD_TYPE_MSG_PIPE)
+        {
+            status = read_pipe_message( hFile, unix_handle, buffer, length, &total );
+            if (status == STATUS_SUCCESS || status == STATUS_BUFFER_OVERFLOW) goto done;
+            if (status != STATUS_PENDING) goto err;
+        }
+        else if ((result = virtual_locked_read( unix_handle, (char *)buffer + total, length - total )) >= 0)
         {
             total += result;
             if (!result || total == length)
@@ -998,14 +1265,15 @@ done:
 
 err:
     if (needs_close) close( unix_handle );
-    if (status == STATUS_SUCCESS || (status == STATUS_END_OF_FILE && !async_read))
+    if (status == STATUS_SUCCESS || status == STATUS_BUFFER_OVERFLOW ||
+        (status == STATUS_END_OF_FILE && !async_read))
     {
         io_status->u.Status = status;
         io_status->Information = total;
         TRACE("= SUCCESS (%u)\n", total);
         if (hEvent) NtSetEvent( hEvent, NULL );
-        if (apc && !status) NtQueueApcThread( GetCurrentThread(), (PNTAPCFUNC)apc,
-                                              (ULONG_PTR)apc_user, (ULONG_PTR)io_status, 0 );
+        if (apc && status != STATUS_END_OF_FILE) NtQueueApcThread( GetCurrentThread(), (PNTAPCFUNC)apc,
+                                                                   (ULONG_PTR)apc_user, (ULONG_PTR)io_status, 0 );
     }
     else
     {
@@ -1054,6 +1322,14 @@ NTSTATUS WINAPI NtReadFileScatter( HANDLE file, HANDLE event, PIO_APC_ROUTINE ap
         goto error;
     }
 
+    if (!apc && offset && offset->QuadPart >= 0)
+    {
+        status = uring_scatter_gather( file, unix_handle, needs_close, event, cvalue, io_status,
+                                       segments, length, offset->QuadPart, FALSE );
+        if (status == STATUS_PENDING) return status;
+        status = STATUS_SUCCESS;
+    }
+
     while (length)
     {
         if (offset && offset->QuadPart != FILE_USE_FILE_POINTER_POSITION)
@@ -1267,6 +1543,12 @@ NTSTATUS WINAPI NtWriteFile(HANDLE hFile, HANDLE hEvent,
                 status = STATUS_INVALID_PARAMETER;
                 goto done;
             }
+            else if (async_write && !apc)
+            {
+                status = uring_read_write( hFile, unix_handle, needs_close, hEvent, cvalue, io_status,
+                                           (void *)buffer, length, off, TRUE );
+                if (status == STATUS_PENDING) return status;
+            }
 
             /* async I/O doesn't make sense on regular files */
             while ((result = pwrite( unix_handle, buffer, length, off )) == -1)
@@ -1300,6 +1582,14 @@ NTSTATUS WINAPI NtWriteFile(HANDLE hFile, HANDLE hEvent,
 
     for (;;)
     {
+        if (!length && type == FD_TYPE_MSG_PIPE)
+        {
+            /* an empty message can't be told apart from the end of the stream */
+            WARN( "dropping empty message on %p\n", hFile );
+            status = STATUS_SUCCESS;
+            goto done;
+        }
+
         /* zero-length writes on sockets may not work with plain write(2) */
         if (!length && (type == FD_TYPE_MAILSLOT || type == FD_TYPE_SOCKET))
             result = send( unix_handle, buffer, 0, 0 );
@@ -1322,6 +1612,8 @@ NTSTATUS WINAPI NtWriteFile(HANDLE hFile, HANDLE hEvent,
             if (!total)
             {
                 if (errno == EFAULT) status = STATUS_INVALID_USER_BUFFER;
+                else if (errno == EPIPE && (type == FD_TYPE_PIPE || type == FD_TYPE_MSG_PIPE))
+                    status = STATUS_PIPE_CLOSING;
                 else status = FILE_GetNtStatus();
             }
             goto err;
@@ -1449,6 +1741,14 @@ NTSTATUS WINAPI NtWriteFileGather( HANDLE file, HANDLE event, PIO_APC_ROUTINE ap
         goto error;
     }
 
+    if (!apc && offset && offset->QuadPart >= 0)
+    {
+        status = uring_scatter_gather( file, unix_handle, needs_close, event, cvalue, io_status,
+                                       segments, length, offset->QuadPart, TRUE );
+        if (status == STATUS_PENDING) return status;
+        status = STATUS_SUCCESS;
+    }
+
     while (length)
     {
         if (offset && offset->QuadPart != FILE_USE_FILE_POINTER_POSITION)
@@ -1647,6 +1947,41 @@ NTSTATUS WINAPI NtDeviceIoControlFile(HANDLE handle, HANDLE event,
 }
 
 
+/* send the request of a transaction on a direct message-mode pipe and read the reply */
+static NTSTATUS pipe_transceive( HANDLE handle, HANDLE event, PIO_APC_ROUTINE apc, void *apc_context,
+                                 IO_STATUS_BLOCK *io, void *in_buffer, ULONG in_size,
+                                 void *out_buffer, ULONG out_size )
+{
+    enum server_fd_type type;
+    int fd, needs_close, avail = 0, ret;
+    NTSTATUS status;
+
+    if ((status = server_get_unix_fd( handle, FILE_WRITE_DATA, &fd, &needs_close, &type, NULL )))
+        return status;
+
+    if (type != FD_TYPE_MSG_PIPE)
+        status = STATUS_BAD_DEVICE_TYPE;
+    else if (!is_pipe_read_message_mode( handle ))
+        status = STATUS_INVALID_READ_MODE;
+    else if (has_pipe_overflow( fd ) || (!ioctl( fd, FIONREAD, &avail ) && avail))
+        status = STATUS_PIPE_BUSY;  /* not allowed if we already have read data buffered */
+    else if (in_size)
+    {
+        /* like on Windows, the transaction doesn't wait for room to write the request */
+        while ((ret = send( fd, in_buffer, in_size, 0 )) == -1 && errno == EINTR);
+        if (ret == -1)
+        {
+            if (errno == EAGAIN) status = STATUS_PIPE_BUSY;
+            else if (errno == EPIPE) status = STATUS_PIPE_CLOSING;
+            else status = FILE_GetNtStatus();
+        }
+    }
+    if (needs_close) close( fd );
+    if (status) return status;
+
+    return NtReadFile( handle, event, apc, apc_context, io, out_buffer, out_size, NULL, NULL );
+}
+
 /**************************************************************************
  *              NtFsControlFile                 [NTDLL.@]
  *              ZwFsControlFile                 [NTDLL.@]
@@ -1691,6 +2026,13 @@ NTSTATUS WINAPI NtFsControlFile(HANDLE handle, HANDLE event, PIO_APC_ROUTINE apc
         if (!status) status = DIR_unmount_device( handle );
         return status;
 
+    case FSCTL_PIPE_TRANSCEIVE:
+        status = pipe_transceive( handle, event, apc, apc_context, io, in_buffer, in_size,
+                                  out_buffer, out_size );
+        if (status != STATUS_BAD_DEVICE_TYPE) return status;
+        return server_ioctl_file( handle, event, apc, apc_context, io, code,
+                                  in_buffer, in_size, out_buffer, out_size );
+
     case FSCTL_PIPE_IMPERSONATE:
         FIXME("FSCTL_PIPE_IMPERSONATE: impersonating self\n");
         status = RtlImpersonateSelf( SecurityImpersonation );
@@ -3501,7 +3843,8 @@ NTSTATUS WINAPI NtCreateNamedPipeFile( PHANDLE handle, ULONG access,
         req->flags = 
             (pipe_type ? NAMED_PIPE_MESSAGE_STREAM_WRITE   : 0) |
             (read_mode ? NAMED_PIPE_MESSAGE_STREAM_READ    : 0) |
-            (completion_mode ? NAMED_PIPE_NONBLOCKING_MODE : 0);
+            (completion_mode ? NAMED_PIPE_NONBLOCKING_MODE : 0) |
+            (!completion_mode && use_direct_pipes() ? NAMED_PIPE_DIRECT : 0);
         req->maxinstances = max_inst;
         req->outsize = outbound_quota;
         req->insize  = inbound_quota;
@@ -3543,8 +3886,13 @@ NTSTATUS WINAPI NtDeleteFile( POBJECT_ATTRIBUTES ObjectAttributes )
  */
 NTSTATUS WINAPI NtCancelIoFileEx( HANDLE hFile, PIO_STATUS_BLOCK iosb, PIO_STATUS_BLOCK io_status )
 {
+    unsigned int count;
+
     TRACE("%p %p %p\n", hFile, iosb, io_status );
 
+    count = uring_cancel( hFile, iosb, FALSE );
+    count += sock_poll_cancel( hFile, iosb, FALSE );
+
     SERVER_START_REQ( cancel_async )
     {
         req->handle      = wine_server_obj_handle( hFile );
@@ -3554,6 +3902,7 @@ NTSTATUS WINAPI NtCancelIoFileEx( HANDLE hFile, PIO_STATUS_BLOCK iosb, PIO_STATU
     }
     SERVER_END_REQ;
 
+    if (io_status->u.Status == STATUS_NOT_FOUND && count) io_status->u.Status = STATUS_SUCCESS;
     return io_status->u.Status;
 }
 
@@ -3564,8 +3913,13 @@ NTSTATUS WINAPI NtCancelIoFileEx( HANDLE hFile, PIO_STATUS_BLOCK iosb, PIO_STATU
  */
 NTSTATUS WINAPI NtCancelIoFile( HANDLE hFile, PIO_STATUS_BLOCK io_status )
 {
+    unsigned int count;
+
     TRACE("%p %p\n", hFile, io_status );
 
+    count = uring_cancel( hFile, NULL, TRUE );
+    count += sock_poll_cancel( hFile, NULL, TRUE );
+
     SERVER_START_REQ( cancel_async )
     {
         req->handle      = wine_server_obj_handle( hFile );
@@ -3575,6 +3929,7 @@ NTSTATUS WINAPI NtCancelIoFile( HANDLE hFile, PIO_STATUS_BLOCK io_status )
     }
     SERVER_END_REQ;
 
+    if (io_status->u.Status == STATUS_NOT_FOUND && count) io_status->u.Status = STATUS_SUCCESS;
     return io_status->u.Status;
 }
 
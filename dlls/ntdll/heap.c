@@ -164,6 +164,8 @@ typedef struct tagHEAP
     ARENA_INUSE    **pending_free;  /* Ring buffer for pending free requests */
     RTL_CRITICAL_SECTION critSection; /* Critical section for serialization */
     FREE_LIST_ENTRY *freeList;      /* Free lists */
+    struct lfh_heap *lfh;           /* Low-fragmentation front end, if enabled */
+    struct heap_stats *stats;       /* Statistics, if enabled */
 } HEAP;
 
 #define HEAP_MAGIC       ((DWORD)('H' | ('E'<<8) | ('A'<<16) | ('P'<<24)))
@@ -925,6 +927,8 @@ static SUBHEAP *HEAP_CreateSubHeap( HEAP *heap, LPVOID address, DWORD flags,
         heap->flags         = flags;
         heap->magic         = HEAP_MAGIC;
         heap->grow_size     = max( HEAP_DEF_SIZE, totalSize );
+        heap->lfh           = NULL;
+        heap->stats         = NULL;
         list_init( &heap->subheap_list );
         list_init( &heap->large_list );
 
@@ -1317,6 +1321,936 @@ static BOOL HEAP_ValidateInUseArena( const SUBHEAP *subheap, const ARENA_INUSE *
 }
 
 
+/* Heap statistics
+ *
+ * When WINEHEAPSTATS is set, every heap keeps operation counters and samples
+ * the call stacks of its allocations, one every HEAP_STATS_SAMPLE_INTERVAL bytes
+ * allocated. The statistics are returned by RtlQueryHeapInformation and are
+ * written to the file named by WINEHEAPSTATS (or stderr if it's empty or "-")
+ * on process exit; the allocation paths only update the counters.
+ */
+
+#define HEAP_STATS_SAMPLE_INTERVAL  0x80000
+#define HEAP_STATS_SKIP_FRAMES      3    /* frames of the heap functions themselves */
+#define HEAP_STATS_MAX_STACKS       512
+#define HEAP_STATS_DUMP_STACKS      32
+
+/* the sampling functions must keep their own frames for HEAP_STATS_SKIP_FRAMES to be right */
+#ifdef __GNUC__
+#define HEAP_STATS_NOINLINE __attribute__((noinline))
+#else
+#define HEAP_STATS_NOINLINE
+#endif
+
+struct heap_stack_entry
+{
+    ULONG                  hash;       /* hash of the frames, 0 if entry is unused */
+    HEAP_WINE_STACK_SAMPLE sample;
+};
+
+struct heap_stats
+{
+    LONGLONG                allocs;       /* number of allocations */
+    LONGLONG                frees;        /* number of frees */
+    LONGLONG                reallocs;     /* number of reallocations */
+    LONGLONG                in_use;       /* bytes currently allocated */
+    LONGLONG                peak;         /* highest value of in_use */
+    LONGLONG                locks;        /* number of lock acquisitions */
+    LONGLONG                contentions;  /* number of lock acquisitions that had to wait */
+    int                     sample_bytes; /* bytes allocated, modulo 2^32, for sampling */
+    ULONG                   nb_stacks;    /* number of distinct stacks */
+    ULONG                   dropped;      /* samples dropped because the table was full */
+    struct heap_stack_entry stacks[HEAP_STATS_MAX_STACKS];  /* protected by the heap lock */
+};
+
+static char *heap_stats_file;               /* dump file, NULL if statistics are disabled */
+
+static inline LONGLONG heap_stats_add( LONGLONG *counter, LONGLONG value )
+{
+    LONGLONG old;
+
+    do old = *counter; while (interlocked_cmpxchg64( counter, old + value, old ) != old);
+    return old + value;
+}
+
+/***********************************************************************
+ *           init_heap_stats
+ */
+static void init_heap_stats(void)
+{
+    const char *file;
+
+    if ((file = getenv( "WINEHEAPSTATS" ))) heap_stats_file = strdup( file );
+}
+
+static struct heap_stats *alloc_heap_stats(void)
+{
+    void *ptr = NULL;
+    SIZE_T size = sizeof(struct heap_stats);
+
+    if (NtAllocateVirtualMemory( NtCurrentProcess(), &ptr, 0, &size, MEM_COMMIT, PAGE_READWRITE ))
+        return NULL;
+    return ptr;
+}
+
+static void free_heap_stats( struct heap_stats *stats )
+{
+    void *ptr = stats;
+    SIZE_T size = 0;
+
+    NtFreeVirtualMemory( NtCurrentProcess(), &ptr, &size, MEM_RELEASE );
+}
+
+/* take the heap lock, counting contention if statistics are enabled */
+static inline void heap_lock( HEAP *heap )
+{
+    struct heap_stats *stats = heap->stats;
+
+    if (stats)
+    {
+        heap_stats_add( &stats->locks, 1 );
+        if (RtlTryEnterCriticalSection( &heap->critSection )) return;
+        heap_stats_add( &stats->contentions, 1 );
+    }
+    RtlEnterCriticalSection( &heap->critSection );
+}
+
+/***********************************************************************
+ *           heap_stats_sample
+ *
+ * Record the call stack of an allocation. Must be called without the heap lock.
+ */
+static void HEAP_STATS_NOINLINE heap_stats_sample( HEAP *heap, SIZE_T size )
+{
+    struct heap_stats *stats = heap->stats;
+    struct heap_stack_entry *entry;
+    void *frames[HEAP_WINE_STACK_DEPTH];
+    ULONG i, hash, depth;
+
+    depth = RtlCaptureStackBackTrace( HEAP_STATS_SKIP_FRAMES, HEAP_WINE_STACK_DEPTH, frames, &hash );
+    if (!hash) hash = 1;
+
+    RtlEnterCriticalSection( &heap->critSection );
+    for (i = 0; i < HEAP_STATS_MAX_STACKS; i++)
+    {
+        entry = &stats->stacks[(hash + i) % HEAP_STATS_MAX_STACKS];
+        if (!entry->hash)
+        {
+            entry->hash = hash;
+            entry->sample.Depth = depth;
+            memcpy( entry->sample.Frames, frames, depth * sizeof(frames[0]) );
+            stats->nb_stacks++;
+        }
+        else if (entry->hash != hash || entry->sample.Depth != depth ||
+                 memcmp( entry->sample.Frames, frames, depth * sizeof(frames[0]) ))
+            continue;
+        entry->sample.Count++;
+        entry->sample.Bytes += size;
+        break;
+    }
+    if (i == HEAP_STATS_MAX_STACKS) stats->dropped++;
+    RtlLeaveCriticalSection( &heap->critSection );
+}
+
+static void HEAP_STATS_NOINLINE heap_stats_alloc( HEAP *heap, SIZE_T size )
+{
+    struct heap_stats *stats = heap->stats;
+    LONGLONG in_use, peak;
+    unsigned int bytes = min( size, HEAP_STATS_SAMPLE_INTERVAL ), old;
+
+    heap_stats_add( &stats->allocs, 1 );
+    in_use = heap_stats_add( &stats->in_use, size );
+    while ((peak = stats->peak) < in_use && interlocked_cmpxchg64( &stats->peak, in_use, peak ) != peak);
+
+    old = interlocked_xchg_add( &stats->sample_bytes, bytes );
+    if ((old ^ (old + bytes)) & ~(HEAP_STATS_SAMPLE_INTERVAL - 1)) heap_stats_sample( heap, size );
+}
+
+static void heap_stats_free( HEAP *heap, SIZE_T size )
+{
+    heap_stats_add( &heap->stats->frees, 1 );
+    heap_stats_add( &heap->stats->in_use, -(LONGLONG)size );
+}
+
+static void heap_stats_realloc( HEAP *heap, SIZE_T old_size, SIZE_T size )
+{
+    heap_stats_add( &heap->stats->reallocs, 1 );
+    heap_stats_add( &heap->stats->in_use, (LONGLONG)size - (LONGLONG)old_size );
+}
+
+/* collect the free list lengths; must be called with the heap lock held */
+static void get_free_list_stats( HEAP *heap, HEAP_WINE_STATISTICS *info )
+{
+    unsigned int i;
+
+    C_ASSERT( HEAP_NB_FREE_LISTS <= HEAP_WINE_MAX_FREE_LISTS );
+
+    info->FreeListCount = HEAP_NB_FREE_LISTS;
+    info->FreeBytes = 0;
+    for (i = 0; i < HEAP_NB_FREE_LISTS; i++)
+    {
+        struct list *ptr = &heap->freeList[i].arena.entry;
+        struct list *end = &heap->freeList[(i + 1) % HEAP_NB_FREE_LISTS].arena.entry;
+
+        if (i < HEAP_NB_SMALL_FREE_LISTS)
+            info->FreeListMaxSize[i] = HEAP_MIN_ARENA_SIZE + i * ALIGNMENT;
+        else
+            info->FreeListMaxSize[i] = min( HEAP_freeListSizes[i - HEAP_NB_SMALL_FREE_LISTS], ~0u );
+        info->FreeListLength[i] = 0;
+        while ((ptr = ptr->next) != end)
+        {
+            ARENA_FREE *arena = LIST_ENTRY( ptr, ARENA_FREE, entry );
+            info->FreeListLength[i]++;
+            info->FreeBytes += arena->size & ARENA_SIZE_MASK;
+        }
+    }
+}
+
+/***********************************************************************
+ *           get_heap_stats
+ *
+ * Fill the HeapWineStatistics information, returning the full size needed.
+ */
+static SIZE_T get_heap_stats( HEAP *heap, HEAP_WINE_STATISTICS *info, SIZE_T size )
+{
+    struct heap_stats *stats = heap->stats;
+    SIZE_T max_stacks = (size - FIELD_OFFSET( HEAP_WINE_STATISTICS, Stacks )) / sizeof(info->Stacks[0]);
+    unsigned int i;
+
+    memset( info, 0, FIELD_OFFSET( HEAP_WINE_STATISTICS, Stacks ));
+    heap_lock( heap );
+    get_free_list_stats( heap, info );
+    if (stats)
+    {
+        info->Flags               = HEAP_WINE_STATS_ENABLED;
+        info->SampleInterval      = HEAP_STATS_SAMPLE_INTERVAL;
+        info->AllocCount          = stats->allocs;
+        info->FreeCount           = stats->frees;
+        info->ReAllocCount        = stats->reallocs;
+        info->BytesInUse          = stats->in_use;
+        info->PeakBytesInUse      = stats->peak;
+        info->LockCount           = stats->locks;
+        info->LockContentionCount = stats->contentions;
+        info->TotalStackCount     = stats->nb_stacks;
+        for (i = 0; i < HEAP_STATS_MAX_STACKS && info->StackCount < max_stacks; i++)
+            if (stats->stacks[i].hash) info->Stacks[info->StackCount++] = stats->stacks[i].sample;
+    }
+    RtlLeaveCriticalSection( &heap->critSection );
+    return FIELD_OFFSET( HEAP_WINE_STATISTICS, Stacks[info->TotalStackCount] );
+}
+
+static void dump_frame( FILE *file, void *addr )
+{
+    LDR_MODULE *module;
+    char name[MAX_PATH];
+    unsigned int i;
+
+    if (LdrFindEntryForAddress( addr, &module ))
+    {
+        fprintf( file, "    %p\n", addr );
+        return;
+    }
+    for (i = 0; i < module->BaseDllName.Length / sizeof(WCHAR) && i < sizeof(name) - 1; i++)
+        name[i] = module->BaseDllName.Buffer[i] < 0x80 ? module->BaseDllName.Buffer[i] : '?';
+    name[i] = 0;
+    fprintf( file, "    %p %s+0x%lx\n", addr, name, (ULONG_PTR)((char *)addr - (char *)module->BaseAddress) );
+}
+
+/***********************************************************************
+ *           dump_heap_stats
+ */
+static void dump_heap_stats( FILE *file, HEAP *heap )
+{
+    struct heap_stats *stats = heap->stats;
+    const struct heap_stack_entry *entry, *best, *prev = NULL;
+    HEAP_WINE_STATISTICS info;
+    unsigned int i, j;
+
+    if (!stats) return;
+
+    heap_lock( heap );
+    get_free_list_stats( heap, &info );
+    fprintf( file, "heap %p: %llu allocs, %llu frees, %llu reallocs, %llu bytes in use (peak %llu)\n",
+             heap, (unsigned long long)stats->allocs, (unsigned long long)stats->frees,
+             (unsigned long long)stats->reallocs, (unsigned long long)stats->in_use,
+             (unsigned long long)stats->peak );
+    fprintf( file, "  lock: %llu acquisitions, %llu contended\n",
+             (unsigned long long)stats->locks, (unsigned long long)stats->contentions );
+    fprintf( file, "  free lists: %llu bytes free, length per max size:",
+             (unsigned long long)info.FreeBytes );
+    for (i = 0; i < info.FreeListCount; i++)
+    {
+        if (!info.FreeListLength[i]) continue;
+        if (info.FreeListMaxSize[i] == ~0u) fprintf( file, " larger:%u", info.FreeListLength[i] );
+        else fprintf( file, " %u:%u", info.FreeListMaxSize[i], info.FreeListLength[i] );
+    }
+    fprintf( file, "\n  %u sampled stacks (%u samples dropped), every %u bytes allocated:\n",
+             stats->nb_stacks, stats->dropped, HEAP_STATS_SAMPLE_INTERVAL );
+
+    /* print the stacks by decreasing sampled bytes, ties in table order */
+    for (i = 0; i < HEAP_STATS_DUMP_STACKS; i++, prev = best)
+    {
+        for (j = 0, best = NULL; j < HEAP_STATS_MAX_STACKS; j++)
+        {
+            entry = &stats->stacks[j];
+            if (!entry->hash) continue;
+            if (prev && (entry->sample.Bytes > prev->sample.Bytes ||
+                         (entry->sample.Bytes == prev->sample.Bytes && entry <= prev))) continue;
+            if (!best || entry->sample.Bytes > best->sample.Bytes) best = entry;
+        }
+        if (!best) break;
+        fprintf( file, "  %llu bytes in %llu samples\n",
+                 (unsigned long long)best->sample.Bytes, (unsigned long long)best->sample.Count );
+        for (j = 0; j < best->sample.Depth; j++) dump_frame( file, best->sample.Frames[j] );
+    }
+    RtlLeaveCriticalSection( &heap->critSection );
+}
+
+/***********************************************************************
+ *           heap_dump_stats
+ *
+ * Write the statistics of all the heaps to the WINEHEAPSTATS file.
+ */
+void heap_dump_stats(void)
+{
+    static int dumping;
+    FILE *file;
+    HEAP *heap;
+
+    if (!heap_stats_file) return;
+    if (interlocked_xchg( &dumping, 1 )) return;
+
+    if (!heap_stats_file[0] || !strcmp( heap_stats_file, "-" )) file = stderr;
+    else file = fopen( heap_stats_file, "a" );
+
+    if (file)
+    {
+        fprintf( file, "heap statistics for process %04x\n", HandleToULong( NtCurrentTeb()->ClientId.UniqueProcess ));
+        RtlEnterCriticalSection( &processHeap->critSection );
+        dump_heap_stats( file, processHeap );
+        LIST_FOR_EACH_ENTRY( heap, &processHeap->entry, HEAP, entry ) dump_heap_stats( file, heap );
+        RtlLeaveCriticalSection( &processHeap->critSection );
+        if (file != stderr) fclose( file );
+        else fflush( file );
+    }
+    else WARN( "cannot open %s\n", debugstr_a(heap_stats_file) );
+    dumping = 0;
+}
+
+
+/* Low-fragmentation heap front end
+ *
+ * Small blocks are carved out of 64k slabs, each slab serving a single size class.
+ * Every thread keeps a short list of free blocks per size class and per heap, so
+ * that most allocations and frees don't need to take the heap lock; the lock is
+ * only taken to move batches of blocks between the thread caches and the slabs.
+ * Size classes are spaced at most 25% apart, and empty slabs are given back to
+ * the system past a small reserve, which keeps fragmentation bounded.
+ */
+
+#define LFH_SLAB_SIZE        0x10000   /* size and alignment of a slab */
+#define LFH_MAX_SIZE         0x2000    /* largest block size handled by the front end */
+#define LFH_NB_BUCKETS       36        /* number of size classes up to LFH_MAX_SIZE */
+#define LFH_MAX_EMPTY_SLABS  8         /* number of empty slabs kept for reuse */
+#define LFH_CACHE_SLOTS      4         /* number of heaps that a thread can cache blocks for */
+#define LFH_CACHE_BYTES      0x8000    /* amount of memory cached per thread and size class */
+
+typedef struct tagARENA_LFH
+{
+    DWORD  size;                    /* Size of user data */
+    DWORD  magic : 24;              /* Magic number */
+    DWORD  bucket : 8;              /* Size class of the block */
+} ARENA_LFH;
+
+C_ASSERT( sizeof(ARENA_LFH) == sizeof(ARENA_INUSE) );
+
+#define ARENA_LFH_MAGIC        0x48464c
+#define ARENA_LFH_FREE_MAGIC   0x46464c
+
+typedef struct tagLFH_SLAB
+{
+    DWORD               magic;      /* Magic number */
+    DWORD               bucket;     /* Size class served by this slab */
+    HEAP               *heap;       /* Heap owning the slab */
+    struct list         entry;      /* Entry in bucket or empty slabs list */
+    ARENA_LFH          *free;       /* List of free blocks */
+    DWORD               block_size; /* Distance between consecutive blocks */
+    DWORD               count;      /* Total number of blocks */
+    DWORD               carved;     /* Number of blocks carved out so far */
+    DWORD               used;       /* Number of blocks allocated or held in thread caches */
+} LFH_SLAB;
+
+#define LFH_SLAB_MAGIC   ((DWORD)('L' | ('F'<<8) | ('H'<<16) | ('S'<<24)))
+
+/* offset of the first block arena in a slab */
+#define LFH_FIRST_BLOCK  (((sizeof(LFH_SLAB) + sizeof(ARENA_LFH) + ALIGNMENT - 1) & ~(ALIGNMENT - 1)) - sizeof(ARENA_LFH))
+
+struct lfh_bucket
+{
+    struct list         partial;    /* Slabs with some free blocks */
+    struct list         full;       /* Slabs without free blocks */
+};
+
+struct lfh_heap
+{
+    int                 serial;     /* Unique identifier used by the thread caches */
+    DWORD               nb_empty;   /* Number of slabs in the empty list */
+    struct list         empty;      /* Empty slabs not assigned to any size class */
+    struct lfh_bucket   buckets[LFH_NB_BUCKETS];
+};
+
+struct lfh_cache_bucket
+{
+    ARENA_LFH          *head;       /* List of cached free blocks */
+    DWORD               count;      /* Number of blocks in the list */
+};
+
+struct lfh_cache_slot
+{
+    int                 serial;     /* Serial of the cached heap, 0 if unused */
+    HEAP               *heap;       /* Cached heap */
+    struct lfh_cache_bucket buckets[LFH_NB_BUCKETS];
+};
+
+struct heap_thread_cache
+{
+    struct list           entry;    /* Entry in the global list of thread caches */
+    struct lfh_cache_slot slots[LFH_CACHE_SLOTS];
+};
+
+/* value of the thread cache pointer while it is created and after the thread is detached */
+#define LFH_NO_CACHE  ((struct heap_thread_cache *)1)
+
+static struct list lfh_caches = LIST_INIT( lfh_caches );
+static int lfh_serial;
+
+static RTL_CRITICAL_SECTION lfh_section;
+static RTL_CRITICAL_SECTION_DEBUG lfh_critsect_debug =
+{
+    0, 0, &lfh_section,
+    { &lfh_critsect_debug.ProcessLocksList, &lfh_critsect_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": lfh_section") }
+};
+static RTL_CRITICAL_SECTION lfh_section = { &lfh_critsect_debug, -1, 0, 0, 0, 0 };
+
+/* bitmap of the slab addresses, split in leaves of 64k bits allocated on demand */
+#ifdef _WIN64
+#define LFH_MAP_ADDRESS_BITS  47
+#else
+#define LFH_MAP_ADDRESS_BITS  32
+#endif
+#define LFH_MAP_LEAF_BITS     16
+#define LFH_MAP_SIZE          (1 << (LFH_MAP_ADDRESS_BITS - 16 - LFH_MAP_LEAF_BITS))
+
+static int *lfh_slab_map[LFH_MAP_SIZE];
+
+static inline unsigned int lfh_highest_bit( unsigned int x )
+{
+#ifdef __GNUC__
+    return 31 - __builtin_clz( x );
+#else
+    unsigned int bit = 0;
+    while (x >>= 1) bit++;
+    return bit;
+#endif
+}
+
+/* size classes are 16 bytes apart up to 256 bytes, then 4 classes per power of two */
+static inline unsigned int lfh_get_bucket( SIZE_T size )
+{
+    unsigned int bit;
+
+    if (size <= 0x100) return size ? (size - 1) / 16 : 0;
+    bit = lfh_highest_bit( size - 1 );
+    return 16 + (bit - 8) * 4 + ((size - 1) >> (bit - 2)) - 4;
+}
+
+static inline SIZE_T lfh_get_bucket_size( unsigned int bucket )
+{
+    if (bucket < 16) return (bucket + 1) * 16;
+    bucket -= 16;
+    return (SIZE_T)(bucket % 4 + 5) << (bucket / 4 + 6);
+}
+
+/* number of blocks a thread may cache for a given size class */
+static inline DWORD lfh_get_cache_depth( unsigned int bucket )
+{
+    DWORD depth = LFH_CACHE_BYTES / lfh_get_bucket_size( bucket );
+
+    if (depth < 4) return 4;
+    if (depth > 64) return 64;
+    return depth;
+}
+
+static inline ARENA_LFH *lfh_get_block( LFH_SLAB *slab, DWORD index )
+{
+    return (ARENA_LFH *)((char *)slab + LFH_FIRST_BLOCK + index * slab->block_size);
+}
+
+/* free blocks are linked through their user data */
+static inline ARENA_LFH **lfh_next_block( ARENA_LFH *arena )
+{
+    return (ARENA_LFH **)(arena + 1);
+}
+
+static BOOL lfh_map_slab( LFH_SLAB *slab )
+{
+    ULONG_PTR index = (ULONG_PTR)slab / LFH_SLAB_SIZE;
+    int *leaf, *word, val, bit = 1u << (index % 32);
+
+    if ((index >> LFH_MAP_LEAF_BITS) >= LFH_MAP_SIZE) return FALSE;
+    if (!(leaf = lfh_slab_map[index >> LFH_MAP_LEAF_BITS]))
+    {
+        void *ptr = NULL;
+        SIZE_T size = (1 << LFH_MAP_LEAF_BITS) / 8;
+
+        if (NtAllocateVirtualMemory( NtCurrentProcess(), &ptr, 0, &size, MEM_COMMIT, PAGE_READWRITE ))
+            return FALSE;
+        if ((leaf = interlocked_cmpxchg_ptr( (void **)&lfh_slab_map[index >> LFH_MAP_LEAF_BITS], ptr, NULL )))
+        {
+            size = 0;
+            NtFreeVirtualMemory( NtCurrentProcess(), &ptr, &size, MEM_RELEASE );
+        }
+        else leaf = ptr;
+    }
+    word = leaf + (index % (1 << LFH_MAP_LEAF_BITS)) / 32;
+    do val = *word; while (interlocked_cmpxchg( word, val | bit, val ) != val);
+    return TRUE;
+}
+
+static void lfh_unmap_slab( LFH_SLAB *slab )
+{
+    ULONG_PTR index = (ULONG_PTR)slab / LFH_SLAB_SIZE;
+    int *word = lfh_slab_map[index >> LFH_MAP_LEAF_BITS] + (index % (1 << LFH_MAP_LEAF_BITS)) / 32;
+    int val, bit = 1u << (index % 32);
+
+    do val = *word; while (interlocked_cmpxchg( word, val & ~bit, val ) != val);
+}
+
+/***********************************************************************
+ *           lfh_find_slab
+ *
+ * Find the slab of the heap that a pointer belongs to. Doesn't need the heap lock.
+ */
+static LFH_SLAB *lfh_find_slab( const HEAP *heap, const void *ptr )
+{
+    ULONG_PTR index = (ULONG_PTR)ptr / LFH_SLAB_SIZE;
+    const int *leaf;
+    LFH_SLAB *slab;
+
+    if ((index >> LFH_MAP_LEAF_BITS) >= LFH_MAP_SIZE) return NULL;
+    if (!(leaf = lfh_slab_map[index >> LFH_MAP_LEAF_BITS])) return NULL;
+    if (!(leaf[(index % (1 << LFH_MAP_LEAF_BITS)) / 32] & (1u << (index % 32)))) return NULL;
+    slab = (LFH_SLAB *)(index * LFH_SLAB_SIZE);
+    if (slab->magic != LFH_SLAB_MAGIC || slab->heap != heap) return NULL;
+    return slab;
+}
+
+/***********************************************************************
+ *           lfh_validate_block
+ *
+ * Minimum validation of a block pointer belonging to a slab.
+ */
+static BOOL lfh_validate_block( const LFH_SLAB *slab, const ARENA_LFH *arena )
+{
+    SIZE_T offset = (const char *)arena - (const char *)slab;
+
+    if (offset < LFH_FIRST_BLOCK || (offset - LFH_FIRST_BLOCK) % slab->block_size ||
+        (offset - LFH_FIRST_BLOCK) / slab->block_size >= slab->carved)
+        WARN( "Heap %p: invalid block pointer %p\n", slab->heap, arena + 1 );
+    else if (arena->magic == ARENA_LFH_FREE_MAGIC)
+        WARN( "Heap %p: block %p used after free\n", slab->heap, arena + 1 );
+    else if (arena->magic != ARENA_LFH_MAGIC)
+        WARN( "Heap %p: invalid block magic %08x for %p\n", slab->heap, arena->magic, arena );
+    else
+        return TRUE;
+    return FALSE;
+}
+
+static void lfh_release_slab( LFH_SLAB *slab )
+{
+    void *addr = slab;
+    SIZE_T size = 0;
+
+    slab->magic = 0;
+    lfh_unmap_slab( slab );
+    NtFreeVirtualMemory( NtCurrentProcess(), &addr, &size, MEM_RELEASE );
+}
+
+/***********************************************************************
+ *           lfh_alloc_slab
+ *
+ * Assign a new slab to a size class. Must be called with the heap lock held.
+ */
+static LFH_SLAB *lfh_alloc_slab( HEAP *heap, unsigned int bucket )
+{
+    struct lfh_heap *lfh = heap->lfh;
+    LFH_SLAB *slab;
+
+    if (!list_empty( &lfh->empty ))
+    {
+        slab = LIST_ENTRY( list_head( &lfh->empty ), LFH_SLAB, entry );
+        list_remove( &slab->entry );
+        lfh->nb_empty--;
+    }
+    else
+    {
+        void *ptr = NULL;
+        SIZE_T size = LFH_SLAB_SIZE;
+
+        if (NtAllocateVirtualMemory( NtCurrentProcess(), &ptr, 0, &size, MEM_COMMIT,
+                                     get_protection_type( heap->flags ) ))
+        {
+            WARN( "Could not allocate slab for heap %p\n", heap );
+            return NULL;
+        }
+        slab = ptr;
+        if ((ULONG_PTR)slab % LFH_SLAB_SIZE || !lfh_map_slab( slab ))
+        {
+            size = 0;
+            NtFreeVirtualMemory( NtCurrentProcess(), &ptr, &size, MEM_RELEASE );
+            return NULL;
+        }
+        slab->magic = LFH_SLAB_MAGIC;
+        slab->heap  = heap;
+    }
+
+    slab->bucket     = bucket;
+    slab->block_size = (lfh_get_bucket_size( bucket ) + sizeof(ARENA_LFH) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    slab->count      = (LFH_SLAB_SIZE - LFH_FIRST_BLOCK) / slab->block_size;
+    slab->carved     = 0;
+    slab->used       = 0;
+    slab->free       = NULL;
+    list_add_head( &lfh->buckets[bucket].partial, &slab->entry );
+    return slab;
+}
+
+/***********************************************************************
+ *           lfh_take_blocks
+ *
+ * Take up to *count free blocks of a size class, returned as a linked list.
+ * Must be called with the heap lock held.
+ */
+static ARENA_LFH *lfh_take_blocks( HEAP *heap, unsigned int bucket, DWORD *count )
+{
+    struct lfh_bucket *lfh_bucket = &heap->lfh->buckets[bucket];
+    ARENA_LFH *arena, *head = NULL;
+    struct list *ptr;
+    LFH_SLAB *slab;
+    DWORD taken = 0;
+
+    while (taken < *count)
+    {
+        if ((ptr = list_head( &lfh_bucket->partial ))) slab = LIST_ENTRY( ptr, LFH_SLAB, entry );
+        else if (!(slab = lfh_alloc_slab( heap, bucket ))) break;
+
+        while (taken < *count && slab->used < slab->count)
+        {
+            if ((arena = slab->free)) slab->free = *lfh_next_block( arena );
+            else arena = lfh_get_block( slab, slab->carved++ );
+            arena->magic  = ARENA_LFH_FREE_MAGIC;
+            arena->bucket = bucket;
+            *lfh_next_block( arena ) = head;
+            head = arena;
+            slab->used++;
+            taken++;
+        }
+        if (slab->used == slab->count)
+        {
+            list_remove( &slab->entry );
+            list_add_head( &lfh_bucket->full, &slab->entry );
+        }
+    }
+    *count = taken;
+    return head;
+}
+
+/***********************************************************************
+ *           lfh_return_block
+ *
+ * Give a free block back to its slab. Must be called with the heap lock held.
+ */
+static void lfh_return_block( HEAP *heap, ARENA_LFH *arena )
+{
+    struct lfh_heap *lfh = heap->lfh;
+    LFH_SLAB *slab = (LFH_SLAB *)((ULONG_PTR)arena & ~(ULONG_PTR)(LFH_SLAB_SIZE - 1));
+
+    *lfh_next_block( arena ) = slab->free;
+    slab->free = arena;
+    if (slab->used-- == slab->count)
+    {
+        list_remove( &slab->entry );
+        list_add_head( &lfh->buckets[slab->bucket].partial, &slab->entry );
+    }
+    if (slab->used) return;
+
+    list_remove( &slab->entry );
+    if (lfh->nb_empty < LFH_MAX_EMPTY_SLABS)
+    {
+        list_add_head( &lfh->empty, &slab->entry );
+        lfh->nb_empty++;
+    }
+    else lfh_release_slab( slab );
+}
+
+/* give back up to count blocks of a thread cache; must be called with the heap lock held */
+static void lfh_flush_cache( HEAP *heap, struct lfh_cache_bucket *cache, DWORD count )
+{
+    ARENA_LFH *arena;
+
+    while (count-- && (arena = cache->head))
+    {
+        cache->head = *lfh_next_block( arena );
+        cache->count--;
+        lfh_return_block( heap, arena );
+    }
+}
+
+/***********************************************************************
+ *           lfh_get_cache_slot
+ *
+ * Get the current thread cache for a heap, or NULL if the thread can't cache blocks.
+ */
+static struct lfh_cache_slot *lfh_get_cache_slot( HEAP *heap )
+{
+    struct heap_thread_cache *cache = ntdll_get_thread_data()->heap_cache;
+    struct lfh_cache_slot *free_slot = NULL;
+    int serial = heap->lfh->serial;
+    unsigned int i;
+
+    if (!cache)
+    {
+        /* the cache itself may come from the front end, make sure we don't recurse */
+        ntdll_get_thread_data()->heap_cache = LFH_NO_CACHE;
+        if (!(cache = RtlAllocateHeap( processHeap, HEAP_ZERO_MEMORY, sizeof(*cache) ))) return NULL;
+        RtlEnterCriticalSection( &lfh_section );
+        list_add_tail( &lfh_caches, &cache->entry );
+        RtlLeaveCriticalSection( &lfh_section );
+        ntdll_get_thread_data()->heap_cache = cache;
+    }
+    if (cache == LFH_NO_CACHE) return NULL;
+
+    for (i = 0; i < LFH_CACHE_SLOTS; i++)
+    {
+        if (cache->slots[i].serial == serial) return &cache->slots[i];
+        if (!cache->slots[i].serial && !free_slot) free_slot = &cache->slots[i];
+    }
+    if (free_slot)
+    {
+        free_slot->heap   = heap;
+        free_slot->serial = serial;
+    }
+    return free_slot;
+}
+
+/***********************************************************************
+ *           lfh_allocate
+ *
+ * Allocate a small block from the front end. Returns NULL if the slabs
+ * can't be grown, to let the caller fall back to the normal heap.
+ */
+static void *lfh_allocate( HEAP *heap, DWORD flags, SIZE_T size )
+{
+    unsigned int bucket = lfh_get_bucket( size );
+    struct lfh_cache_slot *slot = lfh_get_cache_slot( heap );
+    struct lfh_cache_bucket *cache = slot ? &slot->buckets[bucket] : NULL;
+    ARENA_LFH *arena;
+    DWORD count;
+
+    if (cache && (arena = cache->head))
+    {
+        cache->head = *lfh_next_block( arena );
+        cache->count--;
+    }
+    else
+    {
+        count = cache ? lfh_get_cache_depth( bucket ) / 2 : 1;
+        heap_lock( heap );
+        arena = lfh_take_blocks( heap, bucket, &count );
+        RtlLeaveCriticalSection( &heap->critSection );
+        if (!arena) return NULL;
+        if (cache)
+        {
+            cache->head  = *lfh_next_block( arena );
+            cache->count = count - 1;
+        }
+    }
+
+    arena->size  = size;
+    arena->magic = ARENA_LFH_MAGIC;
+    if (flags & HEAP_ZERO_MEMORY) memset( arena + 1, 0, size );
+    return arena + 1;
+}
+
+/***********************************************************************
+ *           lfh_free
+ */
+static void lfh_free( HEAP *heap, ARENA_LFH *arena )
+{
+    struct lfh_cache_slot *slot = lfh_get_cache_slot( heap );
+    struct lfh_cache_bucket *cache;
+    DWORD depth;
+
+    arena->magic = ARENA_LFH_FREE_MAGIC;
+    if (!slot)
+    {
+        heap_lock( heap );
+        lfh_return_block( heap, arena );
+        RtlLeaveCriticalSection( &heap->critSection );
+        return;
+    }
+
+    cache = &slot->buckets[arena->bucket];
+    *lfh_next_block( arena ) = cache->head;
+    cache->head = arena;
+    if (++cache->count > (depth = lfh_get_cache_depth( arena->bucket )))
+    {
+        heap_lock( heap );
+        lfh_flush_cache( heap, cache, depth / 2 );
+        RtlLeaveCriticalSection( &heap->critSection );
+    }
+}
+
+/***********************************************************************
+ *           lfh_reallocate
+ */
+static void *lfh_reallocate( HEAP *heap, DWORD flags, ARENA_LFH *arena, SIZE_T size )
+{
+    void *ret;
+
+    if (size <= lfh_get_bucket_size( arena->bucket ))
+    {
+        if ((flags & HEAP_ZERO_MEMORY) && size > arena->size)
+            memset( (char *)(arena + 1) + arena->size, 0, size - arena->size );
+        arena->size = size;
+        return arena + 1;
+    }
+    if (flags & HEAP_REALLOC_IN_PLACE_ONLY) return NULL;
+    if (!(ret = RtlAllocateHeap( heap, flags & HEAP_NO_SERIALIZE, size ))) return NULL;
+    memcpy( ret, arena + 1, arena->size );
+    if (flags & HEAP_ZERO_MEMORY) memset( (char *)ret + arena->size, 0, size - arena->size );
+    lfh_free( heap, arena );
+    return ret;
+}
+
+/***********************************************************************
+ *           lfh_enable
+ */
+static NTSTATUS lfh_enable( HEAP *heap )
+{
+    struct lfh_heap *lfh = NULL;
+    SIZE_T size = sizeof(*lfh);
+    unsigned int i;
+
+    if (heap->flags & (HEAP_NO_SERIALIZE | HEAP_TAIL_CHECKING_ENABLED | HEAP_FREE_CHECKING_ENABLED |
+                       HEAP_VALIDATE | HEAP_PAGE_ALLOCS) || RUNNING_ON_VALGRIND)
+    {
+        WARN( "Heap %p: flags %08x not compatible with the low-fragmentation heap\n", heap, heap->flags );
+        return STATUS_UNSUCCESSFUL;
+    }
+    /* the slabs are allocated outside of the heap, so they would not count against a fixed size */
+    if (!(heap->flags & HEAP_GROWABLE))
+    {
+        WARN( "Heap %p: the low-fragmentation heap is not supported on fixed-size heaps\n", heap );
+        return STATUS_NOT_SUPPORTED;
+    }
+    if (heap->lfh) return STATUS_SUCCESS;
+
+    if (NtAllocateVirtualMemory( NtCurrentProcess(), (void **)&lfh, 0, &size, MEM_COMMIT, PAGE_READWRITE ))
+        return STATUS_NO_MEMORY;
+    lfh->serial = interlocked_xchg_add( &lfh_serial, 1 ) + 1;
+    list_init( &lfh->empty );
+    for (i = 0; i < LFH_NB_BUCKETS; i++)
+    {
+        list_init( &lfh->buckets[i].partial );
+        list_init( &lfh->buckets[i].full );
+    }
+
+    RtlEnterCriticalSection( &heap->critSection );
+    if (!heap->lfh)
+    {
+        heap->lfh = lfh;
+        lfh = NULL;
+    }
+    RtlLeaveCriticalSection( &heap->critSection );
+
+    if (lfh)
+    {
+        size = 0;
+        NtFreeVirtualMemory( NtCurrentProcess(), (void **)&lfh, &size, MEM_RELEASE );
+    }
+    TRACE( "enabled low-fragmentation heap for %p\n", heap );
+    return STATUS_SUCCESS;
+}
+
+/***********************************************************************
+ *           lfh_destroy
+ */
+static void lfh_destroy( HEAP *heap )
+{
+    struct lfh_heap *lfh = heap->lfh;
+    struct heap_thread_cache *cache;
+    LFH_SLAB *slab, *next;
+    unsigned int i;
+    SIZE_T size = 0;
+
+    /* forget the blocks held by thread caches, they go away with the slabs */
+    RtlEnterCriticalSection( &lfh_section );
+    LIST_FOR_EACH_ENTRY( cache, &lfh_caches, struct heap_thread_cache, entry )
+    {
+        for (i = 0; i < LFH_CACHE_SLOTS; i++)
+        {
+            if (cache->slots[i].serial != lfh->serial) continue;
+            memset( cache->slots[i].buckets, 0, sizeof(cache->slots[i].buckets) );
+            cache->slots[i].serial = 0;
+        }
+    }
+    RtlLeaveCriticalSection( &lfh_section );
+
+    for (i = 0; i < LFH_NB_BUCKETS; i++)
+    {
+        LIST_FOR_EACH_ENTRY_SAFE( slab, next, &lfh->buckets[i].partial, LFH_SLAB, entry )
+            lfh_release_slab( slab );
+        LIST_FOR_EACH_ENTRY_SAFE( slab, next, &lfh->buckets[i].full, LFH_SLAB, entry )
+            lfh_release_slab( slab );
+    }
+    LIST_FOR_EACH_ENTRY_SAFE( slab, next, &lfh->empty, LFH_SLAB, entry )
+        lfh_release_slab( slab );
+
+    heap->lfh = NULL;
+    NtFreeVirtualMemory( NtCurrentProcess(), (void **)&lfh, &size, MEM_RELEASE );
+}
+
+
+/***********************************************************************
+ *           heap_thread_detach
+ *
+ * Give the blocks cached by the current thread back to their heaps.
+ */
+void heap_thread_detach(void)
+{
+    struct heap_thread_cache *cache = ntdll_get_thread_data()->heap_cache;
+    unsigned int i, j;
+
+    ntdll_get_thread_data()->heap_cache = LFH_NO_CACHE;
+    if (!cache || cache == LFH_NO_CACHE) return;
+
+    RtlEnterCriticalSection( &lfh_section );
+    list_remove( &cache->entry );
+    for (i = 0; i < LFH_CACHE_SLOTS; i++)
+    {
+        struct lfh_cache_slot *slot = &cache->slots[i];
+
+        if (!slot->serial) continue;
+        RtlEnterCriticalSection( &slot->heap->critSection );
+        for (j = 0; j < LFH_NB_BUCKETS; j++) lfh_flush_cache( slot->heap, &slot->buckets[j], ~0u );
+        RtlLeaveCriticalSection( &slot->heap->critSection );
+    }
+    RtlLeaveCriticalSection( &lfh_section );
+    RtlFreeHeap( processHeap, 0, cache );
+}
+
+
 /***********************************************************************
  *           HEAP_IsRealArena  [Internal]
  * Validates a block is a valid arena.
@@ -1334,6 +2268,7 @@ static BOOL HEAP_IsRealArena( HEAP *heapPtr,   /* [in] ptr to the heap */
     SUBHEAP *subheap;
     BOOL ret = TRUE;
     const ARENA_LARGE *large_arena;
+    const LFH_SLAB *slab;
 
     flags &= HEAP_NO_SERIALIZE;
     flags |= heapPtr->flags;
@@ -1345,7 +2280,9 @@ static BOOL HEAP_IsRealArena( HEAP *heapPtr,   /* [in] ptr to the heap */
     {
         const ARENA_INUSE *arena = (const ARENA_INUSE *)block - 1;
 
-        if (!(subheap = HEAP_FindSubHeap( heapPtr, arena )) ||
+        if (heapPtr->lfh && (slab = lfh_find_slab( heapPtr, block )))
+            ret = lfh_validate_block( slab, (const ARENA_LFH *)block - 1 );
+        else if (!(subheap = HEAP_FindSubHeap( heapPtr, arena )) ||
             ((const char *)arena < (char *)subheap->base + subheap->headerSize))
         {
             if (!(large_arena = find_large_block( heapPtr, block )))
@@ -1560,9 +2497,12 @@ HANDLE WINAPI RtlCreateHeap( ULONG flags, PVOID addr, SIZE_T totalSize, SIZE_T c
         flags |= HEAP_GROWABLE;
     }
 
+    if (!processHeap && !addr) init_heap_stats();
+
     if (!(subheap = HEAP_CreateSubHeap( NULL, addr, flags, commitSize, totalSize ))) return 0;
 
     heap_set_debug_flags( subheap->heap );
+    if (heap_stats_file) subheap->heap->stats = alloc_heap_stats();
 
     /* link it into the per-process heap list */
     if (processHeap)
@@ -1612,6 +2552,9 @@ HANDLE WINAPI RtlDestroyHeap( HANDLE heap )
     list_remove( &heapPtr->entry );
     RtlLeaveCriticalSection( &processHeap->critSection );
 
+    if (heapPtr->lfh) lfh_destroy( heapPtr );
+    if (heapPtr->stats) free_heap_stats( heapPtr->stats );
+
     heapPtr->critSection.DebugInfo->Spare[0] = 0;
     RtlDeleteCriticalSection( &heapPtr->critSection );
 
@@ -1669,12 +2612,21 @@ void * WINAPI DECLSPEC_HOTPATCH RtlAllocateHeap( HANDLE heap, ULONG flags, SIZE_
     SUBHEAP *subheap;
     HEAP *heapPtr = HEAP_GetPtr( heap );
     SIZE_T rounded_size;
+    void *ret;
 
     /* Validate the parameters */
 
     if (!heapPtr) return NULL;
     flags &= HEAP_GENERATE_EXCEPTIONS | HEAP_NO_SERIALIZE | HEAP_ZERO_MEMORY;
     flags |= heapPtr->flags;
+
+    if (heapPtr->lfh && size <= LFH_MAX_SIZE && (ret = lfh_allocate( heapPtr, flags, size )))
+    {
+        if (heapPtr->stats) heap_stats_alloc( heapPtr, size );
+        TRACE("(%p,%08x,%08lx): returning %p\n", heap, flags, size, ret );
+        return ret;
+    }
+
     rounded_size = ROUND_SIZE(size) + HEAP_TAIL_EXTRA_SIZE( flags );
     if (rounded_size < size)  /* overflow */
     {
@@ -1683,12 +2635,13 @@ void * WINAPI DECLSPEC_HOTPATCH RtlAllocateHeap( HANDLE heap, ULONG flags, SIZE_
     }
     if (rounded_size < HEAP_MIN_DATA_SIZE) rounded_size = HEAP_MIN_DATA_SIZE;
 
-    if (!(flags & HEAP_NO_SERIALIZE)) RtlEnterCriticalSection( &heapPtr->critSection );
+    if (!(flags & HEAP_NO_SERIALIZE)) heap_lock( heapPtr );
 
     if (rounded_size >= HEAP_MIN_LARGE_BLOCK_SIZE && (flags & HEAP_GROWABLE))
     {
-        void *ret = allocate_large_block( heap, flags, size );
+        ret = allocate_large_block( heap, flags, size );
         if (!(flags & HEAP_NO_SERIALIZE)) RtlLeaveCriticalSection( &heapPtr->critSection );
+        if (ret && heapPtr->stats) heap_stats_alloc( heapPtr, size );
         if (!ret && (flags & HEAP_GENERATE_EXCEPTIONS)) RtlRaiseStatus( STATUS_NO_MEMORY );
         TRACE("(%p,%08x,%08lx): returning %p\n", heap, flags, size, ret );
         return ret;
@@ -1727,6 +2680,7 @@ void * WINAPI DECLSPEC_HOTPATCH RtlAllocateHeap( HANDLE heap, ULONG flags, SIZE_
     initialize_block( pInUse + 1, size, pInUse->unused_bytes, flags );
 
     if (!(flags & HEAP_NO_SERIALIZE)) RtlLeaveCriticalSection( &heapPtr->critSection );
+    if (heapPtr->stats) heap_stats_alloc( heapPtr, size );
 
     TRACE("(%p,%08x,%08lx): returning %p\n", heap, flags, size, pInUse + 1 );
     return pInUse + 1;
@@ -1751,7 +2705,9 @@ BOOLEAN WINAPI DECLSPEC_HOTPATCH RtlFreeHeap( HANDLE heap, ULONG flags, void *pt
 {
     ARENA_INUSE *pInUse;
     SUBHEAP *subheap;
+    LFH_SLAB *slab;
     HEAP *heapPtr;
+    SIZE_T size;
 
     /* Validate the parameters */
 
@@ -1764,9 +2720,26 @@ BOOLEAN WINAPI DECLSPEC_HOTPATCH RtlFreeHeap( HANDLE heap, ULONG flags, void *pt
         return FALSE;
     }
 
+    if (heapPtr->lfh && (slab = lfh_find_slab( heapPtr, ptr )))
+    {
+        ARENA_LFH *arena = (ARENA_LFH *)ptr - 1;
+
+        if (!lfh_validate_block( slab, arena ))
+        {
+            RtlSetLastWin32ErrorAndNtStatusFromNtStatus( STATUS_INVALID_PARAMETER );
+            TRACE("(%p,%08x,%p): returning FALSE\n", heap, flags, ptr );
+            return FALSE;
+        }
+        size = arena->size;
+        lfh_free( heapPtr, arena );
+        if (heapPtr->stats) heap_stats_free( heapPtr, size );
+        TRACE("(%p,%08x,%p): returning TRUE\n", heap, flags, ptr );
+        return TRUE;
+    }
+
     flags &= HEAP_NO_SERIALIZE;
     flags |= heapPtr->flags;
-    if (!(flags & HEAP_NO_SERIALIZE)) RtlEnterCriticalSection( &heapPtr->critSection );
+    if (!(flags & HEAP_NO_SERIALIZE)) heap_lock( heapPtr );
 
     /* Inform valgrind we are trying to free memory, so it can throw up an error message */
     notify_free( ptr );
@@ -1776,11 +2749,18 @@ BOOLEAN WINAPI DECLSPEC_HOTPATCH RtlFreeHeap( HANDLE heap, ULONG flags, void *pt
     if (!validate_block_pointer( heapPtr, &subheap, pInUse )) goto error;
 
     if (!subheap)
+    {
+        size = ((ARENA_LARGE *)ptr - 1)->data_size;
         free_large_block( heapPtr, flags, ptr );
+    }
     else
+    {
+        size = (pInUse->size & ARENA_SIZE_MASK) - pInUse->unused_bytes;
         HEAP_MakeInUseBlockFree( subheap, pInUse );
+    }
 
     if (!(flags & HEAP_NO_SERIALIZE)) RtlLeaveCriticalSection( &heapPtr->critSection );
+    if (heapPtr->stats) heap_stats_free( heapPtr, size );
     TRACE("(%p,%08x,%p): returning TRUE\n", heap, flags, ptr );
     return TRUE;
 
@@ -1812,6 +2792,7 @@ PVOID WINAPI RtlReAllocateHeap( HANDLE heap, ULONG flags, PVOID ptr, SIZE_T size
     ARENA_INUSE *pArena;
     HEAP *heapPtr;
     SUBHEAP *subheap;
+    LFH_SLAB *slab;
     SIZE_T oldBlockSize, oldActualSize, rounded_size;
     void *ret;
 
@@ -1827,7 +2808,30 @@ PVOID WINAPI RtlReAllocateHeap( HANDLE heap, ULONG flags, PVOID ptr, SIZE_T size
     flags &= HEAP_GENERATE_EXCEPTIONS | HEAP_NO_SERIALIZE | HEAP_ZERO_MEMORY |
              HEAP_REALLOC_IN_PLACE_ONLY;
     flags |= heapPtr->flags;
-    if (!(flags & HEAP_NO_SERIALIZE)) RtlEnterCriticalSection( &heapPtr->critSection );
+
+    if (heapPtr->lfh && (slab = lfh_find_slab( heapPtr, ptr )))
+    {
+        ARENA_LFH *arena = (ARENA_LFH *)ptr - 1;
+
+        if (!lfh_validate_block( slab, arena ))
+        {
+            RtlSetLastWin32ErrorAndNtStatusFromNtStatus( STATUS_INVALID_PARAMETER );
+            TRACE("(%p,%08x,%p,%08lx): returning NULL\n", heap, flags, ptr, size );
+            return NULL;
+        }
+        oldActualSize = arena->size;
+        if (!(ret = lfh_reallocate( heapPtr, flags, arena, size )))
+        {
+            if (flags & HEAP_GENERATE_EXCEPTIONS) RtlRaiseStatus( STATUS_NO_MEMORY );
+            RtlSetLastWin32ErrorAndNtStatusFromNtStatus( STATUS_NO_MEMORY );
+        }
+        else if (heapPtr->stats)  /* a moved block was already counted as a new allocation */
+            heap_stats_realloc( heapPtr, oldActualSize, ret == ptr ? size : 0 );
+        TRACE("(%p,%08x,%p,%08lx): returning %p\n", heap, flags, ptr, size, ret );
+        return ret;
+    }
+
+    if (!(flags & HEAP_NO_SERIALIZE)) heap_lock( heapPtr );
 
     rounded_size = ROUND_SIZE(size) + HEAP_TAIL_EXTRA_SIZE(flags);
     if (rounded_size < size) goto oom;  /* overflow */
@@ -1837,6 +2841,7 @@ PVOID WINAPI RtlReAllocateHeap( HANDLE heap, ULONG flags, PVOID ptr, SIZE_T size
     if (!validate_block_pointer( heapPtr, &subheap, pArena )) goto error;
     if (!subheap)
     {
+        oldActualSize = ((ARENA_LARGE *)ptr - 1)->data_size;
         if (!(ret = realloc_large_block( heapPtr, flags, ptr, size ))) goto oom;
         goto done;
     }
@@ -1922,6 +2927,7 @@ PVOID WINAPI RtlReAllocateHeap( HANDLE heap, ULONG flags, PVOID ptr, SIZE_T size
     ret = pArena + 1;
 done:
     if (!(flags & HEAP_NO_SERIALIZE)) RtlLeaveCriticalSection( &heapPtr->critSection );
+    if (heapPtr->stats) heap_stats_realloc( heapPtr, oldActualSize, size );
     TRACE("(%p,%08x,%p,%08lx): returning %p\n", heap, flags, ptr, size, ret );
     return ret;
 
@@ -2027,6 +3033,7 @@ SIZE_T WINAPI RtlSizeHeap( HANDLE heap, ULONG flags, const void *ptr )
     SIZE_T ret;
     const ARENA_INUSE *pArena;
     SUBHEAP *subheap;
+    LFH_SLAB *slab;
     HEAP *heapPtr = HEAP_GetPtr( heap );
 
     if (!heapPtr)
@@ -2034,9 +3041,23 @@ SIZE_T WINAPI RtlSizeHeap( HANDLE heap, ULONG flags, const void *ptr )
         RtlSetLastWin32ErrorAndNtStatusFromNtStatus( STATUS_INVALID_HANDLE );
         return ~0UL;
     }
+
+    if (heapPtr->lfh && (slab = lfh_find_slab( heapPtr, ptr )))
+    {
+        const ARENA_LFH *arena = (const ARENA_LFH *)ptr - 1;
+
+        if (lfh_validate_block( slab, arena )) ret = arena->size;
+        else
+        {
+            RtlSetLastWin32ErrorAndNtStatusFromNtStatus( STATUS_INVALID_PARAMETER );
+            ret = ~0UL;
+        }
+        TRACE("(%p,%08x,%p): returning %08lx\n", heap, flags, ptr, ret );
+        return ret;
+    }
     flags &= HEAP_NO_SERIALIZE;
     flags |= heapPtr->flags;
-    if (!(flags & HEAP_NO_SERIALIZE)) RtlEnterCriticalSection( &heapPtr->critSection );
+    if (!(flags & HEAP_NO_SERIALIZE)) heap_lock( heapPtr );
 
     pArena = (const ARENA_INUSE *)ptr - 1;
     if (!validate_block_pointer( heapPtr, &subheap, pArena ))
@@ -2246,7 +3267,10 @@ ULONG WINAPI RtlGetProcessHeaps( ULONG count, HANDLE *heaps )
 NTSTATUS WINAPI RtlQueryHeapInformation( HANDLE heap, HEAP_INFORMATION_CLASS info_class,
                                          PVOID info, SIZE_T size_in, PSIZE_T size_out)
 {
-    switch (info_class)
+    HEAP *heapPtr;
+    SIZE_T size;
+
+    switch ((ULONG)info_class)
     {
     case HeapCompatibilityInformation:
         if (size_out) *size_out = sizeof(ULONG);
@@ -2254,7 +3278,19 @@ NTSTATUS WINAPI RtlQueryHeapInformation( HANDLE heap, HEAP_INFORMATION_CLASS inf
         if (size_in < sizeof(ULONG))
             return STATUS_BUFFER_TOO_SMALL;
 
-        *(ULONG *)info = 0; /* standard heap */
+        heapPtr = HEAP_GetPtr( heap );
+        *(ULONG *)info = heapPtr && heapPtr->lfh ? 2 : 0; /* low-fragmentation or standard heap */
+        return STATUS_SUCCESS;
+
+    case HeapWineStatistics:
+        if (!(heapPtr = HEAP_GetPtr( heap ))) return STATUS_INVALID_HANDLE;
+        if (size_in < FIELD_OFFSET( HEAP_WINE_STATISTICS, Stacks ))
+        {
+            if (size_out) *size_out = sizeof(HEAP_WINE_STATISTICS);
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+        size = get_heap_stats( heapPtr, info, size_in );
+        if (size_out) *size_out = size;
         return STATUS_SUCCESS;
 
     default:
@@ -2268,6 +3304,27 @@ NTSTATUS WINAPI RtlQueryHeapInformation( HANDLE heap, HEAP_INFORMATION_CLASS inf
  */
 NTSTATUS WINAPI RtlSetHeapInformation( HANDLE heap, HEAP_INFORMATION_CLASS info_class, PVOID info, SIZE_T size)
 {
-    FIXME("%p %d %p %ld stub\n", heap, info_class, info, size);
-    return STATUS_SUCCESS;
+    HEAP *heapPtr;
+
+    switch (info_class)
+    {
+    case HeapCompatibilityInformation:
+        if (size < sizeof(ULONG)) return STATUS_BUFFER_TOO_SMALL;
+        if (!(heapPtr = HEAP_GetPtr( heap ))) return STATUS_INVALID_HANDLE;
+
+        switch (*(ULONG *)info)
+        {
+        case 0:  /* the low-fragmentation heap can't be disabled once enabled */
+            return heapPtr->lfh ? STATUS_UNSUCCESSFUL : STATUS_SUCCESS;
+        case 2:
+            return lfh_enable( heapPtr );
+        default:
+            WARN("%p: unsupported heap compatibility mode %u\n", heap, *(ULONG *)info);
+            return STATUS_UNSUCCESSFUL;
+        }
+
+    default:
+        FIXME("%p %d %p %ld stub\n", heap, info_class, info, size);
+        return STATUS_SUCCESS;
+    }
 }
@@ -23,10 +23,21 @@
 #include "wine/port.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+# include <sys/stat.h>
+#endif
 #ifdef HAVE_SYS_MMAN_H
 # include <sys/mman.h>
 #endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -50,6 +61,7 @@ WINE_DECLARE_DEBUG_CHANNEL(relay);
 WINE_DECLARE_DEBUG_CHANNEL(snoop);
 WINE_DECLARE_DEBUG_CHANNEL(loaddll);
 WINE_DECLARE_DEBUG_CHANNEL(imports);
+WINE_DECLARE_DEBUG_CHANNEL(ldrtime);
 
 #ifdef _WIN64
 #define DEFAULT_SECURITY_COOKIE_64  (((ULONGLONG)0x00002b99 << 32) | 0x2ddfa232)
@@ -93,6 +105,8 @@ static const char * const reason_names[] =
 
 static const WCHAR dllW[] = {'.','d','l','l',0};
 
+struct reloc_job;
+
 /* internal representation of 32bit modules. per process. */
 typedef struct _wine_modref
 {
@@ -102,6 +116,12 @@ typedef struct _wine_modref
     int                   alloc_deps;
     int                   nDeps;
     struct _wine_modref **deps;
+    DWORD                 export_hash;  /* hash of the export tables, for the binding cache */
+    LONGLONG              load_time;    /* time spent mapping the module (+ldrtime) */
+    LONGLONG              reloc_time;   /* time spent relocating the module */
+    LONGLONG              import_time;  /* time spent resolving imports, excluding dependencies */
+    LONGLONG              init_time;    /* time spent in the process attach notification */
+    struct reloc_job     *reloc_job;    /* relocations still being applied by a worker thread */
 } WINE_MODREF;
 
 /* info about the current builtin dll load */
@@ -133,9 +153,12 @@ static RTL_CRITICAL_SECTION loader_section = { &critsect_debug, -1, 0, 0, 0, 0 }
 static WINE_MODREF *cached_modref;
 static WINE_MODREF *current_modref;
 static WINE_MODREF *last_failed_modref;
+static LONGLONG ldr_nested_time;  /* time spent loading dependencies, for +ldrtime */
+static int load_dll_depth;        /* nesting level of load_dll calls */
 
 static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_MODREF** pwm );
 static NTSTATUS process_attach( WINE_MODREF *wm, LPVOID lpReserved );
+static void wait_module_relocations( WINE_MODREF *wm );
 static FARPROC find_ordinal_export( HMODULE module, const IMAGE_EXPORT_DIRECTORY *exports,
                                     DWORD exp_size, DWORD ordinal, LPCWSTR load_path );
 static FARPROC find_named_export( HMODULE module, const IMAGE_EXPORT_DIRECTORY *exports,
@@ -147,6 +170,27 @@ static inline void *get_rva( HMODULE module, DWORD va )
     return (void *)((char *)module + va);
 }
 
+static inline LONGLONG get_ldr_time(void)
+{
+    LARGE_INTEGER counter;
+    NtQueryPerformanceCounter( &counter, NULL );
+    return counter.QuadPart;
+}
+
+/* print the time spent in each loading step of a module, in microseconds */
+static void dump_module_times( const WINE_MODREF *wm )
+{
+    LARGE_INTEGER counter, freq;
+
+    NtQueryPerformanceCounter( &counter, &freq );
+    TRACE_(ldrtime)( "%s: load %s us, reloc %s us, imports %s us, init %s us\n",
+                     debugstr_w(wm->ldr.BaseDllName.Buffer),
+                     wine_dbgstr_longlong( wm->load_time * 1000000 / freq.QuadPart ),
+                     wine_dbgstr_longlong( wm->reloc_time * 1000000 / freq.QuadPart ),
+                     wine_dbgstr_longlong( wm->import_time * 1000000 / freq.QuadPart ),
+                     wine_dbgstr_longlong( wm->init_time * 1000000 / freq.QuadPart ));
+}
+
 /* check whether the file name contains a path */
 static inline BOOL contains_path( LPCWSTR name )
 {
@@ -645,13 +689,257 @@ static FARPROC find_named_export( HMODULE module, const IMAGE_EXPORT_DIRECTORY *
 }
 
 
+/*************************************************************************
+ *		Import binding cache
+ *
+ * Like bound imports on Windows, the resolved import address tables of a
+ * module are stored in the prefix, as offsets into the exporting modules,
+ * so that the next process loading the same modules can fill them in
+ * without looking up every name. Entries are validated against hashes of
+ * the import and export tables, so a stale cache only costs a lookup.
+ * Enabled by setting WINEBINDCACHE=1.
+ */
+
+#define BIND_CACHE_MAGIC   0x444e4942  /* "BIND" */
+#define BIND_CACHE_VERSION 1
+
+struct bind_cache_header
+{
+    DWORD magic;          /* BIND_CACHE_MAGIC */
+    DWORD version;        /* BIND_CACHE_VERSION */
+    DWORD import_hash;    /* hash of the importing module import tables */
+    DWORD timestamp;      /* importing module TimeDateStamp */
+    DWORD image_size;     /* importing module SizeOfImage */
+    DWORD nb_imports;     /* number of import descriptors */
+    DWORD nb_thunks;      /* total number of thunks */
+};
+
+struct bind_cache_import
+{
+    DWORD export_hash;    /* hash of the exporting module export tables, 0 if not bound */
+    DWORD timestamp;      /* exporting module TimeDateStamp */
+    DWORD image_size;     /* exporting module SizeOfImage */
+    DWORD first;          /* index of the first thunk */
+    DWORD count;          /* number of thunks */
+};
+
+struct bind_cache
+{
+    struct bind_cache_header *header;
+    struct bind_cache_import *imports;
+    DWORD                    *rvas;     /* thunk offsets in the exporting module, 0 if not bound */
+    BOOL                      dirty;    /* needs to be written back */
+};
+
+static inline DWORD bind_hash( DWORD hash, const void *data, SIZE_T size )
+{
+    const BYTE *p = data;
+
+    while (size--) hash = (hash ^ *p++) * 0x01000193;  /* FNV-1a */
+    return hash;
+}
+
+static BOOL use_bind_cache(void)
+{
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINEBINDCACHE" );
+        enabled = env && atoi( env );
+    }
+    /* relay and snoop replace the exported addresses with thunks */
+    return enabled && !TRACE_ON(relay) && !TRACE_ON(snoop);
+}
+
+/* build the cache file name from the module full name */
+static char *get_bind_cache_path( const WINE_MODREF *wm, BOOL create_dir )
+{
+    const char *config_dir = wine_get_config_dir();
+    DWORD hash = bind_hash( 0x811c9dc5, wm->ldr.FullDllName.Buffer, wm->ldr.FullDllName.Length );
+    char *path;
+
+    if (!(path = RtlAllocateHeap( GetProcessHeap(), 0, strlen(config_dir) + sizeof("/bindcache/") + 16 )))
+        return NULL;
+    strcpy( path, config_dir );
+    strcat( path, "/bindcache" );
+    if (create_dir) mkdir( path, 0777 );
+    sprintf( path + strlen(path), "/%08x-%u", hash, (unsigned int)sizeof(void *) * 8 );
+    return path;
+}
+
+/* the export tables determine the addresses that a given import resolves to */
+static DWORD get_export_hash( WINE_MODREF *wm, const IMAGE_EXPORT_DIRECTORY *exports )
+{
+    HMODULE module = wm->ldr.BaseAddress;
+    DWORD hash;
+
+    if (wm->export_hash) return wm->export_hash;
+
+    hash = bind_hash( 0x811c9dc5, exports, sizeof(*exports) );
+    hash = bind_hash( hash, get_rva( module, exports->AddressOfFunctions ),
+                      exports->NumberOfFunctions * sizeof(DWORD) );
+    hash = bind_hash( hash, get_rva( module, exports->AddressOfNames ),
+                      exports->NumberOfNames * sizeof(DWORD) );
+    hash = bind_hash( hash, get_rva( module, exports->AddressOfNameOrdinals ),
+                      exports->NumberOfNames * sizeof(WORD) );
+    if (!hash) hash = 1;
+    return wm->export_hash = hash;
+}
+
+/* count the thunks of all the import descriptors and hash the imported names */
+static DWORD get_import_hash( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *imports, int nb_imports,
+                              DWORD *nb_thunks )
+{
+    DWORD hash = 0x811c9dc5;
+    int i;
+
+    *nb_thunks = 0;
+    for (i = 0; i < nb_imports; i++)
+    {
+        const IMAGE_THUNK_DATA *import_list;
+        const char *name = get_rva( module, imports[i].Name );
+
+        hash = bind_hash( hash, name, strlen(name) + 1 );
+        import_list = get_rva( module, imports[i].u.OriginalFirstThunk ?
+                               (DWORD)imports[i].u.OriginalFirstThunk : (DWORD)imports[i].FirstThunk );
+        for ( ; import_list->u1.Ordinal; import_list++, (*nb_thunks)++)
+        {
+            if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
+                hash = bind_hash( hash, &import_list->u1.Ordinal, sizeof(import_list->u1.Ordinal) );
+            else
+            {
+                const IMAGE_IMPORT_BY_NAME *pe_name = get_rva( module, (DWORD)import_list->u1.AddressOfData );
+                hash = bind_hash( hash, pe_name->Name, strlen( (const char *)pe_name->Name ) + 1 );
+            }
+        }
+    }
+    return hash;
+}
+
+/* count the thunks of an import descriptor */
+static DWORD get_import_thunk_count( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *import )
+{
+    const IMAGE_THUNK_DATA *import_list = get_rva( module, import->u.OriginalFirstThunk ?
+                                                   (DWORD)import->u.OriginalFirstThunk :
+                                                   (DWORD)import->FirstThunk );
+    DWORD count = 0;
+
+    while (import_list[count].u1.Ordinal) count++;
+    return count;
+}
+
+/* make sure that the thunk ranges and offsets of a cache read from disk are valid */
+static BOOL check_bind_cache( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *imports, int nb_imports,
+                              const struct bind_cache *cache )
+{
+    DWORD i, j, first = 0;
+
+    for (i = 0; i < nb_imports; i++)
+    {
+        const struct bind_cache_import *bind = &cache->imports[i];
+
+        if (bind->first != first || bind->count > cache->header->nb_thunks - first) return FALSE;
+        if (bind->count != get_import_thunk_count( module, &imports[i] )) return FALSE;
+        for (j = 0; j < bind->count; j++)
+            if (cache->rvas[first + j] >= bind->image_size && cache->rvas[first + j]) return FALSE;
+        first += bind->count;
+    }
+    return first == cache->header->nb_thunks;
+}
+
+/* load the cache for a module, or initialize an empty one if it is missing or stale */
+static BOOL load_bind_cache( WINE_MODREF *wm, const IMAGE_IMPORT_DESCRIPTOR *imports, int nb_imports,
+                             struct bind_cache *cache )
+{
+    const IMAGE_NT_HEADERS *nt = RtlImageNtHeader( wm->ldr.BaseAddress );
+    struct bind_cache_header header;
+    DWORD i, first, nb_thunks, import_hash;
+    SIZE_T size;
+    char *path;
+    int fd;
+
+    import_hash = get_import_hash( wm->ldr.BaseAddress, imports, nb_imports, &nb_thunks );
+    size = sizeof(header) + nb_imports * sizeof(*cache->imports) + nb_thunks * sizeof(DWORD);
+    if (!(cache->header = RtlAllocateHeap( GetProcessHeap(), 0, size ))) return FALSE;
+    cache->imports = (struct bind_cache_import *)(cache->header + 1);
+    cache->rvas = (DWORD *)(cache->imports + nb_imports);
+    cache->dirty = FALSE;
+
+    header.magic       = BIND_CACHE_MAGIC;
+    header.version     = BIND_CACHE_VERSION;
+    header.import_hash = import_hash;
+    header.timestamp   = nt->FileHeader.TimeDateStamp;
+    header.image_size  = nt->OptionalHeader.SizeOfImage;
+    header.nb_imports  = nb_imports;
+    header.nb_thunks   = nb_thunks;
+
+    if ((path = get_bind_cache_path( wm, FALSE )))
+    {
+        if ((fd = open( path, O_RDONLY )) != -1)
+        {
+            if (read( fd, cache->header, size ) == size &&
+                !memcmp( cache->header, &header, sizeof(header) ) &&
+                check_bind_cache( wm->ldr.BaseAddress, imports, nb_imports, cache ))
+            {
+                TRACE_(imports)( "using binding cache %s for %s\n", path, debugstr_w(wm->ldr.BaseDllName.Buffer) );
+                close( fd );
+                RtlFreeHeap( GetProcessHeap(), 0, path );
+                return TRUE;
+            }
+            close( fd );
+        }
+        RtlFreeHeap( GetProcessHeap(), 0, path );
+    }
+
+    *cache->header = header;
+    for (i = first = 0; i < nb_imports; i++)
+    {
+        cache->imports[i].export_hash = 0;
+        cache->imports[i].first = first;
+        cache->imports[i].count = get_import_thunk_count( wm->ldr.BaseAddress, &imports[i] );
+        first += cache->imports[i].count;
+    }
+    memset( cache->rvas, 0, nb_thunks * sizeof(DWORD) );
+    return TRUE;
+}
+
+/* write back the cache of a module, replacing the existing file atomically */
+static void save_bind_cache( WINE_MODREF *wm, struct bind_cache *cache )
+{
+    SIZE_T size = sizeof(*cache->header) + cache->header->nb_imports * sizeof(*cache->imports) +
+                  cache->header->nb_thunks * sizeof(DWORD);
+    char *path, *tmp;
+    int fd;
+
+    if (!(path = get_bind_cache_path( wm, TRUE ))) return;
+    if ((tmp = RtlAllocateHeap( GetProcessHeap(), 0, strlen(path) + 16 )))
+    {
+        sprintf( tmp, "%s.%x", path, (unsigned int)getpid() );
+        if ((fd = open( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666 )) != -1)
+        {
+            BOOL ok = (write( fd, cache->header, size ) == size);
+            close( fd );
+            if (!ok || rename( tmp, path ) == -1)
+            {
+                WARN_(imports)( "failed to write binding cache %s: %s\n", path, strerror(errno) );
+                unlink( tmp );
+            }
+        }
+        RtlFreeHeap( GetProcessHeap(), 0, tmp );
+    }
+    RtlFreeHeap( GetProcessHeap(), 0, path );
+}
+
+
 /*************************************************************************
  *		import_dll
  *
  * Import the dll specified by the given import descriptor.
  * The loader_section must be locked while calling this function.
  */
-static BOOL import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LPCWSTR load_path, WINE_MODREF **pwm )
+static BOOL import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LPCWSTR load_path,
+                        struct bind_cache *cache, int index, WINE_MODREF **pwm )
 {
     NTSTATUS status;
     WINE_MODREF *wmImp;
@@ -666,6 +954,8 @@ static BOOL import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LP
     PVOID protect_base;
     SIZE_T protect_size = 0;
     DWORD protect_old;
+    DWORD *rvas = NULL;
+    BOOL bound = FALSE;
 
     thunk_list = get_rva( module, (DWORD)descr->FirstThunk );
     if (descr->u.OriginalFirstThunk)
@@ -709,6 +999,9 @@ static BOOL import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LP
         return FALSE;
     }
 
+    /* the import table can only be written once the module is relocated */
+    wait_module_relocations( current_modref );
+
     /* unprotect the import address table since it can be located in
      * readonly section */
     while (import_list[protect_size].u1.Ordinal) protect_size++;
@@ -746,9 +1039,33 @@ static BOOL import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LP
         goto done;
     }
 
+    if (cache)
+    {
+        struct bind_cache_import *bind = &cache->imports[index];
+        const IMAGE_NT_HEADERS *nt = RtlImageNtHeader( imp_mod );
+        DWORD export_hash = get_export_hash( wmImp, exports );
+
+        rvas = cache->rvas + bind->first;
+        bound = (bind->export_hash == export_hash &&
+                 bind->timestamp == nt->FileHeader.TimeDateStamp &&
+                 bind->image_size == nt->OptionalHeader.SizeOfImage);
+        if (!bound)
+        {
+            bind->export_hash = export_hash;
+            bind->timestamp   = nt->FileHeader.TimeDateStamp;
+            bind->image_size  = nt->OptionalHeader.SizeOfImage;
+            cache->dirty = TRUE;
+        }
+    }
+
     while (import_list->u1.Ordinal)
     {
-        if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
+        if (bound && *rvas)
+        {
+            thunk_list->u1.Function = (ULONG_PTR)imp_mod + *rvas;
+            TRACE_(imports)("--- bound %s.%u = %p\n", name, *rvas, (void *)thunk_list->u1.Function );
+        }
+        else if (IMAGE_SNAP_BY_ORDINAL(import_list->u1.Ordinal))
         {
             int ordinal = IMAGE_ORDINAL(import_list->u1.Ordinal);
 
@@ -780,6 +1097,17 @@ static BOOL import_dll( HMODULE module, const IMAGE_IMPORT_DESCRIPTOR *descr, LP
             TRACE_(imports)("--- %s %s.%d = %p\n",
                             pe_name->Name, name, pe_name->Hint, (void *)thunk_list->u1.Function);
         }
+        if (rvas)
+        {
+            /* only addresses inside the exporting module can be bound, forwarded
+             * exports and stubs are looked up again on the next load */
+            if (!bound)
+            {
+                ULONG_PTR rva = thunk_list->u1.Function - (ULONG_PTR)imp_mod;
+                *rvas = rva < wmImp->ldr.SizeOfImage ? rva : 0;
+            }
+            rvas++;
+        }
         import_list++;
         thunk_list++;
     }
@@ -1017,10 +1345,16 @@ static NTSTATUS fixup_imports( WINE_MODREF *wm, LPCWSTR load_path )
     DWORD size;
     NTSTATUS status;
     ULONG_PTR cookie;
+    struct bind_cache cache;
+    BOOL use_cache;
+    LONGLONG start = 0, nested = 0;
 
     if (!(wm->ldr.Flags & LDR_DONT_RESOLVE_REFS)) return STATUS_SUCCESS;  /* already done */
     wm->ldr.Flags &= ~LDR_DONT_RESOLVE_REFS;
 
+    /* the TLS directory contains relocated addresses */
+    if (RtlImageDirectoryEntryToData( wm->ldr.BaseAddress, TRUE, IMAGE_DIRECTORY_ENTRY_TLS, &size ))
+        wait_module_relocations( wm );
     wm->ldr.TlsIndex = alloc_tls_slot( &wm->ldr );
 
     if (!(imports = RtlImageDirectoryEntryToData( wm->ldr.BaseAddress, TRUE,
@@ -1039,6 +1373,13 @@ static NTSTATUS fixup_imports( WINE_MODREF *wm, LPCWSTR load_path )
     wm->alloc_deps = nb_imports;
     wm->deps  = RtlAllocateHeap( GetProcessHeap(), 0, nb_imports*sizeof(WINE_MODREF *) );
 
+    if (TRACE_ON(ldrtime))
+    {
+        start = get_ldr_time();
+        nested = ldr_nested_time;
+    }
+    use_cache = use_bind_cache() && load_bind_cache( wm, imports, nb_imports, &cache );
+
     /* load the imported modules. They are automatically
      * added to the modref list of the process.
      */
@@ -1049,7 +1390,7 @@ static NTSTATUS fixup_imports( WINE_MODREF *wm, LPCWSTR load_path )
     {
         dep = wm->nDeps++;
 
-        if (!import_dll( wm->ldr.BaseAddress, &imports[i], load_path, &imp ))
+        if (!import_dll( wm->ldr.BaseAddress, &imports[i], load_path, use_cache ? &cache : NULL, i, &imp ))
         {
             imp = NULL;
             status = STATUS_DLL_NOT_FOUND;
@@ -1057,6 +1398,13 @@ static NTSTATUS fixup_imports( WINE_MODREF *wm, LPCWSTR load_path )
         wm->deps[dep] = imp;
     }
     current_modref = prev;
+
+    if (use_cache)
+    {
+        if (cache.dirty && status == STATUS_SUCCESS) save_bind_cache( wm, &cache );
+        RtlFreeHeap( GetProcessHeap(), 0, cache.header );
+    }
+    if (TRACE_ON(ldrtime)) wm->import_time = get_ldr_time() - start - (ldr_nested_time - nested);
     if (wm->ldr.ActivationContext) RtlDeactivateActivationContext( 0, cookie );
     return status;
 }
@@ -1311,10 +1659,16 @@ static NTSTATUS process_attach( WINE_MODREF *wm, LPVOID lpReserved )
     if (status == STATUS_SUCCESS)
     {
         WINE_MODREF *prev = current_modref;
-        current_modref = wm;
+        LONGLONG start = TRACE_ON(ldrtime) ? get_ldr_time() : 0;
 
+        current_modref = wm;
         call_ldr_notifications( LDR_DLL_NOTIFICATION_REASON_LOADED, &wm->ldr );
         status = MODULE_InitDLL( wm, DLL_PROCESS_ATTACH, lpReserved );
+        if (TRACE_ON(ldrtime))
+        {
+            wm->init_time = get_ldr_time() - start;
+            dump_module_times( wm );
+        }
         if (status == STATUS_SUCCESS)
         {
             wm->ldr.Flags |= LDR_PROCESS_ATTACHED;
@@ -1828,7 +2182,221 @@ static void set_security_cookie( void *module, SIZE_T len )
     }
 }
 
-static NTSTATUS perform_relocations( void *module, IMAGE_NT_HEADERS *nt, SIZE_T len )
+/***********************************************************************
+ *           Parallel relocations
+ *
+ * When WINEPARALLELLOAD=1 is set, the relocations of native modules are
+ * applied by worker threads while the loader goes on mapping the
+ * dependencies. The workers are plain Unix threads without a TEB, so they
+ * only touch the module memory; the section protections and the security
+ * cookie are handled by the loader thread once the job is done. A module
+ * relocation is always finished before its import table is written, its
+ * TLS directory is used, or any of its code runs.
+ */
+
+struct reloc_job
+{
+    struct list            entry;       /* entry in the pending jobs list */
+    struct list            queue_entry; /* entry in the workers queue */
+    WINE_MODREF           *wm;          /* module, once the modref is created */
+    char                  *module;      /* module base address */
+    SIZE_T                 len;         /* mapped size */
+    IMAGE_BASE_RELOCATION *rel;         /* first relocation block */
+    IMAGE_BASE_RELOCATION *end;         /* end of the relocation blocks */
+    INT_PTR                delta;       /* relocation delta */
+    ULONG                  nb_sections; /* number of sections to restore */
+    ULONG                  protect_old[96]; /* original protection of the sections */
+    enum { RELOC_QUEUED, RELOC_RUNNING, RELOC_DONE } state;
+};
+
+static struct list pending_relocs = LIST_INIT( pending_relocs );  /* jobs not finished by the loader */
+static struct list reloc_queue = LIST_INIT( reloc_queue );        /* jobs not started yet */
+static pthread_mutex_t reloc_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reloc_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reloc_done_cond = PTHREAD_COND_INITIALIZER;
+static int reloc_workers = -1;  /* number of worker threads, 0 if disabled */
+
+static void apply_relocations( struct reloc_job *job )
+{
+    IMAGE_BASE_RELOCATION *rel = job->rel;
+
+    while (rel < job->end - 1 && rel->SizeOfBlock)
+        rel = LdrProcessRelocationBlock( job->module + rel->VirtualAddress,
+                                         (rel->SizeOfBlock - sizeof(*rel)) / sizeof(USHORT),
+                                         (USHORT *)(rel + 1), job->delta );
+}
+
+static void *reloc_worker( void *arg )
+{
+    struct reloc_job *job;
+
+    pthread_mutex_lock( &reloc_mutex );
+    for (;;)
+    {
+        while (list_empty( &reloc_queue )) pthread_cond_wait( &reloc_queue_cond, &reloc_mutex );
+        job = LIST_ENTRY( list_head( &reloc_queue ), struct reloc_job, queue_entry );
+        list_remove( &job->queue_entry );
+        job->state = RELOC_RUNNING;
+        pthread_mutex_unlock( &reloc_mutex );
+
+        apply_relocations( job );
+
+        pthread_mutex_lock( &reloc_mutex );
+        job->state = RELOC_DONE;
+        pthread_cond_broadcast( &reloc_done_cond );
+    }
+    return NULL;
+}
+
+/* start the worker threads on first use */
+static BOOL init_reloc_workers(void)
+{
+    const char *env;
+    pthread_attr_t attr;
+    pthread_t id;
+    sigset_t sigset, old_sigset;
+    int i, count;
+
+    if (reloc_workers != -1) return reloc_workers > 0;
+
+    reloc_workers = 0;
+    if (!(env = getenv( "WINEPARALLELLOAD" )) || !atoi( env )) return FALSE;
+    count = min( NtCurrentTeb()->Peb->NumberOfProcessors - 1, 4 );
+
+    /* the workers have no TEB, make sure they never handle a signal */
+    sigfillset( &sigset );
+    pthread_sigmask( SIG_SETMASK, &sigset, &old_sigset );
+    pthread_attr_init( &attr );
+    pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+    pthread_attr_setstacksize( &attr, 64 * 1024 );
+    for (i = 0; i < count; i++)
+        if (!pthread_create( &id, &attr, reloc_worker, NULL )) reloc_workers++;
+    pthread_attr_destroy( &attr );
+    pthread_sigmask( SIG_SETMASK, &old_sigset, NULL );
+
+    TRACE( "started %d relocation workers\n", reloc_workers );
+    return reloc_workers > 0;
+}
+
+/* check the relocation blocks up front, so that applying them cannot fail */
+static NTSTATUS validate_relocations( IMAGE_BASE_RELOCATION *rel, IMAGE_BASE_RELOCATION *end, SIZE_T len )
+{
+    while (rel < end - 1 && rel->SizeOfBlock)
+    {
+        const USHORT *relocs = (const USHORT *)(rel + 1);
+        UINT i, count = (rel->SizeOfBlock - sizeof(*rel)) / sizeof(USHORT);
+
+        if (rel->VirtualAddress >= len)
+        {
+            WARN( "invalid address %x in relocation %p\n", rel->VirtualAddress, rel );
+            return STATUS_ACCESS_VIOLATION;
+        }
+        for (i = 0; i < count; i++)
+        {
+            switch (relocs[i] >> 12)
+            {
+            case IMAGE_REL_BASED_ABSOLUTE:
+            case IMAGE_REL_BASED_HIGH:
+            case IMAGE_REL_BASED_LOW:
+            case IMAGE_REL_BASED_HIGHLOW:
+#ifdef _WIN64
+            case IMAGE_REL_BASED_DIR64:
+#endif
+                break;
+#ifdef __arm__
+            case IMAGE_REL_BASED_THUMB_MOV32:  /* may print errors, which requires a TEB */
+                return STATUS_NOT_SUPPORTED;
+#endif
+            default:
+                FIXME( "Unknown/unsupported fixup type %x.\n", relocs[i] >> 12 );
+                return STATUS_INVALID_IMAGE_FORMAT;
+            }
+        }
+        rel = (IMAGE_BASE_RELOCATION *)(relocs + count);
+    }
+    return STATUS_SUCCESS;
+}
+
+/* wait for a relocation job, or run it directly if no worker picked it up yet */
+static void finish_relocations( struct reloc_job *job )
+{
+    const IMAGE_NT_HEADERS *nt = RtlImageNtHeader( (HMODULE)job->module );
+    const IMAGE_SECTION_HEADER *sec;
+    ULONG i;
+
+    pthread_mutex_lock( &reloc_mutex );
+    if (job->state == RELOC_QUEUED)
+    {
+        list_remove( &job->queue_entry );
+        job->state = RELOC_RUNNING;
+        pthread_mutex_unlock( &reloc_mutex );
+        apply_relocations( job );
+    }
+    else
+    {
+        while (job->state != RELOC_DONE) pthread_cond_wait( &reloc_done_cond, &reloc_mutex );
+        pthread_mutex_unlock( &reloc_mutex );
+    }
+
+    sec = (const IMAGE_SECTION_HEADER *)((const char *)&nt->OptionalHeader +
+                                         nt->FileHeader.SizeOfOptionalHeader);
+    for (i = 0; i < job->nb_sections; i++)
+    {
+        void *addr = get_rva( (HMODULE)job->module, sec[i].VirtualAddress );
+        SIZE_T size = sec[i].SizeOfRawData;
+        NtProtectVirtualMemory( NtCurrentProcess(), &addr,
+                                &size, job->protect_old[i], &job->protect_old[i] );
+    }
+    set_security_cookie( job->module, job->len );
+
+    list_remove( &job->entry );
+    if (job->wm) job->wm->reloc_job = NULL;
+    RtlFreeHeap( GetProcessHeap(), 0, job );
+}
+
+/* finish the relocations of a module before it is used */
+static void wait_module_relocations( WINE_MODREF *wm )
+{
+    if (wm->reloc_job) finish_relocations( wm->reloc_job );
+}
+
+/* finish all the outstanding relocations, before releasing the loader lock */
+static void wait_all_relocations(void)
+{
+    struct list *ptr;
+
+    while ((ptr = list_head( &pending_relocs )))
+        finish_relocations( LIST_ENTRY( ptr, struct reloc_job, entry ));
+}
+
+/* queue the relocations of a module whose sections have been made writable */
+static NTSTATUS queue_relocations( char *module, SIZE_T len, IMAGE_BASE_RELOCATION *rel,
+                                   IMAGE_BASE_RELOCATION *end, INT_PTR delta,
+                                   ULONG nb_sections, const ULONG *protect_old, struct reloc_job **ret )
+{
+    struct reloc_job *job;
+
+    if (!(job = RtlAllocateHeap( GetProcessHeap(), 0, sizeof(*job) ))) return STATUS_NO_MEMORY;
+    job->wm          = NULL;
+    job->module      = module;
+    job->len         = len;
+    job->rel         = rel;
+    job->end         = end;
+    job->delta       = delta;
+    job->nb_sections = nb_sections;
+    memcpy( job->protect_old, protect_old, nb_sections * sizeof(*protect_old) );
+    job->state       = RELOC_QUEUED;
+    list_add_tail( &pending_relocs, &job->entry );
+
+    pthread_mutex_lock( &reloc_mutex );
+    list_add_tail( &reloc_queue, &job->queue_entry );
+    pthread_cond_signal( &reloc_queue_cond );
+    pthread_mutex_unlock( &reloc_mutex );
+    *ret = job;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS perform_relocations( void *module, IMAGE_NT_HEADERS *nt, SIZE_T len, struct reloc_job **job )
 {
     char *base;
     IMAGE_BASE_RELOCATION *rel, *end;
@@ -1879,6 +2447,15 @@ static NTSTATUS perform_relocations( void *module, IMAGE_NT_HEADERS *nt, SIZE_T
     end = get_rva( module, relocs->VirtualAddress + relocs->Size );
     delta = (char *)module - base;
 
+    if (job && init_reloc_workers())
+    {
+        NTSTATUS status = validate_relocations( rel, end, len );
+
+        if (!status) return queue_relocations( module, len, rel, end, delta,
+                                               nt->FileHeader.NumberOfSections, protect_old, job );
+        if (status != STATUS_NOT_SUPPORTED) return status;
+    }
+
     while (rel < end - 1 && rel->SizeOfBlock)
     {
         if (rel->VirtualAddress >= len)
@@ -1996,31 +2573,43 @@ static NTSTATUS load_native_dll( LPCWSTR load_path, const UNICODE_STRING *nt_nam
     IMAGE_NT_HEADERS *nt = RtlImageNtHeader( module );
     WINE_MODREF *wm;
     NTSTATUS status;
+    LONGLONG reloc_time = 0;
+    struct reloc_job *job = NULL;
 
     TRACE("Trying native dll %s\n", debugstr_us(nt_name));
 
     /* perform base relocation, if necessary */
 
-    if ((status = perform_relocations( module, nt, image_info->map_size )))
+    if (TRACE_ON(ldrtime)) reloc_time = get_ldr_time();
+    if ((status = perform_relocations( module, nt, image_info->map_size, &job )))
     {
         NtUnmapViewOfSection( NtCurrentProcess(), module );
         return status;
     }
+    if (TRACE_ON(ldrtime)) reloc_time = get_ldr_time() - reloc_time;
 
     /* create the MODREF */
 
     if (!(wm = alloc_module( module, nt_name )))
     {
+        if (job) finish_relocations( job );
         NtUnmapViewOfSection( NtCurrentProcess(), module );
         return STATUS_NO_MEMORY;
     }
 
     wm->dev = st->st_dev;
     wm->ino = st->st_ino;
+    wm->reloc_time = reloc_time;
     if (image_info->loader_flags) wm->ldr.Flags |= LDR_COR_IMAGE;
     if (image_info->image_flags & IMAGE_FLAGS_ComPlusILOnly) wm->ldr.Flags |= LDR_COR_ILONLY;
 
-    set_security_cookie( module, image_info->map_size );
+    /* the security cookie is set once the relocations are done */
+    if (job)
+    {
+        job->wm = wm;
+        wm->reloc_job = job;
+    }
+    else set_security_cookie( module, image_info->map_size );
 
     /* fixup imports */
 
@@ -2492,9 +3081,16 @@ static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_
     void *module;
     pe_image_info_t image_info;
     NTSTATUS nts;
+    LONGLONG start = 0, nested = 0;
 
     TRACE( "looking for %s in %s\n", debugstr_w(libname), debugstr_w(load_path) );
 
+    if (TRACE_ON(ldrtime))
+    {
+        start = get_ldr_time();
+        nested = ldr_nested_time;
+    }
+
     nts = find_dll_file( load_path, libname, &nt_name, pwm, &module, &image_info, &st );
 
     if (*pwm)  /* found already loaded module */
@@ -2508,6 +3104,7 @@ static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_
         return STATUS_SUCCESS;
     }
 
+    load_dll_depth++;
     if (nts && nts != STATUS_DLL_NOT_FOUND && nts != STATUS_INVALID_IMAGE_NOT_MZ) goto done;
 
     main_exe = get_modref( NtCurrentTeb()->Peb->ImageBaseAddress );
@@ -2589,9 +3186,21 @@ static NTSTATUS load_dll( LPCWSTR load_path, LPCWSTR libname, DWORD flags, WINE_
     }
 
 done:
+    /* the whole dependency tree is relocated before returning to the caller */
+    if (!--load_dll_depth) wait_all_relocations();
+
     if (nts == STATUS_SUCCESS)
+    {
         TRACE("Loaded module %s (%s) at %p\n", debugstr_us(&nt_name),
               ((*pwm)->ldr.Flags & LDR_WINE_INTERNAL) ? "builtin" : "native", (*pwm)->ldr.BaseAddress);
+        if (TRACE_ON(ldrtime))
+        {
+            /* the time spent loading dependencies is accounted to them */
+            LONGLONG elapsed = get_ldr_time() - start;
+            (*pwm)->load_time = elapsed - (ldr_nested_time - nested) - (*pwm)->import_time - (*pwm)->reloc_time;
+            ldr_nested_time = nested + elapsed;
+        }
+    }
     else
         WARN("Failed to load module %s; status=%x\n", debugstr_w(libname), nts);
 
@@ -3016,6 +3625,7 @@ void WINAPI LdrShutdownProcess(void)
     TRACE("()\n");
     process_detaching = TRUE;
     process_detach();
+    heap_dump_stats();
 }
 
 
@@ -3090,6 +3700,8 @@ static void free_modref( WINE_MODREF *wm )
     if (wm->ldr.InInitializationOrderModuleList.Flink)
         RemoveEntryList(&wm->ldr.InInitializationOrderModuleList);
 
+    wait_module_relocations( wm );
+
     TRACE(" unloading %s\n", debugstr_w(wm->ldr.FullDllName.Buffer));
     if (!TRACE_ON(module))
         TRACE_(loaddll)("Unloaded module %s : %s\n",
@@ -1502,12 +1502,19 @@
 @ cdecl wine_server_fd_to_handle(long long long ptr)
 @ cdecl wine_server_handle_to_fd(long long ptr ptr)
 @ cdecl wine_server_release_fd(long long)
+@ cdecl __wine_server_get_unix_fd(long long ptr ptr ptr)
+@ cdecl __wine_server_socket_fd_generation()
 @ cdecl wine_server_send_fd(long)
 @ cdecl __wine_make_process_system()
 
 # Virtual memory
 @ cdecl __wine_locked_recvmsg(long ptr long)
 
+# Sockets
+@ cdecl __wine_queue_socket_async(long long ptr long long ptr)
+@ cdecl __wine_set_socket_batch_handler(ptr ptr)
+@ cdecl __wine_use_server_socket_asyncs(long)
+
 # Version
 @ cdecl wine_get_version() NTDLL_wine_get_version
 @ cdecl wine_get_build_id() NTDLL_wine_get_build_id
@@ -354,7 +354,19 @@ NTSTATUS WINAPI NtDuplicateObject( HANDLE source_process, HANDLE source,
                                    HANDLE dest_process, PHANDLE dest,
                                    ACCESS_MASK access, ULONG attributes, ULONG options )
 {
+    BOOL close_self = (options & DUPLICATE_CLOSE_SOURCE) && source_process == NtCurrentProcess();
     NTSTATUS ret;
+    int fd = -1;
+
+    /* like close_handle, get rid of the client state before the handle can be reused */
+    if (close_self)
+    {
+        sock_poll_close( source );
+        pipe_message_close( source );
+        fd = server_remove_fd_from_cache( source );
+        esync_close( source );
+    }
+
     SERVER_START_REQ( dup_handle )
     {
         req->src_process = wine_server_obj_handle( source_process );
@@ -367,14 +379,18 @@ NTSTATUS WINAPI NtDuplicateObject( HANDLE source_process, HANDLE source,
         if (!(ret = wine_server_call( req )))
         {
             if (dest) *dest = wine_server_ptr_handle( reply->handle );
-            if (reply->closed && reply->self)
+            if (reply->closed && reply->self && !close_self)
             {
-                int fd = server_remove_fd_from_cache( source );
-                if (fd != -1) close( fd );
+                /* closed through a real handle to the current process */
+                sock_poll_close( source );
+                pipe_message_close( source );
+                fd = server_remove_fd_from_cache( source );
+                esync_close( source );
             }
         }
     }
     SERVER_END_REQ;
+    if (fd != -1) close( fd );
     return ret;
 }
 
@@ -388,8 +404,12 @@ static LONG WINAPI invalid_handle_exception_handler( EXCEPTION_POINTERS *eptr )
 NTSTATUS close_handle( HANDLE handle )
 {
     NTSTATUS ret;
-    int fd = server_remove_fd_from_cache( handle );
+    int fd;
 
+    sock_poll_close( handle );
+    pipe_message_close( handle );
+    fd = server_remove_fd_from_cache( handle );
+    esync_close( handle );
     SERVER_START_REQ( close_handle )
     {
         req->handle = wine_server_obj_handle( handle );
@@ -419,6 +439,49 @@ NTSTATUS close_handle( HANDLE handle )
     return ret;
 }
 
+/* close several handles in a single server round trip */
+NTSTATUS close_handles( const HANDLE *handles, unsigned int count )
+{
+    struct __server_request_info reqs[16];
+    int fds[16];
+    NTSTATUS ret = STATUS_SUCCESS, status;
+    unsigned int i, n;
+
+    while (count)
+    {
+        n = min( count, ARRAY_SIZE(reqs) );
+        for (i = 0; i < n; i++)
+        {
+            struct close_handle_request *req = server_init_batch_request( &reqs[i], REQ_close_handle );
+
+            sock_poll_close( handles[i] );
+            pipe_message_close( handles[i] );
+            fds[i] = server_remove_fd_from_cache( handles[i] );
+            esync_close( handles[i] );
+            req->handle = wine_server_obj_handle( handles[i] );
+        }
+        if (!(status = server_call_batch( reqs, n )))
+        {
+            for (i = 0; i < n && !status; i++) status = reqs[i].u.reply.reply_header.error;
+        }
+        else
+        {
+            /* none of the requests were performed, close the handles one by one */
+            status = STATUS_SUCCESS;
+            for (i = 0; i < n; i++)
+            {
+                NTSTATUS err = close_handle( handles[i] );
+                if (!status) status = err;
+            }
+        }
+        for (i = 0; i < n; i++) if (fds[i] != -1) close( fds[i] );
+        if (!ret) ret = status;
+        handles += n;
+        count -= n;
+    }
+    return ret;
+}
+
 /**************************************************************************
  *                 NtClose				[NTDLL.@]
  *
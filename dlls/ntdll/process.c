@@ -607,6 +607,27 @@ NTSTATUS WINAPI NtQueryInformationProcess(
         else
             ret = STATUS_INVALID_PARAMETER;
         break;
+    case ProcessWineHandleTableInformation:
+        len = sizeof(PROCESS_WINE_HANDLE_TABLE_INFORMATION);
+        if (ProcessInformationLength == len)
+        {
+            PROCESS_WINE_HANDLE_TABLE_INFORMATION *info = ProcessInformation;
+
+            SERVER_START_REQ(get_handle_table_info)
+            {
+                req->handle = wine_server_obj_handle( ProcessHandle );
+                if (!(ret = wine_server_call( req )))
+                {
+                    info->HandleCount  = reply->count;
+                    info->TableEntries = reply->entries;
+                    info->TableSize    = reply->size;
+                }
+            }
+            SERVER_END_REQ;
+        }
+        else
+            ret = STATUS_INFO_LENGTH_MISMATCH;
+        break;
     default:
         FIXME("(%p,info_class=%d,%p,0x%08x,%p) Unknown information class\n",
               ProcessHandle,ProcessInformationClass,
@@ -1194,6 +1215,8 @@ NTSTATUS WINAPI RtlCreateUserProcess( UNICODE_STRING *path, ULONG attributes,
     NTSTATUS status;
     BOOL success = FALSE;
     HANDLE file_handle, process_info = 0, process_handle = 0, thread_handle = 0;
+    HANDLE handles[4];
+    unsigned int nb_handles = 0;
     ULONG process_id, thread_id;
     struct object_attributes *objattr;
     data_size_t attr_len;
@@ -1330,10 +1353,11 @@ NTSTATUS WINAPI RtlCreateUserProcess( UNICODE_STRING *path, ULONG attributes,
     else status = err ? err : ERROR_INTERNAL_ERROR;
 
 done:
-    NtClose( file_handle );
-    if (process_info) NtClose( process_info );
-    if (process_handle) NtClose( process_handle );
-    if (thread_handle) NtClose( thread_handle );
+    if (file_handle) handles[nb_handles++] = file_handle;
+    if (process_info) handles[nb_handles++] = process_info;
+    if (process_handle) handles[nb_handles++] = process_handle;
+    if (thread_handle) handles[nb_handles++] = thread_handle;
+    close_handles( handles, nb_handles );
     if (socketfd[0] != -1) close( socketfd[0] );
     RtlFreeHeap( GetProcessHeap(), 0, startup_info );
     RtlFreeHeap( GetProcessHeap(), 0, winedebug );
@@ -1215,6 +1215,66 @@ static NTSTATUS RTL_GetKeyHandle(ULONG RelativeTo, PCWSTR Path, PHANDLE handle)
     return status;
 }
 
+#define VALUE_BATCH_SIZE 8
+#define VALUE_BATCH_ENTRY_SIZE 512
+
+/* values of a key prefetched with a single server round trip */
+struct value_batch
+{
+    ULONG    start;                       /* index of the first value */
+    ULONG    count;                       /* number of values */
+    NTSTATUS status[VALUE_BATCH_SIZE];    /* enumeration status of each value */
+    DWORD    len[VALUE_BATCH_SIZE];       /* full length of each value info */
+    char     buffer[VALUE_BATCH_SIZE][VALUE_BATCH_ENTRY_SIZE];
+};
+
+/* retrieve the full info of a value, fetching the next batch of values from the server if needed */
+static NTSTATUS get_batched_value( struct value_batch *batch, HANDLE handle, ULONG index,
+                                   KEY_VALUE_FULL_INFORMATION **info, DWORD *len )
+{
+    const DWORD fixed_size = FIELD_OFFSET( KEY_VALUE_FULL_INFORMATION, Name );
+    struct __server_request_info reqs[VALUE_BATCH_SIZE];
+    ULONG i;
+
+    if (index < batch->start || index >= batch->start + batch->count)
+    {
+        for (i = 0; i < VALUE_BATCH_SIZE; i++)
+        {
+            KEY_VALUE_FULL_INFORMATION *value = (KEY_VALUE_FULL_INFORMATION *)batch->buffer[i];
+            struct enum_key_value_request *req = server_init_batch_request( &reqs[i], REQ_enum_key_value );
+
+            req->hkey       = wine_server_obj_handle( handle );
+            req->index      = index + i;
+            req->info_class = KeyValueFullInformation;
+            wine_server_set_reply( &reqs[i], value->Name, VALUE_BATCH_ENTRY_SIZE - fixed_size );
+        }
+        batch->start = index;
+        batch->count = 0;
+        *info = (KEY_VALUE_FULL_INFORMATION *)batch->buffer[0];
+        if (server_call_batch( reqs, VALUE_BATCH_SIZE ))
+            return NtEnumerateValueKey( handle, index, KeyValueFullInformation, *info,
+                                        VALUE_BATCH_ENTRY_SIZE, len );
+
+        for (i = 0; i < VALUE_BATCH_SIZE; i++)
+        {
+            const struct enum_key_value_reply *reply = &reqs[i].u.reply.enum_key_value_reply;
+
+            if (!(batch->status[i] = reply->__header.error))
+            {
+                copy_key_value_info( KeyValueFullInformation, batch->buffer[i], VALUE_BATCH_ENTRY_SIZE,
+                                     reply->type, reply->namelen, wine_server_reply_size(reply) - reply->namelen );
+                batch->len[i] = fixed_size + reply->total;
+                if (batch->len[i] > VALUE_BATCH_ENTRY_SIZE) batch->status[i] = STATUS_BUFFER_OVERFLOW;
+            }
+        }
+        batch->count = VALUE_BATCH_SIZE;
+    }
+    i = index - batch->start;
+    *info = (KEY_VALUE_FULL_INFORMATION *)batch->buffer[i];
+    *len = batch->len[i];
+    return batch->status[i];
+}
+
 /*************************************************************************
  * RtlQueryRegistryValues   [NTDLL.@]
  *
@@ -1236,7 +1296,8 @@ NTSTATUS WINAPI RtlQueryRegistryValues(IN ULONG RelativeTo, IN PCWSTR Path,
 {
     UNICODE_STRING Value;
     HANDLE handle, topkey;
-    PKEY_VALUE_FULL_INFORMATION pInfo = NULL;
+    PKEY_VALUE_FULL_INFORMATION pInfo = NULL, info;
+    struct value_batch *batch = NULL;
     ULONG len, buflen = 0;
     NTSTATUS status=STATUS_SUCCESS, ret = STATUS_SUCCESS;
     INT i;
@@ -1306,11 +1367,20 @@ NTSTATUS WINAPI RtlQueryRegistryValues(IN ULONG RelativeTo, IN PCWSTR Path,
                 goto out;
             }
 
+            /* values are prefetched in batches, unless they get deleted as we go */
+            if (!(QueryTable->Flags & RTL_QUERY_REGISTRY_DELETE) && !batch)
+                batch = RtlAllocateHeap(GetProcessHeap(), 0, sizeof(*batch));
+            if (batch) batch->count = 0;
+
             /* Report all subkeys */
             for (i = 0;; ++i)
             {
-                status = NtEnumerateValueKey(handle, i,
-                    KeyValueFullInformation, pInfo, buflen, &len);
+                info = pInfo;
+                if (batch && !(QueryTable->Flags & RTL_QUERY_REGISTRY_DELETE))
+                    status = get_batched_value(batch, handle, i, &info, &len);
+                else
+                    status = NtEnumerateValueKey(handle, i,
+                        KeyValueFullInformation, pInfo, buflen, &len);
                 if (status == STATUS_NO_MORE_ENTRIES)
                     break;
                 if (status == STATUS_BUFFER_OVERFLOW ||
@@ -1321,9 +1391,10 @@ NTSTATUS WINAPI RtlQueryRegistryValues(IN ULONG RelativeTo, IN PCWSTR Path,
                     pInfo = RtlAllocateHeap(GetProcessHeap(), 0, buflen);
                     NtEnumerateValueKey(handle, i, KeyValueFullInformation,
                         pInfo, buflen, &len);
+                    info = pInfo;
                 }
 
-                status = RTL_ReportRegistryValue(pInfo, QueryTable, Context, Environment);
+                status = RTL_ReportRegistryValue(info, QueryTable, Context, Environment);
                 if(status != STATUS_SUCCESS && status != STATUS_BUFFER_TOO_SMALL)
                 {
                     ret = status;
@@ -1331,7 +1402,7 @@ NTSTATUS WINAPI RtlQueryRegistryValues(IN ULONG RelativeTo, IN PCWSTR Path,
                 }
                 if (QueryTable->Flags & RTL_QUERY_REGISTRY_DELETE)
                 {
-                    RtlInitUnicodeString(&Value, pInfo->Name);
+                    RtlInitUnicodeString(&Value, info->Name);
                     NtDeleteValueKey(handle, &Value);
                 }
             }
@@ -1386,6 +1457,7 @@ NTSTATUS WINAPI RtlQueryRegistryValues(IN ULONG RelativeTo, IN PCWSTR Path,
 
 out:
     RtlFreeHeap(GetProcessHeap(), 0, pInfo);
+    RtlFreeHeap(GetProcessHeap(), 0, batch);
     if (handle != topkey)
         NtClose(handle);
     NtClose(topkey);
@@ -34,6 +34,9 @@
 #ifdef HAVE_PTHREAD_NP_H
 # include <pthread_np.h>
 #endif
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
 #include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -119,14 +122,14 @@ sigset_t server_block_set;  /* signals to block during server calls */
 static int fd_socket = -1;  /* socket to exchange file descriptors with the server */
 static pid_t server_pid;
 
-static RTL_CRITICAL_SECTION fd_cache_section;
+RTL_CRITICAL_SECTION fd_cache_section;
 static RTL_CRITICAL_SECTION_DEBUG critsect_debug =
 {
     0, 0, &fd_cache_section,
     { &critsect_debug.ProcessLocksList, &critsect_debug.ProcessLocksList },
       0, 0, { (DWORD_PTR)(__FILE__ ": fd_cache_section") }
 };
-static RTL_CRITICAL_SECTION fd_cache_section = { &critsect_debug, -1, 0, 0, 0, 0 };
+RTL_CRITICAL_SECTION fd_cache_section = { &critsect_debug, -1, 0, 0, 0, 0 };
 
 /* atomically exchange a 64-bit value */
 static inline LONG64 interlocked_xchg64( LONG64 *dest, LONG64 val )
@@ -277,6 +280,160 @@ static inline unsigned int wait_reply( struct __server_request_info *req )
 }
 
 
+#if defined(__linux__) && defined(__NR_futex)
+
+static inline void small_pause(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__( "rep;nop" : : : "memory" );
+#else
+    __asm__ __volatile__( "" : : : "memory" );
+#endif
+}
+
+/***********************************************************************
+ *           shm_call
+ *
+ * Perform a server call through the shared memory area; helper for server_call_unlocked.
+ * Return FALSE if the request cannot be passed that way.
+ */
+static BOOL shm_call( struct __server_request_info *req, unsigned int *ret )
+{
+    volatile struct request_shm *shm = ntdll_get_thread_data()->request_shm;
+    char *req_ptr = (char *)shm + REQUEST_SHM_REQ + sizeof(req->u.req);
+    const char *reply_ptr = (const char *)shm + REQUEST_SHM_REPLY;
+    data_size_t reply_size = req->u.req.request_header.reply_size;
+    unsigned int i, seq, spin;
+    static const ULONGLONG one = 1;
+    struct timespec timeout;
+    struct pollfd pfd;
+
+    if (req->u.req.request_header.request_size > REQUEST_SHM_REPLY - REQUEST_SHM_REQ - sizeof(req->u.req))
+        return FALSE;
+    if (reply_size > REQUEST_SHM_SIZE - REQUEST_SHM_REPLY - sizeof(req->u.reply))
+        return FALSE;
+
+    /* make sure that copying the data cannot fault, the pipe transport handles it otherwise */
+    for (i = 0; i < req->data_count; i++)
+        if (!virtual_check_buffer_for_read( req->data[i].ptr, req->data[i].size )) return FALSE;
+    if (reply_size && !virtual_check_buffer_for_write( req->reply_data, reply_size )) return FALSE;
+
+    memcpy( (char *)shm + REQUEST_SHM_REQ, &req->u.req, sizeof(req->u.req) );
+    for (i = 0; i < req->data_count; i++)
+    {
+        memcpy( req_ptr, req->data[i].ptr, req->data[i].size );
+        req_ptr += req->data[i].size;
+    }
+    seq = shm->req_seq + 1;
+    shm->client_waiting = 0;
+    interlocked_xchg( (int *)&shm->req_seq, seq );
+
+    /* no need to signal the server if it is busy-polling, it will see the new sequence number */
+    if (!shm->server_polling && write( ntdll_get_thread_data()->shm_doorbell, &one, sizeof(one) ) != sizeof(one))
+    {
+        if (errno == EPIPE) abort_thread(0);
+        server_protocol_perror( "doorbell write" );
+    }
+
+    for (spin = 0; spin < 4000 && shm->reply_seq != seq; spin++) small_pause();
+
+    while (shm->reply_seq != seq)
+    {
+        interlocked_xchg( (int *)&shm->client_waiting, 1 );
+        timeout.tv_sec  = 1;
+        timeout.tv_nsec = 0;
+        if (syscall( __NR_futex, &shm->reply_seq, 0 /* FUTEX_WAIT */, seq - 1, &timeout, 0, 0 ) == -1 &&
+            errno == ETIMEDOUT)
+        {
+            /* the server doesn't signal anything if it kills us, check that it is still there */
+            pfd.fd = ntdll_get_thread_data()->reply_fd;
+            pfd.events = POLLIN;
+            if (poll( &pfd, 1, 0 ) == 1 && (pfd.revents & (POLLHUP | POLLERR))) abort_thread(0);
+        }
+    }
+
+    memcpy( &req->u.reply, reply_ptr, sizeof(req->u.reply) );
+    if (req->u.reply.reply_header.reply_size)
+        memcpy( req->reply_data, reply_ptr + sizeof(req->u.reply), req->u.reply.reply_header.reply_size );
+    *ret = req->u.reply.reply_header.error;
+    return TRUE;
+}
+
+
+/***********************************************************************
+ *           init_request_shm
+ *
+ * Switch the current thread to shared memory requests, if enabled by the
+ * WINESHMREQUESTS environment variable.
+ */
+static void init_request_shm(void)
+{
+    const char *env = getenv( "WINESHMREQUESTS" );
+    obj_handle_t handle;
+    sigset_t sigset;
+    int fd, doorbell = -1;
+    data_size_t size = 0;
+    void *ptr;
+
+    if (!env || !atoi( env )) return;
+
+    server_enter_uninterrupted_section( &fd_cache_section, &sigset );
+    SERVER_START_REQ( get_request_shm )
+    {
+        /* WINESHMREQUESTS=2 makes the server busy-poll for the next request after replying */
+        req->spin = atoi( env ) > 1 ? 256 : 0;
+        if (!wine_server_call( req )) size = reply->size;
+    }
+    SERVER_END_REQ;
+    if (size)
+    {
+        fd = receive_fd( &handle );
+        doorbell = receive_fd( &handle );
+    }
+    server_leave_uninterrupted_section( &fd_cache_section, &sigset );
+    if (!size) return;
+
+    ptr = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (ptr == MAP_FAILED) server_protocol_perror( "mmap request shm" );
+    ntdll_get_thread_data()->shm_doorbell = doorbell;
+    ntdll_get_thread_data()->request_shm  = ptr;
+}
+
+
+/***********************************************************************
+ *           server_free_request_shm
+ *
+ * Release the shared memory request resources of a thread.
+ */
+void server_free_request_shm( TEB *teb )
+{
+    struct ntdll_thread_data *thread_data = (struct ntdll_thread_data *)&teb->GdiTebBatch;
+
+    if (thread_data->request_shm) munmap( thread_data->request_shm, REQUEST_SHM_SIZE );
+    if (thread_data->shm_doorbell != -1) close( thread_data->shm_doorbell );
+    thread_data->request_shm  = NULL;
+    thread_data->shm_doorbell = -1;
+}
+
+#else  /* __linux__ && __NR_futex */
+
+static BOOL shm_call( struct __server_request_info *req, unsigned int *ret )
+{
+    return FALSE;
+}
+
+static void init_request_shm(void)
+{
+}
+
+void server_free_request_shm( TEB *teb )
+{
+}
+
+#endif  /* __linux__ && __NR_futex */
+
+
 /***********************************************************************
  *           server_call_unlocked
  */
@@ -285,11 +442,83 @@ unsigned int server_call_unlocked( void *req_ptr )
     struct __server_request_info * const req = req_ptr;
     unsigned int ret;
 
+    if (ntdll_get_thread_data()->request_shm && shm_call( req, &ret )) return ret;
     if ((ret = send_request( req ))) return ret;
     return wait_reply( req );
 }
 
 
+/***********************************************************************
+ *           server_init_batch_request
+ *
+ * Initialize a request that will be passed to server_call_batch.
+ */
+void *server_init_batch_request( struct __server_request_info *req, enum request type )
+{
+    memset( &req->u.req, 0, sizeof(req->u.req) );
+    req->u.req.request_header.req = type;
+    req->data_count = 0;
+    req->reply_data = NULL;
+    return &req->u.req;
+}
+
+
+/***********************************************************************
+ *           server_call_batch
+ *
+ * Perform several server calls in a single round trip. The status of each
+ * request is returned in its reply header.
+ */
+unsigned int server_call_batch( struct __server_request_info *reqs, unsigned int count )
+{
+    data_size_t size = 0, reply_size = 0;
+    unsigned int i, j, ret;
+    char *requests, *replies, *ptr;
+
+    for (i = 0; i < count; i++)
+    {
+        size += sizeof(reqs[i].u.req) + BATCH_DATA_ALIGN( reqs[i].u.req.request_header.request_size );
+        reply_size += sizeof(reqs[i].u.reply) + BATCH_DATA_ALIGN( reqs[i].u.req.request_header.reply_size );
+    }
+    if (!(requests = RtlAllocateHeap( GetProcessHeap(), 0, size + reply_size ))) return STATUS_NO_MEMORY;
+    replies = requests + size;
+
+    for (i = 0, ptr = requests; i < count; i++)
+    {
+        memcpy( ptr, &reqs[i].u.req, sizeof(reqs[i].u.req) );
+        ptr += sizeof(reqs[i].u.req);
+        for (j = 0; j < reqs[i].data_count; j++)
+        {
+            memcpy( ptr, reqs[i].data[j].ptr, reqs[i].data[j].size );
+            ptr += reqs[i].data[j].size;
+        }
+        ptr = requests + BATCH_DATA_ALIGN( ptr - requests );
+    }
+
+    SERVER_START_REQ( batch_requests )
+    {
+        wine_server_add_data( req, requests, size );
+        wine_server_set_reply( req, replies, reply_size );
+        if (!(ret = wine_server_call( req ))) count = reply->count;
+    }
+    SERVER_END_REQ;
+
+    if (!ret)
+    {
+        for (i = 0, ptr = replies; i < count; i++)
+        {
+            memcpy( &reqs[i].u.reply, ptr, sizeof(reqs[i].u.reply) );
+            ptr += sizeof(reqs[i].u.reply);
+            if (reqs[i].u.reply.reply_header.reply_size)
+                memcpy( reqs[i].reply_data, ptr, reqs[i].u.reply.reply_header.reply_size );
+            ptr += BATCH_DATA_ALIGN( reqs[i].u.reply.reply_header.reply_size );
+        }
+    }
+    RtlFreeHeap( GetProcessHeap(), 0, requests );
+    return ret;
+}
+
+
 /***********************************************************************
  *           wine_server_call (NTDLL.@)
  *
@@ -750,7 +979,7 @@ void CDECL wine_server_send_fd( int fd )
  *
  * Receive a file descriptor passed from the server.
  */
-static int receive_fd( obj_handle_t *handle )
+int receive_fd( obj_handle_t *handle )
 {
     struct iovec vec;
     struct msghdr msghdr;
@@ -814,19 +1043,56 @@ union fd_cache_entry
     struct
     {
         int fd;
-        enum server_fd_type type : 5;
+        enum server_fd_type type : 4;
+        unsigned int        completion : 1;
         unsigned int        access : 3;
         unsigned int        options : 24;
     } s;
 };
 
 C_ASSERT( sizeof(union fd_cache_entry) == sizeof(LONG64) );
+C_ASSERT( FD_TYPE_NB_TYPES <= 16 );
+
+/* server generation counter that must not change for the entry to remain valid */
+union fd_cache_generation
+{
+    LONG64 data;
+    struct
+    {
+        unsigned int slot;   /* counter index, 0 if the entry is always valid */
+        unsigned int value;  /* counter value when the entry was added */
+    } s;
+};
+
+struct fd_cache_item
+{
+    union fd_cache_entry      entry;
+    union fd_cache_generation gen;
+};
+
+#define FD_CACHE_BLOCK_SIZE  (65536 / sizeof(struct fd_cache_item))
+#define FD_CACHE_ENTRIES     256
 
-#define FD_CACHE_BLOCK_SIZE  (65536 / sizeof(union fd_cache_entry))
-#define FD_CACHE_ENTRIES     128
+static struct fd_cache_item *fd_cache[FD_CACHE_ENTRIES];
+static struct fd_cache_item fd_cache_initial_block[FD_CACHE_BLOCK_SIZE];
 
-static union fd_cache_entry *fd_cache[FD_CACHE_ENTRIES];
-static union fd_cache_entry fd_cache_initial_block[FD_CACHE_BLOCK_SIZE];
+static const volatile unsigned int *fd_cache_generations;        /* counters shared with the server */
+static const volatile unsigned int *fd_cache_process_generation; /* bumped on handle close by other processes */
+static unsigned int fd_cache_flush_generation;                   /* process counter value at last flush */
+static LONG socket_fd_generation;                                /* bumped when a cached socket fd is closed */
+
+/* fds removed from the cache while their handle is still open; other threads
+ * may still be using them without a reference, so they are kept open until
+ * the handle is closed */
+struct retired_fd
+{
+    HANDLE handle;
+    int    fd;
+};
+
+static struct retired_fd *retired_fds;
+static unsigned int nb_retired_fds;
+static unsigned int max_retired_fds;
 
 static inline unsigned int handle_to_index( HANDLE handle, unsigned int *entry )
 {
@@ -842,10 +1108,12 @@ static inline unsigned int handle_to_index( HANDLE handle, unsigned int *entry )
  * Caller must hold fd_cache_section.
  */
 static BOOL add_fd_to_cache( HANDLE handle, int fd, enum server_fd_type type,
-                            unsigned int access, unsigned int options )
+                            unsigned int access, unsigned int options, BOOL completion,
+                            unsigned int slot, unsigned int generation )
 {
     unsigned int entry, idx = handle_to_index( handle, &entry );
     union fd_cache_entry cache;
+    union fd_cache_generation gen;
 
     if (entry >= FD_CACHE_ENTRIES)
     {
@@ -858,24 +1126,48 @@ static BOOL add_fd_to_cache( HANDLE handle, int fd, enum server_fd_type type,
         if (!entry) fd_cache[0] = fd_cache_initial_block;
         else
         {
-            void *ptr = wine_anon_mmap( NULL, FD_CACHE_BLOCK_SIZE * sizeof(union fd_cache_entry),
+            void *ptr = wine_anon_mmap( NULL, FD_CACHE_BLOCK_SIZE * sizeof(struct fd_cache_item),
                                         PROT_READ | PROT_WRITE, 0 );
             if (ptr == MAP_FAILED) return FALSE;
             fd_cache[entry] = ptr;
         }
     }
 
+    /* the generation must be set before the entry becomes visible */
+    gen.s.slot = slot;
+    gen.s.value = generation;
+    interlocked_xchg64( &fd_cache[entry][idx].gen.data, gen.data );
+
     /* store fd+1 so that 0 can be used as the unset value */
     cache.s.fd = fd + 1;
     cache.s.type = type;
+    cache.s.completion = completion;
     cache.s.access = access;
     cache.s.options = options;
-    cache.data = interlocked_xchg64( &fd_cache[entry][idx].data, cache.data );
+    cache.data = interlocked_xchg64( &fd_cache[entry][idx].entry.data, cache.data );
     assert( !cache.s.fd );
     return TRUE;
 }
 
 
+/***********************************************************************
+ *           is_fd_cache_entry_valid
+ *
+ * Check that the server didn't invalidate a cache entry since it was added.
+ */
+static inline BOOL is_fd_cache_entry_valid( struct fd_cache_item *item, LONG64 data )
+{
+    union fd_cache_generation gen;
+
+    if (fd_cache_process_generation && *fd_cache_process_generation != fd_cache_flush_generation)
+        return FALSE;
+    gen.data = interlocked_cmpxchg64( &item->gen.data, 0, 0 );
+    /* make sure that the generation belongs to the entry we retrieved */
+    if (interlocked_cmpxchg64( &item->entry.data, 0, 0 ) != data) return FALSE;
+    return !gen.s.slot || fd_cache_generations[gen.s.slot] == gen.s.value;
+}
+
+
 /***********************************************************************
  *           get_cached_fd
  */
@@ -887,8 +1179,9 @@ static inline NTSTATUS get_cached_fd( HANDLE handle, int *fd, enum server_fd_typ
 
     if (entry >= FD_CACHE_ENTRIES || !fd_cache[entry]) return STATUS_INVALID_HANDLE;
 
-    cache.data = interlocked_cmpxchg64( &fd_cache[entry][idx].data, 0, 0 );
+    cache.data = interlocked_cmpxchg64( &fd_cache[entry][idx].entry.data, 0, 0 );
     if (!cache.data) return STATUS_INVALID_HANDLE;
+    if (!is_fd_cache_entry_valid( &fd_cache[entry][idx], cache.data )) return STATUS_INVALID_HANDLE;
 
     /* if fd type is invalid, fd stores an error value */
     if (cache.s.type == FD_TYPE_INVALID) return cache.s.fd - 1;
@@ -902,9 +1195,31 @@ static inline NTSTATUS get_cached_fd( HANDLE handle, int *fd, enum server_fd_typ
 
 
 /***********************************************************************
- *           server_remove_fd_from_cache
+ *           server_get_fd_completion
+ *
+ * Check whether the file object of a handle is associated with a
+ * completion port. This is only known for handles in the fd cache;
+ * returns FALSE if it isn't.
  */
-int server_remove_fd_from_cache( HANDLE handle )
+BOOL server_get_fd_completion( HANDLE handle, BOOL *completion )
+{
+    unsigned int entry, idx = handle_to_index( handle, &entry );
+    union fd_cache_entry cache;
+
+    if (entry >= FD_CACHE_ENTRIES || !fd_cache[entry]) return FALSE;
+
+    cache.data = interlocked_cmpxchg64( &fd_cache[entry][idx].entry.data, 0, 0 );
+    if (!cache.data || cache.s.type == FD_TYPE_INVALID) return FALSE;
+    if (!is_fd_cache_entry_valid( &fd_cache[entry][idx], cache.data )) return FALSE;
+    *completion = cache.s.completion;
+    return TRUE;
+}
+
+
+/***********************************************************************
+ *           remove_fd_from_cache
+ */
+static int remove_fd_from_cache( HANDLE handle )
 {
     unsigned int entry, idx = handle_to_index( handle, &entry );
     int fd = -1;
@@ -912,7 +1227,8 @@ int server_remove_fd_from_cache( HANDLE handle )
     if (entry < FD_CACHE_ENTRIES && fd_cache[entry])
     {
         union fd_cache_entry cache;
-        cache.data = interlocked_xchg64( &fd_cache[entry][idx].data, 0 );
+        cache.data = interlocked_xchg64( &fd_cache[entry][idx].entry.data, 0 );
+        if (cache.s.type == FD_TYPE_SOCKET) interlocked_xchg_add( &socket_fd_generation, 1 );
         if (cache.s.type != FD_TYPE_INVALID) fd = cache.s.fd - 1;
     }
 
@@ -920,6 +1236,146 @@ int server_remove_fd_from_cache( HANDLE handle )
 }
 
 
+/***********************************************************************
+ *           retire_fd
+ *
+ * Keep a stale fd open until its handle is closed.
+ * Caller must hold fd_cache_section.
+ */
+static void retire_fd( HANDLE handle, int fd )
+{
+    if (nb_retired_fds == max_retired_fds)
+    {
+        unsigned int new_max = max( 16, max_retired_fds * 2 );
+        struct retired_fd *new_fds;
+
+        if (retired_fds)
+            new_fds = RtlReAllocateHeap( GetProcessHeap(), 0, retired_fds, new_max * sizeof(*new_fds) );
+        else
+            new_fds = RtlAllocateHeap( GetProcessHeap(), 0, new_max * sizeof(*new_fds) );
+        if (!new_fds)
+        {
+            /* leaking it is safer than closing an fd that may still be in use */
+            ERR( "out of memory, leaking fd %d\n", fd );
+            return;
+        }
+        retired_fds = new_fds;
+        max_retired_fds = new_max;
+    }
+    retired_fds[nb_retired_fds].handle = handle;
+    retired_fds[nb_retired_fds].fd = fd;
+    nb_retired_fds++;
+}
+
+
+/***********************************************************************
+ *           server_remove_fd_from_cache
+ *
+ * Remove the cache entry of a handle that is being closed, and close the
+ * stale fds that were kept for it. Return the cached fd, which the caller
+ * must close once the handle is closed.
+ */
+int server_remove_fd_from_cache( HANDLE handle )
+{
+    unsigned int i;
+    sigset_t sigset;
+
+    if (*(volatile unsigned int *)&nb_retired_fds)
+    {
+        server_enter_uninterrupted_section( &fd_cache_section, &sigset );
+        for (i = 0; i < nb_retired_fds; )
+        {
+            if (retired_fds[i].handle != handle) i++;
+            else
+            {
+                close( retired_fds[i].fd );
+                retired_fds[i] = retired_fds[--nb_retired_fds];
+            }
+        }
+        server_leave_uninterrupted_section( &fd_cache_section, &sigset );
+    }
+    return remove_fd_from_cache( handle );
+}
+
+
+/***********************************************************************
+ *           flush_fd_cache
+ *
+ * Remove all the cache entries, because a handle was closed behind our back.
+ * The fds whose server object is gone or changed, as told by their generation
+ * counter, are closed right away; the others are only closed along with their
+ * handle, since we can't tell which one was closed.
+ * Caller must hold fd_cache_section.
+ */
+static void flush_fd_cache(void)
+{
+    unsigned int entry, idx, generation = *fd_cache_process_generation;
+    union fd_cache_entry cache;
+    union fd_cache_generation gen;
+    HANDLE handle;
+
+    interlocked_xchg_add( &socket_fd_generation, 1 );
+    for (entry = 0; entry < FD_CACHE_ENTRIES; entry++)
+    {
+        if (!fd_cache[entry]) continue;
+        for (idx = 0; idx < FD_CACHE_BLOCK_SIZE; idx++)
+        {
+            if (!fd_cache[entry][idx].entry.data) continue;
+            cache.data = interlocked_xchg64( &fd_cache[entry][idx].entry.data, 0 );
+            if (!cache.data || cache.s.type == FD_TYPE_INVALID) continue;
+            gen.data = fd_cache[entry][idx].gen.data;
+            if (gen.s.slot && fd_cache_generations[gen.s.slot] != gen.s.value)
+            {
+                close( cache.s.fd - 1 );
+                continue;
+            }
+            handle = wine_server_ptr_handle( (entry * FD_CACHE_BLOCK_SIZE + idx + 1) << 2 );
+            retire_fd( handle, cache.s.fd - 1 );
+        }
+    }
+    fd_cache_flush_generation = generation;
+}
+
+
+/***********************************************************************
+ *           init_fd_cache
+ *
+ * Map the server generation counters that allow caching all kinds of fds.
+ */
+static void init_fd_cache(void)
+{
+    unsigned int slot = 0;
+    HANDLE mapping = 0;
+    SIZE_T size = 0;
+    void *ptr = NULL;
+
+    SERVER_START_REQ( get_fd_cache_info )
+    {
+        if (!wine_server_call( req ))
+        {
+            mapping = wine_server_ptr_handle( reply->handle );
+            slot = reply->process_slot;
+        }
+    }
+    SERVER_END_REQ;
+    if (!mapping) return;
+
+    if (!NtMapViewOfSection( mapping, NtCurrentProcess(), &ptr, 0, 0, NULL, &size,
+                             ViewShare, 0, PAGE_READONLY ))
+    {
+        const volatile unsigned int *generations = ptr;
+
+        fd_cache_generations = generations;
+        if (slot)
+        {
+            fd_cache_flush_generation = generations[slot];
+            fd_cache_process_generation = &generations[slot];
+        }
+    }
+    NtClose( mapping );
+}
+
+
 /***********************************************************************
  *           server_get_unix_fd
  *
@@ -930,7 +1386,7 @@ int server_get_unix_fd( HANDLE handle, unsigned int wanted_access, int *unix_fd,
 {
     sigset_t sigset;
     obj_handle_t fd_handle;
-    int ret, fd = -1;
+    int ret, cacheable, fd = -1;
     unsigned int access = 0;
 
     *unix_fd = -1;
@@ -944,10 +1400,19 @@ int server_get_unix_fd( HANDLE handle, unsigned int wanted_access, int *unix_fd,
     ret = get_cached_fd( handle, &fd, type, &access, options );
     if (ret == STATUS_INVALID_HANDLE)
     {
+        /* get rid of the stale entries, if any */
+        if (fd_cache_process_generation && *fd_cache_process_generation != fd_cache_flush_generation)
+            flush_fd_cache();
+        else if ((fd = remove_fd_from_cache( handle )) != -1)
+            retire_fd( handle, fd );
+        fd = -1;
+
         SERVER_START_REQ( get_handle_fd )
         {
             req->handle = wine_server_obj_handle( handle );
-            if (!(ret = wine_server_call( req )))
+            ret = wine_server_call( req );
+            cacheable = reply->cacheable || (reply->cache_slot && fd_cache_generations);
+            if (!ret)
             {
                 if (type) *type = reply->type;
                 if (options) *options = reply->options;
@@ -955,15 +1420,17 @@ int server_get_unix_fd( HANDLE handle, unsigned int wanted_access, int *unix_fd,
                 if ((fd = receive_fd( &fd_handle )) != -1)
                 {
                     assert( wine_server_ptr_handle(fd_handle) == handle );
-                    *needs_close = (!reply->cacheable ||
-                                    !add_fd_to_cache( handle, fd, reply->type,
-                                                      reply->access, reply->options ));
+                    *needs_close = (!cacheable ||
+                                    !add_fd_to_cache( handle, fd, reply->type, reply->access,
+                                                      reply->options, reply->completion,
+                                                      reply->cache_slot, reply->cache_generation ));
                 }
                 else ret = STATUS_TOO_MANY_OPENED_FILES;
             }
-            else if (reply->cacheable)
+            else if (cacheable)
             {
-                add_fd_to_cache( handle, ret, FD_TYPE_INVALID, 0, 0 );
+                add_fd_to_cache( handle, ret, FD_TYPE_INVALID, 0, 0, FALSE,
+                                 reply->cache_slot, reply->cache_generation );
             }
         }
         SERVER_END_REQ;
@@ -981,6 +1448,33 @@ done:
 }
 
 
+/***********************************************************************
+ *           __wine_server_get_unix_fd   (NTDLL.@)
+ *
+ * Retrieve the Unix fd of a handle without duplicating it when it is
+ * kept in the fd cache. The fd must be closed iff needs_close is
+ * non-zero; a cached fd remains valid until the handle is closed.
+ */
+int CDECL __wine_server_get_unix_fd( HANDLE handle, unsigned int access, int *unix_fd,
+                                     int *needs_close, unsigned int *options )
+{
+    return server_get_unix_fd( handle, access, unix_fd, needs_close, NULL, options );
+}
+
+
+/***********************************************************************
+ *           __wine_server_socket_fd_generation   (NTDLL.@)
+ *
+ * Return a counter that changes whenever a cached socket fd is closed,
+ * so that callers can tell whether the fds they got from
+ * __wine_server_get_unix_fd may have been reused since.
+ */
+unsigned int CDECL __wine_server_socket_fd_generation(void)
+{
+    return *(volatile LONG *)&socket_fd_generation;
+}
+
+
 /***********************************************************************
  *           wine_server_fd_to_handle   (NTDLL.@)
  *
@@ -1464,6 +1958,7 @@ void server_init_process_done(void)
     SERVER_END_REQ;
 
     assert( !status );
+    init_fd_cache();
     signal_start_process( entry, suspend );
 }
 
@@ -1524,6 +2019,7 @@ size_t server_init_thread( void *entry_point, BOOL *suspend )
     switch (ret)
     {
     case STATUS_SUCCESS:
+        init_request_shm();
         if (arch)
         {
             if (!strcmp( arch, "win32" ) && (is_win64 || is_wow64))
@@ -4433,13 +4433,73 @@ __ASM_GLOBAL_FUNC( RtlRaiseException,
                    "call " __ASM_NAME("RtlRaiseStatus") /* does not return */ );
 
 
+/***********************************************************************
+ *           unwind_stack_frame
+ *
+ * Unwind a single frame for stack walking, without calling any handlers.
+ */
+static BOOL unwind_stack_frame( CONTEXT *context )
+{
+    RUNTIME_FUNCTION *function;
+    LDR_MODULE *module;
+    ULONG64 base, frame;
+    void *handler_data;
+
+    if ((function = lookup_function_info( context->Rip, &base, &module )))
+    {
+        RtlVirtualUnwind( UNW_FLAG_NHANDLER, base, context->Rip, function,
+                          context, &handler_data, &frame, NULL );
+    }
+    else if (!module || (module->Flags & LDR_WINE_INTERNAL))
+    {
+        PEXCEPTION_ROUTINE handler;
+        BOOL got_info = FALSE;
+        struct dwarf_eh_bases bases;
+        const struct dwarf_fde *fde = _Unwind_Find_FDE( (void *)(context->Rip - 1), &bases );
+
+        if (fde)
+        {
+            if (dwarf_virtual_unwind( context->Rip, &frame, context, fde, &bases, &handler, &handler_data ))
+                return FALSE;
+            got_info = TRUE;
+        }
+#ifdef HAVE_LIBUNWIND_H
+        else if (libunwind_virtual_unwind( context->Rip, &got_info, &frame, context, &handler, &handler_data ))
+            return FALSE;
+#endif
+        if (!got_info) return FALSE;
+    }
+    else  /* no exception information, treat as a leaf function */
+    {
+        context->Rip = *(ULONG64 *)context->Rsp;
+        context->Rsp += sizeof(ULONG64);
+    }
+
+    return context->Rip && !(context->Rsp & 7) &&
+           context->Rsp >= (ULONG64)NtCurrentTeb()->Tib.StackLimit &&
+           context->Rsp < (ULONG64)NtCurrentTeb()->Tib.StackBase;
+}
+
+
 /*************************************************************************
  *		RtlCaptureStackBackTrace (NTDLL.@)
  */
 USHORT WINAPI RtlCaptureStackBackTrace( ULONG skip, ULONG count, PVOID *buffer, ULONG *hash )
 {
-    FIXME( "(%d, %d, %p, %p) stub!\n", skip, count, buffer, hash );
-    return 0;
+    CONTEXT context;
+    ULONG i, num_entries = 0;
+
+    RtlCaptureContext( &context );
+    if (hash) *hash = 0;
+
+    for (i = 0; i < skip + count; i++)
+    {
+        if (!unwind_stack_frame( &context )) break;
+        if (i < skip) continue;
+        buffer[num_entries++] = (void *)context.Rip;
+        if (hash) *hash += context.Rip;
+    }
+    return num_entries;
 }
 
 
@@ -0,0 +1,643 @@
+/*
+ * In-process socket readiness engine
+ *
+ * When enabled with WINESOCKPOLL=1, overlapped socket reads and writes
+ * that can't complete immediately are not registered with the server.
+ * They are queued on the socket here instead, and a dedicated thread
+ * waits for the sockets with a per-process epoll. Once a socket is
+ * ready, the thread runs the async callback of ws2_32, and reports the
+ * completion through the event and the completion port. On datagram
+ * sockets, callbacks with a registered batch handler get several queued
+ * asyncs at once, so that ws2_32 can serve them with a single recvmmsg()
+ * or sendmmsg().
+ *
+ * Asyncs that need the server, such as those with a completion routine,
+ * can't be mixed with in-process ones without breaking the completion
+ * order. The first time one is registered on a socket, the queued asyncs
+ * are moved to the server, and all the further asyncs go there too.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+#include "wine/port.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+#include "wine/list.h"
+#include "wine/server.h"
+#include "wine/debug.h"
+#include "ntdll_misc.h"
+
+WINE_DEFAULT_DEBUG_CHANNEL(winsock);
+
+#ifdef HAVE_SYS_EPOLL_H
+
+typedef NTSTATUS async_callback_t( void *user, IO_STATUS_BLOCK *io, NTSTATUS status );
+typedef unsigned int async_batch_t( void **users, IO_STATUS_BLOCK **io, NTSTATUS *status, unsigned int count );
+
+struct sock_async
+{
+    struct list         entry;      /* entry in the socket queue */
+    async_callback_t  **user;       /* ws2_32 async, starting with its callback */
+    IO_STATUS_BLOCK    *iosb;
+    HANDLE              event;
+    ULONG_PTR           cvalue;     /* completion value, 0 if no port is to be notified */
+    DWORD               tid;        /* issuing thread, for NtCancelIoFile */
+    BOOL                cancelled;  /* cancelled while its callback was running */
+};
+
+struct sock_poll
+{
+    int                 fd;         /* private fd registered with the epoll */
+    unsigned int        armed;      /* epoll events currently armed */
+    BOOL                busy;       /* queues being processed by the poll thread */
+    BOOL                closed;     /* handle closed while busy */
+    BOOL                server;     /* asyncs are queued on the server from now on */
+    BOOL                dgram;      /* datagram socket, the asyncs can be batched */
+    struct list         running;    /* asyncs whose callback is running */
+    struct list         queue[2];   /* pending reads and writes */
+};
+
+#define SOCK_POLL_BLOCK_SIZE  (65536 / sizeof(struct sock_poll *))
+#define SOCK_POLL_BLOCKS      128
+#define SOCK_POLL_BATCH       32
+
+static struct
+{
+    async_callback_t   *callback;
+    async_batch_t      *batch;
+} batch_handlers[8];
+
+static struct sock_poll **sock_poll_table[SOCK_POLL_BLOCKS];
+static int sock_poll_fd = -1;
+static int sock_poll_unsupported;
+
+static RTL_CRITICAL_SECTION sock_poll_section;
+static RTL_CRITICAL_SECTION_DEBUG sock_poll_section_debug =
+{
+    0, 0, &sock_poll_section,
+    { &sock_poll_section_debug.ProcessLocksList, &sock_poll_section_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": sock_poll_section") }
+};
+static RTL_CRITICAL_SECTION sock_poll_section = { &sock_poll_section_debug, -1, 0, 0, 0, 0 };
+
+static int do_sock_poll(void)
+{
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINESOCKPOLL" );
+        enabled = env && atoi( env );
+    }
+    return enabled && !sock_poll_unsupported;
+}
+
+static struct sock_poll **get_sock_entry( HANDLE handle, BOOL alloc )
+{
+    unsigned int idx = (wine_server_obj_handle( handle ) >> 2) - 1;
+    unsigned int block = idx / SOCK_POLL_BLOCK_SIZE;
+
+    if (block >= SOCK_POLL_BLOCKS) return NULL;
+    if (!sock_poll_table[block])
+    {
+        if (!alloc) return NULL;
+        if (!(sock_poll_table[block] = RtlAllocateHeap( GetProcessHeap(), HEAP_ZERO_MEMORY,
+                                                        SOCK_POLL_BLOCK_SIZE * sizeof(struct sock_poll *) )))
+            return NULL;
+    }
+    return &sock_poll_table[block][idx % SOCK_POLL_BLOCK_SIZE];
+}
+
+/* arm the epoll for the non-empty queues; called with sock_poll_section held */
+static BOOL arm_socket( HANDLE handle, struct sock_poll *sock )
+{
+    struct epoll_event ev;
+    unsigned int events = 0;
+
+    if (!list_empty( &sock->queue[0] )) events |= EPOLLIN | EPOLLPRI;
+    if (!list_empty( &sock->queue[1] )) events |= EPOLLOUT;
+    if (events == sock->armed) return TRUE;
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.u64 = wine_server_obj_handle( handle );
+    if (epoll_ctl( sock_poll_fd, EPOLL_CTL_MOD, sock->fd, &ev ) == -1)
+    {
+        ERR( "failed to arm socket %p: %s\n", handle, strerror( errno ));
+        return FALSE;
+    }
+    sock->armed = events;
+    return TRUE;
+}
+
+static struct sock_poll *create_socket( HANDLE handle )
+{
+    struct epoll_event ev;
+    struct sock_poll *sock;
+    int fd, needs_close, type = 0;
+    socklen_t len = sizeof(type);
+
+    if (server_get_unix_fd( handle, 0, &fd, &needs_close, NULL, NULL )) return NULL;
+    /* use our own fd, the cached one may go away while the registration is still needed */
+    if (!needs_close && (fd = dup( fd )) == -1) return NULL;
+
+    if (!(sock = RtlAllocateHeap( GetProcessHeap(), 0, sizeof(*sock) )))
+    {
+        close( fd );
+        return NULL;
+    }
+    sock->fd      = fd;
+    sock->armed   = 0;
+    sock->busy    = FALSE;
+    sock->closed  = FALSE;
+    sock->server  = FALSE;
+    /* stream data must not be split between batched buffers, so only datagrams are batched */
+    sock->dgram   = !getsockopt( fd, SOL_SOCKET, SO_TYPE, (char *)&type, &len ) && type == SOCK_DGRAM;
+    list_init( &sock->running );
+    list_init( &sock->queue[0] );
+    list_init( &sock->queue[1] );
+
+    ev.events = EPOLLONESHOT;
+    ev.data.u64 = wine_server_obj_handle( handle );
+    if (epoll_ctl( sock_poll_fd, EPOLL_CTL_ADD, fd, &ev ) == -1)
+    {
+        WARN( "failed to add socket %p: %s\n", handle, strerror( errno ));
+        close( fd );
+        RtlFreeHeap( GetProcessHeap(), 0, sock );
+        return NULL;
+    }
+    return sock;
+}
+
+static void free_socket( struct sock_poll *sock )
+{
+    if (sock->fd != -1) close( sock->fd );
+    RtlFreeHeap( GetProcessHeap(), 0, sock );
+}
+
+static void complete_async( HANDLE handle, struct sock_async *async, NTSTATUS status )
+{
+    ULONG_PTR info = async->iosb->Information;
+
+    TRACE( "socket %p iosb %p status %08x\n", handle, async->iosb, status );
+
+    if (async->event) NtSetEvent( async->event, NULL );
+    if (async->cvalue) NTDLL_AddCompletion( handle, async->cvalue, status, info, TRUE );
+    RtlFreeHeap( GetProcessHeap(), 0, async );
+}
+
+/* terminate asyncs that have been removed from their socket */
+static void abort_asyncs( HANDLE handle, struct list *list, NTSTATUS status )
+{
+    struct sock_async *async, *next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( async, next, list, struct sock_async, entry )
+    {
+        list_remove( &async->entry );
+        complete_async( handle, async, (**async->user)( async->user, async->iosb, status ));
+    }
+}
+
+static async_batch_t *get_batch_handler( async_callback_t *callback )
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(batch_handlers) && batch_handlers[i].callback; i++)
+        if (batch_handlers[i].callback == callback) return batch_handlers[i].batch;
+    return NULL;
+}
+
+/* move the asyncs to run next to the running list; called with sock_poll_section held */
+static unsigned int start_asyncs( struct sock_poll *sock, struct list *queue, struct sock_async **asyncs )
+{
+    struct sock_async *async = LIST_ENTRY( list_head( queue ), struct sock_async, entry );
+    async_callback_t *callback = *async->user;
+    unsigned int count = 0;
+    struct list *ptr;
+
+    do
+    {
+        list_remove( &async->entry );
+        list_add_tail( &sock->running, &async->entry );
+        asyncs[count++] = async;
+        if (!(ptr = list_head( queue ))) break;
+        async = LIST_ENTRY( ptr, struct sock_async, entry );
+    } while (count < SOCK_POLL_BATCH && sock->dgram && *async->user == callback && get_batch_handler( callback ));
+
+    return count;
+}
+
+/* run the callbacks of a set of asyncs, returns the number of leading asyncs done */
+static unsigned int run_asyncs( struct sock_async **asyncs, NTSTATUS *status, unsigned int count )
+{
+    IO_STATUS_BLOCK *iosbs[SOCK_POLL_BATCH];
+    void *users[SOCK_POLL_BATCH];
+    unsigned int i, done = 0;
+    async_batch_t *batch;
+
+    if (count > 1 && (batch = get_batch_handler( *asyncs[0]->user )))
+    {
+        for (i = 0; i < count; i++)
+        {
+            users[i] = asyncs[i]->user;
+            iosbs[i] = asyncs[i]->iosb;
+        }
+        done = batch( users, iosbs, status, count );
+    }
+    if (!done)
+    {
+        status[0] = (**asyncs[0]->user)( asyncs[0]->user, asyncs[0]->iosb, STATUS_ALERTED );
+        done = status[0] != STATUS_PENDING;
+    }
+    return done;
+}
+
+static void process_socket( HANDLE handle, unsigned int events )
+{
+    static const unsigned int ready[2] = { EPOLLIN | EPOLLPRI | EPOLLERR | EPOLLHUP,
+                                           EPOLLOUT | EPOLLERR | EPOLLHUP };
+    struct sock_async *asyncs[SOCK_POLL_BATCH];
+    NTSTATUS status[SOCK_POLL_BATCH];
+    struct sock_poll *sock, **entry;
+    unsigned int i, count, done;
+    struct list cancelled, closed;
+    int type;
+
+    RtlEnterCriticalSection( &sock_poll_section );
+    if (!(entry = get_sock_entry( handle, FALSE )) || !(sock = *entry))
+    {
+        RtlLeaveCriticalSection( &sock_poll_section );
+        return;
+    }
+    sock->armed = 0;
+    sock->busy = TRUE;
+
+    for (type = 0; type < 2; type++)
+    {
+        if (!(events & ready[type])) continue;
+
+        while (!sock->closed && !sock->server && !list_empty( &sock->queue[type] ))
+        {
+            count = start_asyncs( sock, &sock->queue[type], asyncs );
+            RtlLeaveCriticalSection( &sock_poll_section );
+
+            done = run_asyncs( asyncs, status, count );
+
+            RtlEnterCriticalSection( &sock_poll_section );
+            list_init( &cancelled );
+            list_init( &closed );
+            for (i = count; i-- > 0;)
+            {
+                list_remove( &asyncs[i]->entry );
+                if (i < done) continue;
+                if (asyncs[i]->cancelled) list_add_head( &cancelled, &asyncs[i]->entry );
+                else if (sock->closed) list_add_head( &closed, &asyncs[i]->entry );
+                else list_add_head( &sock->queue[type], &asyncs[i]->entry );
+            }
+            RtlLeaveCriticalSection( &sock_poll_section );
+
+            for (i = 0; i < done; i++) complete_async( handle, asyncs[i], status[i] );
+            abort_asyncs( handle, &cancelled, STATUS_CANCELLED );
+            abort_asyncs( handle, &closed, STATUS_HANDLES_CLOSED );
+
+            RtlEnterCriticalSection( &sock_poll_section );
+            if (done < count) break;
+        }
+    }
+
+    sock->busy = FALSE;
+    if (sock->closed) free_socket( sock );
+    else if (!sock->server) arm_socket( handle, sock );
+    RtlLeaveCriticalSection( &sock_poll_section );
+}
+
+static void CALLBACK sock_poll_thread( void *arg )
+{
+    struct epoll_event events[64];
+    int i, count;
+
+    for (;;)
+    {
+        if ((count = epoll_wait( sock_poll_fd, events, ARRAY_SIZE(events), -1 )) == -1)
+        {
+            if (errno == EINTR) continue;
+            ERR( "epoll_wait failed: %s\n", strerror( errno ));
+            return;
+        }
+        for (i = 0; i < count; i++)
+            process_socket( wine_server_ptr_handle( events[i].data.u64 ), events[i].events );
+    }
+}
+
+/* create the epoll and its thread; called with sock_poll_section held */
+static BOOL init_sock_poll(void)
+{
+    HANDLE thread;
+
+    if (sock_poll_fd != -1) return TRUE;
+    if (sock_poll_unsupported) return FALSE;
+
+    if ((sock_poll_fd = epoll_create1( EPOLL_CLOEXEC )) == -1)
+    {
+        WARN( "epoll_create1 failed: %s\n", strerror( errno ));
+        sock_poll_unsupported = 1;
+        return FALSE;
+    }
+    if (RtlCreateUserThread( GetCurrentProcess(), NULL, FALSE, NULL, 0, 0,
+                             (PRTL_THREAD_START_ROUTINE)sock_poll_thread, NULL, &thread, NULL ))
+    {
+        ERR( "failed to create the poll thread\n" );
+        close( sock_poll_fd );
+        sock_poll_fd = -1;
+        sock_poll_unsupported = 1;
+        return FALSE;
+    }
+    NtClose( thread );
+    return TRUE;
+}
+
+/***********************************************************************
+ *           __wine_queue_socket_async   (NTDLL.@)
+ *
+ * Queue an overlapped socket read or write that couldn't complete
+ * immediately. Returns STATUS_NOT_IMPLEMENTED if the async should be
+ * registered with the server instead.
+ */
+NTSTATUS CDECL __wine_queue_socket_async( HANDLE handle, int type, void *user, HANDLE event,
+                                          ULONG_PTR cvalue, IO_STATUS_BLOCK *iosb )
+{
+    struct sock_poll *sock, **entry;
+    struct sock_async *async;
+    NTSTATUS status = STATUS_NOT_IMPLEMENTED;
+    BOOL completion;
+    int idx;
+
+    if (!do_sock_poll()) return STATUS_NOT_IMPLEMENTED;
+
+    switch (type)
+    {
+    case ASYNC_TYPE_READ:  idx = 0; break;
+    case ASYNC_TYPE_WRITE: idx = 1; break;
+    default: return STATUS_NOT_IMPLEMENTED;
+    }
+
+    /* the port may have been associated through another handle to the socket */
+    if (!server_get_fd_completion( handle, &completion )) return STATUS_NOT_IMPLEMENTED;
+    /* without an event or a port, the caller would wait on the socket object itself,
+     * unless it didn't ask for any notification at all */
+    if (!completion)
+    {
+        if (!event && cvalue) return STATUS_NOT_IMPLEMENTED;
+        cvalue = 0;
+    }
+
+    if (!(async = RtlAllocateHeap( GetProcessHeap(), 0, sizeof(*async) ))) return STATUS_NOT_IMPLEMENTED;
+    async->user      = user;
+    async->iosb      = iosb;
+    async->event     = event;
+    async->cvalue    = cvalue;
+    async->tid       = GetCurrentThreadId();
+    async->cancelled = FALSE;
+    if (event) NtResetEvent( event, NULL );
+
+    RtlEnterCriticalSection( &sock_poll_section );
+    if (init_sock_poll() && (entry = get_sock_entry( handle, TRUE )))
+    {
+        if (!(sock = *entry)) sock = *entry = create_socket( handle );
+        if (sock && !sock->server)
+        {
+            list_add_tail( &sock->queue[idx], &async->entry );
+            if (sock->busy || arm_socket( handle, sock )) status = STATUS_PENDING;
+            else list_remove( &async->entry );
+        }
+    }
+    RtlLeaveCriticalSection( &sock_poll_section );
+
+    if (status != STATUS_PENDING) RtlFreeHeap( GetProcessHeap(), 0, async );
+    return status;
+}
+
+/* register a queued async with the server */
+static NTSTATUS register_server_async( HANDLE handle, int type, struct sock_async *async )
+{
+    NTSTATUS status;
+
+    SERVER_START_REQ( register_async )
+    {
+        req->type              = type;
+        req->async.handle      = wine_server_obj_handle( handle );
+        req->async.user        = wine_server_client_ptr( async->user );
+        req->async.iosb        = wine_server_client_ptr( async->iosb );
+        req->async.event       = wine_server_obj_handle( async->event );
+        req->async.apc_context = async->cvalue;
+        status = wine_server_call( req );
+    }
+    SERVER_END_REQ;
+    return status;
+}
+
+/***********************************************************************
+ *           __wine_use_server_socket_asyncs   (NTDLL.@)
+ *
+ * Called before an async is registered with the server for a socket.
+ * The asyncs queued in-process are moved to the server in order, and
+ * the further ones are no longer queued here.
+ */
+void CDECL __wine_use_server_socket_asyncs( HANDLE handle )
+{
+    static const int types[2] = { ASYNC_TYPE_READ, ASYNC_TYPE_WRITE };
+    struct list moved[2] = { LIST_INIT( moved[0] ), LIST_INIT( moved[1] ) };
+    struct sock_poll *sock, **entry;
+    struct sock_async *async, *next;
+    NTSTATUS status;
+    int type;
+
+    if (!(entry = get_sock_entry( handle, FALSE )) || !*entry) return;
+
+    RtlEnterCriticalSection( &sock_poll_section );
+    if (!(sock = *entry) || sock->server)
+    {
+        RtlLeaveCriticalSection( &sock_poll_section );
+        return;
+    }
+    sock->server = TRUE;
+    /* the poll thread stops after its current batch, and puts back the asyncs left pending */
+    while (sock->busy)
+    {
+        RtlLeaveCriticalSection( &sock_poll_section );
+        NtYieldExecution();
+        RtlEnterCriticalSection( &sock_poll_section );
+        if (*entry != sock)
+        {
+            RtlLeaveCriticalSection( &sock_poll_section );
+            return;
+        }
+    }
+    epoll_ctl( sock_poll_fd, EPOLL_CTL_DEL, sock->fd, NULL );
+    close( sock->fd );
+    sock->fd = -1;
+    sock->armed = 0;
+    list_move_tail( &moved[0], &sock->queue[0] );
+    list_move_tail( &moved[1], &sock->queue[1] );
+    RtlLeaveCriticalSection( &sock_poll_section );
+
+    for (type = 0; type < 2; type++)
+    {
+        LIST_FOR_EACH_ENTRY_SAFE( async, next, &moved[type], struct sock_async, entry )
+        {
+            list_remove( &async->entry );
+            TRACE( "socket %p moving iosb %p to the server\n", handle, async->iosb );
+            if ((status = register_server_async( handle, types[type], async )) == STATUS_PENDING)
+                RtlFreeHeap( GetProcessHeap(), 0, async );
+            else
+                complete_async( handle, async, (**async->user)( async->user, async->iosb, status ));
+        }
+    }
+}
+
+/***********************************************************************
+ *           __wine_set_socket_batch_handler   (NTDLL.@)
+ *
+ * Register a function that can complete several queued asyncs using the
+ * given callback at once. It is only used for datagram sockets. It returns the number of leading asyncs it
+ * completed, the others are left queued.
+ */
+void CDECL __wine_set_socket_batch_handler( void *callback, void *batch )
+{
+    unsigned int i;
+
+    RtlEnterCriticalSection( &sock_poll_section );
+    for (i = 0; i < ARRAY_SIZE(batch_handlers); i++)
+    {
+        if (batch_handlers[i].callback && batch_handlers[i].callback != callback) continue;
+        batch_handlers[i].batch = batch;
+        batch_handlers[i].callback = callback;
+        break;
+    }
+    RtlLeaveCriticalSection( &sock_poll_section );
+}
+
+/***********************************************************************
+ *           sock_poll_cancel
+ *
+ * Cancel the queued asyncs of a socket, optionally only those of the
+ * current thread or those using a given status block. Returns the
+ * number of asyncs cancelled.
+ */
+unsigned int sock_poll_cancel( HANDLE handle, IO_STATUS_BLOCK *iosb, BOOL only_thread )
+{
+    struct list aborted = LIST_INIT( aborted );
+    struct sock_poll *sock, **entry;
+    struct sock_async *async, *next;
+    unsigned int type, count = 0;
+
+    if (!(entry = get_sock_entry( handle, FALSE )) || !*entry) return 0;
+
+    RtlEnterCriticalSection( &sock_poll_section );
+    if ((sock = *entry))
+    {
+        for (type = 0; type < 2; type++)
+        {
+            LIST_FOR_EACH_ENTRY_SAFE( async, next, &sock->queue[type], struct sock_async, entry )
+            {
+                if (iosb && async->iosb != iosb) continue;
+                if (only_thread && async->tid != GetCurrentThreadId()) continue;
+                list_remove( &async->entry );
+                list_add_tail( &aborted, &async->entry );
+                count++;
+            }
+        }
+        LIST_FOR_EACH_ENTRY( async, &sock->running, struct sock_async, entry )
+        {
+            if (iosb && async->iosb != iosb) continue;
+            if (only_thread && async->tid != GetCurrentThreadId()) continue;
+            async->cancelled = TRUE;
+            count++;
+        }
+    }
+    RtlLeaveCriticalSection( &sock_poll_section );
+
+    abort_asyncs( handle, &aborted, STATUS_CANCELLED );
+    return count;
+}
+
+/***********************************************************************
+ *           sock_poll_close
+ */
+void sock_poll_close( HANDLE handle )
+{
+    struct list aborted = LIST_INIT( aborted );
+    struct sock_poll *sock, **entry;
+
+    if (!(entry = get_sock_entry( handle, FALSE )) || !*entry) return;
+
+    RtlEnterCriticalSection( &sock_poll_section );
+    if ((sock = *entry))
+    {
+        *entry = NULL;
+        epoll_ctl( sock_poll_fd, EPOLL_CTL_DEL, sock->fd, NULL );
+        list_move_tail( &aborted, &sock->queue[0] );
+        list_move_tail( &aborted, &sock->queue[1] );
+        if (sock->busy) sock->closed = TRUE;
+        else free_socket( sock );
+    }
+    RtlLeaveCriticalSection( &sock_poll_section );
+
+    abort_asyncs( handle, &aborted, STATUS_HANDLES_CLOSED );
+}
+
+#else  /* HAVE_SYS_EPOLL_H */
+
+void CDECL __wine_use_server_socket_asyncs( HANDLE handle )
+{
+}
+
+void CDECL __wine_set_socket_batch_handler( void *callback, void *batch )
+{
+}
+
+NTSTATUS CDECL __wine_queue_socket_async( HANDLE handle, int type, void *user, HANDLE event,
+                                          ULONG_PTR cvalue, IO_STATUS_BLOCK *iosb )
+{
+    return STATUS_NOT_IMPLEMENTED;
+}
+
+unsigned int sock_poll_cancel( HANDLE handle, IO_STATUS_BLOCK *iosb, BOOL only_thread )
+{
+    return 0;
+}
+
+void sock_poll_close( HANDLE handle )
+{
+}
+
+#endif  /* HAVE_SYS_EPOLL_H */
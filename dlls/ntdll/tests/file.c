@@ -3586,6 +3586,130 @@ static void test_file_completion_information(void)
     CloseHandle(h);
 }
 
+#define test_port_write(a,b,c) _test_port_write(__LINE__,a,b,c)
+static void _test_port_write(unsigned line, HANDLE handle, HANDLE port, OVERLAPPED *ov)
+{
+    static const char buf[] = "testdata";
+    OVERLAPPED *pov;
+    DWORD num_bytes;
+    ULONG_PTR key;
+    BOOL ret;
+
+    SetLastError(0xdeadbeef);
+    ret = WriteFile(handle, buf, sizeof(buf), &num_bytes, ov);
+    if (!ret && GetLastError() == ERROR_IO_PENDING)
+        ret = GetOverlappedResult(handle, ov, &num_bytes, TRUE);
+    ok_(__FILE__,line)(ret, "WriteFile failed, error %u\n", GetLastError());
+    ok_(__FILE__,line)(num_bytes == sizeof(buf), "expected sizeof(buf), got %u\n", num_bytes);
+
+    key = 0;
+    pov = NULL;
+    ret = GetQueuedCompletionStatus(port, &num_bytes, &key, &pov, 1000);
+    ok_(__FILE__,line)(ret, "GetQueuedCompletionStatus failed, error %u\n", GetLastError());
+    ok_(__FILE__,line)(key == 0xdeadbeef, "expected 0xdeadbeef, got %lx\n", key);
+    ok_(__FILE__,line)(pov == ov, "expected %p, got %p\n", ov, pov);
+    ok_(__FILE__,line)(num_bytes == sizeof(buf), "expected sizeof(buf), got %u\n", num_bytes);
+}
+
+static void test_file_completion_duplicate(void)
+{
+    static const char pipe_name[] = "\\\\.\\pipe\\iocompletionduptestnamedpipe";
+    IO_STATUS_BLOCK io;
+    OVERLAPPED ov, *pov;
+    HANDLE port, h, dup, dup2, server, client;
+    char buf[16];
+    DWORD num_bytes;
+    ULONG_PTR key;
+    NTSTATUS status;
+    BOOL ret;
+
+    if (!(h = create_temp_file(FILE_FLAG_OVERLAPPED))) return;
+    ret = DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    ok(ret, "DuplicateHandle failed, error %u\n", GetLastError());
+
+    memset(&ov, 0, sizeof(ov));
+    ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+
+    /* use the duplicate before the association so that it already has an fd */
+    ret = WriteFile(dup, "testdata", 8, &num_bytes, &ov);
+    if (!ret && GetLastError() == ERROR_IO_PENDING)
+        ret = GetOverlappedResult(dup, &ov, &num_bytes, TRUE);
+    ok(ret, "WriteFile failed, error %u\n", GetLastError());
+
+    /* the port belongs to the file object, not to the handle it was associated through */
+    port = CreateIoCompletionPort(h, NULL, 0xdeadbeef, 0);
+    ok(port != NULL, "CreateIoCompletionPort failed, error %u\n", GetLastError());
+    test_port_write(h, port, &ov);
+    test_port_write(dup, port, &ov);
+
+    ret = DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &dup2, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    ok(ret, "DuplicateHandle failed, error %u\n", GetLastError());
+    test_port_write(dup2, port, &ov);
+    CloseHandle(h);
+    test_port_write(dup, port, &ov);
+
+    pov = (void *)0xdeadbeef;
+    ret = GetQueuedCompletionStatus(port, &num_bytes, &key, &pov, 0);
+    ok(!ret, "GetQueuedCompletionStatus succeeded\n");
+    ok(pov == NULL, "expected NULL, got %p\n", pov);
+
+    CloseHandle(dup2);
+    CloseHandle(dup);
+    CloseHandle(port);
+
+    /* cancelling a read queued through a duplicate */
+    server = CreateNamedPipeA(pipe_name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED,
+                              PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT, 1, 1024, 1024, 1000, NULL);
+    ok(server != INVALID_HANDLE_VALUE, "CreateNamedPipe failed, error %u\n", GetLastError());
+    client = CreateFileA(pipe_name, GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    ok(client != INVALID_HANDLE_VALUE, "CreateFile failed, error %u\n", GetLastError());
+    ret = DuplicateHandle(GetCurrentProcess(), server, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    ok(ret, "DuplicateHandle failed, error %u\n", GetLastError());
+    port = CreateIoCompletionPort(server, NULL, 0xdeadbeef, 0);
+    ok(port != NULL, "CreateIoCompletionPort failed, error %u\n", GetLastError());
+
+    SetLastError(0xdeadbeef);
+    ret = ReadFile(dup, buf, sizeof(buf), &num_bytes, &ov);
+    ok(!ret && GetLastError() == ERROR_IO_PENDING, "ReadFile returned %d, error %u\n", ret, GetLastError());
+
+    status = pNtCancelIoFileEx(dup, (IO_STATUS_BLOCK *)&ov, &io);
+    ok(status == STATUS_SUCCESS, "expected STATUS_SUCCESS, got %#x\n", status);
+    ret = GetOverlappedResult(dup, &ov, &num_bytes, TRUE);
+    ok(!ret && GetLastError() == ERROR_OPERATION_ABORTED, "GetOverlappedResult returned %d, error %u\n",
+       ret, GetLastError());
+
+    key = 0;
+    pov = NULL;
+    ret = GetQueuedCompletionStatus(port, &num_bytes, &key, &pov, 1000);
+    ok(!ret && GetLastError() == ERROR_OPERATION_ABORTED, "GetQueuedCompletionStatus returned %d, error %u\n",
+       ret, GetLastError());
+    ok(key == 0xdeadbeef, "expected 0xdeadbeef, got %lx\n", key);
+    ok(pov == &ov, "expected %p, got %p\n", &ov, pov);
+
+    /* nothing is left to cancel */
+    status = pNtCancelIoFileEx(dup, (IO_STATUS_BLOCK *)&ov, &io);
+    ok(status == STATUS_NOT_FOUND, "expected STATUS_NOT_FOUND, got %#x\n", status);
+
+    /* the data written afterwards isn't lost */
+    SetLastError(0xdeadbeef);
+    ret = ReadFile(dup, buf, sizeof(buf), &num_bytes, &ov);
+    ok(!ret && GetLastError() == ERROR_IO_PENDING, "ReadFile returned %d, error %u\n", ret, GetLastError());
+    ret = WriteFile(client, "data", 4, &num_bytes, NULL);
+    ok(ret, "WriteFile failed, error %u\n", GetLastError());
+    ret = GetOverlappedResult(dup, &ov, &num_bytes, TRUE);
+    ok(ret, "GetOverlappedResult failed, error %u\n", GetLastError());
+    ok(num_bytes == 4, "expected 4, got %u\n", num_bytes);
+    ret = GetQueuedCompletionStatus(port, &num_bytes, &key, &pov, 1000);
+    ok(ret, "GetQueuedCompletionStatus failed, error %u\n", GetLastError());
+    ok(pov == &ov, "expected %p, got %p\n", &ov, pov);
+
+    CloseHandle(ov.hEvent);
+    CloseHandle(dup);
+    CloseHandle(client);
+    CloseHandle(server);
+    CloseHandle(port);
+}
+
 static void test_file_id_information(void)
 {
     BY_HANDLE_FILE_INFORMATION info;
@@ -4762,10 +4886,202 @@ static void test_flush_buffers_file(void)
     DeleteFileA(buffer);
 }
 
+static HANDLE fd_cache_file;
+static volatile LONG fd_cache_done;
+
+static DWORD WINAPI fd_cache_read_thread( void *arg )
+{
+    IO_STATUS_BLOCK io;
+    LARGE_INTEGER offset;
+    NTSTATUS status = STATUS_SUCCESS;
+    char buf[16];
+
+    while (!fd_cache_done)
+    {
+        offset.QuadPart = 0;
+        memset( buf, 0, sizeof(buf) );
+        U(io).Status = 0xdeadbeef;
+        io.Information = 0;
+        status = pNtReadFile( fd_cache_file, NULL, NULL, NULL, &io, buf, sizeof(buf), &offset, NULL );
+        if (status || io.Information != 8 || memcmp( buf, "fdcache!", 8 )) break;
+    }
+    ok( status == STATUS_SUCCESS, "NtReadFile failed %#x\n", status );
+    ok( io.Information == 8, "got %lu bytes\n", io.Information );
+    ok( !memcmp( buf, "fdcache!", 8 ), "got wrong data %.8s\n", buf );
+    return 0;
+}
+
+static void fd_cache_flush_child( DWORD pid )
+{
+    HANDLE process, event, remote;
+    unsigned int i;
+    BOOL ret;
+
+    process = OpenProcess( PROCESS_DUP_HANDLE, FALSE, pid );
+    ok( process != NULL, "OpenProcess failed %u\n", GetLastError() );
+    event = CreateEventA( NULL, FALSE, FALSE, NULL );
+
+    /* each handle closed by another process flushes the fd cache of the parent */
+    for (i = 0; i < 2000; i++)
+    {
+        ret = DuplicateHandle( GetCurrentProcess(), event, process, &remote, 0, FALSE, DUPLICATE_SAME_ACCESS );
+        ok( ret, "DuplicateHandle failed %u\n", GetLastError() );
+        if (!ret) break;
+        ret = DuplicateHandle( process, remote, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE );
+        ok( ret, "DuplicateHandle failed %u\n", GetLastError() );
+    }
+    CloseHandle( event );
+    CloseHandle( process );
+}
+
+static void test_fd_cache_flush( char **argv )
+{
+    char path[MAX_PATH], buffer[MAX_PATH], cmdline[MAX_PATH * 2];
+    STARTUPINFOA si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    HANDLE threads[2];
+    DWORD written;
+    unsigned int i;
+    BOOL ret;
+
+    GetTempPathA( MAX_PATH, path );
+    GetTempFileNameA( path, "fdc", 0, buffer );
+    fd_cache_file = CreateFileA( buffer, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                 NULL, CREATE_ALWAYS, FILE_FLAG_DELETE_ON_CLOSE, 0 );
+    ok( fd_cache_file != INVALID_HANDLE_VALUE, "CreateFile failed %u\n", GetLastError() );
+    ret = WriteFile( fd_cache_file, "fdcache!", 8, &written, NULL );
+    ok( ret && written == 8, "WriteFile failed %u\n", GetLastError() );
+
+    fd_cache_done = 0;
+    for (i = 0; i < ARRAY_SIZE(threads); i++)
+        threads[i] = CreateThread( NULL, 0, fd_cache_read_thread, NULL, 0, NULL );
+
+    sprintf( cmdline, "%s %s fd_cache_flush %u", argv[0], argv[1], GetCurrentProcessId() );
+    ret = CreateProcessA( NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi );
+    ok( ret, "CreateProcess failed %u\n", GetLastError() );
+    if (ret)
+    {
+        winetest_wait_child_process( pi.hProcess );
+        CloseHandle( pi.hProcess );
+        CloseHandle( pi.hThread );
+    }
+
+    fd_cache_done = 1;
+    for (i = 0; i < ARRAY_SIZE(threads); i++)
+    {
+        WaitForSingleObject( threads[i], INFINITE );
+        CloseHandle( threads[i] );
+    }
+    CloseHandle( fd_cache_file );
+}
+
+static void uring_child(void)
+{
+    static char data[4][512];
+    char buf[512];
+    IO_STATUS_BLOCK io[4], iosb;
+    LARGE_INTEGER offset, timeout;
+    ULONG_PTR key, value;
+    HANDLE h, dup, port, event;
+    NTSTATUS status;
+    unsigned int i, seen = 0;
+
+    if (!(h = create_temp_file(FILE_FLAG_OVERLAPPED))) return;
+    event = CreateEventA(NULL, TRUE, FALSE, NULL);
+    for (i = 0; i < ARRAY_SIZE(data); i++) memset(data[i], 'a' + i, sizeof(data[i]));
+
+    offset.QuadPart = 0;
+    U(io[0]).Status = 0xdeadbeef;
+    status = pNtWriteFile(h, event, NULL, NULL, &io[0], data[0], sizeof(data[0]), &offset, NULL);
+    if (status != STATUS_PENDING)
+    {
+        ok(status == STATUS_SUCCESS, "NtWriteFile returned %#x\n", status);
+        skip("overlapped writes complete synchronously, io_uring is not available\n");
+        CloseHandle(event);
+        CloseHandle(h);
+        return;
+    }
+    ok(!WaitForSingleObject(event, 1000), "write didn't complete\n");
+    ok(U(io[0]).Status == STATUS_SUCCESS, "got status %#x\n", U(io[0]).Status);
+    ok(io[0].Information == sizeof(data[0]), "got %lu bytes\n", io[0].Information);
+
+    /* the port is associated through a duplicate, the I/O goes through the original handle */
+    DuplicateHandle(GetCurrentProcess(), h, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS);
+    port = CreateIoCompletionPort(dup, NULL, 0xdeadbeef, 0);
+    ok(port != NULL, "CreateIoCompletionPort failed, error %u\n", GetLastError());
+
+    for (i = 1; i < ARRAY_SIZE(data); i++)
+    {
+        offset.QuadPart = i * sizeof(data[i]);
+        status = pNtWriteFile(h, NULL, NULL, (void *)(ULONG_PTR)i, &io[i], data[i], sizeof(data[i]),
+                              &offset, NULL);
+        ok(status == STATUS_PENDING || status == STATUS_SUCCESS, "NtWriteFile returned %#x\n", status);
+    }
+
+    timeout.QuadPart = -10000000;
+    for (i = 1; i < ARRAY_SIZE(data); i++)
+    {
+        status = pNtRemoveIoCompletion(port, &key, &value, &iosb, &timeout);
+        ok(status == STATUS_SUCCESS, "NtRemoveIoCompletion returned %#x\n", status);
+        if (status) break;
+        ok(key == 0xdeadbeef, "got key %#lx\n", key);
+        ok(value && value < ARRAY_SIZE(data), "got value %#lx\n", value);
+        ok(U(iosb).Status == STATUS_SUCCESS, "got status %#x\n", U(iosb).Status);
+        ok(iosb.Information == sizeof(data[0]), "got %lu bytes\n", iosb.Information);
+        if (value && value < ARRAY_SIZE(data)) seen |= 1 << value;
+    }
+    ok(seen == 0xe, "got completions %#x\n", seen);
+
+    for (i = 0; i < ARRAY_SIZE(data); i++)
+    {
+        offset.QuadPart = i * sizeof(data[i]);
+        memset(buf, 0, sizeof(buf));
+        status = pNtReadFile(dup, NULL, NULL, (void *)(ULONG_PTR)(i + 1), &io[i], buf, sizeof(buf),
+                             &offset, NULL);
+        ok(status == STATUS_PENDING || status == STATUS_SUCCESS, "NtReadFile returned %#x\n", status);
+        status = pNtRemoveIoCompletion(port, &key, &value, &iosb, &timeout);
+        ok(status == STATUS_SUCCESS, "NtRemoveIoCompletion returned %#x\n", status);
+        ok(value == i + 1, "got value %#lx\n", value);
+        ok(iosb.Information == sizeof(buf), "got %lu bytes\n", iosb.Information);
+        ok(!memcmp(buf, data[i], sizeof(buf)), "got wrong data in block %u\n", i);
+    }
+
+    /* the reads are complete, there is nothing to cancel */
+    status = pNtCancelIoFileEx(h, &io[0], &iosb);
+    ok(status == STATUS_NOT_FOUND, "NtCancelIoFileEx returned %#x\n", status);
+
+    CloseHandle(port);
+    CloseHandle(dup);
+    CloseHandle(event);
+    CloseHandle(h);
+}
+
+static void test_uring( char **argv )
+{
+    char cmdline[MAX_PATH * 2];
+    STARTUPINFOA si = { sizeof(si) };
+    PROCESS_INFORMATION pi;
+    BOOL ret;
+
+    /* the child queues its overlapped file I/O to an io_uring if it can */
+    SetEnvironmentVariableA( "WINEIOURING", "1" );
+    sprintf( cmdline, "%s %s uring", argv[0], argv[1] );
+    ret = CreateProcessA( NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi );
+    ok( ret, "CreateProcess failed %u\n", GetLastError() );
+    SetEnvironmentVariableA( "WINEIOURING", NULL );
+    if (!ret) return;
+    winetest_wait_child_process( pi.hProcess );
+    CloseHandle( pi.hProcess );
+    CloseHandle( pi.hThread );
+}
+
 START_TEST(file)
 {
     HMODULE hkernel32 = GetModuleHandleA("kernel32.dll");
     HMODULE hntdll = GetModuleHandleA("ntdll.dll");
+    char **argv;
+    int argc;
+
     if (!hntdll)
     {
         skip("not running on NT, skipping test\n");
@@ -4803,6 +5119,18 @@ START_TEST(file)
     pNtQueryFullAttributesFile = (void *)GetProcAddress(hntdll, "NtQueryFullAttributesFile");
     pNtFlushBuffersFile = (void *)GetProcAddress(hntdll, "NtFlushBuffersFile");
 
+    argc = winetest_get_mainargs( &argv );
+    if (argc >= 4 && !strcmp( argv[2], "fd_cache_flush" ))
+    {
+        fd_cache_flush_child( strtoul( argv[3], NULL, 10 ) );
+        return;
+    }
+    if (argc >= 3 && !strcmp( argv[2], "uring" ))
+    {
+        uring_child();
+        return;
+    }
+
     test_read_write();
     test_NtCreateFile();
     create_file_test();
@@ -4823,6 +5151,7 @@ START_TEST(file)
     test_file_link_information();
     test_file_disposition_information();
     test_file_completion_information();
+    test_file_completion_duplicate();
     test_file_id_information();
     test_file_access_information();
     test_file_mode();
@@ -4830,4 +5159,6 @@ START_TEST(file)
     test_query_attribute_information_file();
     test_ioctl();
     test_flush_buffers_file();
+    test_fd_cache_flush( argv );
+    test_uring( argv );
 }
@@ -0,0 +1,211 @@
+/*
+ * Unit test suite for ntdll heap functions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include <stdio.h>
+
+#include "ntdll_test.h"
+
+static NTSTATUS (WINAPI *pRtlQueryHeapInformation)(HANDLE, HEAP_INFORMATION_CLASS, void *, SIZE_T, SIZE_T *);
+static USHORT   (WINAPI *pRtlCaptureStackBackTrace)(ULONG, ULONG, void **, ULONG *);
+static char *   (CDECL *pwine_get_unix_file_name)(const WCHAR *);
+
+#define STATS_SIZE FIELD_OFFSET(HEAP_WINE_STATISTICS, Stacks[16])
+
+static BOOL is_main_module_address(void *addr)
+{
+    HMODULE module;
+
+    if (!GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+                            addr, &module))
+        return FALSE;
+    return module == GetModuleHandleA(NULL);
+}
+
+static void test_RtlCaptureStackBackTrace(void)
+{
+    void *frames[8], *frames2[8];
+    ULONG hash, hash2, sum;
+    USHORT count, count2, i;
+
+    if (!pRtlCaptureStackBackTrace)
+    {
+        win_skip("RtlCaptureStackBackTrace is not available\n");
+        return;
+    }
+
+    hash = 0xdeadbeef;
+    count = pRtlCaptureStackBackTrace(0, ARRAY_SIZE(frames), frames, &hash);
+    ok(count > 0, "got no frames\n");
+    for (i = 0, sum = 0; i < count; i++) sum += (ULONG_PTR)frames[i];
+    ok(hash == sum, "got hash %#x, expected %#x\n", hash, sum);
+    ok(is_main_module_address(frames[0]), "first frame %p is not in the test module\n", frames[0]);
+
+    hash2 = 0xdeadbeef;
+    count2 = pRtlCaptureStackBackTrace(1, ARRAY_SIZE(frames2), frames2, &hash2);
+    ok(count2 == count - 1 || (count == ARRAY_SIZE(frames) && count2 == count),
+       "got %u frames, expected %u\n", count2, count - 1);
+    ok(count2 > 0 && frames2[0] == frames[1], "got %p, expected %p\n", frames2[0], frames[1]);
+    ok(hash2 != hash, "skipping a frame did not change the hash %#x\n", hash);
+
+    count2 = pRtlCaptureStackBackTrace(0, ARRAY_SIZE(frames2), frames2, NULL);
+    ok(count2 == count, "got %u frames, expected %u\n", count2, count);
+}
+
+static void heap_stats_child(void)
+{
+    static const unsigned int count = 256, size = 0x1000;
+    HEAP_WINE_STATISTICS *before, *after;
+    void *ptrs[256], *ptr;
+    unsigned int i;
+    NTSTATUS status;
+    HANDLE heap;
+    BOOL found;
+
+    before = HeapAlloc(GetProcessHeap(), 0, STATS_SIZE);
+    after = HeapAlloc(GetProcessHeap(), 0, STATS_SIZE);
+    heap = HeapCreate(0, 0, 0);
+    ok(heap != NULL, "HeapCreate failed\n");
+
+    status = pRtlQueryHeapInformation(heap, HeapWineStatistics, before, STATS_SIZE, NULL);
+    ok(!status, "RtlQueryHeapInformation failed %x\n", status);
+    ok(before->Flags & HEAP_WINE_STATS_ENABLED, "statistics not enabled, flags %x\n", before->Flags);
+    ok(before->SampleInterval > 0, "got sample interval %u\n", before->SampleInterval);
+
+    for (i = 0; i < count; i++)
+    {
+        ptrs[i] = HeapAlloc(heap, 0, size);
+        ok(ptrs[i] != NULL, "HeapAlloc %u failed\n", i);
+    }
+    ptr = HeapReAlloc(heap, HEAP_REALLOC_IN_PLACE_ONLY, ptrs[0], size / 2);
+    ok(ptr == ptrs[0], "HeapReAlloc moved the block\n");
+    for (i = 1; i < count; i += 2) HeapFree(heap, 0, ptrs[i]);
+
+    status = pRtlQueryHeapInformation(heap, HeapWineStatistics, after, STATS_SIZE, NULL);
+    ok(!status, "RtlQueryHeapInformation failed %x\n", status);
+    ok(after->AllocCount - before->AllocCount == count, "got %s allocations, expected %u\n",
+       wine_dbgstr_longlong(after->AllocCount - before->AllocCount), count);
+    ok(after->FreeCount - before->FreeCount == count / 2, "got %s frees, expected %u\n",
+       wine_dbgstr_longlong(after->FreeCount - before->FreeCount), count / 2);
+    ok(after->ReAllocCount - before->ReAllocCount == 1, "got %s reallocations\n",
+       wine_dbgstr_longlong(after->ReAllocCount - before->ReAllocCount));
+    ok(after->BytesInUse - before->BytesInUse == count / 2 * size - size / 2, "got %s bytes in use, expected %u\n",
+       wine_dbgstr_longlong(after->BytesInUse - before->BytesInUse), count / 2 * size - size / 2);
+    ok(after->PeakBytesInUse >= before->BytesInUse + count * size, "got peak %s\n",
+       wine_dbgstr_longlong(after->PeakBytesInUse));
+
+    /* more than a sample interval was allocated, so some stacks point into this function */
+    ok(after->StackCount > 0, "got no sampled stacks\n");
+    ok(after->StackCount <= after->TotalStackCount, "got %u stacks out of %u\n",
+       after->StackCount, after->TotalStackCount);
+    for (i = 0, found = FALSE; i < after->StackCount && !found; i++)
+    {
+        unsigned int j;
+
+        ok(after->Stacks[i].Depth > 0 && after->Stacks[i].Depth <= HEAP_WINE_STACK_DEPTH,
+           "stack %u: got depth %u\n", i, after->Stacks[i].Depth);
+        ok(after->Stacks[i].Count > 0, "stack %u: got no samples\n", i);
+        for (j = 0; j < after->Stacks[i].Depth && !found; j++)
+            found = is_main_module_address(after->Stacks[i].Frames[j]);
+    }
+    ok(found, "no sampled stack in the test module\n");
+
+    HeapDestroy(heap);
+    HeapFree(GetProcessHeap(), 0, before);
+    HeapFree(GetProcessHeap(), 0, after);
+}
+
+static void test_heap_stats(char **argv)
+{
+    static const char expect[] = "heap statistics for process";
+    static const WCHAR prefixW[] = {'h','s','t',0};
+    char buffer[sizeof(expect)], cmdline[MAX_PATH];
+    WCHAR path[MAX_PATH];
+    HEAP_WINE_STATISTICS *stats;
+    PROCESS_INFORMATION pi;
+    STARTUPINFOA si = { sizeof(si) };
+    char *unix_name;
+    NTSTATUS status;
+    DWORD len;
+    HANDLE file;
+    BOOL ret;
+
+    stats = HeapAlloc(GetProcessHeap(), 0, STATS_SIZE);
+    status = pRtlQueryHeapInformation(GetProcessHeap(), HeapWineStatistics, stats, STATS_SIZE, NULL);
+    HeapFree(GetProcessHeap(), 0, stats);
+    if (status)
+    {
+        win_skip("HeapWineStatistics not supported\n");
+        return;
+    }
+    if (!pwine_get_unix_file_name)
+    {
+        skip("wine_get_unix_file_name is not available\n");
+        return;
+    }
+
+    GetTempPathW(MAX_PATH, path);
+    GetTempFileNameW(path, prefixW, 0, path);
+    unix_name = pwine_get_unix_file_name(path);
+    ok(unix_name != NULL, "no unix name for %s\n", wine_dbgstr_w(path));
+    if (!unix_name) return;
+
+    SetEnvironmentVariableA("WINEHEAPSTATS", unix_name);
+    HeapFree(GetProcessHeap(), 0, unix_name);
+    sprintf(cmdline, "%s %s stats", argv[0], argv[1]);
+    ret = CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
+    ok(ret, "CreateProcess failed, last error %u.\n", GetLastError());
+    SetEnvironmentVariableA("WINEHEAPSTATS", NULL);
+    if (ret)
+    {
+        winetest_wait_child_process(pi.hProcess);
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+
+        /* the statistics are written on process exit */
+        file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+        ok(file != INVALID_HANDLE_VALUE, "CreateFile failed, last error %u.\n", GetLastError());
+        ret = ReadFile(file, buffer, sizeof(buffer) - 1, &len, NULL);
+        ok(ret, "ReadFile failed, last error %u.\n", GetLastError());
+        buffer[len] = 0;
+        ok(!strcmp(buffer, expect), "got %s\n", buffer);
+        CloseHandle(file);
+    }
+    DeleteFileW(path);
+}
+
+START_TEST(heap)
+{
+    HMODULE hntdll = GetModuleHandleA("ntdll.dll");
+    char **argv;
+    int argc;
+
+    pRtlQueryHeapInformation = (void *)GetProcAddress(hntdll, "RtlQueryHeapInformation");
+    pRtlCaptureStackBackTrace = (void *)GetProcAddress(hntdll, "RtlCaptureStackBackTrace");
+    pwine_get_unix_file_name = (void *)GetProcAddress(GetModuleHandleA("kernel32.dll"), "wine_get_unix_file_name");
+
+    argc = winetest_get_mainargs(&argv);
+    if (argc >= 3 && !strcmp(argv[2], "stats"))
+    {
+        heap_stats_child();
+        return;
+    }
+
+    test_RtlCaptureStackBackTrace();
+    if (pRtlQueryHeapInformation) test_heap_stats(argv);
+    else win_skip("RtlQueryHeapInformation is not available\n");
+}
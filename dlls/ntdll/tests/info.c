@@ -2255,6 +2255,61 @@ static void test_query_data_alignment(void)
     ok(value == 64, "Expected 64, got %u\n", value);
 }
 
+static void request_latency_child(const char *transport)
+{
+    LARGE_INTEGER freq, start, end;
+    THREAD_BASIC_INFORMATION tbi;
+    NTSTATUS status;
+    int i, count = 20000;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < count; i++)
+    {
+        status = pNtQueryInformationThread(GetCurrentThread(), ThreadBasicInformation, &tbi, sizeof(tbi), NULL);
+        if (status || HandleToULong(tbi.ClientId.UniqueThread) != GetCurrentThreadId()) break;
+    }
+    QueryPerformanceCounter(&end);
+    ok(status == STATUS_SUCCESS, "NtQueryInformationThread failed %08x\n", status);
+    ok(i == count, "request %d returned thread %p\n", i, tbi.ClientId.UniqueThread);
+    trace("%s transport: %.0f ns per request\n", transport,
+          (double)(end.QuadPart - start.QuadPart) * 1e9 / freq.QuadPart / count);
+}
+
+/* null request latency through the request pipe and through the shared memory,
+ * with and without server polling */
+static void test_request_latency(char **argv)
+{
+    static const struct
+    {
+        const char *name;
+        const char *env;
+    } transports[] =
+    {
+        { "pipe", "0" },
+        { "shm", "1" },
+        { "shm-polling", "2" },
+    };
+    PROCESS_INFORMATION pi;
+    STARTUPINFOA si = { sizeof(si) };
+    char cmdline[MAX_PATH];
+    unsigned int i;
+    BOOL ret;
+
+    for (i = 0; i < ARRAY_SIZE(transports); i++)
+    {
+        SetEnvironmentVariableA("WINESHMREQUESTS", transports[i].env);
+        sprintf(cmdline, "%s %s latency %s", argv[0], argv[1], transports[i].name);
+        ret = CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
+        ok(ret, "CreateProcess failed, last error %#x.\n", GetLastError());
+        if (!ret) continue;
+        winetest_wait_child_process(pi.hProcess);
+        CloseHandle(pi.hProcess);
+        CloseHandle(pi.hThread);
+    }
+    SetEnvironmentVariableA("WINESHMREQUESTS", NULL);
+}
+
 START_TEST(info)
 {
     char **argv;
@@ -2264,6 +2319,11 @@ START_TEST(info)
         return;
 
     argc = winetest_get_mainargs(&argv);
+    if (argc >= 4 && !strcmp(argv[2], "latency"))
+    {
+        request_latency_child(argv[3]);
+        return;
+    }
     if (argc >= 3) return; /* Child */
 
     /* NtQuerySystemInformation */
@@ -2398,4 +2458,7 @@ START_TEST(info)
 
     trace("Starting test_query_data_alignment()\n");
     test_query_data_alignment();
+
+    trace("Starting test_request_latency()\n");
+    test_request_latency(argv);
 }
@@ -74,6 +74,7 @@ static NTSTATUS (WINAPI *pNtQuerySystemTime)( LARGE_INTEGER * );
 static NTSTATUS (WINAPI *pRtlWaitOnAddress)( const void *, const void *, SIZE_T, const LARGE_INTEGER * );
 static void     (WINAPI *pRtlWakeAddressAll)( const void * );
 static void     (WINAPI *pRtlWakeAddressSingle)( const void * );
+static NTSTATUS (WINAPI *pNtQueryInformationProcess)( HANDLE, PROCESSINFOCLASS, void *, ULONG, ULONG * );
 
 #define KEYEDEVENT_WAIT       0x0001
 #define KEYEDEVENT_WAKE       0x0002
@@ -2113,6 +2114,78 @@ static void test_wait_on_address(void)
     ok(address == 0, "got %s\n", wine_dbgstr_longlong(address));
 }
 
+static void test_handle_table_usage(void)
+{
+    static const unsigned int count = 20000;
+    PROCESS_WINE_HANDLE_TABLE_INFORMATION before, opened, closed;
+    LARGE_INTEGER freq, start, end;
+    HANDLE event, *handles;
+    unsigned int i;
+    NTSTATUS status;
+    BOOL ret = TRUE;
+
+    status = pNtQueryInformationProcess(GetCurrentProcess(), ProcessWineHandleTableInformation,
+                                        &before, sizeof(before), NULL);
+    if (status == STATUS_INVALID_INFO_CLASS)
+    {
+        win_skip("ProcessWineHandleTableInformation not supported\n");
+        return;
+    }
+    ok(!status, "NtQueryInformationProcess failed %x\n", status);
+
+    handles = HeapAlloc(GetProcessHeap(), 0, count * sizeof(*handles));
+    event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    ok(event != NULL, "CreateEvent failed, last error %u.\n", GetLastError());
+    status = pNtQueryInformationProcess(GetCurrentProcess(), ProcessWineHandleTableInformation,
+                                        &before, sizeof(before), NULL);
+    ok(!status, "NtQueryInformationProcess failed %x\n", status);
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    for (i = 0; i < count && ret; i++)
+        ret = DuplicateHandle(GetCurrentProcess(), event, GetCurrentProcess(), &handles[i], 0, FALSE, DUPLICATE_SAME_ACCESS);
+    ok(ret, "DuplicateHandle %u failed, last error %u.\n", i, GetLastError());
+    QueryPerformanceCounter(&end);
+
+    status = pNtQueryInformationProcess(GetCurrentProcess(), ProcessWineHandleTableInformation,
+                                        &opened, sizeof(opened), NULL);
+    ok(!status, "NtQueryInformationProcess failed %x\n", status);
+    ok(opened.HandleCount == before.HandleCount + count, "got %u handles, expected %u\n",
+       opened.HandleCount, before.HandleCount + count);
+    ok(opened.TableEntries >= opened.HandleCount, "got %u entries for %u handles\n",
+       opened.TableEntries, opened.HandleCount);
+    ok(opened.TableSize > before.TableSize, "table size did not grow: %s -> %s\n",
+       wine_dbgstr_longlong(before.TableSize), wine_dbgstr_longlong(opened.TableSize));
+    trace("opened %u handles in %.3f s, server table %u entries, %u KiB\n", count,
+          (double)(end.QuadPart - start.QuadPart) / freq.QuadPart,
+          opened.TableEntries, (ULONG)(opened.TableSize / 1024));
+
+    /* freed slots are reused before the table grows again */
+    for (i = 0; i < count; i += 2) CloseHandle(handles[i]);
+    for (i = 0; i < count && ret; i += 2)
+        ret = DuplicateHandle(GetCurrentProcess(), event, GetCurrentProcess(), &handles[i], 0, FALSE, DUPLICATE_SAME_ACCESS);
+    ok(ret, "DuplicateHandle %u failed, last error %u.\n", i, GetLastError());
+    status = pNtQueryInformationProcess(GetCurrentProcess(), ProcessWineHandleTableInformation,
+                                        &closed, sizeof(closed), NULL);
+    ok(!status, "NtQueryInformationProcess failed %x\n", status);
+    ok(closed.HandleCount == opened.HandleCount, "got %u handles, expected %u\n",
+       closed.HandleCount, opened.HandleCount);
+    ok(closed.TableEntries == opened.TableEntries, "table grew from %u to %u entries\n",
+       opened.TableEntries, closed.TableEntries);
+
+    for (i = 0; i < count; i++) CloseHandle(handles[i]);
+    status = pNtQueryInformationProcess(GetCurrentProcess(), ProcessWineHandleTableInformation,
+                                        &closed, sizeof(closed), NULL);
+    ok(!status, "NtQueryInformationProcess failed %x\n", status);
+    ok(closed.HandleCount == before.HandleCount, "got %u handles, expected %u\n",
+       closed.HandleCount, before.HandleCount);
+    trace("server table %u entries, %u KiB after closing\n",
+          closed.TableEntries, (ULONG)(closed.TableSize / 1024));
+
+    CloseHandle(event);
+    HeapFree(GetProcessHeap(), 0, handles);
+}
+
 START_TEST(om)
 {
     HMODULE hntdll = GetModuleHandleA("ntdll.dll");
@@ -2170,6 +2243,7 @@ START_TEST(om)
     pRtlWaitOnAddress       =  (void *)GetProcAddress(hntdll, "RtlWaitOnAddress");
     pRtlWakeAddressAll      =  (void *)GetProcAddress(hntdll, "RtlWakeAddressAll");
     pRtlWakeAddressSingle   =  (void *)GetProcAddress(hntdll, "RtlWakeAddressSingle");
+    pNtQueryInformationProcess = (void *)GetProcAddress(hntdll, "NtQueryInformationProcess");
 
     test_case_sensitive();
     test_namespace_pipe();
@@ -2184,4 +2258,5 @@ START_TEST(om)
     test_keyed_events();
     test_null_device();
     test_wait_on_address();
+    test_handle_table_usage();
 }
@@ -231,6 +231,7 @@ void thread_init(void)
     thread_data->reply_fd   = -1;
     thread_data->wait_fd[0] = -1;
     thread_data->wait_fd[1] = -1;
+    thread_data->shm_doorbell = -1;
     thread_data->debug_info = &debug_info;
 
     signal_init_thread( teb );
@@ -286,6 +287,7 @@ static void free_thread_data( TEB *teb )
         size = 0;
         NtFreeVirtualMemory( GetCurrentProcess(), &thread_data->start_stack, &size, MEM_RELEASE );
     }
+    server_free_request_shm( teb );
     signal_free_thread( teb );
 }
 
@@ -306,6 +308,7 @@ void abort_thread( int status )
  */
 void exit_thread( int status )
 {
+    server_free_request_shm( NtCurrentTeb() );
     close( ntdll_get_thread_data()->wait_fd[0] );
     close( ntdll_get_thread_data()->wait_fd[1] );
     close( ntdll_get_thread_data()->reply_fd );
@@ -342,6 +345,7 @@ void WINAPI RtlExitUserThread( ULONG status )
 
     LdrShutdownThread();
     RtlFreeThreadActivationContextStack();
+    heap_thread_detach();
 
     pthread_sigmask( SIG_BLOCK, &server_block_set, NULL );
 
@@ -521,6 +525,7 @@ NTSTATUS WINAPI RtlCreateUserThread( HANDLE process, SECURITY_DESCRIPTOR *descr,
     thread_data->reply_fd    = -1;
     thread_data->wait_fd[0]  = -1;
     thread_data->wait_fd[1]  = -1;
+    thread_data->shm_doorbell = -1;
     thread_data->start_stack = (char *)teb->Tib.StackBase;
 
     pthread_attr_init( &attr );
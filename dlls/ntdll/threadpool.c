@@ -114,8 +114,22 @@ struct timer_queue
  */
 
 #define THREADPOOL_WORKER_TIMEOUT 5000
+#define THREADPOOL_GATE_INTERVAL  10
+#define THREADPOOL_RUNQ_SIZE      256
+#define THREADPOOL_RUNQ_BATCH     32
+#define THREADPOOL_MAX_RUNQS      64
 #define MAXIMUM_WAITQUEUE_OBJECTS (MAXIMUM_WAIT_OBJECTS - 1)
 
+/* queue of objects owned by a worker thread, filled only by its owner,
+ * but other workers are allowed to steal from the head */
+struct threadpool_runq
+{
+    BOOL                    in_use;
+    LONG                    head;
+    LONG                    tail;
+    struct threadpool_object *items[THREADPOOL_RUNQ_SIZE];
+};
+
 /* internal threadpool representation */
 struct threadpool
 {
@@ -123,14 +137,33 @@ struct threadpool
     LONG                    objcount;
     BOOL                    shutdown;
     CRITICAL_SECTION        cs;
-    /* pool of work items, locked via .cs */
+    /* global queue of work items, locked via .cs */
     struct list             pool;
-    RTL_CONDITION_VARIABLE  update_event;
+    int                     num_global;
+    /* work items submitted from non-worker threads, pushed without locking */
+    struct threadpool_object *injected;
+    /* per-worker queues, only freed when the pool is destroyed */
+    struct threadpool_runq  *runqs[THREADPOOL_MAX_RUNQS];
+    LONG                    num_runqs;
+    /* statistics used for scheduling, updated with interlocked functions */
+    LONG                    num_queued;
+    LONG                    num_completed;
+    LONG                    num_idle_workers;
+    LONG                    wake_seq;
+    LONG                    gate_running;
     /* information about worker threads, locked via .cs */
     int                     max_workers;
     int                     min_workers;
     int                     num_workers;
-    int                     num_busy_workers;
+};
+
+/* internal state of a worker thread */
+struct threadpool_worker
+{
+    struct threadpool       *pool;
+    struct threadpool_runq  *runq;
+    unsigned int            steal_index;
+    unsigned int            ticks;
 };
 
 enum threadpool_objtype
@@ -158,13 +191,17 @@ struct threadpool_object
     /* information about the group, locked via .group->cs */
     struct list             group_entry;
     BOOL                    is_group_member;
+    /* information about the pool, updated with interlocked functions */
+    LONG                    queued;
+    struct threadpool_object *next_injected;
+    LONG                    num_pending_callbacks;
+    LONG                    num_running_callbacks;
+    LONG                    num_associated_callbacks;
+    LONG                    num_waiters;
     /* information about the pool, locked via .pool->cs */
     struct list             pool_entry;
     RTL_CONDITION_VARIABLE  finished_event;
     RTL_CONDITION_VARIABLE  group_finished_event;
-    LONG                    num_pending_callbacks;
-    LONG                    num_running_callbacks;
-    LONG                    num_associated_callbacks;
     /* arguments for callback */
     union
     {
@@ -326,6 +363,7 @@ static inline struct threadpool_instance *impl_from_TP_CALLBACK_INSTANCE( TP_CAL
 }
 
 static void CALLBACK threadpool_worker_proc( void *param );
+static void CALLBACK threadpool_gate_proc( void *param );
 static void tp_object_submit( struct threadpool_object *object, BOOL signaled );
 static void tp_object_prepare_shutdown( struct threadpool_object *object );
 static BOOL tp_object_release( struct threadpool_object *object );
@@ -1311,7 +1349,6 @@ static NTSTATUS tp_new_worker_thread( struct threadpool *pool )
     {
         interlocked_inc( &pool->refcount );
         pool->num_workers++;
-        pool->num_busy_workers++;
         NtClose( thread );
     }
     return status;
@@ -1661,12 +1698,20 @@ static NTSTATUS tp_threadpool_alloc( struct threadpool **out )
     pool->cs.DebugInfo->Spare[0] = (DWORD_PTR)(__FILE__ ": threadpool.cs");
 
     list_init( &pool->pool );
-    RtlInitializeConditionVariable( &pool->update_event );
+    pool->num_global            = 0;
+    pool->injected              = NULL;
+    memset( pool->runqs, 0, sizeof(pool->runqs) );
+    pool->num_runqs             = 0;
+
+    pool->num_queued            = 0;
+    pool->num_completed         = 0;
+    pool->num_idle_workers      = 0;
+    pool->wake_seq              = 0;
+    pool->gate_running          = FALSE;
 
     pool->max_workers           = 500;
     pool->min_workers           = 0;
     pool->num_workers           = 0;
-    pool->num_busy_workers      = 0;
 
     TRACE( "allocated threadpool %p\n", pool );
 
@@ -1686,7 +1731,8 @@ static void tp_threadpool_shutdown( struct threadpool *pool )
     assert( pool != default_threadpool );
 
     pool->shutdown = TRUE;
-    RtlWakeAllConditionVariable( &pool->update_event );
+    interlocked_inc( &pool->wake_seq );
+    RtlWakeAddressAll( &pool->wake_seq );
 }
 
 /***********************************************************************
@@ -1696,6 +1742,8 @@ static void tp_threadpool_shutdown( struct threadpool *pool )
  */
 static BOOL tp_threadpool_release( struct threadpool *pool )
 {
+    LONG i;
+
     if (interlocked_dec( &pool->refcount ))
         return FALSE;
 
@@ -1704,6 +1752,14 @@ static BOOL tp_threadpool_release( struct threadpool *pool )
     assert( pool->shutdown );
     assert( !pool->objcount );
     assert( list_empty( &pool->pool ) );
+    assert( !pool->injected );
+
+    for (i = 0; i < pool->num_runqs; i++)
+    {
+        assert( !pool->runqs[i]->in_use );
+        assert( pool->runqs[i]->head == pool->runqs[i]->tail );
+        RtlFreeHeap( GetProcessHeap(), 0, pool->runqs[i] );
+    }
 
     pool->cs.DebugInfo->Spare[0] = 0;
     RtlDeleteCriticalSection( &pool->cs );
@@ -1864,12 +1920,15 @@ static void tp_object_initialize( struct threadpool_object *object, struct threa
     memset( &object->group_entry, 0, sizeof(object->group_entry) );
     object->is_group_member         = FALSE;
 
-    memset( &object->pool_entry, 0, sizeof(object->pool_entry) );
-    RtlInitializeConditionVariable( &object->finished_event );
-    RtlInitializeConditionVariable( &object->group_finished_event );
+    object->queued                  = FALSE;
+    object->next_injected           = NULL;
     object->num_pending_callbacks   = 0;
     object->num_running_callbacks   = 0;
     object->num_associated_callbacks = 0;
+    object->num_waiters             = 0;
+    memset( &object->pool_entry, 0, sizeof(object->pool_entry) );
+    RtlInitializeConditionVariable( &object->finished_event );
+    RtlInitializeConditionVariable( &object->group_finished_event );
 
     if (environment)
     {
@@ -1916,6 +1975,281 @@ static void tp_object_initialize( struct threadpool_object *object, struct threa
         tp_object_release( object );
 }
 
+/***********************************************************************
+ *           tp_runq_push    (internal)
+ *
+ * Appends an object to the queue of a worker thread. Only the owner of
+ * the queue is allowed to call this function.
+ */
+static BOOL tp_runq_push( struct threadpool_runq *runq, struct threadpool_object *object )
+{
+    ULONG tail = runq->tail;
+
+    if (tail - *(volatile LONG *)&runq->head >= THREADPOOL_RUNQ_SIZE)
+        return FALSE;
+
+    runq->items[tail % THREADPOOL_RUNQ_SIZE] = object;
+    interlocked_xchg( &runq->tail, tail + 1 );
+    return TRUE;
+}
+
+/***********************************************************************
+ *           tp_runq_pop    (internal)
+ *
+ * Removes the oldest object from the queue of a worker thread. This
+ * function can be called from any thread.
+ */
+static struct threadpool_object *tp_runq_pop( struct threadpool_runq *runq )
+{
+    struct threadpool_object *object;
+    ULONG head;
+
+    for (;;)
+    {
+        head = *(volatile LONG *)&runq->head;
+        if (head == *(volatile LONG *)&runq->tail)
+            return NULL;
+
+        /* The slot can only be reused after the head was advanced,
+         * so the object is valid if the exchange succeeds. */
+        object = ((struct threadpool_object * volatile *)runq->items)[head % THREADPOOL_RUNQ_SIZE];
+        if (interlocked_cmpxchg( &runq->head, head + 1, head ) == head)
+            return object;
+    }
+}
+
+/***********************************************************************
+ *           tp_threadpool_flush_injected    (internal)
+ *
+ * Moves all objects submitted by non-worker threads to the global queue,
+ * preserving the submission order. Has to be called with .cs held.
+ */
+static void tp_threadpool_flush_injected( struct threadpool *pool )
+{
+    struct threadpool_object *object, *next, *prev = NULL;
+
+    object = interlocked_xchg_ptr( (void **)&pool->injected, NULL );
+    while (object)
+    {
+        next = object->next_injected;
+        object->next_injected = prev;
+        prev = object;
+        object = next;
+    }
+
+    for (object = prev; object; object = object->next_injected)
+    {
+        list_add_tail( &pool->pool, &object->pool_entry );
+        pool->num_global++;
+    }
+}
+
+/***********************************************************************
+ *           tp_threadpool_get_global    (internal)
+ *
+ * Retrieves the next object from the global queue, and moves a fair share
+ * of the remaining ones to the local queue of the worker thread.
+ */
+static struct threadpool_object *tp_threadpool_get_global( struct threadpool *pool,
+                                                          struct threadpool_worker *worker )
+{
+    struct threadpool_object *object = NULL, *next;
+    struct list *ptr;
+    int batch;
+
+    if (!*(struct threadpool_object * volatile *)&pool->injected &&
+        !*(int volatile *)&pool->num_global)
+        return NULL;
+
+    RtlEnterCriticalSection( &pool->cs );
+    tp_threadpool_flush_injected( pool );
+    if ((ptr = list_head( &pool->pool )))
+    {
+        object = LIST_ENTRY( ptr, struct threadpool_object, pool_entry );
+        list_remove( &object->pool_entry );
+        pool->num_global--;
+
+        batch = min( pool->num_global / max( pool->num_workers, 1 ), THREADPOOL_RUNQ_BATCH );
+        while (worker->runq && batch-- > 0 && (ptr = list_head( &pool->pool )))
+        {
+            next = LIST_ENTRY( ptr, struct threadpool_object, pool_entry );
+            if (!tp_runq_push( worker->runq, next )) break;
+            list_remove( &next->pool_entry );
+            pool->num_global--;
+        }
+    }
+    RtlLeaveCriticalSection( &pool->cs );
+    return object;
+}
+
+/***********************************************************************
+ *           tp_threadpool_get_object    (internal)
+ *
+ * Retrieves the next queued object for a worker thread. The local queue
+ * is checked first, then the global queue, and if both are empty an
+ * object is stolen from one of the other workers.
+ */
+static struct threadpool_object *tp_threadpool_get_object( struct threadpool *pool,
+                                                          struct threadpool_worker *worker )
+{
+    struct threadpool_object *object;
+    struct threadpool_runq *runq;
+    LONG i, count;
+
+    /* Objects with further pending callbacks are queued again locally, prefer
+     * the global queue every second time, so they can't starve other objects. */
+    if ((worker->ticks++ & 1) && (object = tp_threadpool_get_global( pool, worker )))
+        goto found;
+    if (worker->runq && (object = tp_runq_pop( worker->runq )))
+        goto found;
+    if ((object = tp_threadpool_get_global( pool, worker )))
+        goto found;
+
+    count = *(volatile LONG *)&pool->num_runqs;
+    for (i = 0; i < count; i++)
+    {
+        runq = pool->runqs[(worker->steal_index + i) % count];
+        if (runq == worker->runq) continue;
+        if ((object = tp_runq_pop( runq )))
+        {
+            worker->steal_index += i;
+            goto found;
+        }
+    }
+    return NULL;
+
+found:
+    /* Wake up another idle worker if more work is waiting. */
+    if (interlocked_dec( &pool->num_queued ) && pool->num_idle_workers)
+    {
+        interlocked_inc( &pool->wake_seq );
+        RtlWakeAddressSingle( &pool->wake_seq );
+    }
+    return object;
+}
+
+/***********************************************************************
+ *           tp_threadpool_start_gate    (internal)
+ *
+ * Starts the gate thread of a pool, which injects new worker threads when
+ * the existing ones appear to be blocked.
+ */
+static void tp_threadpool_start_gate( struct threadpool *pool )
+{
+    HANDLE thread;
+
+    if (interlocked_cmpxchg( &pool->gate_running, TRUE, FALSE ))
+        return;
+
+    interlocked_inc( &pool->refcount );
+    if (RtlCreateUserThread( GetCurrentProcess(), NULL, FALSE, NULL, 0, 0,
+                             threadpool_gate_proc, pool, &thread, NULL ) == STATUS_SUCCESS)
+    {
+        NtClose( thread );
+        return;
+    }
+
+    interlocked_xchg( &pool->gate_running, FALSE );
+    tp_threadpool_release( pool );
+}
+
+/***********************************************************************
+ *           tp_object_enqueue    (internal)
+ *
+ * Queues an object unless it is already queued, and makes sure that
+ * a worker thread will pick it up.
+ */
+static void tp_object_enqueue( struct threadpool_object *object )
+{
+    struct threadpool_worker *worker = ntdll_get_thread_data()->threadpool_worker;
+    struct threadpool *pool = object->pool;
+    struct threadpool_object *head;
+    NTSTATUS status = STATUS_UNSUCCESSFUL;
+
+    if (interlocked_cmpxchg( &object->queued, TRUE, FALSE ))
+        return;
+
+    /* The queue holds its own reference to the object. */
+    interlocked_inc( &object->refcount );
+    interlocked_inc( &pool->num_queued );
+
+    if (!worker || worker->pool != pool || !worker->runq || !tp_runq_push( worker->runq, object ))
+    {
+        do
+        {
+            head = *(struct threadpool_object * volatile *)&pool->injected;
+            object->next_injected = head;
+        }
+        while (interlocked_cmpxchg_ptr( (void **)&pool->injected, object, head ) != head);
+    }
+
+    /* Wake up an idle thread if possible. Otherwise start a new thread as long
+     * as there are less threads than processors, or leave the decision to the
+     * gate thread, which only starts new threads when the others are blocked. */
+    if (pool->num_idle_workers)
+    {
+        interlocked_inc( &pool->wake_seq );
+        RtlWakeAddressSingle( &pool->wake_seq );
+        return;
+    }
+
+    if (pool->num_workers < pool->max_workers && (object->may_run_long ||
+        pool->num_workers < NtCurrentTeb()->Peb->NumberOfProcessors))
+    {
+        RtlEnterCriticalSection( &pool->cs );
+        if (!pool->num_idle_workers && pool->num_workers < pool->max_workers)
+            status = tp_new_worker_thread( pool );
+        RtlLeaveCriticalSection( &pool->cs );
+        if (status == STATUS_SUCCESS) return;
+    }
+
+    tp_threadpool_start_gate( pool );
+}
+
+/***********************************************************************
+ *           tp_object_wake_waiters    (internal)
+ *
+ * Wakes up threads waiting in tp_object_wait after the number of pending,
+ * running or associated callbacks reached zero.
+ */
+static void tp_object_wake_waiters( struct threadpool_object *object, BOOL group_finished, BOOL finished )
+{
+    struct threadpool *pool = object->pool;
+
+    if ((!group_finished && !finished) || !object->num_waiters)
+        return;
+
+    RtlEnterCriticalSection( &pool->cs );
+    if (group_finished)
+        RtlWakeAllConditionVariable( &object->group_finished_event );
+    if (finished)
+        RtlWakeAllConditionVariable( &object->finished_event );
+    RtlLeaveCriticalSection( &pool->cs );
+}
+
+/***********************************************************************
+ *           tp_object_claim    (internal)
+ *
+ * Takes one pending callback of an object. Returns FALSE if all of them
+ * have already been executed or cancelled.
+ */
+static BOOL tp_object_claim( struct threadpool_object *object, LONG *remaining )
+{
+    LONG pending = object->num_pending_callbacks, prev;
+
+    while (pending > 0)
+    {
+        prev = interlocked_cmpxchg( &object->num_pending_callbacks, pending - 1, pending );
+        if (prev == pending)
+        {
+            *remaining = pending - 1;
+            return TRUE;
+        }
+        pending = prev;
+    }
+    return FALSE;
+}
+
 /***********************************************************************
  *           tp_object_submit    (internal)
  *
@@ -1925,35 +2259,26 @@ static void tp_object_initialize( struct threadpool_object *object, struct threa
 static void tp_object_submit( struct threadpool_object *object, BOOL signaled )
 {
     struct threadpool *pool = object->pool;
-    NTSTATUS status = STATUS_UNSUCCESSFUL;
 
     assert( !object->shutdown );
     assert( !pool->shutdown );
 
-    RtlEnterCriticalSection( &pool->cs );
-
-    /* Start new worker threads if required. */
-    if (pool->num_busy_workers >= pool->num_workers &&
-        pool->num_workers < pool->max_workers)
-        status = tp_new_worker_thread( pool );
-
-    /* Queue work item and increment refcount. */
+    /* Each pending callback holds a reference to the object. */
     interlocked_inc( &object->refcount );
-    if (!object->num_pending_callbacks++)
-        list_add_tail( &pool->pool, &object->pool_entry );
-
-    /* Count how often the object was signaled. */
-    if (object->type == TP_OBJECT_TYPE_WAIT && signaled)
-        object->u.wait.signaled++;
 
-    /* No new thread started - wake up one existing thread. */
-    if (status != STATUS_SUCCESS)
+    /* Count how often the object was signaled. Wait objects are rare
+     * enough to keep both counters consistent using the pool lock. */
+    if (object->type == TP_OBJECT_TYPE_WAIT)
     {
-        assert( pool->num_workers > 0 );
-        RtlWakeConditionVariable( &pool->update_event );
+        RtlEnterCriticalSection( &pool->cs );
+        if (signaled) object->u.wait.signaled++;
+        object->num_pending_callbacks++;
+        RtlLeaveCriticalSection( &pool->cs );
     }
+    else
+        interlocked_inc( &object->num_pending_callbacks );
 
-    RtlLeaveCriticalSection( &pool->cs );
+    tp_object_enqueue( object );
 }
 
 /***********************************************************************
@@ -1964,19 +2289,24 @@ static void tp_object_submit( struct threadpool_object *object, BOOL signaled )
 static void tp_object_cancel( struct threadpool_object *object )
 {
     struct threadpool *pool = object->pool;
-    LONG pending_callbacks = 0;
+    LONG pending_callbacks;
 
-    RtlEnterCriticalSection( &pool->cs );
-    if (object->num_pending_callbacks)
+    /* The object might still be queued, it is skipped by the worker
+     * threads because no callbacks are pending anymore. */
+    if (object->type == TP_OBJECT_TYPE_WAIT)
     {
-        pending_callbacks = object->num_pending_callbacks;
-        object->num_pending_callbacks = 0;
-        list_remove( &object->pool_entry );
-
-        if (object->type == TP_OBJECT_TYPE_WAIT)
-            object->u.wait.signaled = 0;
+        RtlEnterCriticalSection( &pool->cs );
+        pending_callbacks = interlocked_xchg( &object->num_pending_callbacks, 0 );
+        object->u.wait.signaled = 0;
+        RtlLeaveCriticalSection( &pool->cs );
     }
-    RtlLeaveCriticalSection( &pool->cs );
+    else
+        pending_callbacks = interlocked_xchg( &object->num_pending_callbacks, 0 );
+
+    if (!pending_callbacks)
+        return;
+
+    tp_object_wake_waiters( object, !object->num_running_callbacks, !object->num_associated_callbacks );
 
     while (pending_callbacks--)
         tp_object_release( object );
@@ -1992,6 +2322,7 @@ static void tp_object_wait( struct threadpool_object *object, BOOL group_wait )
 {
     struct threadpool *pool = object->pool;
 
+    interlocked_inc( &object->num_waiters );
     RtlEnterCriticalSection( &pool->cs );
     if (group_wait)
     {
@@ -2004,6 +2335,7 @@ static void tp_object_wait( struct threadpool_object *object, BOOL group_wait )
             RtlSleepConditionVariableCS( &object->finished_event, &pool->cs, NULL );
     }
     RtlLeaveCriticalSection( &pool->cs );
+    interlocked_dec( &object->num_waiters );
 }
 
 /***********************************************************************
@@ -2062,166 +2394,268 @@ static BOOL tp_object_release( struct threadpool_object *object )
 }
 
 /***********************************************************************
- *           threadpool_worker_proc    (internal)
+ *           tp_object_execute    (internal)
+ *
+ * Executes one pending callback of a queued object.
  */
-static void CALLBACK threadpool_worker_proc( void *param )
+static void tp_object_execute( struct threadpool_object *object )
 {
     TP_CALLBACK_INSTANCE *callback_instance;
     struct threadpool_instance instance;
-    struct threadpool *pool = param;
+    struct threadpool *pool = object->pool;
     TP_WAIT_RESULT wait_result = 0;
-    LARGE_INTEGER timeout;
-    struct list *ptr;
+    LONG remaining = 0, running, associated;
     NTSTATUS status;
+    BOOL claimed;
 
-    TRACE( "starting worker thread for pool %p\n", pool );
+    /* Mark the object as not queued before looking at the pending callbacks,
+     * so that concurrent submissions queue it again. The callback is accounted
+     * as running before claiming it, tp_object_wait relies on that. */
+    interlocked_xchg( &object->queued, FALSE );
+    interlocked_inc( &object->num_associated_callbacks );
+    interlocked_inc( &object->num_running_callbacks );
 
-    RtlEnterCriticalSection( &pool->cs );
-    pool->num_busy_workers--;
-    for (;;)
+    /* For wait objects check if they were signaled or have timed out. */
+    if (object->type == TP_OBJECT_TYPE_WAIT)
     {
-        while ((ptr = list_head( &pool->pool )))
+        RtlEnterCriticalSection( &pool->cs );
+        if ((claimed = tp_object_claim( object, &remaining )))
         {
-            struct threadpool_object *object = LIST_ENTRY( ptr, struct threadpool_object, pool_entry );
-            assert( object->num_pending_callbacks > 0 );
+            wait_result = object->u.wait.signaled ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
+            if (wait_result == WAIT_OBJECT_0) object->u.wait.signaled--;
+        }
+        RtlLeaveCriticalSection( &pool->cs );
+    }
+    else
+        claimed = tp_object_claim( object, &remaining );
 
-            /* If further pending callbacks are queued, move the work item to
-             * the end of the pool list. Otherwise remove it from the pool. */
-            list_remove( &object->pool_entry );
-            if (--object->num_pending_callbacks)
-                list_add_tail( &pool->pool, &object->pool_entry );
+    if (!claimed)
+    {
+        /* All callbacks have been cancelled in the meantime. */
+        running = interlocked_dec( &object->num_running_callbacks );
+        associated = interlocked_dec( &object->num_associated_callbacks );
+        if (!object->num_pending_callbacks)
+            tp_object_wake_waiters( object, !running, !associated );
+        tp_object_release( object );
+        return;
+    }
 
-            /* For wait objects check if they were signaled or have timed out. */
-            if (object->type == TP_OBJECT_TYPE_WAIT)
-            {
-                wait_result = object->u.wait.signaled ? WAIT_OBJECT_0 : WAIT_TIMEOUT;
-                if (wait_result == WAIT_OBJECT_0) object->u.wait.signaled--;
-            }
+    /* If further pending callbacks are queued, queue the object again,
+     * so that other objects get a chance to run in the meantime. */
+    if (remaining)
+        tp_object_enqueue( object );
 
-            /* Leave critical section and do the actual callback. */
-            object->num_associated_callbacks++;
-            object->num_running_callbacks++;
-            pool->num_busy_workers++;
-            RtlLeaveCriticalSection( &pool->cs );
-
-            /* Initialize threadpool instance struct. */
-            callback_instance = (TP_CALLBACK_INSTANCE *)&instance;
-            instance.object                     = object;
-            instance.threadid                   = GetCurrentThreadId();
-            instance.associated                 = TRUE;
-            instance.may_run_long               = object->may_run_long;
-            instance.cleanup.critical_section   = NULL;
-            instance.cleanup.mutex              = NULL;
-            instance.cleanup.semaphore          = NULL;
-            instance.cleanup.semaphore_count    = 0;
-            instance.cleanup.event              = NULL;
-            instance.cleanup.library            = NULL;
-
-            switch (object->type)
-            {
-                case TP_OBJECT_TYPE_SIMPLE:
-                {
-                    TRACE( "executing simple callback %p(%p, %p)\n",
-                           object->u.simple.callback, callback_instance, object->userdata );
-                    object->u.simple.callback( callback_instance, object->userdata );
-                    TRACE( "callback %p returned\n", object->u.simple.callback );
-                    break;
-                }
+    /* Initialize threadpool instance struct. */
+    callback_instance = (TP_CALLBACK_INSTANCE *)&instance;
+    instance.object                     = object;
+    instance.threadid                   = GetCurrentThreadId();
+    instance.associated                 = TRUE;
+    instance.may_run_long               = object->may_run_long;
+    instance.cleanup.critical_section   = NULL;
+    instance.cleanup.mutex              = NULL;
+    instance.cleanup.semaphore          = NULL;
+    instance.cleanup.semaphore_count    = 0;
+    instance.cleanup.event              = NULL;
+    instance.cleanup.library            = NULL;
 
-                case TP_OBJECT_TYPE_WORK:
-                {
-                    TRACE( "executing work callback %p(%p, %p, %p)\n",
-                           object->u.work.callback, callback_instance, object->userdata, object );
-                    object->u.work.callback( callback_instance, object->userdata, (TP_WORK *)object );
-                    TRACE( "callback %p returned\n", object->u.work.callback );
-                    break;
-                }
+    switch (object->type)
+    {
+        case TP_OBJECT_TYPE_SIMPLE:
+        {
+            TRACE( "executing simple callback %p(%p, %p)\n",
+                   object->u.simple.callback, callback_instance, object->userdata );
+            object->u.simple.callback( callback_instance, object->userdata );
+            TRACE( "callback %p returned\n", object->u.simple.callback );
+            break;
+        }
 
-                case TP_OBJECT_TYPE_TIMER:
-                {
-                    TRACE( "executing timer callback %p(%p, %p, %p)\n",
-                           object->u.timer.callback, callback_instance, object->userdata, object );
-                    object->u.timer.callback( callback_instance, object->userdata, (TP_TIMER *)object );
-                    TRACE( "callback %p returned\n", object->u.timer.callback );
-                    break;
-                }
+        case TP_OBJECT_TYPE_WORK:
+        {
+            TRACE( "executing work callback %p(%p, %p, %p)\n",
+                   object->u.work.callback, callback_instance, object->userdata, object );
+            object->u.work.callback( callback_instance, object->userdata, (TP_WORK *)object );
+            TRACE( "callback %p returned\n", object->u.work.callback );
+            break;
+        }
 
-                case TP_OBJECT_TYPE_WAIT:
-                {
-                    TRACE( "executing wait callback %p(%p, %p, %p, %u)\n",
-                           object->u.wait.callback, callback_instance, object->userdata, object, wait_result );
-                    object->u.wait.callback( callback_instance, object->userdata, (TP_WAIT *)object, wait_result );
-                    TRACE( "callback %p returned\n", object->u.wait.callback );
-                    break;
-                }
+        case TP_OBJECT_TYPE_TIMER:
+        {
+            TRACE( "executing timer callback %p(%p, %p, %p)\n",
+                   object->u.timer.callback, callback_instance, object->userdata, object );
+            object->u.timer.callback( callback_instance, object->userdata, (TP_TIMER *)object );
+            TRACE( "callback %p returned\n", object->u.timer.callback );
+            break;
+        }
 
-                default:
-                    assert(0);
-                    break;
-            }
+        case TP_OBJECT_TYPE_WAIT:
+        {
+            TRACE( "executing wait callback %p(%p, %p, %p, %u)\n",
+                   object->u.wait.callback, callback_instance, object->userdata, object, wait_result );
+            object->u.wait.callback( callback_instance, object->userdata, (TP_WAIT *)object, wait_result );
+            TRACE( "callback %p returned\n", object->u.wait.callback );
+            break;
+        }
 
-            /* Execute finalization callback. */
-            if (object->finalization_callback)
-            {
-                TRACE( "executing finalization callback %p(%p, %p)\n",
-                       object->finalization_callback, callback_instance, object->userdata );
-                object->finalization_callback( callback_instance, object->userdata );
-                TRACE( "callback %p returned\n", object->finalization_callback );
-            }
+        default:
+            assert(0);
+            break;
+    }
 
-            /* Execute cleanup tasks. */
-            if (instance.cleanup.critical_section)
-            {
-                RtlLeaveCriticalSection( instance.cleanup.critical_section );
-            }
-            if (instance.cleanup.mutex)
-            {
-                status = NtReleaseMutant( instance.cleanup.mutex, NULL );
-                if (status != STATUS_SUCCESS) goto skip_cleanup;
-            }
-            if (instance.cleanup.semaphore)
-            {
-                status = NtReleaseSemaphore( instance.cleanup.semaphore, instance.cleanup.semaphore_count, NULL );
-                if (status != STATUS_SUCCESS) goto skip_cleanup;
-            }
-            if (instance.cleanup.event)
-            {
-                status = NtSetEvent( instance.cleanup.event, NULL );
-                if (status != STATUS_SUCCESS) goto skip_cleanup;
-            }
-            if (instance.cleanup.library)
-            {
-                LdrUnloadDll( instance.cleanup.library );
-            }
+    /* Execute finalization callback. */
+    if (object->finalization_callback)
+    {
+        TRACE( "executing finalization callback %p(%p, %p)\n",
+               object->finalization_callback, callback_instance, object->userdata );
+        object->finalization_callback( callback_instance, object->userdata );
+        TRACE( "callback %p returned\n", object->finalization_callback );
+    }
 
-        skip_cleanup:
-            RtlEnterCriticalSection( &pool->cs );
-            pool->num_busy_workers--;
+    /* Execute cleanup tasks. */
+    if (instance.cleanup.critical_section)
+    {
+        RtlLeaveCriticalSection( instance.cleanup.critical_section );
+    }
+    if (instance.cleanup.mutex)
+    {
+        status = NtReleaseMutant( instance.cleanup.mutex, NULL );
+        if (status != STATUS_SUCCESS) goto skip_cleanup;
+    }
+    if (instance.cleanup.semaphore)
+    {
+        status = NtReleaseSemaphore( instance.cleanup.semaphore, instance.cleanup.semaphore_count, NULL );
+        if (status != STATUS_SUCCESS) goto skip_cleanup;
+    }
+    if (instance.cleanup.event)
+    {
+        status = NtSetEvent( instance.cleanup.event, NULL );
+        if (status != STATUS_SUCCESS) goto skip_cleanup;
+    }
+    if (instance.cleanup.library)
+    {
+        LdrUnloadDll( instance.cleanup.library );
+    }
 
-            /* Simple callbacks are automatically shutdown after execution. */
-            if (object->type == TP_OBJECT_TYPE_SIMPLE)
-            {
-                tp_object_prepare_shutdown( object );
-                object->shutdown = TRUE;
-            }
+skip_cleanup:
+    interlocked_inc( &pool->num_completed );
 
-            object->num_running_callbacks--;
-            if (!object->num_pending_callbacks && !object->num_running_callbacks)
-                RtlWakeAllConditionVariable( &object->group_finished_event );
+    /* Simple callbacks are automatically shutdown after execution. */
+    if (object->type == TP_OBJECT_TYPE_SIMPLE)
+    {
+        tp_object_prepare_shutdown( object );
+        object->shutdown = TRUE;
+    }
 
-            if (instance.associated)
-            {
-                object->num_associated_callbacks--;
-                if (!object->num_pending_callbacks && !object->num_associated_callbacks)
-                    RtlWakeAllConditionVariable( &object->finished_event );
-            }
+    if (!interlocked_dec( &object->num_running_callbacks ) && !object->num_pending_callbacks)
+        tp_object_wake_waiters( object, TRUE, FALSE );
 
-            tp_object_release( object );
+    if (instance.associated)
+    {
+        if (!interlocked_dec( &object->num_associated_callbacks ) && !object->num_pending_callbacks)
+            tp_object_wake_waiters( object, FALSE, TRUE );
+    }
+
+    /* Release the references of the callback and the queue entry. */
+    tp_object_release( object );
+    tp_object_release( object );
+}
+
+/***********************************************************************
+ *           tp_threadpool_attach_worker    (internal)
+ *
+ * Assigns a local queue to a new worker thread. Threads beyond the
+ * maximum number of queues only use the global queue.
+ */
+static void tp_threadpool_attach_worker( struct threadpool *pool, struct threadpool_worker *worker )
+{
+    struct threadpool_runq *runq;
+    LONG i;
+
+    worker->pool        = pool;
+    worker->runq        = NULL;
+    worker->steal_index = GetCurrentThreadId();
+    worker->ticks       = 0;
+
+    RtlEnterCriticalSection( &pool->cs );
+    for (i = 0; i < pool->num_runqs; i++)
+    {
+        if (pool->runqs[i]->in_use) continue;
+        worker->runq = pool->runqs[i];
+        break;
+    }
+    if (!worker->runq && pool->num_runqs < THREADPOOL_MAX_RUNQS &&
+        (runq = RtlAllocateHeap( GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*runq) )))
+    {
+        pool->runqs[pool->num_runqs] = runq;
+        interlocked_inc( &pool->num_runqs );
+        worker->runq = runq;
+    }
+    if (worker->runq) worker->runq->in_use = TRUE;
+    RtlLeaveCriticalSection( &pool->cs );
+
+    ntdll_get_thread_data()->threadpool_worker = worker;
+}
+
+/***********************************************************************
+ *           tp_threadpool_detach_worker    (internal)
+ *
+ * Moves objects left in the local queue of a terminating worker thread
+ * to the global queue. Has to be called with .cs held.
+ */
+static void tp_threadpool_detach_worker( struct threadpool *pool, struct threadpool_worker *worker )
+{
+    struct threadpool_object *object;
+
+    ntdll_get_thread_data()->threadpool_worker = NULL;
+    if (!worker->runq) return;
+
+    while ((object = tp_runq_pop( worker->runq )))
+    {
+        list_add_tail( &pool->pool, &object->pool_entry );
+        pool->num_global++;
+    }
+    worker->runq->in_use = FALSE;
+}
+
+/***********************************************************************
+ *           threadpool_worker_proc    (internal)
+ */
+static void CALLBACK threadpool_worker_proc( void *param )
+{
+    struct threadpool_object *object;
+    struct threadpool_worker worker;
+    struct threadpool *pool = param;
+    LARGE_INTEGER timeout;
+    NTSTATUS status;
+    LONG seq;
+
+    TRACE( "starting worker thread for pool %p\n", pool );
+
+    tp_threadpool_attach_worker( pool, &worker );
+    for (;;)
+    {
+        if ((object = tp_threadpool_get_object( pool, &worker )))
+        {
+            tp_object_execute( object );
+            continue;
         }
 
         /* Shutdown worker thread if requested. */
         if (pool->shutdown)
+        {
+            RtlEnterCriticalSection( &pool->cs );
             break;
+        }
+
+        /* Announce that this thread is idle and check again for new objects,
+         * submitting threads only wake up threads which are marked as idle. */
+        seq = *(volatile LONG *)&pool->wake_seq;
+        interlocked_inc( &pool->num_idle_workers );
+        if ((object = tp_threadpool_get_object( pool, &worker )))
+        {
+            interlocked_dec( &pool->num_idle_workers );
+            tp_object_execute( object );
+            continue;
+        }
 
         /* Wait for new tasks or until the timeout expires. A thread only terminates
          * when no new tasks are available, and the number of threads can be
@@ -2229,13 +2663,20 @@ static void CALLBACK threadpool_worker_proc( void *param )
          * min_workers == 0, then objcount is used to detect if the last thread
          * can be terminated. */
         timeout.QuadPart = (ULONGLONG)THREADPOOL_WORKER_TIMEOUT * -10000;
-        if (RtlSleepConditionVariableCS( &pool->update_event, &pool->cs, &timeout ) == STATUS_TIMEOUT &&
-            !list_head( &pool->pool ) && (pool->num_workers > max( pool->min_workers, 1 ) ||
+        status = RtlWaitOnAddress( &pool->wake_seq, &seq, sizeof(seq), &timeout );
+        interlocked_dec( &pool->num_idle_workers );
+        if (status != STATUS_TIMEOUT)
+            continue;
+
+        RtlEnterCriticalSection( &pool->cs );
+        if (!pool->num_queued && (pool->num_workers > max( pool->min_workers, 1 ) ||
             (!pool->min_workers && !pool->objcount)))
         {
             break;
         }
+        RtlLeaveCriticalSection( &pool->cs );
     }
+    tp_threadpool_detach_worker( pool, &worker );
     pool->num_workers--;
     RtlLeaveCriticalSection( &pool->cs );
 
@@ -2244,6 +2685,51 @@ static void CALLBACK threadpool_worker_proc( void *param )
     RtlExitUserThread( 0 );
 }
 
+/***********************************************************************
+ *           threadpool_gate_proc    (internal)
+ *
+ * Injects new worker threads as long as objects are queued, but no
+ * worker thread is idle and no callback completed in the last interval.
+ */
+static void CALLBACK threadpool_gate_proc( void *param )
+{
+    struct threadpool *pool = param;
+    LONG completed = pool->num_completed;
+    LARGE_INTEGER timeout;
+
+    TRACE( "starting gate thread for pool %p\n", pool );
+
+    timeout.QuadPart = (ULONGLONG)THREADPOOL_GATE_INTERVAL * -10000;
+    for (;;)
+    {
+        NtDelayExecution( FALSE, &timeout );
+
+        if (pool->shutdown || !pool->num_queued)
+        {
+            /* Recheck after clearing the flag, objects queued in
+             * the meantime might not have started a new gate thread. */
+            interlocked_xchg( &pool->gate_running, FALSE );
+            if (pool->shutdown || !pool->num_queued ||
+                interlocked_cmpxchg( &pool->gate_running, TRUE, FALSE ))
+                break;
+        }
+
+        RtlEnterCriticalSection( &pool->cs );
+        if (!pool->num_idle_workers && pool->num_completed == completed &&
+            pool->num_workers < pool->max_workers)
+        {
+            TRACE( "workers of pool %p are blocked, starting a new one\n", pool );
+            tp_new_worker_thread( pool );
+        }
+        completed = pool->num_completed;
+        RtlLeaveCriticalSection( &pool->cs );
+    }
+
+    TRACE( "terminating gate thread for pool %p\n", pool );
+    tp_threadpool_release( pool );
+    RtlExitUserThread( 0 );
+}
+
 /***********************************************************************
  *           TpAllocCleanupGroup    (NTDLL.@)
  */
@@ -2416,7 +2902,7 @@ NTSTATUS WINAPI TpCallbackMayRunLong( TP_CALLBACK_INSTANCE *instance )
     RtlEnterCriticalSection( &pool->cs );
 
     /* Start new worker threads if required. */
-    if (pool->num_busy_workers >= pool->num_workers)
+    if (!pool->num_idle_workers)
     {
         if (pool->num_workers < pool->max_workers)
         {
@@ -2495,7 +2981,6 @@ VOID WINAPI TpDisassociateCallback( TP_CALLBACK_INSTANCE *instance )
 {
     struct threadpool_instance *this = impl_from_TP_CALLBACK_INSTANCE( instance );
     struct threadpool_object *object = this->object;
-    struct threadpool *pool;
 
     TRACE( "%p\n", instance );
 
@@ -2508,14 +2993,9 @@ VOID WINAPI TpDisassociateCallback( TP_CALLBACK_INSTANCE *instance )
     if (!this->associated)
         return;
 
-    pool = object->pool;
-    RtlEnterCriticalSection( &pool->cs );
+    if (!interlocked_dec( &object->num_associated_callbacks ) && !object->num_pending_callbacks)
+        tp_object_wake_waiters( object, FALSE, TRUE );
 
-    object->num_associated_callbacks--;
-    if (!object->num_pending_callbacks && !object->num_associated_callbacks)
-        RtlWakeAllConditionVariable( &object->finished_event );
-
-    RtlLeaveCriticalSection( &pool->cs );
     this->associated = FALSE;
 }
 
@@ -0,0 +1,501 @@
+/*
+ * Asynchronous file I/O through io_uring
+ *
+ * When enabled with WINEIOURING=1, overlapped reads and writes at an
+ * explicit offset on regular files are queued to a per-process io_uring
+ * instead of being done synchronously. A dedicated thread reaps the
+ * completions and reports them through the I/O status block, the event
+ * and the completion port, without a server round trip per operation
+ * when the handle has no completion port.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+#include "wine/port.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+# include <linux/io_uring.h>
+#endif
+
+#define NONAMELESSUNION
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+#include "wine/list.h"
+#include "wine/server.h"
+#include "wine/debug.h"
+#include "ntdll_misc.h"
+
+WINE_DEFAULT_DEBUG_CHANNEL(file);
+
+#if defined(__linux__) && defined(HAVE_LINUX_IO_URING_H) && defined(__NR_io_uring_setup)
+
+#define URING_ENTRIES     256
+#define URING_MAX_IOV     1024  /* IOV_MAX */
+
+struct uring_request
+{
+    struct list       entry;    /* entry in the in-flight list */
+    HANDLE            handle;   /* file handle the request was issued on */
+    HANDLE            event;    /* event to signal on completion */
+    ULONG_PTR         cvalue;   /* completion value, 0 if no port is to be notified */
+    IO_STATUS_BLOCK  *io;       /* status block to fill on completion */
+    DWORD             tid;      /* issuing thread, for NtCancelIoFile */
+    int               fd;       /* private unix fd, closed on completion */
+    BOOL              write;
+    ULONGLONG         offset;
+    ULONG             length;   /* total length of the transfer */
+    unsigned int      iovcnt;
+    struct iovec      iov[1];
+};
+
+/* cancellations issued by a uring_cancel call */
+struct uring_cancel
+{
+    LONG              pending;   /* cancel requests not reaped yet, plus one for the caller */
+    LONG              cancelled; /* requests that were actually cancelled */
+    HANDLE            event;     /* signaled once all of them have been reaped */
+};
+
+static int uring_fd = -1;
+static int uring_unsupported;
+static unsigned int uring_inflight;
+static unsigned int sq_entries;
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cq_cqes;
+static struct io_uring_sqe *sq_sqes;
+static struct list uring_requests = LIST_INIT( uring_requests );
+
+static RTL_CRITICAL_SECTION uring_section;
+static RTL_CRITICAL_SECTION_DEBUG uring_section_debug =
+{
+    0, 0, &uring_section,
+    { &uring_section_debug.ProcessLocksList, &uring_section_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": uring_section") }
+};
+static RTL_CRITICAL_SECTION uring_section = { &uring_section_debug, -1, 0, 0, 0, 0 };
+
+static int do_uring(void)
+{
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINEIOURING" );
+        enabled = env && atoi( env );
+    }
+    return enabled && !uring_unsupported;
+}
+
+static inline int io_uring_setup( unsigned int entries, struct io_uring_params *params )
+{
+    return syscall( __NR_io_uring_setup, entries, params );
+}
+
+static inline int io_uring_enter( int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags )
+{
+    return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+/* redo a read that failed with EFAULT, so that write watches on the buffer are handled */
+static int retry_read( struct uring_request *req )
+{
+    unsigned int i;
+    ssize_t ret;
+    int total = 0;
+
+    for (i = 0; i < req->iovcnt; i++)
+    {
+        while ((ret = virtual_locked_pread( req->fd, req->iov[i].iov_base, req->iov[i].iov_len,
+                                            req->offset + total )) == -1 && errno == EINTR)
+            ;
+        if (ret == -1) return total ? total : -errno;
+        total += ret;
+        if (ret < req->iov[i].iov_len) break;
+    }
+    return total;
+}
+
+static void complete_request( struct uring_request *req, int res )
+{
+    NTSTATUS status;
+    ULONG info = 0;
+
+    RtlEnterCriticalSection( &uring_section );
+    list_remove( &req->entry );
+    uring_inflight--;
+    RtlLeaveCriticalSection( &uring_section );
+
+    if (res == -EFAULT && !req->write) res = retry_read( req );
+
+    if (res >= 0)
+    {
+        info = res;
+        if (res || !req->length) status = STATUS_SUCCESS;
+        else status = req->write ? STATUS_DISK_FULL : STATUS_END_OF_FILE;
+    }
+    else if (res == -ECANCELED || res == -EINTR) status = STATUS_CANCELLED;
+    else if (res == -EFAULT && req->write) status = STATUS_INVALID_USER_BUFFER;
+    else
+    {
+        errno = -res;
+        status = FILE_GetNtStatus();
+    }
+
+    TRACE( "%p io %p = 0x%08x (%u)\n", req->handle, req->io, status, info );
+
+    req->io->Information = info;
+    req->io->u.Status = status;
+    if (req->event) NtSetEvent( req->event, NULL );
+    if (req->cvalue) NTDLL_AddCompletion( req->handle, req->cvalue, status, info, TRUE );
+
+    if (req->fd != -1) close( req->fd );
+    RtlFreeHeap( GetProcessHeap(), 0, req );
+}
+
+static void complete_cancel( struct uring_cancel *cancel, int res )
+{
+    if (!res) interlocked_xchg_add( &cancel->cancelled, 1 );
+    if (interlocked_xchg_add( &cancel->pending, -1 ) == 1) NtSetEvent( cancel->event, NULL );
+}
+
+static void CALLBACK uring_thread( void *arg )
+{
+    for (;;)
+    {
+        unsigned int head, tail;
+
+        if (io_uring_enter( uring_fd, 0, 1, IORING_ENTER_GETEVENTS ) < 0 && errno != EINTR)
+        {
+            ERR( "io_uring_enter failed: %s\n", strerror( errno ));
+            return;
+        }
+
+        head = *cq_head;
+        tail = __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE );
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &cq_cqes[head & *cq_mask];
+            ULONG_PTR data = cqe->user_data;
+            int res = cqe->res;
+
+            __atomic_store_n( cq_head, ++head, __ATOMIC_RELEASE );
+            /* cancel requests point to their batch, with the low bit set */
+            if (data & 1) complete_cancel( (struct uring_cancel *)(data & ~1), res );
+            else complete_request( (struct uring_request *)data, res );
+        }
+    }
+}
+
+/* create the ring and its completion thread; called with uring_section held */
+static BOOL init_uring(void)
+{
+    struct io_uring_params params;
+    size_t sq_size, cq_size;
+    char *sq_ring, *cq_ring;
+    HANDLE thread;
+    int fd;
+
+    if (uring_fd != -1) return TRUE;
+    if (uring_unsupported) return FALSE;
+
+    memset( &params, 0, sizeof(params) );
+    if ((fd = io_uring_setup( URING_ENTRIES, &params )) == -1)
+    {
+        WARN( "io_uring not supported: %s\n", strerror( errno ));
+        goto failed;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    sq_ring = mmap( NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    cq_ring = mmap( NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    sq_sqes = mmap( NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sq_sqes == MAP_FAILED)
+    {
+        WARN( "failed to map the ring: %s\n", strerror( errno ));
+        if (sq_ring != MAP_FAILED) munmap( sq_ring, sq_size );
+        if (cq_ring != MAP_FAILED) munmap( cq_ring, cq_size );
+        if (sq_sqes != MAP_FAILED) munmap( sq_sqes, params.sq_entries * sizeof(struct io_uring_sqe) );
+        close( fd );
+        goto failed;
+    }
+
+    sq_entries = params.sq_entries;
+    sq_head  = (unsigned int *)(sq_ring + params.sq_off.head);
+    sq_tail  = (unsigned int *)(sq_ring + params.sq_off.tail);
+    sq_mask  = (unsigned int *)(sq_ring + params.sq_off.ring_mask);
+    sq_array = (unsigned int *)(sq_ring + params.sq_off.array);
+    cq_head  = (unsigned int *)(cq_ring + params.cq_off.head);
+    cq_tail  = (unsigned int *)(cq_ring + params.cq_off.tail);
+    cq_mask  = (unsigned int *)(cq_ring + params.cq_off.ring_mask);
+    cq_cqes  = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+    uring_fd = fd;
+
+    if (RtlCreateUserThread( GetCurrentProcess(), NULL, FALSE, NULL, 0, 0,
+                             (PRTL_THREAD_START_ROUTINE)uring_thread, NULL, &thread, NULL ))
+    {
+        ERR( "failed to create the completion thread\n" );
+        uring_fd = -1;
+        close( fd );
+        goto failed;
+    }
+    NtClose( thread );
+
+    TRACE( "created ring with %u entries\n", sq_entries );
+    return TRUE;
+
+failed:
+    uring_unsupported = 1;
+    return FALSE;
+}
+
+/* queue a sqe; called with uring_section held */
+static BOOL queue_sqe( const struct io_uring_sqe *src )
+{
+    unsigned int tail = *sq_tail, idx = tail & *sq_mask;
+
+    sq_sqes[idx] = *src;
+    sq_array[idx] = idx;
+    __atomic_store_n( sq_tail, tail + 1, __ATOMIC_RELEASE );
+
+    if (io_uring_enter( uring_fd, 1, 0, 0 ) == 1) return TRUE;
+
+    /* put the entry back unless the kernel consumed it anyway */
+    if (__atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) == tail)
+    {
+        __atomic_store_n( sq_tail, tail, __ATOMIC_RELEASE );
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static NTSTATUS submit_request( struct uring_request *req )
+{
+    struct io_uring_sqe sqe;
+    NTSTATUS status = STATUS_NOT_IMPLEMENTED;
+
+    memset( &sqe, 0, sizeof(sqe) );
+    sqe.opcode    = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe.fd        = req->fd;
+    sqe.addr      = (ULONG_PTR)req->iov;
+    sqe.len       = req->iovcnt;
+    sqe.off       = req->offset;
+    sqe.user_data = (ULONG_PTR)req;
+
+    req->io->u.Status = STATUS_PENDING;
+    req->io->Information = 0;
+    if (req->event) NtResetEvent( req->event, NULL );
+
+    RtlEnterCriticalSection( &uring_section );
+    if (init_uring() && uring_inflight < sq_entries)
+    {
+        list_add_tail( &uring_requests, &req->entry );
+        uring_inflight++;
+        if (queue_sqe( &sqe )) status = STATUS_PENDING;
+        else
+        {
+            list_remove( &req->entry );
+            uring_inflight--;
+        }
+    }
+    RtlLeaveCriticalSection( &uring_section );
+    return status;
+}
+
+static struct uring_request *alloc_request( HANDLE handle, HANDLE event, ULONG_PTR cvalue,
+                                            IO_STATUS_BLOCK *io, unsigned int iovcnt )
+{
+    struct uring_request *req;
+    BOOL completion;
+
+    if (!do_uring() || iovcnt > URING_MAX_IOV) return NULL;
+    /* the port may have been associated through another handle to the file */
+    if (!server_get_fd_completion( handle, &completion )) return NULL;
+    /* without an event or a port, the caller would have nothing to wait on */
+    if (!completion)
+    {
+        if (!event) return NULL;
+        cvalue = 0;
+    }
+
+    if (!(req = RtlAllocateHeap( GetProcessHeap(), 0, offsetof( struct uring_request, iov[iovcnt] ))))
+        return NULL;
+    req->handle = handle;
+    req->event  = event;
+    req->cvalue = cvalue;
+    req->io     = io;
+    req->tid    = GetCurrentThreadId();
+    req->iovcnt = iovcnt;
+    return req;
+}
+
+/* submit a request on a unix fd; on success the fd is owned by the request */
+static NTSTATUS submit_fd_request( struct uring_request *req, int fd, int needs_close )
+{
+    NTSTATUS status;
+
+    /* the cached fd goes away with the handle, which may be closed before completion */
+    req->fd = needs_close ? fd : dup( fd );
+    if (req->fd == -1)
+    {
+        RtlFreeHeap( GetProcessHeap(), 0, req );
+        return STATUS_NOT_IMPLEMENTED;
+    }
+    if ((status = submit_request( req )) != STATUS_PENDING)
+    {
+        if (!needs_close) close( req->fd );
+        RtlFreeHeap( GetProcessHeap(), 0, req );
+    }
+    return status;
+}
+
+/***********************************************************************
+ *           uring_read_write
+ *
+ * Queue an overlapped read or write of a single buffer. Returns
+ * STATUS_NOT_IMPLEMENTED if the caller should do the I/O itself.
+ */
+NTSTATUS uring_read_write( HANDLE handle, int fd, int needs_close, HANDLE event, ULONG_PTR cvalue,
+                           IO_STATUS_BLOCK *io, void *buffer, ULONG length, ULONGLONG offset, BOOL write )
+{
+    struct uring_request *req;
+
+    if (!(req = alloc_request( handle, event, cvalue, io, 1 ))) return STATUS_NOT_IMPLEMENTED;
+    req->write  = write;
+    req->offset = offset;
+    req->length = length;
+    req->iov[0].iov_base = buffer;
+    req->iov[0].iov_len  = length;
+
+    return submit_fd_request( req, fd, needs_close );
+}
+
+/***********************************************************************
+ *           uring_scatter_gather
+ *
+ * Queue an overlapped read or write over page-sized segments.
+ */
+NTSTATUS uring_scatter_gather( HANDLE handle, int fd, int needs_close, HANDLE event, ULONG_PTR cvalue,
+                               IO_STATUS_BLOCK *io, FILE_SEGMENT_ELEMENT *segments, ULONG length,
+                               ULONGLONG offset, BOOL write )
+{
+    struct uring_request *req;
+    unsigned int i, count = (length + page_size - 1) / page_size;
+
+    if (!count || !(req = alloc_request( handle, event, cvalue, io, count )))
+        return STATUS_NOT_IMPLEMENTED;
+    req->write  = write;
+    req->offset = offset;
+    req->length = length;
+    for (i = 0; i < count; i++)
+    {
+        req->iov[i].iov_base = segments[i].Buffer;
+        req->iov[i].iov_len  = min( length - i * page_size, page_size );
+    }
+
+    return submit_fd_request( req, fd, needs_close );
+}
+
+/***********************************************************************
+ *           uring_cancel
+ *
+ * Cancel the queued requests on a handle, optionally only those of the
+ * current thread or those using a given status block. Returns the
+ * number of requests that were actually cancelled, once the kernel has
+ * reported it.
+ */
+unsigned int uring_cancel( HANDLE handle, IO_STATUS_BLOCK *io, BOOL only_thread )
+{
+    struct uring_request *req;
+    struct uring_cancel cancel;
+    struct io_uring_sqe sqe;
+
+    if (!do_uring()) return 0;
+
+    cancel.pending = 1;
+    cancel.cancelled = 0;
+    cancel.event = 0;
+
+    RtlEnterCriticalSection( &uring_section );
+    LIST_FOR_EACH_ENTRY( req, &uring_requests, struct uring_request, entry )
+    {
+        if (req->handle != handle) continue;
+        if (io && req->io != io) continue;
+        if (only_thread && req->tid != GetCurrentThreadId()) continue;
+
+        if (!cancel.event && NtCreateEvent( &cancel.event, EVENT_ALL_ACCESS, NULL,
+                                            SynchronizationEvent, FALSE ))
+            break;
+
+        memset( &sqe, 0, sizeof(sqe) );
+        sqe.opcode    = IORING_OP_ASYNC_CANCEL;
+        sqe.fd        = -1;
+        sqe.addr      = (ULONG_PTR)req;
+        sqe.user_data = (ULONG_PTR)&cancel | 1;
+        interlocked_xchg_add( &cancel.pending, 1 );
+        if (!queue_sqe( &sqe )) interlocked_xchg_add( &cancel.pending, -1 );
+    }
+    RtlLeaveCriticalSection( &uring_section );
+
+    if (!cancel.event) return 0;
+    if (interlocked_xchg_add( &cancel.pending, -1 ) != 1)
+        NtWaitForSingleObject( cancel.event, FALSE, NULL );
+    NtClose( cancel.event );
+    return cancel.cancelled;
+}
+
+#else  /* HAVE_LINUX_IO_URING_H */
+
+NTSTATUS uring_read_write( HANDLE handle, int fd, int needs_close, HANDLE event, ULONG_PTR cvalue,
+                           IO_STATUS_BLOCK *io, void *buffer, ULONG length, ULONGLONG offset, BOOL write )
+{
+    return STATUS_NOT_IMPLEMENTED;
+}
+
+NTSTATUS uring_scatter_gather( HANDLE handle, int fd, int needs_close, HANDLE event, ULONG_PTR cvalue,
+                               IO_STATUS_BLOCK *io, FILE_SEGMENT_ELEMENT *segments, ULONG length,
+                               ULONGLONG offset, BOOL write )
+{
+    return STATUS_NOT_IMPLEMENTED;
+}
+
+unsigned int uring_cancel( HANDLE handle, IO_STATUS_BLOCK *io, BOOL only_thread )
+{
+    return 0;
+}
+
+#endif  /* HAVE_LINUX_IO_URING_H */
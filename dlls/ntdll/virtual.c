@@ -47,6 +47,11 @@
 #ifdef HAVE_VALGRIND_VALGRIND_H
 # include <valgrind/valgrind.h>
 #endif
+#ifdef HAVE_LINUX_USERFAULTFD_H
+# include <sys/ioctl.h>
+# include <sys/syscall.h>
+# include <linux/userfaultfd.h>
+#endif
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -74,6 +79,9 @@ struct file_view
     void         *base;          /* base address */
     size_t        size;          /* size in bytes */
     unsigned int  protect;       /* protection for all pages at allocation time and SEC_* flags */
+    void         *tree_start;    /* start of the first view in the subtree of this view */
+    void         *tree_end;      /* end of the last view in the subtree of this view */
+    size_t        max_gap;       /* largest gap between two views in the subtree of this view */
 };
 
 /* per-page protection flags */
@@ -86,6 +94,7 @@ struct file_view
 #define VPROT_WRITEWATCH 0x40
 /* per-mapping protection flags */
 #define VPROT_SYSTEM     0x0200  /* system view (underlying mmap not under our control) */
+#define VPROT_UFFD_WATCH 0x0400  /* write watches are tracked by userfaultfd instead of page faults */
 
 /* Conversion from VPROT_* to Win32 flags */
 static const BYTE VIRTUAL_Win32Flags[16] =
@@ -154,13 +163,22 @@ static const BOOL is_win64 = (sizeof(void *) > sizeof(int));
 #define VIRTUAL_DEBUG_DUMP_VIEW(view) \
     do { if (TRACE_ON(virtual)) VIRTUAL_DumpView(view); } while (0)
 
+/* The page protection bytes are grouped in chunks of VPROT_CHUNK_SIZE pages, and each chunk has
+ * a summary word. When the VPROT_CHUNK_UNIFORM flag is set in the summary, all the pages of the
+ * chunk have the protection stored in its low byte and the bytes of the chunk are not used, so
+ * that operations on large ranges only need to update the summaries of the chunks they cover. */
+#define VPROT_CHUNK_SHIFT    10
+#define VPROT_CHUNK_SIZE     ((size_t)1 << VPROT_CHUNK_SHIFT)
+#define VPROT_CHUNK_UNIFORM  0x100
+
 #ifdef _WIN64  /* on 64-bit the page protection bytes use a 2-level table */
 static const size_t pages_vprot_shift = 20;
 static const size_t pages_vprot_mask = (1 << 20) - 1;
 static size_t pages_vprot_size;
-static BYTE **pages_vprot;
+static BYTE **pages_vprot;  /* each block is followed by the summaries of its chunks */
 #else  /* on 32-bit we use a simple array with one byte per page */
 static BYTE *pages_vprot;
+static WORD *pages_vprot_chunks;
 #endif
 
 static struct file_view *view_block_start, *view_block_end, *next_free_view;
@@ -175,6 +193,37 @@ static inline int is_view_valloc( const struct file_view *view )
     return !(view->protect & (SEC_FILE | SEC_RESERVE | SEC_COMMIT));
 }
 
+/***********************************************************************
+ *           get_vprot_chunk
+ *
+ * Return the summary of the chunk containing a page. The page protection block must exist.
+ */
+static inline WORD *get_vprot_chunk( size_t idx )
+{
+#ifdef _WIN64
+    BYTE *block = pages_vprot[idx >> pages_vprot_shift];
+    return (WORD *)(block + pages_vprot_mask + 1) + ((idx & pages_vprot_mask) >> VPROT_CHUNK_SHIFT);
+#else
+    return pages_vprot_chunks + (idx >> VPROT_CHUNK_SHIFT);
+#endif
+}
+
+
+/***********************************************************************
+ *           get_vprot_ptr
+ *
+ * Return a pointer to the protection byte of a page. The page protection block must exist.
+ */
+static inline BYTE *get_vprot_ptr( size_t idx )
+{
+#ifdef _WIN64
+    return pages_vprot[idx >> pages_vprot_shift] + (idx & pages_vprot_mask);
+#else
+    return pages_vprot + idx;
+#endif
+}
+
+
 /***********************************************************************
  *           get_page_vprot
  *
@@ -183,14 +232,60 @@ static inline int is_view_valloc( const struct file_view *view )
 static BYTE get_page_vprot( const void *addr )
 {
     size_t idx = (size_t)addr >> page_shift;
+    WORD chunk;
 
 #ifdef _WIN64
     if ((idx >> pages_vprot_shift) >= pages_vprot_size) return 0;
     if (!pages_vprot[idx >> pages_vprot_shift]) return 0;
-    return pages_vprot[idx >> pages_vprot_shift][idx & pages_vprot_mask];
-#else
-    return pages_vprot[idx];
 #endif
+    chunk = *get_vprot_chunk( idx );
+    if (chunk & VPROT_CHUNK_UNIFORM) return chunk;
+    return *get_vprot_ptr( idx );
+}
+
+
+/***********************************************************************
+ *           update_vprot_range
+ *
+ * Set and clear bits in the protection bytes of a range of pages.
+ */
+static void update_vprot_range( size_t idx, size_t end, BYTE set, BYTE clear )
+{
+    while (idx < end)
+    {
+        size_t i, chunk_end = min( end, (idx | (VPROT_CHUNK_SIZE - 1)) + 1 );
+        BOOL full = !(idx & (VPROT_CHUNK_SIZE - 1)) && chunk_end - idx == VPROT_CHUNK_SIZE;
+        WORD *chunk = get_vprot_chunk( idx );
+        BYTE *ptr = get_vprot_ptr( idx );
+
+        if (*chunk & VPROT_CHUNK_UNIFORM)
+        {
+            BYTE vprot = (*chunk & ~clear) | set;
+
+            if (full)
+            {
+                *chunk = VPROT_CHUNK_UNIFORM | vprot;
+                idx = chunk_end;
+                continue;
+            }
+            /* only part of the chunk changes, expand it to separate bytes */
+            memset( ptr - (idx & (VPROT_CHUNK_SIZE - 1)), (BYTE)*chunk, VPROT_CHUNK_SIZE );
+            *chunk = 0;
+        }
+        else if (full && clear == 0xff)
+        {
+            *chunk = VPROT_CHUNK_UNIFORM | set;
+            idx = chunk_end;
+            continue;
+        }
+
+        if (clear == 0xff) memset( ptr, set, chunk_end - idx );
+        else for (i = 0; i < chunk_end - idx; i++) ptr[i] = (ptr[i] & ~clear) | set;
+
+        /* collapse the chunk again if all its pages ended up with the same protection */
+        if (full && !memcmp( ptr, ptr + 1, VPROT_CHUNK_SIZE - 1 )) *chunk = VPROT_CHUNK_UNIFORM | ptr[0];
+        idx = chunk_end;
+    }
 }
 
 
@@ -204,17 +299,7 @@ static void set_page_vprot( const void *addr, size_t size, BYTE vprot )
     size_t idx = (size_t)addr >> page_shift;
     size_t end = ((size_t)addr + size + page_mask) >> page_shift;
 
-#ifdef _WIN64
-    while (idx >> pages_vprot_shift != end >> pages_vprot_shift)
-    {
-        size_t dir_size = pages_vprot_mask + 1 - (idx & pages_vprot_mask);
-        memset( pages_vprot[idx >> pages_vprot_shift] + (idx & pages_vprot_mask), vprot, dir_size );
-        idx += dir_size;
-    }
-    memset( pages_vprot[idx >> pages_vprot_shift] + (idx & pages_vprot_mask), vprot, end - idx );
-#else
-    memset( pages_vprot + idx, vprot, end - idx );
-#endif
+    update_vprot_range( idx, end, vprot, 0xff );
 }
 
 
@@ -228,15 +313,48 @@ static void set_page_vprot_bits( const void *addr, size_t size, BYTE set, BYTE c
     size_t idx = (size_t)addr >> page_shift;
     size_t end = ((size_t)addr + size + page_mask) >> page_shift;
 
-#ifdef _WIN64
-    for ( ; idx < end; idx++)
+    update_vprot_range( idx, end, set, clear );
+}
+
+
+/***********************************************************************
+ *           get_vprot_range_size
+ *
+ * Return the size of the range starting at base where the page protection bytes
+ * are identical once masked, and the protection byte of the first page.
+ */
+static SIZE_T get_vprot_range_size( char *base, SIZE_T size, BYTE mask, BYTE *vprot )
+{
+    size_t idx = (size_t)base >> page_shift, start = idx;
+    size_t end = ((size_t)base + size + page_mask) >> page_shift;
+
+    *vprot = get_page_vprot( base );
+    while (idx < end)
     {
-        BYTE *ptr = pages_vprot[idx >> pages_vprot_shift] + (idx & pages_vprot_mask);
-        *ptr = (*ptr & ~clear) | set;
-    }
-#else
-    for ( ; idx < end; idx++) pages_vprot[idx] = (pages_vprot[idx] & ~clear) | set;
+        size_t chunk_end = min( end, (idx | (VPROT_CHUNK_SIZE - 1)) + 1 );
+        const BYTE *ptr;
+        WORD chunk;
+
+#ifdef _WIN64
+        if ((idx >> pages_vprot_shift) >= pages_vprot_size || !pages_vprot[idx >> pages_vprot_shift])
+        {
+            if (*vprot & mask) break;
+            idx = min( end, (idx | pages_vprot_mask) + 1 );
+            continue;
+        }
 #endif
+        chunk = *get_vprot_chunk( idx );
+        if (chunk & VPROT_CHUNK_UNIFORM)
+        {
+            if ((chunk ^ *vprot) & mask) break;
+            idx = chunk_end;
+            continue;
+        }
+        for (ptr = get_vprot_ptr( idx ); idx < chunk_end; idx++, ptr++)
+            if ((*ptr ^ *vprot) & mask) break;
+        if (idx < chunk_end) break;
+    }
+    return (idx - start) << page_shift;
 }
 
 
@@ -257,7 +375,8 @@ static BOOL alloc_pages_vprot( const void *addr, size_t size )
     for (i = idx >> pages_vprot_shift; i < (end + pages_vprot_mask) >> pages_vprot_shift; i++)
     {
         if (pages_vprot[i]) continue;
-        if ((ptr = wine_anon_mmap( NULL, pages_vprot_mask + 1, PROT_READ | PROT_WRITE, 0 )) == (void *)-1)
+        if ((ptr = wine_anon_mmap( NULL, pages_vprot_mask + 1 + ((pages_vprot_mask + 1) >> VPROT_CHUNK_SHIFT) * sizeof(WORD),
+                                   PROT_READ | PROT_WRITE, 0 )) == (void *)-1)
             return FALSE;
         pages_vprot[i] = ptr;
     }
@@ -281,6 +400,35 @@ static int compare_view( const void *addr, const struct wine_rb_entry *entry )
 }
 
 
+/***********************************************************************
+ *           augment_view
+ *
+ * Update the subtree range and largest gap of a view from its children in the rb tree.
+ */
+static void augment_view( struct wine_rb_entry *entry )
+{
+    struct file_view *view = WINE_RB_ENTRY_VALUE( entry, struct file_view, entry );
+    struct file_view *left = entry->left ? WINE_RB_ENTRY_VALUE( entry->left, struct file_view, entry ) : NULL;
+    struct file_view *right = entry->right ? WINE_RB_ENTRY_VALUE( entry->right, struct file_view, entry ) : NULL;
+    size_t gap = 0;
+
+    view->tree_start = view->base;
+    view->tree_end = (char *)view->base + view->size;
+    if (left)
+    {
+        view->tree_start = left->tree_start;
+        gap = max( left->max_gap, (size_t)((char *)view->base - (char *)left->tree_end) );
+    }
+    if (right)
+    {
+        view->tree_end = right->tree_end;
+        gap = max( gap, right->max_gap );
+        gap = max( gap, (size_t)((char *)right->tree_start - ((char *)view->base + view->size)) );
+    }
+    view->max_gap = gap;
+}
+
+
 /***********************************************************************
  *           VIRTUAL_GetProtStr
  */
@@ -323,9 +471,9 @@ static int VIRTUAL_GetUnixProt( BYTE vprot )
  */
 static void VIRTUAL_DumpView( struct file_view *view )
 {
-    UINT i, count;
-    char *addr = view->base;
-    BYTE prot = get_page_vprot( addr );
+    char *addr = view->base, *end = addr + view->size;
+    SIZE_T range_size;
+    BYTE prot;
 
     TRACE( "View: %p - %p", addr, addr + view->size - 1 );
     if (view->protect & VPROT_SYSTEM)
@@ -339,19 +487,11 @@ static void VIRTUAL_DumpView( struct file_view *view )
     else
         TRACE( " (valloc)\n");
 
-    for (count = i = 1; i < view->size >> page_shift; i++, count++)
+    for ( ; addr < end; addr += range_size)
     {
-        BYTE next = get_page_vprot( addr + (count << page_shift) );
-        if (next == prot) continue;
-        TRACE( "      %p - %p %s\n",
-                 addr, addr + (count << page_shift) - 1, VIRTUAL_GetProtStr(prot) );
-        addr += (count << page_shift);
-        prot = next;
-        count = 0;
+        range_size = get_vprot_range_size( addr, end - addr, 0xff, &prot );
+        TRACE( "      %p - %p %s\n", addr, addr + range_size - 1, VIRTUAL_GetProtStr(prot) );
     }
-    if (count)
-        TRACE( "      %p - %p %s\n",
-                 addr, addr + (count << page_shift) - 1, VIRTUAL_GetProtStr(prot) );
 }
 
 
@@ -451,70 +591,104 @@ static struct file_view *find_view_range( const void *addr, size_t size )
 
 
 /***********************************************************************
- *           find_free_area
+ *           fit_free_area
  *
- * Find a free area between views inside the specified range.
- * The csVirtual section must be held by caller.
+ * Check if an aligned area of the requested size fits in the free range start-end,
+ * clipped to the base-limit range.
  */
-static void *find_free_area( void *base, void *end, size_t size, size_t mask, int top_down )
+static void *fit_free_area( char *start, char *end, char *base, char *limit,
+                            size_t size, size_t mask, int top_down )
 {
-    struct wine_rb_entry *first = NULL, *ptr = views_tree.root;
-    void *start;
+    char *ptr;
 
-    /* find the first (resp. last) view inside the range */
-    while (ptr)
+    start = max( start, base );
+    end = min( end, limit );
+    if (start >= end || (size_t)(end - start) < size) return NULL;
+
+    if (top_down)
     {
-        struct file_view *view = WINE_RB_ENTRY_VALUE( ptr, struct file_view, entry );
-        if ((char *)view->base + view->size >= (char *)end)
-        {
-            end = min( end, view->base );
-            ptr = ptr->left;
-        }
-        else if (view->base <= base)
+        ptr = ROUND_ADDR( end - size, mask );
+        if (ptr < start) return NULL;
+    }
+    else
+    {
+        ptr = ROUND_ADDR( start + mask, mask );
+        if (!ptr || ptr < start || ptr >= end || (size_t)(end - ptr) < size) return NULL;
+    }
+    return ptr;
+}
+
+
+/***********************************************************************
+ *           find_free_gap
+ *
+ * Find a free area between the views of a subtree, using the largest gap of
+ * each subtree to skip the ones that can't contain it.
+ */
+static void *find_free_gap( struct wine_rb_entry *entry, char *base, char *limit,
+                            size_t size, size_t mask, int top_down )
+{
+    struct file_view *view, *left, *right;
+    char *start, *end;
+    void *ptr;
+
+    while (entry)
+    {
+        view = WINE_RB_ENTRY_VALUE( entry, struct file_view, entry );
+        if (view->max_gap < size) return NULL;
+        start = max( (char *)view->tree_start, base );
+        end = min( (char *)view->tree_end, limit );
+        if (start >= end || (size_t)(end - start) < size) return NULL;
+
+        left = entry->left ? WINE_RB_ENTRY_VALUE( entry->left, struct file_view, entry ) : NULL;
+        right = entry->right ? WINE_RB_ENTRY_VALUE( entry->right, struct file_view, entry ) : NULL;
+
+        if (top_down)
         {
-            base = max( (char *)base, (char *)view->base + view->size );
-            ptr = ptr->right;
+            if ((ptr = find_free_gap( entry->right, base, limit, size, mask, top_down ))) return ptr;
+            if (right && (ptr = fit_free_area( (char *)view->base + view->size, right->tree_start,
+                                               base, limit, size, mask, top_down ))) return ptr;
+            if (left && (ptr = fit_free_area( left->tree_end, view->base,
+                                              base, limit, size, mask, top_down ))) return ptr;
+            entry = entry->left;
         }
         else
         {
-            first = ptr;
-            ptr = top_down ? ptr->right : ptr->left;
+            if ((ptr = find_free_gap( entry->left, base, limit, size, mask, top_down ))) return ptr;
+            if (left && (ptr = fit_free_area( left->tree_end, view->base,
+                                              base, limit, size, mask, top_down ))) return ptr;
+            if (right && (ptr = fit_free_area( (char *)view->base + view->size, right->tree_start,
+                                               base, limit, size, mask, top_down ))) return ptr;
+            entry = entry->right;
         }
     }
+    return NULL;
+}
 
-    if (top_down)
-    {
-        start = ROUND_ADDR( (char *)end - size, mask );
-        if (start >= end || start < base) return NULL;
-
-        while (first)
-        {
-            struct file_view *view = WINE_RB_ENTRY_VALUE( first, struct file_view, entry );
 
-            if ((char *)view->base + view->size <= (char *)start) break;
-            start = ROUND_ADDR( (char *)view->base - size, mask );
-            /* stop if remaining space is not large enough */
-            if (!start || start >= end || start < base) return NULL;
-            first = wine_rb_prev( first );
-        }
-    }
-    else
-    {
-        start = ROUND_ADDR( (char *)base + mask, mask );
-        if (!start || start >= end || (char *)end - (char *)start < size) return NULL;
+/***********************************************************************
+ *           find_free_area
+ *
+ * Find a free area between views inside the specified range.
+ * The csVirtual section must be held by caller.
+ */
+static void *find_free_area( void *base, void *end, size_t size, size_t mask, int top_down )
+{
+    struct file_view *root;
+    void *ptr;
 
-        while (first)
-        {
-            struct file_view *view = WINE_RB_ENTRY_VALUE( first, struct file_view, entry );
+    if (!views_tree.root) return fit_free_area( base, end, base, end, size, mask, top_down );
 
-            if ((char *)view->base >= (char *)start + size) break;
-            start = ROUND_ADDR( (char *)view->base + view->size + mask, mask );
-            /* stop if remaining space is not large enough */
-            if (!start || start >= end || (char *)end - (char *)start < size) return NULL;
-            first = wine_rb_next( first );
-        }
+    root = WINE_RB_ENTRY_VALUE( views_tree.root, struct file_view, entry );
+    if (top_down)
+    {
+        if ((ptr = fit_free_area( root->tree_end, end, base, end, size, mask, top_down ))) return ptr;
+        if ((ptr = find_free_gap( views_tree.root, base, end, size, mask, top_down ))) return ptr;
+        return fit_free_area( base, root->tree_start, base, end, size, mask, top_down );
     }
-    return start;
+    if ((ptr = fit_free_area( base, root->tree_start, base, end, size, mask, top_down ))) return ptr;
+    if ((ptr = find_free_gap( views_tree.root, base, end, size, mask, top_down ))) return ptr;
+    return fit_free_area( root->tree_end, end, base, end, size, mask, top_down );
 }
 
 
@@ -838,22 +1012,25 @@ static inline int mprotect_exec( void *base, size_t size, int unix_prot )
  */
 static void mprotect_range( void *base, size_t size, BYTE set, BYTE clear )
 {
-    size_t i, count;
-    char *addr = ROUND_ADDR( base, page_mask );
-    int prot, next;
+    SIZE_T range_size;
+    char *addr = ROUND_ADDR( base, page_mask ), *start, *end;
+    int prot = 0, next;
+    BYTE vprot;
 
     size = ROUND_SIZE( base, size );
-    prot = VIRTUAL_GetUnixProt( (get_page_vprot( addr ) & ~clear ) | set );
-    for (count = i = 1; i < size >> page_shift; i++, count++)
+    end = addr + size;
+    for (start = addr; addr < end; addr += range_size)
     {
-        next = VIRTUAL_GetUnixProt( (get_page_vprot( addr + (count << page_shift) ) & ~clear) | set );
-        if (next == prot) continue;
-        mprotect_exec( addr, count << page_shift, prot );
-        addr += count << page_shift;
+        range_size = get_vprot_range_size( addr, end - addr, 0xff, &vprot );
+        next = VIRTUAL_GetUnixProt( (vprot & ~clear) | set );
+        if (addr > start && next != prot)
+        {
+            mprotect_exec( start, addr - start, prot );
+            start = addr;
+        }
         prot = next;
-        count = 0;
     }
-    if (count) mprotect_exec( addr, count << page_shift, prot );
+    if (end > start) mprotect_exec( start, end - start, prot );
 }
 
 
@@ -926,6 +1103,228 @@ static NTSTATUS set_protection( struct file_view *view, void *base, SIZE_T size,
 }
 
 
+/* Write watches tracked by the kernel
+ *
+ * With a userfaultfd in asynchronous write-protect mode the kernel resolves the
+ * first write to a protected page by itself, without raising a signal, and
+ * remembers that the page was written. PAGEMAP_SCAN then returns the written
+ * pages of a range, and can protect them again at the same time. Views that
+ * use it have VPROT_UFFD_WATCH set and never have VPROT_WRITEWATCH in their
+ * page protection bytes.
+ */
+
+#if defined(__linux__) && defined(HAVE_LINUX_USERFAULTFD_H) && defined(__NR_userfaultfd)
+
+#ifndef UFFD_USER_MODE_ONLY
+#define UFFD_USER_MODE_ONLY 1
+#endif
+#ifndef UFFD_FEATURE_WP_UNPOPULATED
+#define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#endif
+#ifndef UFFD_FEATURE_WP_ASYNC
+#define UFFD_FEATURE_WP_ASYNC (1 << 15)
+#endif
+
+/* from linux/fs.h, which can't be included here */
+#ifndef PAGEMAP_SCAN
+#define PAGE_IS_WRITTEN        (1 << 1)
+#define PM_SCAN_WP_MATCHING    (1 << 0)
+#define PM_SCAN_CHECK_WPASYNC  (1 << 1)
+
+struct page_region
+{
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long categories;
+};
+
+struct pm_scan_arg
+{
+    unsigned long long size;
+    unsigned long long flags;
+    unsigned long long start;
+    unsigned long long end;
+    unsigned long long walk_end;
+    unsigned long long vec;
+    unsigned long long vec_len;
+    unsigned long long max_pages;
+    unsigned long long category_inverted;
+    unsigned long long category_mask;
+    unsigned long long category_anyof_mask;
+    unsigned long long return_mask;
+};
+
+#define PAGEMAP_SCAN _IOWR('f', 16, struct pm_scan_arg)
+#endif
+
+static int uffd_fd = -1;     /* userfaultfd for write watches, -1 if not available */
+static int pagemap_fd = -1;  /* /proc/self/pagemap, for PAGEMAP_SCAN */
+
+/***********************************************************************
+ *           init_uffd_write_watches
+ *
+ * Check if the kernel can track write watches. The csVirtual section must be held by caller.
+ */
+static BOOL init_uffd_write_watches(void)
+{
+    static const unsigned long long features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED;
+    static BOOL initialized;
+    struct uffdio_api api;
+    struct pm_scan_arg arg;
+    int fd;
+
+    if (initialized) return uffd_fd != -1;
+    initialized = TRUE;
+
+    if ((fd = syscall( __NR_userfaultfd, O_CLOEXEC | O_NONBLOCK | UFFD_USER_MODE_ONLY )) == -1)
+    {
+        TRACE( "userfaultfd not available (%s), using page faults for write watches\n", strerror(errno) );
+        return FALSE;
+    }
+    memset( &api, 0, sizeof(api) );
+    api.api = UFFD_API;
+    api.features = features;
+    if (ioctl( fd, UFFDIO_API, &api ) || (api.features & features) != features)
+    {
+        TRACE( "asynchronous write protection not supported, using page faults for write watches\n" );
+        close( fd );
+        return FALSE;
+    }
+    if ((pagemap_fd = open( "/proc/self/pagemap", O_RDONLY | O_CLOEXEC )) == -1)
+    {
+        close( fd );
+        return FALSE;
+    }
+    /* an empty scan checks that PAGEMAP_SCAN is supported */
+    memset( &arg, 0, sizeof(arg) );
+    arg.size = sizeof(arg);
+    if (ioctl( pagemap_fd, PAGEMAP_SCAN, &arg ))
+    {
+        TRACE( "PAGEMAP_SCAN not supported, using page faults for write watches\n" );
+        close( pagemap_fd );
+        pagemap_fd = -1;
+        close( fd );
+        return FALSE;
+    }
+    TRACE( "using userfaultfd for write watches\n" );
+    uffd_fd = fd;
+    return TRUE;
+}
+
+/***********************************************************************
+ *           uffd_reset_range
+ *
+ * Write-protect a registered range, so that the next writes are recorded.
+ */
+static BOOL uffd_reset_range( void *base, size_t size )
+{
+    struct uffdio_writeprotect wp;
+
+    memset( &wp, 0, sizeof(wp) );
+    wp.range.start = (ULONG_PTR)base;
+    wp.range.len = size;
+    wp.mode = UFFDIO_WRITEPROTECT_MODE_WP;
+    return !ioctl( uffd_fd, UFFDIO_WRITEPROTECT, &wp );
+}
+
+/***********************************************************************
+ *           uffd_protect_range
+ *
+ * Register a range with the userfaultfd and write-protect it.
+ */
+static BOOL uffd_protect_range( void *base, size_t size )
+{
+    struct uffdio_register reg;
+
+    memset( &reg, 0, sizeof(reg) );
+    reg.range.start = (ULONG_PTR)base;
+    reg.range.len = size;
+    reg.mode = UFFDIO_REGISTER_MODE_WP;
+    if (ioctl( uffd_fd, UFFDIO_REGISTER, &reg )) return FALSE;
+    return uffd_reset_range( base, size );
+}
+
+/***********************************************************************
+ *           uffd_watch_view
+ *
+ * Switch a new write watch view to kernel tracking if possible.
+ * The csVirtual section must be held by caller.
+ */
+static void uffd_watch_view( struct file_view *view )
+{
+    if (!init_uffd_write_watches()) return;
+    if (!uffd_protect_range( view->base, view->size ))
+    {
+        WARN( "failed to register %p-%p, using page faults\n", view->base, (char *)view->base + view->size );
+        return;
+    }
+    view->protect |= VPROT_UFFD_WATCH;
+    set_page_vprot_bits( view->base, view->size, 0, VPROT_WRITEWATCH );
+    mprotect_range( view->base, view->size, 0, 0 );
+}
+
+/***********************************************************************
+ *           uffd_get_write_watches
+ *
+ * Return the written pages of a range, optionally protecting them again.
+ */
+static void uffd_get_write_watches( char *base, size_t size, void **addresses, ULONG_PTR *count, BOOL reset )
+{
+    struct page_region regions[64];
+    struct pm_scan_arg arg;
+    ULONG_PTR pos = 0;
+    char *addr = base, *end = base + size, *page;
+    int i, ret;
+
+    while (pos < *count && addr < end)
+    {
+        memset( &arg, 0, sizeof(arg) );
+        arg.size = sizeof(arg);
+        arg.flags = PM_SCAN_CHECK_WPASYNC | (reset ? PM_SCAN_WP_MATCHING : 0);
+        arg.start = (ULONG_PTR)addr;
+        arg.end = (ULONG_PTR)end;
+        arg.vec = (ULONG_PTR)regions;
+        arg.vec_len = ARRAY_SIZE(regions);
+        arg.max_pages = *count - pos;
+        arg.category_mask = PAGE_IS_WRITTEN;
+        arg.return_mask = PAGE_IS_WRITTEN;
+        if ((ret = ioctl( pagemap_fd, PAGEMAP_SCAN, &arg )) == -1)
+        {
+            ERR( "PAGEMAP_SCAN failed for %p-%p: %s\n", addr, end, strerror(errno) );
+            break;
+        }
+        for (i = 0; i < ret; i++)
+            for (page = (char *)(ULONG_PTR)regions[i].start; page < (char *)(ULONG_PTR)regions[i].end; page += page_size)
+                addresses[pos++] = page;
+        addr = (char *)(ULONG_PTR)arg.walk_end;
+    }
+    *count = pos;
+}
+
+#else  /* __linux__ && HAVE_LINUX_USERFAULTFD_H */
+
+static BOOL uffd_reset_range( void *base, size_t size )
+{
+    return FALSE;
+}
+
+static BOOL uffd_protect_range( void *base, size_t size )
+{
+    return FALSE;
+}
+
+static void uffd_watch_view( struct file_view *view )
+{
+}
+
+static void uffd_get_write_watches( char *base, size_t size, void **addresses, ULONG_PTR *count, BOOL reset )
+{
+    *count = 0;
+}
+
+#endif  /* __linux__ && HAVE_LINUX_USERFAULTFD_H */
+
+
 /***********************************************************************
  *           update_write_watches
  */
@@ -944,8 +1343,13 @@ static void update_write_watches( void *base, size_t size, size_t accessed_size
  *
  * Reset write watches in a memory range.
  */
-static void reset_write_watches( void *base, SIZE_T size )
+static void reset_write_watches( struct file_view *view, void *base, SIZE_T size )
 {
+    if (view->protect & VPROT_UFFD_WATCH)
+    {
+        if (!uffd_reset_range( base, size )) ERR( "failed to reset %p-%p\n", base, (char *)base + size );
+        return;
+    }
     set_page_vprot_bits( base, size, VPROT_WRITEWATCH, 0 );
     mprotect_range( base, size, 0, 0 );
 }
@@ -1211,7 +1615,7 @@ done:
  */
 static SIZE_T get_committed_size( struct file_view *view, void *base, BYTE *vprot )
 {
-    SIZE_T i, start;
+    SIZE_T start;
 
     start = ((char *)base - (char *)view->base) >> page_shift;
     *vprot = get_page_vprot( base );
@@ -1236,9 +1640,8 @@ static SIZE_T get_committed_size( struct file_view *view, void *base, BYTE *vpro
         SERVER_END_REQ;
         return ret;
     }
-    for (i = start + 1; i < view->size >> page_shift; i++)
-        if ((*vprot ^ get_page_vprot( (char *)view->base + (i << page_shift) )) & VPROT_COMMITTED) break;
-    return (i - start) << page_shift;
+    return get_vprot_range_size( (char *)view->base + (start << page_shift),
+                                 view->size - (start << page_shift), VPROT_COMMITTED, vprot );
 }
 
 
@@ -1253,6 +1656,9 @@ static NTSTATUS decommit_pages( struct file_view *view, size_t start, size_t siz
     if (wine_anon_mmap( (char *)view->base + start, size, PROT_NONE, MAP_FIXED ) != (void *)-1)
     {
         set_page_vprot_bits( (char *)view->base + start, size, 0, VPROT_COMMITTED );
+        /* the new mapping is not registered with the userfaultfd anymore */
+        if ((view->protect & VPROT_UFFD_WATCH) && !uffd_protect_range( (char *)view->base + start, size ))
+            ERR( "failed to register %p-%p again\n", (char *)view->base + start, (char *)view->base + start + size );
         return STATUS_SUCCESS;
     }
     return FILE_GetNtStatus();
@@ -1358,7 +1764,8 @@ static NTSTATUS map_pe_header( void *ptr, size_t size, int fd, BOOL *removable )
  * Map an executable (PE format) image into memory.
  */
 static NTSTATUS map_image( HANDLE hmapping, ACCESS_MASK access, int fd, SIZE_T mask,
-                           pe_image_info_t *image_info, int shared_fd, BOOL removable, PVOID *addr_ptr )
+                           pe_image_info_t *image_info, int shared_fd, int layout_fd,
+                           BOOL removable, PVOID *addr_ptr )
 {
     IMAGE_DOS_HEADER *dos;
     IMAGE_NT_HEADERS *nt;
@@ -1516,14 +1923,30 @@ static NTSTATUS map_image( HANDLE hmapping, ACCESS_MASK access, int fd, SIZE_T m
 
         if (!sec->PointerToRawData || !file_size) continue;
 
-        /* Note: if the section is not aligned properly map_file_into_view will magically
-         *       fall back to read(), so we don't need to check anything here.
-         */
         end = file_start + file_size;
         if (sec->PointerToRawData >= st.st_size ||
             end > ((st.st_size + sector_align) & ~sector_align) ||
-            end < file_start ||
-            map_file_into_view( view, fd, sec->VirtualAddress, file_size, file_start,
+            end < file_start)
+        {
+            ERR_(module)( "Could not map section %.8s, file probably truncated\n", sec->Name );
+            goto error;
+        }
+
+        /* the server keeps a page-aligned copy of the sections that are not aligned in the file,
+         * already zero-padded, so that their pages are shared with other processes */
+        if (layout_fd != -1 && (file_start & page_mask))
+        {
+            if (map_file_into_view( view, layout_fd, sec->VirtualAddress, ROUND_SIZE( 0, file_size ),
+                                    sec->VirtualAddress, VPROT_COMMITTED | VPROT_READ | VPROT_WRITECOPY,
+                                    FALSE ) == STATUS_SUCCESS)
+                continue;
+            WARN_(module)( "Could not map section %.8s from the image layout\n", sec->Name );
+        }
+
+        /* Note: if the section is not aligned properly map_file_into_view will magically
+         *       fall back to read(), so we don't need to check anything here.
+         */
+        if (map_file_into_view( view, fd, sec->VirtualAddress, file_size, file_start,
                                 VPROT_COMMITTED | VPROT_READ | VPROT_WRITECOPY,
                                 removable ) != STATUS_SUCCESS)
         {
@@ -1618,7 +2041,7 @@ NTSTATUS virtual_map_section( HANDLE handle, PVOID *addr_ptr, ULONG zero_bits, S
     int unix_handle = -1, needs_close;
     unsigned int vprot, sec_flags;
     struct file_view *view;
-    HANDLE shared_file;
+    HANDLE shared_file, image_file;
     LARGE_INTEGER offset;
     sigset_t sigset;
 
@@ -1655,6 +2078,7 @@ NTSTATUS virtual_map_section( HANDLE handle, PVOID *addr_ptr, ULONG zero_bits, S
         sec_flags   = reply->flags;
         full_size   = reply->size;
         shared_file = wine_server_ptr_handle( reply->shared_file );
+        image_file  = wine_server_ptr_handle( reply->image_file );
     }
     SERVER_END_REQ;
     if (res) return res;
@@ -1663,21 +2087,31 @@ NTSTATUS virtual_map_section( HANDLE handle, PVOID *addr_ptr, ULONG zero_bits, S
 
     if (sec_flags & SEC_IMAGE)
     {
+        int shared_fd = -1, shared_needs_close = 0;
+        int layout_fd = -1, layout_needs_close = 0;
+
         if (shared_file)
         {
-            int shared_fd, shared_needs_close;
-
-            if ((res = server_get_unix_fd( shared_file, FILE_READ_DATA|FILE_WRITE_DATA,
-                                           &shared_fd, &shared_needs_close, NULL, NULL ))) goto done;
-            res = map_image( handle, access, unix_handle, mask, image_info,
-                             shared_fd, needs_close, addr_ptr );
-            if (shared_needs_close) close( shared_fd );
+            res = server_get_unix_fd( shared_file, FILE_READ_DATA|FILE_WRITE_DATA,
+                                      &shared_fd, &shared_needs_close, NULL, NULL );
             close_handle( shared_file );
+            if (res)
+            {
+                if (image_file) close_handle( image_file );
+                goto done;
+            }
         }
-        else
+        if (image_file)
         {
-            res = map_image( handle, access, unix_handle, mask, image_info, -1, needs_close, addr_ptr );
+            /* not fatal, the sections will be read from the file instead */
+            if (server_get_unix_fd( image_file, FILE_READ_DATA, &layout_fd, &layout_needs_close, NULL, NULL ))
+                layout_fd = -1;
+            close_handle( image_file );
         }
+        res = map_image( handle, access, unix_handle, mask, image_info,
+                         shared_fd, layout_fd, needs_close, addr_ptr );
+        if (shared_needs_close) close( shared_fd );
+        if (layout_needs_close) close( layout_fd );
         if (needs_close) close( unix_handle );
         if (res >= 0) *size_ptr = image_info->map_size;
         return res;
@@ -1819,7 +2253,8 @@ void virtual_init(void)
     pages_vprot_size = ((size_t)address_space_limit >> page_shift >> pages_vprot_shift) + 1;
     alloc_views.size = view_block_size + pages_vprot_size * sizeof(*pages_vprot);
 #else
-    alloc_views.size = view_block_size + (1U << (32 - page_shift));
+    alloc_views.size = view_block_size + (1U << (32 - page_shift)) +
+                       (1U << (32 - page_shift - VPROT_CHUNK_SHIFT)) * sizeof(WORD);
 #endif
     if (wine_mmap_enum_reserved_areas( alloc_virtual_heap, &alloc_views, 1 ))
         wine_mmap_remove_reserved_area( alloc_views.base, alloc_views.size, 0 );
@@ -1830,7 +2265,10 @@ void virtual_init(void)
     view_block_start = alloc_views.base;
     view_block_end = view_block_start + view_block_size / sizeof(*view_block_start);
     pages_vprot = (void *)((char *)alloc_views.base + view_block_size);
-    wine_rb_init( &views_tree, compare_view );
+#ifndef _WIN64
+    pages_vprot_chunks = (WORD *)(pages_vprot + (1U << (32 - page_shift)));
+#endif
+    wine_rb_init_augmented( &views_tree, compare_view, augment_view );
 
     /* make the DOS area accessible (except the low 64K) to hide bugs in broken apps like Excel 2003 */
     size = (char *)address_space_start - (char *)0x10000;
@@ -1967,6 +2405,7 @@ NTSTATUS virtual_alloc_thread_stack( TEB *teb, SIZE_T reserve_size, SIZE_T commi
         /* shrink the first view and create a second one for the extra size */
         /* this allows the app to free the stack without freeing the thread start portion */
         view->size -= extra_size;
+        wine_rb_augment_path( &views_tree, &view->entry );
         status = create_view( &extra_view, (char *)view->base + view->size, extra_size,
                               VPROT_READ | VPROT_WRITE | VPROT_COMMITTED );
         if (status != STATUS_SUCCESS)
@@ -2046,13 +2485,14 @@ NTSTATUS virtual_handle_fault( LPCVOID addr, DWORD err, BOOL on_signal_stack )
  */
 static NTSTATUS check_write_access( void *base, size_t size, BOOL *has_write_watch )
 {
-    size_t i;
+    size_t i, range_size;
     char *addr = ROUND_ADDR( base, page_mask );
+    BYTE vprot;
 
     size = ROUND_SIZE( base, size );
-    for (i = 0; i < size; i += page_size)
+    for (i = 0; i < size; i += range_size)
     {
-        BYTE vprot = get_page_vprot( addr + i );
+        range_size = get_vprot_range_size( addr + i, size - i, 0xff, &vprot );
         if (vprot & VPROT_WRITEWATCH) *has_write_watch = TRUE;
         if (!(VIRTUAL_GetUnixProt( vprot & ~VPROT_WRITEWATCH ) & PROT_WRITE))
             return STATUS_INVALID_USER_BUFFER;
@@ -2552,7 +2992,11 @@ NTSTATUS WINAPI NtAllocateVirtualMemory( HANDLE process, PVOID *ret, ULONG zero_
             else if (is_dos_memory) status = allocate_dos_memory( &view, vprot );
             else status = map_view( &view, base, size, mask, type & MEM_TOP_DOWN, vprot );
 
-            if (status == STATUS_SUCCESS) base = view->base;
+            if (status == STATUS_SUCCESS)
+            {
+                base = view->base;
+                if (vprot & VPROT_WRITEWATCH) uffd_watch_view( view );
+            }
         }
     }
     else if (type & MEM_RESET)
@@ -2914,7 +3358,6 @@ NTSTATUS WINAPI NtQueryVirtualMemory( HANDLE process, LPCVOID addr,
     else
     {
         BYTE vprot;
-        char *ptr;
         SIZE_T range_size = get_committed_size( view, base, &vprot );
 
         info->State = (vprot & VPROT_COMMITTED) ? MEM_COMMIT : MEM_RESERVE;
@@ -2923,9 +3366,7 @@ NTSTATUS WINAPI NtQueryVirtualMemory( HANDLE process, LPCVOID addr,
         if (view->protect & SEC_IMAGE) info->Type = MEM_IMAGE;
         else if (view->protect & (SEC_FILE | SEC_RESERVE | SEC_COMMIT)) info->Type = MEM_MAPPED;
         else info->Type = MEM_PRIVATE;
-        for (ptr = base; ptr < base + range_size; ptr += page_size)
-            if ((get_page_vprot( ptr ) ^ vprot) & ~VPROT_WRITEWATCH) break;
-        info->RegionSize = ptr - base;
+        info->RegionSize = get_vprot_range_size( base, range_size, ~VPROT_WRITEWATCH, &vprot );
     }
     server_leave_uninterrupted_section( &csVirtual, &sigset );
 
@@ -3326,6 +3767,7 @@ NTSTATUS WINAPI NtFlushVirtualMemory( HANDLE process, LPCVOID *addr_ptr,
 NTSTATUS WINAPI NtGetWriteWatch( HANDLE process, ULONG flags, PVOID base, SIZE_T size, PVOID *addresses,
                                  ULONG_PTR *count, ULONG *granularity )
 {
+    struct file_view *view;
     NTSTATUS status = STATUS_SUCCESS;
     sigset_t sigset;
 
@@ -3343,22 +3785,30 @@ NTSTATUS WINAPI NtGetWriteWatch( HANDLE process, ULONG flags, PVOID base, SIZE_T
 
     server_enter_uninterrupted_section( &csVirtual, &sigset );
 
-    if (is_write_watch_range( base, size ))
+    if (!(view = VIRTUAL_FindView( base, size )) || !(view->protect & VPROT_WRITEWATCH))
+        status = STATUS_INVALID_PARAMETER;
+    else if (view->protect & VPROT_UFFD_WATCH)
+    {
+        uffd_get_write_watches( base, size, addresses, count, flags & WRITE_WATCH_FLAG_RESET );
+        *granularity = page_size;
+    }
+    else
     {
         ULONG_PTR pos = 0;
-        char *addr = base;
+        char *addr = base, *next;
         char *end = addr + size;
+        BYTE vprot;
 
         while (pos < *count && addr < end)
         {
-            if (!(get_page_vprot( addr ) & VPROT_WRITEWATCH)) addresses[pos++] = addr;
-            addr += page_size;
+            next = addr + get_vprot_range_size( addr, end - addr, VPROT_WRITEWATCH, &vprot );
+            if (vprot & VPROT_WRITEWATCH) addr = next;
+            else for ( ; pos < *count && addr < next; addr += page_size) addresses[pos++] = addr;
         }
-        if (flags & WRITE_WATCH_FLAG_RESET) reset_write_watches( base, addr - (char *)base );
+        if (flags & WRITE_WATCH_FLAG_RESET) reset_write_watches( view, base, addr - (char *)base );
         *count = pos;
         *granularity = page_size;
     }
-    else status = STATUS_INVALID_PARAMETER;
 
     server_leave_uninterrupted_section( &csVirtual, &sigset );
     return status;
@@ -3371,6 +3821,7 @@ NTSTATUS WINAPI NtGetWriteWatch( HANDLE process, ULONG flags, PVOID base, SIZE_T
  */
 NTSTATUS WINAPI NtResetWriteWatch( HANDLE process, PVOID base, SIZE_T size )
 {
+    struct file_view *view;
     NTSTATUS status = STATUS_SUCCESS;
     sigset_t sigset;
 
@@ -3383,8 +3834,8 @@ NTSTATUS WINAPI NtResetWriteWatch( HANDLE process, PVOID base, SIZE_T size )
 
     server_enter_uninterrupted_section( &csVirtual, &sigset );
 
-    if (is_write_watch_range( base, size ))
-        reset_write_watches( base, size );
+    if ((view = VIRTUAL_FindView( base, size )) && (view->protect & VPROT_WRITEWATCH))
+        reset_write_watches( view, base, size );
     else
         status = STATUS_INVALID_PARAMETER;
 
@@ -2740,6 +2740,60 @@ static inline void call_sendmsg_callback( SENDASYNCPROC callback, HWND hwnd, UIN
 }
 
 
+/***********************************************************************
+ *           get_queue_shared
+ *
+ * Retrieve the queue state shared by the server, mapping it on first use.
+ */
+const volatile struct queue_shared *get_queue_shared(void)
+{
+    struct user_thread_info *thread_info = get_user_thread_info();
+    HANDLE handle = 0;
+    SIZE_T size = 0;
+    void *ptr = NULL;
+
+    if (thread_info->queue_shared) return thread_info->queue_shared;
+
+    SERVER_START_REQ( get_queue_shared )
+    {
+        if (!wine_server_call( req )) handle = wine_server_ptr_handle( reply->handle );
+    }
+    SERVER_END_REQ;
+    if (!handle) return NULL;
+
+    if (!NtMapViewOfSection( handle, GetCurrentProcess(), &ptr, 0, 0, NULL, &size, ViewShare, 0, PAGE_READONLY ))
+        thread_info->queue_shared = ptr;
+    NtClose( handle );
+    return thread_info->queue_shared;
+}
+
+
+/***********************************************************************
+ *           can_skip_get_message
+ *
+ * Check the shared queue state to find out whether a get_message request
+ * would return nothing and leave the queue unchanged.
+ */
+static BOOL can_skip_get_message( HWND hwnd, UINT flags, UINT changed_mask )
+{
+    const volatile struct queue_shared *shared;
+    UINT filter = flags >> 16;
+    LARGE_INTEGER now;
+
+    if (hwnd == (HWND)-1 || !(shared = get_queue_shared())) return FALSE;
+
+    if (!filter) filter = QS_ALLINPUT;
+    if (filter & QS_POSTMESSAGE) filter |= QS_ALLPOSTMESSAGE | QS_HOTKEY | QS_TIMER;
+    if (shared->wake_bits & (filter | QS_SENDMESSAGE)) return FALSE;
+    if (shared->wake_mask != (changed_mask & (QS_SENDMESSAGE | QS_SMRESULT)) ||
+        shared->changed_mask != changed_mask) return FALSE;
+
+    /* the server relies on get_message requests to detect hung applications */
+    NtQuerySystemTime( &now );
+    return now.QuadPart - shared->last_get_msg < 10000000;
+}
+
+
 /***********************************************************************
  *           peek_message
  *
@@ -2761,6 +2815,14 @@ static BOOL peek_message( MSG *msg, HWND hwnd, UINT first, UINT last, UINT flags
     if (!first && !last) last = ~0;
     if (hwnd == HWND_BROADCAST) hwnd = HWND_TOPMOST;
 
+    if (can_skip_get_message( hwnd, flags, changed_mask ))
+    {
+        HeapFree( GetProcessHeap(), 0, buffer );
+        thread_info->wake_mask = changed_mask & (QS_SENDMESSAGE | QS_SMRESULT);
+        thread_info->changed_mask = changed_mask;
+        return FALSE;
+    }
+
     for (;;)
     {
         NTSTATUS res;
@@ -64,6 +64,9 @@
 #ifdef HAVE_SYS_UIO_H
 # include <sys/uio.h>
 #endif
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
@@ -128,6 +131,9 @@
 #ifdef HAVE_SYS_POLL_H
 # include <sys/poll.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
 #ifdef HAVE_SYS_TIME_H
 # include <sys/time.h>
 #endif
@@ -159,6 +165,7 @@
 #include "wine/exception.h"
 #include "wine/unicode.h"
 #include "wine/heap.h"
+#include "wine/list.h"
 
 #if defined(linux) && !defined(IP_UNICAST_IF)
 #define IP_UNICAST_IF 50
@@ -243,6 +250,17 @@ static struct interface_filter generic_interface_filter = {
 #endif /* LINUX_BOUND_IF */
 
 extern ssize_t CDECL __wine_locked_recvmsg( int fd, struct msghdr *hdr, int flags );
+extern NTSTATUS CDECL __wine_queue_socket_async( HANDLE handle, int type, void *user, HANDLE event,
+                                                 ULONG_PTR cvalue, IO_STATUS_BLOCK *iosb );
+extern void CDECL __wine_set_socket_batch_handler( void *callback, void *batch );
+extern void CDECL __wine_use_server_socket_asyncs( HANDLE handle );
+extern int CDECL __wine_server_get_unix_fd( HANDLE handle, unsigned int access, int *unix_fd,
+                                            int *needs_close, unsigned int *options );
+extern unsigned int CDECL __wine_server_socket_fd_generation(void);
+
+static void WS2_register_batch_handlers(void);
+struct poll_epoll;
+static void free_poll_epoll( struct poll_epoll *epoll );
 
 /*
  * The actual definition of WSASendTo, wrapped in a different function name
@@ -524,20 +542,26 @@ struct ws2_accept_async
     struct ws2_async    *read;
 };
 
-struct ws2_transmitfile_async
-{
-    struct ws2_async_io   io;
-    char                  *buffer;
-    HANDLE                file;
-    DWORD                 file_read;
-    DWORD                 file_bytes;
-    DWORD                 bytes_per_send;
-    TRANSMIT_FILE_BUFFERS buffers;
-    DWORD                 flags;
-    LARGE_INTEGER         offset;
-    struct ws2_async      write;
+struct ws2_transmitpackets_async
+{
+    struct ws2_async_io       io;
+    char                     *buffer;      /* bounce buffer for files that can't be sent directly */
+    TRANSMIT_PACKETS_ELEMENT *elements;
+    DWORD                     count;       /* number of elements */
+    DWORD                     current;     /* element being sent */
+    DWORD                     file_read;   /* bytes of the current file element handled so far */
+    DWORD                     send_size;   /* size of the bounce buffer */
+    BOOL                      zero_copy;   /* try to send the current file element with sendfile() */
+    DWORD                     flags;
+    struct ws2_async          write;       /* must be last, followed by the iovecs */
 };
 
+/* maximum number of consecutive memory elements sent at once */
+#define WS2_TRANSMIT_MAX_IOVECS 64
+
+/* maximum number of queued reads or writes handled by a single recvmmsg() or sendmmsg() */
+#define WS2_MAX_BATCH 32
+
 static struct ws2_async_io *async_io_freelist;
 
 static void release_async_io( struct ws2_async_io *io )
@@ -573,6 +597,9 @@ static NTSTATUS register_async( int type, HANDLE handle, struct ws2_async_io *as
 {
     NTSTATUS status;
 
+    /* keep the completions in order with the asyncs queued in-process */
+    __wine_use_server_socket_asyncs( handle );
+
     SERVER_START_REQ( register_async )
     {
         req->type              = type;
@@ -589,6 +616,17 @@ static NTSTATUS register_async( int type, HANDLE handle, struct ws2_async_io *as
     return status;
 }
 
+/* queue a read or write without a completion routine, preferably in-process */
+static NTSTATUS register_socket_async( int type, HANDLE handle, struct ws2_async_io *async, HANDLE event,
+                                       void *apc_context, IO_STATUS_BLOCK *io )
+{
+    NTSTATUS status;
+
+    status = __wine_queue_socket_async( handle, type, async, event, (ULONG_PTR)apc_context, io );
+    if (status != STATUS_NOT_IMPLEMENTED) return status;
+    return register_async( type, handle, async, event, NULL, apc_context, io );
+}
+
 /****************************************************************/
 
 /* ----------------------------------- internal data */
@@ -616,7 +654,9 @@ struct per_thread_data
     struct WS_servent *se_buffer;
     struct WS_protoent *pe_buffer;
     struct pollfd *fd_cache;
+    unsigned char *fd_flags;
     unsigned int fd_count;
+    struct poll_epoll *epoll;
     int he_len;
     int se_len;
     int pe_len;
@@ -1133,6 +1173,28 @@ static inline void release_sock_fd( SOCKET s, int fd )
     wine_server_release_fd( SOCKET2HANDLE(s), fd );
 }
 
+/* same as get_sock_fd, but return the fd of the ntdll fd cache when possible instead of a copy */
+static inline int get_cached_sock_fd( SOCKET s, DWORD access, int *needs_close )
+{
+    int fd;
+    if (set_error( __wine_server_get_unix_fd( SOCKET2HANDLE(s), access, &fd, needs_close, NULL ) ))
+        return -1;
+    return fd;
+}
+
+static inline void release_cached_sock_fd( int fd, int needs_close )
+{
+    if (needs_close) close( fd );
+}
+
+/* get the fd to poll for a socket, a copy if the cached fds may have been closed and reused while polling */
+static inline int get_poll_sock_fd( SOCKET s, DWORD access, BOOL copy, int *needs_close )
+{
+    if (!copy) return get_cached_sock_fd( s, access, needs_close );
+    *needs_close = 1;
+    return get_sock_fd( s, access, NULL );
+}
+
 static void _enable_event( HANDLE s, unsigned int event,
                            unsigned int sstate, unsigned int cstate )
 {
@@ -1338,6 +1400,7 @@ static void free_per_thread_data(void)
     HeapFree( GetProcessHeap(), 0, ptb->se_buffer );
     HeapFree( GetProcessHeap(), 0, ptb->pe_buffer );
     HeapFree( GetProcessHeap(), 0, ptb->fd_cache );
+    free_poll_epoll( ptb->epoll );
 
     HeapFree( GetProcessHeap(), 0, ptb );
     NtCurrentTeb()->WinSockData = NULL;
@@ -1674,7 +1737,7 @@ int WINAPI WSAStartup(WORD wVersionRequested, LPWSADATA lpWSAData)
 
     if (!lpWSAData) return WSAEINVAL;
 
-    num_startup++;
+    if (!num_startup++) WS2_register_batch_handlers();
 
     /* that's the whole of the negotiation for now */
     lpWSAData->wVersion = wVersionRequested;
@@ -2431,13 +2494,12 @@ static int WS2_recv( int fd, struct ws2_async *wsa, int flags )
 }
 
 /***********************************************************************
- *              WS2_async_recv          (INTERNAL)
+ *              WS2_async_recv_io       (INTERNAL)
  *
- * Handler for overlapped recv() operations.
+ * Perform an overlapped recv() and fill the status block once it's done.
  */
-static NTSTATUS WS2_async_recv( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+static NTSTATUS WS2_async_recv_io( struct ws2_async *wsa, IO_STATUS_BLOCK *iosb, NTSTATUS status )
 {
-    struct ws2_async *wsa = user;
     int result = 0, fd;
 
     switch (status)
@@ -2472,12 +2534,25 @@ static NTSTATUS WS2_async_recv( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS stat
     {
         iosb->u.Status = status;
         iosb->Information = result;
-        if (!wsa->completion_func)
-            release_async_io( &wsa->io );
     }
     return status;
 }
 
+/***********************************************************************
+ *              WS2_async_recv          (INTERNAL)
+ *
+ * Handler for overlapped recv() operations.
+ */
+static NTSTATUS WS2_async_recv( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+{
+    struct ws2_async *wsa = user;
+
+    status = WS2_async_recv_io( wsa, iosb, status );
+    if (status != STATUS_PENDING && !wsa->completion_func)
+        release_async_io( &wsa->io );
+    return status;
+}
+
 /***********************************************************************
  *              WS2_async_accept_recv            (INTERNAL)
  *
@@ -2578,11 +2653,23 @@ finish:
  *
  * Workhorse for both synchronous and asynchronous send() operations.
  */
+/* skip the part of the iovecs that has been sent */
+static void WS2_skip_iovecs( struct ws2_async *wsa, int n )
+{
+    while (wsa->first_iovec < wsa->n_iovecs && wsa->iovec[wsa->first_iovec].iov_len <= n)
+        n -= wsa->iovec[wsa->first_iovec++].iov_len;
+    if (wsa->first_iovec < wsa->n_iovecs)
+    {
+        wsa->iovec[wsa->first_iovec].iov_base = (char*)wsa->iovec[wsa->first_iovec].iov_base + n;
+        wsa->iovec[wsa->first_iovec].iov_len -= n;
+    }
+}
+
 static int WS2_send( int fd, struct ws2_async *wsa, int flags )
 {
     struct msghdr hdr;
     union generic_unix_sockaddr unix_addr;
-    int n, ret;
+    int ret;
 
     hdr.msg_name = NULL;
     hdr.msg_namelen = 0;
@@ -2632,25 +2719,17 @@ static int WS2_send( int fd, struct ws2_async *wsa, int flags )
             return -1;
     }
 
-    n = ret;
-    while (wsa->first_iovec < wsa->n_iovecs && wsa->iovec[wsa->first_iovec].iov_len <= n)
-        n -= wsa->iovec[wsa->first_iovec++].iov_len;
-    if (wsa->first_iovec < wsa->n_iovecs)
-    {
-        wsa->iovec[wsa->first_iovec].iov_base = (char*)wsa->iovec[wsa->first_iovec].iov_base + n;
-        wsa->iovec[wsa->first_iovec].iov_len -= n;
-    }
+    WS2_skip_iovecs( wsa, ret );
     return ret;
 }
 
 /***********************************************************************
- *              WS2_async_send          (INTERNAL)
+ *              WS2_async_send_io       (INTERNAL)
  *
- * Handler for overlapped send() operations.
+ * Perform an overlapped send() and fill the status block once it's done.
  */
-static NTSTATUS WS2_async_send( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+static NTSTATUS WS2_async_send_io( struct ws2_async *wsa, IO_STATUS_BLOCK *iosb, NTSTATUS status )
 {
-    struct ws2_async *wsa = user;
     int result = 0, fd;
 
     switch (status)
@@ -2688,14 +2767,161 @@ static NTSTATUS WS2_async_send( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS stat
         }
         break;
     }
-    if (status != STATUS_PENDING)
+    if (status != STATUS_PENDING) iosb->u.Status = status;
+    return status;
+}
+
+/***********************************************************************
+ *              WS2_async_send          (INTERNAL)
+ *
+ * Handler for overlapped send() operations.
+ */
+static NTSTATUS WS2_async_send( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+{
+    struct ws2_async *wsa = user;
+
+    status = WS2_async_send_io( wsa, iosb, status );
+    if (status != STATUS_PENDING && !wsa->completion_func)
+        release_async_io( &wsa->io );
+    return status;
+}
+
+#ifdef HAVE_RECVMMSG
+/***********************************************************************
+ *              WS2_recv_batch          (INTERNAL)
+ *
+ * Receive into several queued reads of the same datagram socket with a
+ * single recvmmsg(). Returns the number of leading reads that completed.
+ * Only called for datagram sockets, stream data must not be split between
+ * the buffers.
+ */
+static unsigned int WS2_recv_batch( void **users, IO_STATUS_BLOCK **iosbs, unsigned int count )
+{
+    union generic_unix_sockaddr addrs[WS2_MAX_BATCH];
+    struct mmsghdr msgs[WS2_MAX_BATCH];
+    struct ws2_async *wsa = users[0];
+    unsigned int i;
+    int fd, n;
+
+    count = min( count, WS2_MAX_BATCH );
+    for (i = 0; i < count; i++)
     {
-        iosb->u.Status = status;
-        if (!wsa->completion_func)
-            release_async_io( &wsa->io );
+        struct ws2_async *cur = users[i];
+
+        /* control headers and flags such as MSG_PEEK are left to WS2_recv() */
+        if (cur->control || cur->flags) break;
+        memset( &msgs[i], 0, sizeof(msgs[i]) );
+        if (cur->addr)
+        {
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        }
+        msgs[i].msg_hdr.msg_iov = cur->iovec + cur->first_iovec;
+        msgs[i].msg_hdr.msg_iovlen = cur->n_iovecs - cur->first_iovec;
     }
-    return status;
+    if ((count = i) < 2) return 0;
+
+    if (wine_server_handle_to_fd( wsa->hSocket, FILE_READ_DATA, &fd, NULL )) return 0;
+    while ((n = recvmmsg( fd, msgs, count, 0, NULL )) == -1 && errno == EINTR);
+    wine_server_release_fd( wsa->hSocket, fd );
+    if (n <= 0) return 0;
+
+    for (i = 0; i < n; i++)
+    {
+        wsa = users[i];
+        if (wsa->addr && msgs[i].msg_hdr.msg_namelen)
+            ws_sockaddr_u2ws( &addrs[i].addr, wsa->addr, wsa->addrlen.ptr );
+        iosbs[i]->u.Status = STATUS_SUCCESS;
+        iosbs[i]->Information = msgs[i].msg_len;
+    }
+    return n;
+}
+
+static unsigned int WS2_async_recv_batch( void **users, IO_STATUS_BLOCK **iosbs, NTSTATUS *status,
+                                          unsigned int count )
+{
+    HANDLE handle = ((struct ws2_async *)users[0])->hSocket;
+    unsigned int i, done = WS2_recv_batch( users, iosbs, count );
+
+    for (i = 0; i < done; i++)
+    {
+        struct ws2_async *wsa = users[i];
+
+        status[i] = STATUS_SUCCESS;
+        if (!wsa->completion_func) release_async_io( &wsa->io );
+    }
+    if (done) _enable_event( handle, FD_READ, 0, 0 );
+    return done;
+}
+#endif
+
+#ifdef HAVE_SENDMMSG
+/***********************************************************************
+ *              WS2_send_batch          (INTERNAL)
+ *
+ * Send the data of several queued writes of the same datagram socket with
+ * a single sendmmsg(). Returns the number of leading writes that completed.
+ * Only called for datagram sockets, a partial write on a stream socket
+ * would reorder the data of the following writes.
+ */
+static unsigned int WS2_send_batch( void **users, IO_STATUS_BLOCK **iosbs, unsigned int count )
+{
+    union generic_unix_sockaddr addrs[WS2_MAX_BATCH];
+    struct mmsghdr msgs[WS2_MAX_BATCH];
+    struct ws2_async *wsa = users[0];
+    unsigned int i, done;
+    int fd, n;
+
+    count = min( count, WS2_MAX_BATCH );
+    for (i = 0; i < count; i++)
+    {
+        struct ws2_async *cur = users[i];
+
+        if (cur->flags) break;
+        memset( &msgs[i], 0, sizeof(msgs[i]) );
+        if (cur->addr)
+        {
+            /* IPX needs the packet type from the socket, leave it to WS2_send() */
+            if (cur->addr->sa_family == WS_AF_IPX) break;
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            if (!(msgs[i].msg_hdr.msg_namelen = ws_sockaddr_ws2u( cur->addr, cur->addrlen.val, &addrs[i] )))
+                break;
+        }
+        msgs[i].msg_hdr.msg_iov = cur->iovec + cur->first_iovec;
+        msgs[i].msg_hdr.msg_iovlen = cur->n_iovecs - cur->first_iovec;
+    }
+    if ((count = i) < 2) return 0;
+
+    if (wine_server_handle_to_fd( wsa->hSocket, FILE_WRITE_DATA, &fd, NULL )) return 0;
+    while ((n = sendmmsg( fd, msgs, count, 0 )) == -1 && errno == EINTR);
+    wine_server_release_fd( wsa->hSocket, fd );
+    if (n <= 0) return 0;
+
+    for (done = 0; done < n; done++)
+    {
+        wsa = users[done];
+        WS2_skip_iovecs( wsa, msgs[done].msg_len );
+        iosbs[done]->Information += msgs[done].msg_len;
+        iosbs[done]->u.Status = STATUS_SUCCESS;
+    }
+    return done;
+}
+
+static unsigned int WS2_async_send_batch( void **users, IO_STATUS_BLOCK **iosbs, NTSTATUS *status,
+                                          unsigned int count )
+{
+    unsigned int i, done = WS2_send_batch( users, iosbs, count );
+
+    for (i = 0; i < done; i++)
+    {
+        struct ws2_async *wsa = users[i];
+
+        status[i] = STATUS_SUCCESS;
+        if (!wsa->completion_func) release_async_io( &wsa->io );
+    }
+    return done;
 }
+#endif
 
 /***********************************************************************
  *              WS2_async_shutdown      (INTERNAL)
@@ -2959,88 +3185,161 @@ static NTSTATUS WS2_ReadFile(HANDLE hFile, PIO_STATUS_BLOCK io_status, char* buf
 }
 
 /***********************************************************************
- *     WS2_transmitfile_getbuffer       (INTERNAL)
+ *     WS2_transmitpackets_sendfile     (INTERNAL)
  *
- * Pick the appropriate buffer for a TransmitFile send operation.
+ * Send the next part of a file element straight from the page cache.
+ * Returns STATUS_NOT_SUPPORTED if the file has to go through the bounce buffer.
  */
-static NTSTATUS WS2_transmitfile_getbuffer( int fd, struct ws2_transmitfile_async *wsa )
+static NTSTATUS WS2_transmitpackets_sendfile( int fd, struct ws2_transmitpackets_async *wsa,
+                                              TRANSMIT_PACKETS_ELEMENT *element )
 {
-    /* send any incomplete writes from a previous iteration */
-    if (wsa->write.first_iovec < wsa->write.n_iovecs)
-        return STATUS_PENDING;
+#ifdef HAVE_SYS_SENDFILE_H
+    IO_STATUS_BLOCK *iosb = (IO_STATUS_BLOCK *)wsa->write.user_overlapped;
+    size_t count = 0x7ffff000; /* largest transfer done by sendfile() */
+    int file_fd, err;
+    ssize_t ret;
+    off_t off;
 
-    /* process the header (if applicable) */
-    if (wsa->buffers.Head)
+    if (element->cLength) count = element->cLength - wsa->file_read;
+    if (wine_server_handle_to_fd( element->u.s.hFile, FILE_READ_DATA, &file_fd, NULL ))
+        return STATUS_NOT_SUPPORTED;
+
+    do
     {
-        wsa->write.first_iovec       = 0;
-        wsa->write.n_iovecs          = 1;
-        wsa->write.iovec[0].iov_base = wsa->buffers.Head;
-        wsa->write.iovec[0].iov_len  = wsa->buffers.HeadLength;
-        wsa->buffers.Head            = NULL;
-        return STATUS_PENDING;
+        if (element->u.s.nFileOffset.QuadPart == FILE_USE_FILE_POINTER_POSITION)
+            ret = sendfile( fd, file_fd, NULL, count );
+        else
+        {
+            off = element->u.s.nFileOffset.QuadPart;
+            ret = sendfile( fd, file_fd, &off, count );
+        }
     }
+    while (ret == -1 && errno == EINTR);
+    err = errno;
+    wine_server_release_fd( element->u.s.hFile, file_fd );
 
-    /* process the main file */
-    if (wsa->file)
+    if (ret == -1)
     {
-        DWORD bytes_per_send = wsa->bytes_per_send;
-        IO_STATUS_BLOCK iosb;
-        NTSTATUS status;
+        if (err == EAGAIN) return STATUS_PENDING;
+        if (err == EINVAL || err == ENOSYS) return STATUS_NOT_SUPPORTED;
+        errno = err;
+        return wsaErrStatus();
+    }
+    if (!ret) return STATUS_END_OF_FILE;
 
-        iosb.Information = 0;
-        /* when the size of the transfer is limited ensure that we don't go past that limit */
-        if (wsa->file_bytes != 0)
-            bytes_per_send = min(bytes_per_send, wsa->file_bytes - wsa->file_read);
-        status = WS2_ReadFile( wsa->file, &iosb, wsa->buffer, bytes_per_send, &wsa->offset );
-        if (wsa->offset.QuadPart != FILE_USE_FILE_POINTER_POSITION)
-            wsa->offset.QuadPart += iosb.Information;
-        if (status == STATUS_END_OF_FILE)
-            wsa->file = NULL; /* continue on to the footer */
-        else if (status != STATUS_SUCCESS)
-            return status;
-        else
-        {
-            if (iosb.Information)
-            {
-                wsa->write.first_iovec       = 0;
-                wsa->write.n_iovecs          = 1;
-                wsa->write.iovec[0].iov_base = wsa->buffer;
-                wsa->write.iovec[0].iov_len  = iosb.Information;
-                wsa->file_read += iosb.Information;
-            }
+    if (element->u.s.nFileOffset.QuadPart != FILE_USE_FILE_POINTER_POSITION)
+        element->u.s.nFileOffset.QuadPart += ret;
+    wsa->file_read += ret;
+    if (iosb) iosb->Information += ret;
+    return STATUS_PENDING;
+#else
+    return STATUS_NOT_SUPPORTED;
+#endif
+}
 
-            if (wsa->file_bytes != 0 && wsa->file_read >= wsa->file_bytes)
-                wsa->file = NULL;
+/***********************************************************************
+ *     WS2_transmitpackets_file         (INTERNAL)
+ *
+ * Send the next part of a file element. Returns STATUS_END_OF_FILE once
+ * the element is complete.
+ */
+static NTSTATUS WS2_transmitpackets_file( int fd, struct ws2_transmitpackets_async *wsa,
+                                          TRANSMIT_PACKETS_ELEMENT *element )
+{
+    DWORD bytes_per_send = wsa->send_size;
+    IO_STATUS_BLOCK iosb;
+    NTSTATUS status;
 
-            return STATUS_PENDING;
-        }
+    /* when the size of the transfer is limited ensure that we don't go past that limit */
+    if (element->cLength)
+    {
+        if (wsa->file_read >= element->cLength) return STATUS_END_OF_FILE;
+        bytes_per_send = min( bytes_per_send, element->cLength - wsa->file_read );
     }
 
-    /* send the footer (if applicable) */
-    if (wsa->buffers.Tail)
+    if (wsa->zero_copy)
     {
-        wsa->write.first_iovec       = 0;
-        wsa->write.n_iovecs          = 1;
-        wsa->write.iovec[0].iov_base = wsa->buffers.Tail;
-        wsa->write.iovec[0].iov_len  = wsa->buffers.TailLength;
-        wsa->buffers.Tail            = NULL;
+        status = WS2_transmitpackets_sendfile( fd, wsa, element );
+        if (status != STATUS_NOT_SUPPORTED) return status;
+        wsa->zero_copy = FALSE;
+    }
+
+    iosb.Information = 0;
+    status = WS2_ReadFile( element->u.s.hFile, &iosb, wsa->buffer, bytes_per_send, &element->u.s.nFileOffset );
+    if (element->u.s.nFileOffset.QuadPart != FILE_USE_FILE_POINTER_POSITION)
+        element->u.s.nFileOffset.QuadPart += iosb.Information;
+    if (status != STATUS_SUCCESS)
+        return status;
+
+    wsa->write.first_iovec       = 0;
+    wsa->write.n_iovecs          = 1;
+    wsa->write.iovec[0].iov_base = wsa->buffer;
+    wsa->write.iovec[0].iov_len  = iosb.Information;
+    wsa->file_read += iosb.Information;
+    return STATUS_PENDING;
+}
+
+/***********************************************************************
+ *     WS2_transmitpackets_getbuffer    (INTERNAL)
+ *
+ * Pick the appropriate buffers for a TransmitPackets send operation.
+ */
+static NTSTATUS WS2_transmitpackets_getbuffer( int fd, struct ws2_transmitpackets_async *wsa )
+{
+    TRANSMIT_PACKETS_ELEMENT *element;
+    NTSTATUS status;
+
+    /* send any incomplete writes from a previous iteration */
+    if (wsa->write.first_iovec < wsa->write.n_iovecs)
         return STATUS_PENDING;
+
+    while (wsa->current < wsa->count)
+    {
+        element = &wsa->elements[wsa->current];
+
+        if (element->dwElFlags & TP_ELEMENT_FILE)
+        {
+            status = WS2_transmitpackets_file( fd, wsa, element );
+            if (status != STATUS_END_OF_FILE)
+                return status;
+
+            /* continue on to the next element */
+            wsa->current++;
+            wsa->file_read = 0;
+            wsa->zero_copy = TRUE;
+            continue;
+        }
+
+        /* send consecutive memory elements together */
+        wsa->write.first_iovec = 0;
+        wsa->write.n_iovecs    = 0;
+        while (wsa->current < wsa->count && wsa->write.n_iovecs < WS2_TRANSMIT_MAX_IOVECS &&
+               !(wsa->elements[wsa->current].dwElFlags & TP_ELEMENT_FILE))
+        {
+            element = &wsa->elements[wsa->current++];
+            if (!element->cLength) continue;
+            wsa->write.iovec[wsa->write.n_iovecs].iov_base = element->u.pBuffer;
+            wsa->write.iovec[wsa->write.n_iovecs].iov_len  = element->cLength;
+            wsa->write.n_iovecs++;
+        }
+        if (wsa->write.n_iovecs)
+            return STATUS_PENDING;
     }
 
     return STATUS_SUCCESS;
 }
 
 /***********************************************************************
- *     WS2_transmitfile_base            (INTERNAL)
+ *     WS2_transmitpackets_base         (INTERNAL)
  *
- * Shared implementation for both synchronous and asynchronous TransmitFile.
+ * Shared implementation for both synchronous and asynchronous TransmitPackets.
  */
-static NTSTATUS WS2_transmitfile_base( int fd, struct ws2_transmitfile_async *wsa )
+static NTSTATUS WS2_transmitpackets_base( int fd, struct ws2_transmitpackets_async *wsa )
 {
     NTSTATUS status;
 
-    status = WS2_transmitfile_getbuffer( fd, wsa );
-    if (status == STATUS_PENDING)
+    status = WS2_transmitpackets_getbuffer( fd, wsa );
+    if (status == STATUS_PENDING && wsa->write.first_iovec < wsa->write.n_iovecs)
     {
         IO_STATUS_BLOCK *iosb = (IO_STATUS_BLOCK *)wsa->write.user_overlapped;
         int n;
@@ -3058,20 +3357,20 @@ static NTSTATUS WS2_transmitfile_base( int fd, struct ws2_transmitfile_async *ws
 }
 
 /***********************************************************************
- *     WS2_async_transmitfile           (INTERNAL)
+ *     WS2_async_transmitpackets        (INTERNAL)
  *
- * Asynchronous callback for overlapped TransmitFile operations.
+ * Asynchronous callback for overlapped TransmitFile and TransmitPackets operations.
  */
-static NTSTATUS WS2_async_transmitfile( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+static NTSTATUS WS2_async_transmitpackets( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
 {
-    struct ws2_transmitfile_async *wsa = user;
+    struct ws2_transmitpackets_async *wsa = user;
     int fd;
 
     if (status == STATUS_ALERTED)
     {
         if (!(status = wine_server_handle_to_fd( wsa->write.hSocket, FILE_WRITE_DATA, &fd, NULL )))
         {
-            status = WS2_transmitfile_base( fd, wsa );
+            status = WS2_transmitpackets_base( fd, wsa );
             wine_server_release_fd( wsa->write.hSocket, fd );
         }
         if (status == STATUS_PENDING)
@@ -3084,66 +3383,73 @@ static NTSTATUS WS2_async_transmitfile( void *user, IO_STATUS_BLOCK *iosb, NTSTA
 }
 
 /***********************************************************************
- *     TransmitFile
+ *     WS2_transmitpackets_get_fd       (INTERNAL)
+ *
+ * Get the fd of the connected socket used by a transmit operation.
  */
-static BOOL WINAPI WS2_TransmitFile( SOCKET s, HANDLE h, DWORD file_bytes, DWORD bytes_per_send,
-                                     LPOVERLAPPED overlapped, LPTRANSMIT_FILE_BUFFERS buffers,
-                                     DWORD flags )
+static int WS2_transmitpackets_get_fd( SOCKET s )
 {
     union generic_unix_sockaddr uaddr;
     socklen_t uaddrlen = sizeof(uaddr);
-    struct ws2_transmitfile_async *wsa;
-    NTSTATUS status;
     int fd;
 
-    TRACE("(%lx, %p, %d, %d, %p, %p, %d)\n", s, h, file_bytes, bytes_per_send, overlapped,
-            buffers, flags );
-
     fd = get_sock_fd( s, FILE_WRITE_DATA, NULL );
     if (fd == -1)
     {
         WSASetLastError( WSAENOTSOCK );
-        return FALSE;
+        return -1;
     }
     if (getpeername( fd, &uaddr.addr, &uaddrlen ) != 0)
     {
         release_sock_fd( s, fd );
         WSASetLastError( WSAENOTCONN );
-        return FALSE;
+        return -1;
     }
+    return fd;
+}
+
+/***********************************************************************
+ *     WS2_transmitpackets_start        (INTERNAL)
+ *
+ * Shared implementation for both TransmitFile and TransmitPackets.
+ */
+static BOOL WS2_transmitpackets_start( SOCKET s, int fd, const TRANSMIT_PACKETS_ELEMENT *elements,
+                                       DWORD count, DWORD send_size, LPOVERLAPPED overlapped, DWORD flags )
+{
+    DWORD size = offsetof( struct ws2_transmitpackets_async, write.iovec[min( max( count, 1 ), WS2_TRANSMIT_MAX_IOVECS )] );
+    struct ws2_transmitpackets_async *wsa;
+    NTSTATUS status;
+    DWORD i;
+
     if (flags)
         FIXME("Flags are not currently supported (0x%x).\n", flags);
 
-    if (h && GetFileType( h ) != FILE_TYPE_DISK)
-    {
-        FIXME("Non-disk file handles are not currently supported.\n");
-        release_sock_fd( s, fd );
-        WSASetLastError( WSAEOPNOTSUPP );
-        return FALSE;
-    }
-
     /* set reasonable defaults when requested */
-    if (!bytes_per_send)
-        bytes_per_send = (1 << 16); /* Depends on OS version: PAGE_SIZE, 2*PAGE_SIZE, or 2^16 */
+    if (!send_size)
+        send_size = (1 << 16); /* Depends on OS version: PAGE_SIZE, 2*PAGE_SIZE, or 2^16 */
 
-    if (!(wsa = (struct ws2_transmitfile_async *)alloc_async_io( sizeof(*wsa) + bytes_per_send,
-                                                                 WS2_async_transmitfile )))
+    if (!(wsa = (struct ws2_transmitpackets_async *)alloc_async_io( size + count * sizeof(*elements) + send_size,
+                                                                    WS2_async_transmitpackets )))
     {
         release_sock_fd( s, fd );
         WSASetLastError( WSAEFAULT );
         return FALSE;
     }
-    if (buffers)
-        wsa->buffers = *buffers;
-    else
-        memset(&wsa->buffers, 0x0, sizeof(wsa->buffers));
-    wsa->buffer                = (char *)(wsa + 1);
-    wsa->file                  = h;
+    wsa->elements = (TRANSMIT_PACKETS_ELEMENT *)((char *)wsa + size);
+    wsa->buffer   = (char *)(wsa->elements + count);
+    memcpy( wsa->elements, elements, count * sizeof(*elements) );
+    for (i = 0; i < count; i++)
+    {
+        /* an offset of -1 means the current file position */
+        if ((wsa->elements[i].dwElFlags & TP_ELEMENT_FILE) && wsa->elements[i].u.s.nFileOffset.QuadPart == -1)
+            wsa->elements[i].u.s.nFileOffset.QuadPart = FILE_USE_FILE_POINTER_POSITION;
+    }
+    wsa->count                 = count;
+    wsa->current               = 0;
     wsa->file_read             = 0;
-    wsa->file_bytes            = file_bytes;
-    wsa->bytes_per_send        = bytes_per_send;
+    wsa->send_size             = send_size;
+    wsa->zero_copy             = TRUE;
     wsa->flags                 = flags;
-    wsa->offset.QuadPart       = FILE_USE_FILE_POINTER_POSITION;
     wsa->write.hSocket         = SOCKET2HANDLE(s);
     wsa->write.addr            = NULL;
     wsa->write.addrlen.val     = 0;
@@ -3158,8 +3464,6 @@ static BOOL WINAPI WS2_TransmitFile( SOCKET s, HANDLE h, DWORD file_bytes, DWORD
         IO_STATUS_BLOCK *iosb = (IO_STATUS_BLOCK *)overlapped;
         int status;
 
-        wsa->offset.u.LowPart  = overlapped->u.s.Offset;
-        wsa->offset.u.HighPart = overlapped->u.s.OffsetHigh;
         iosb->u.Status = STATUS_PENDING;
         iosb->Information = 0;
         status = register_async( ASYNC_TYPE_WRITE, SOCKET2HANDLE(s), &wsa->io,
@@ -3172,7 +3476,7 @@ static BOOL WINAPI WS2_TransmitFile( SOCKET s, HANDLE h, DWORD file_bytes, DWORD
 
     do
     {
-        status = WS2_transmitfile_base( fd, wsa );
+        status = WS2_transmitpackets_base( fd, wsa );
         if (status == STATUS_PENDING)
         {
             /* block here */
@@ -3190,65 +3494,809 @@ static BOOL WINAPI WS2_TransmitFile( SOCKET s, HANDLE h, DWORD file_bytes, DWORD
 }
 
 /***********************************************************************
- *     GetAcceptExSockaddrs
+ *     TransmitFile
  */
-static void WINAPI WS2_GetAcceptExSockaddrs(PVOID buffer, DWORD data_size, DWORD local_size, DWORD remote_size,
-                                     struct WS_sockaddr **local_addr, LPINT local_addr_len,
-                                     struct WS_sockaddr **remote_addr, LPINT remote_addr_len)
+static BOOL WINAPI WS2_TransmitFile( SOCKET s, HANDLE h, DWORD file_bytes, DWORD bytes_per_send,
+                                     LPOVERLAPPED overlapped, LPTRANSMIT_FILE_BUFFERS buffers,
+                                     DWORD flags )
 {
-    char *cbuf = buffer;
-    TRACE("(%p, %d, %d, %d, %p, %p, %p, %p)\n", buffer, data_size, local_size, remote_size, local_addr,
-                                                local_addr_len, remote_addr, remote_addr_len );
-    cbuf += data_size;
-
-    *local_addr_len = *(int *) cbuf;
-    *local_addr = (struct WS_sockaddr *)(cbuf + sizeof(int));
+    TRANSMIT_PACKETS_ELEMENT elements[3];
+    DWORD count = 0;
+    int fd;
 
-    cbuf += local_size;
+    TRACE("(%lx, %p, %d, %d, %p, %p, %d)\n", s, h, file_bytes, bytes_per_send, overlapped,
+            buffers, flags );
 
-    *remote_addr_len = *(int *) cbuf;
-    *remote_addr = (struct WS_sockaddr *)(cbuf + sizeof(int));
-}
+    if ((fd = WS2_transmitpackets_get_fd( s )) == -1)
+        return FALSE;
 
-/***********************************************************************
- *     WSASendMsg
- */
-int WINAPI WSASendMsg( SOCKET s, LPWSAMSG msg, DWORD dwFlags, LPDWORD lpNumberOfBytesSent,
-                       LPWSAOVERLAPPED lpOverlapped,
-                       LPWSAOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine)
-{
-    if (!msg)
+    if (h && GetFileType( h ) != FILE_TYPE_DISK)
     {
-        SetLastError( WSAEFAULT );
-        return SOCKET_ERROR;
+        FIXME("Non-disk file handles are not currently supported.\n");
+        release_sock_fd( s, fd );
+        WSASetLastError( WSAEOPNOTSUPP );
+        return FALSE;
     }
 
-    return WS2_sendto( s, msg->lpBuffers, msg->dwBufferCount, lpNumberOfBytesSent,
-                       dwFlags, msg->name, msg->namelen,
+    if (buffers && buffers->Head)
+    {
+        elements[count].dwElFlags = TP_ELEMENT_MEMORY;
+        elements[count].cLength   = buffers->HeadLength;
+        elements[count].u.pBuffer = buffers->Head;
+        count++;
+    }
+    if (h)
+    {
+        elements[count].dwElFlags = TP_ELEMENT_FILE;
+        elements[count].cLength   = file_bytes;
+        elements[count].u.s.hFile = h;
+        if (overlapped)
+        {
+            elements[count].u.s.nFileOffset.u.LowPart  = overlapped->u.s.Offset;
+            elements[count].u.s.nFileOffset.u.HighPart = overlapped->u.s.OffsetHigh;
+        }
+        else
+            elements[count].u.s.nFileOffset.QuadPart = FILE_USE_FILE_POINTER_POSITION;
+        count++;
+    }
+    if (buffers && buffers->Tail)
+    {
+        elements[count].dwElFlags = TP_ELEMENT_MEMORY;
+        elements[count].cLength   = buffers->TailLength;
+        elements[count].u.pBuffer = buffers->Tail;
+        count++;
+    }
+
+    return WS2_transmitpackets_start( s, fd, elements, count, bytes_per_send, overlapped, flags );
+}
+
+/***********************************************************************
+ *     TransmitPackets
+ */
+static BOOL WINAPI WS2_TransmitPackets( SOCKET s, LPTRANSMIT_PACKETS_ELEMENT elements, DWORD count,
+                                        DWORD send_size, LPOVERLAPPED overlapped, DWORD flags )
+{
+    DWORD i;
+    int fd;
+
+    TRACE("(%lx, %p, %d, %d, %p, %d)\n", s, elements, count, send_size, overlapped, flags );
+
+    for (i = 0; i < count; i++)
+    {
+        DWORD type = elements[i].dwElFlags & (TP_ELEMENT_MEMORY | TP_ELEMENT_FILE);
+
+        if (type != TP_ELEMENT_MEMORY && type != TP_ELEMENT_FILE)
+        {
+            WSASetLastError( WSAEINVAL );
+            return FALSE;
+        }
+    }
+
+    if ((fd = WS2_transmitpackets_get_fd( s )) == -1)
+        return FALSE;
+
+    return WS2_transmitpackets_start( s, fd, elements, count, send_size, overlapped, flags );
+}
+
+/***********************************************************************
+ *     GetAcceptExSockaddrs
+ */
+static void WINAPI WS2_GetAcceptExSockaddrs(PVOID buffer, DWORD data_size, DWORD local_size, DWORD remote_size,
+                                     struct WS_sockaddr **local_addr, LPINT local_addr_len,
+                                     struct WS_sockaddr **remote_addr, LPINT remote_addr_len)
+{
+    char *cbuf = buffer;
+    TRACE("(%p, %d, %d, %d, %p, %p, %p, %p)\n", buffer, data_size, local_size, remote_size, local_addr,
+                                                local_addr_len, remote_addr, remote_addr_len );
+    cbuf += data_size;
+
+    *local_addr_len = *(int *) cbuf;
+    *local_addr = (struct WS_sockaddr *)(cbuf + sizeof(int));
+
+    cbuf += local_size;
+
+    *remote_addr_len = *(int *) cbuf;
+    *remote_addr = (struct WS_sockaddr *)(cbuf + sizeof(int));
+}
+
+/***********************************************************************
+ *     WSASendMsg
+ */
+int WINAPI WSASendMsg( SOCKET s, LPWSAMSG msg, DWORD dwFlags, LPDWORD lpNumberOfBytesSent,
+                       LPWSAOVERLAPPED lpOverlapped,
+                       LPWSAOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine)
+{
+    if (!msg)
+    {
+        SetLastError( WSAEFAULT );
+        return SOCKET_ERROR;
+    }
+
+    return WS2_sendto( s, msg->lpBuffers, msg->dwBufferCount, lpNumberOfBytesSent,
+                       dwFlags, msg->name, msg->namelen,
                        lpOverlapped, lpCompletionRoutine );
 }
 
 /***********************************************************************
- *     WSARecvMsg
- *
- * Perform a receive operation that is capable of returning message
- * control headers.  It is important to note that the WSAMSG parameter
- * must remain valid throughout the operation, even when an overlapped
- * receive is performed.
+ *     WSARecvMsg
+ *
+ * Perform a receive operation that is capable of returning message
+ * control headers.  It is important to note that the WSAMSG parameter
+ * must remain valid throughout the operation, even when an overlapped
+ * receive is performed.
+ */
+static int WINAPI WS2_WSARecvMsg( SOCKET s, LPWSAMSG msg, LPDWORD lpNumberOfBytesRecvd,
+                                  LPWSAOVERLAPPED lpOverlapped,
+                                  LPWSAOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine )
+{
+    if (!msg)
+    {
+        SetLastError( WSAEFAULT );
+        return SOCKET_ERROR;
+    }
+
+    return WS2_recv_base( s, msg->lpBuffers, msg->dwBufferCount, lpNumberOfBytesRecvd,
+                          &msg->dwFlags, msg->name, &msg->namelen,
+                          lpOverlapped, lpCompletionRoutine, &msg->Control );
+}
+
+/*
+ * Registered I/O
+ *
+ * Requests are regular overlapped reads and writes that report their
+ * result to a completion queue instead of an event or a port, so they
+ * get the same in-process queuing and batching as WSARecv and WSASend.
+ */
+
+struct ws2_rio_buffer
+{
+    char   *data;
+    DWORD   size;
+};
+
+struct ws2_rio_cq
+{
+    LONG                         refs;        /* one for the handle, one per request queue */
+    CRITICAL_SECTION             cs;
+    RIORESULT                   *results;     /* ring of completed requests */
+    DWORD                        size;
+    DWORD                        head;
+    DWORD                        count;
+    DWORD                        reserved;    /* room reserved by the request queues */
+    BOOL                         overflow;
+    BOOL                         armed;       /* RIONotify() called, waiting for a completion */
+    BOOL                         closed;      /* RIOCloseCompletionQueue() called */
+    BOOL                         has_notify;
+    RIO_NOTIFICATION_COMPLETION  notify;
+};
+
+struct ws2_rio_rq
+{
+    struct list         entry;       /* entry in rio_queues */
+    LONG                refs;        /* one for the socket, one per pending request */
+    SOCKET              socket;
+    ULONGLONG           context;
+    struct ws2_rio_cq  *recv_cq;
+    struct ws2_rio_cq  *send_cq;
+    ULONG               max_recv;
+    ULONG               max_send;
+    LONG                recv_count;  /* outstanding requests */
+    LONG                send_count;
+};
+
+struct ws2_rio_request
+{
+    struct ws2_async    wsa;         /* must be first, with a single iovec */
+    struct ws2_rio_rq  *rq;
+    ULONGLONG           context;
+    DWORD               flags;
+    int                 addrlen;
+    BOOL                send;
+};
+
+static struct list rio_queues = LIST_INIT( rio_queues );
+
+static CRITICAL_SECTION rio_cs;
+static CRITICAL_SECTION_DEBUG rio_cs_debug =
+{
+    0, 0, &rio_cs,
+    { &rio_cs_debug.ProcessLocksList, &rio_cs_debug.ProcessLocksList },
+      0, 0, { (DWORD_PTR)(__FILE__ ": rio_cs") }
+};
+static CRITICAL_SECTION rio_cs = { &rio_cs_debug, -1, 0, 0, 0, 0 };
+
+static void WS2_rio_release_cq( struct ws2_rio_cq *cq )
+{
+    if (InterlockedDecrement( &cq->refs )) return;
+
+    cq->cs.DebugInfo->Spare[0] = 0;
+    DeleteCriticalSection( &cq->cs );
+    heap_free( cq->results );
+    heap_free( cq );
+}
+
+static void WS2_rio_release_rq( struct ws2_rio_rq *rq )
+{
+    if (InterlockedDecrement( &rq->refs )) return;
+
+    EnterCriticalSection( &rq->recv_cq->cs );
+    rq->recv_cq->reserved -= rq->max_recv;
+    LeaveCriticalSection( &rq->recv_cq->cs );
+    EnterCriticalSection( &rq->send_cq->cs );
+    rq->send_cq->reserved -= rq->max_send;
+    LeaveCriticalSection( &rq->send_cq->cs );
+    WS2_rio_release_cq( rq->recv_cq );
+    WS2_rio_release_cq( rq->send_cq );
+    HeapFree( GetProcessHeap(), 0, rq );
+}
+
+/* the socket of a request queue has been closed */
+static void WS2_rio_close_socket( SOCKET s )
+{
+    struct ws2_rio_rq *rq, *next;
+    struct list closed = LIST_INIT( closed );
+
+    if (list_empty( &rio_queues )) return;
+
+    EnterCriticalSection( &rio_cs );
+    LIST_FOR_EACH_ENTRY_SAFE( rq, next, &rio_queues, struct ws2_rio_rq, entry )
+    {
+        if (rq->socket != s) continue;
+        list_remove( &rq->entry );
+        list_add_tail( &closed, &rq->entry );
+    }
+    LeaveCriticalSection( &rio_cs );
+
+    LIST_FOR_EACH_ENTRY_SAFE( rq, next, &closed, struct ws2_rio_rq, entry )
+        WS2_rio_release_rq( rq );
+}
+
+/* signal the notification of a completion queue; called with the queue lock held */
+static void WS2_rio_notify( struct ws2_rio_cq *cq )
+{
+    cq->armed = FALSE;
+    if (cq->notify.Type == RIO_EVENT_COMPLETION)
+        SetEvent( cq->notify.u.Event.EventHandle );
+    else
+        PostQueuedCompletionStatus( cq->notify.u.Iocp.IocpHandle, 0,
+                                    (ULONG_PTR)cq->notify.u.Iocp.CompletionKey, cq->notify.u.Iocp.Overlapped );
+}
+
+/* report a finished request to its completion queue and free it */
+static void WS2_rio_complete( struct ws2_rio_request *req, IO_STATUS_BLOCK *iosb )
+{
+    struct ws2_rio_rq *rq = req->rq;
+    struct ws2_rio_cq *cq = req->send ? rq->send_cq : rq->recv_cq;
+    RIORESULT *result;
+
+    TRACE( "request %p status %08x size %lu\n", req, iosb->u.Status, iosb->Information );
+
+    EnterCriticalSection( &cq->cs );
+    if (cq->count < cq->size)
+    {
+        result = &cq->results[(cq->head + cq->count++) % cq->size];
+        result->Status           = NtStatusToWSAError( iosb->u.Status );
+        result->BytesTransferred = iosb->Information;
+        result->SocketContext    = rq->context;
+        result->RequestContext   = req->context;
+    }
+    else cq->overflow = TRUE;
+    if (cq->armed && !cq->closed && !(req->flags & RIO_MSG_DONT_NOTIFY)) WS2_rio_notify( cq );
+    LeaveCriticalSection( &cq->cs );
+
+    InterlockedDecrement( req->send ? &rq->send_count : &rq->recv_count );
+    release_async_io( &req->wsa.io );
+    WS2_rio_release_rq( rq );
+}
+
+static NTSTATUS WS2_async_rio_recv( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+{
+    status = WS2_async_recv_io( user, iosb, status );
+    if (status != STATUS_PENDING) WS2_rio_complete( user, iosb );
+    return status;
+}
+
+static NTSTATUS WS2_async_rio_send( void *user, IO_STATUS_BLOCK *iosb, NTSTATUS status )
+{
+    status = WS2_async_send_io( user, iosb, status );
+    if (status != STATUS_PENDING) WS2_rio_complete( user, iosb );
+    return status;
+}
+
+#ifdef HAVE_RECVMMSG
+static unsigned int WS2_async_rio_recv_batch( void **users, IO_STATUS_BLOCK **iosbs, NTSTATUS *status,
+                                              unsigned int count )
+{
+    HANDLE handle = ((struct ws2_async *)users[0])->hSocket;
+    unsigned int i, done = WS2_recv_batch( users, iosbs, count );
+
+    for (i = 0; i < done; i++)
+    {
+        status[i] = STATUS_SUCCESS;
+        WS2_rio_complete( users[i], iosbs[i] );
+    }
+    if (done) _enable_event( handle, FD_READ, 0, 0 );
+    return done;
+}
+#endif
+
+#ifdef HAVE_SENDMMSG
+static unsigned int WS2_async_rio_send_batch( void **users, IO_STATUS_BLOCK **iosbs, NTSTATUS *status,
+                                              unsigned int count )
+{
+    unsigned int i, done = WS2_send_batch( users, iosbs, count );
+
+    for (i = 0; i < done; i++)
+    {
+        status[i] = STATUS_SUCCESS;
+        WS2_rio_complete( users[i], iosbs[i] );
+    }
+    return done;
+}
+#endif
+
+static void *WS2_rio_buffer( const RIO_BUF *buf )
+{
+    struct ws2_rio_buffer *buffer = (struct ws2_rio_buffer *)buf->BufferId;
+
+    if (!buffer || buf->BufferId == RIO_INVALID_BUFFERID || buf->Offset > buffer->size ||
+        buf->Length > buffer->size - buf->Offset)
+        return NULL;
+    return buffer->data + buf->Offset;
+}
+
+static BOOL WS2_rio_start( RIO_RQ queue, PRIO_BUF data, ULONG count, PRIO_BUF remote, DWORD flags,
+                           void *context, BOOL send )
+{
+    struct ws2_rio_rq *rq = (struct ws2_rio_rq *)queue;
+    LONG *outstanding = send ? &rq->send_count : &rq->recv_count;
+    struct ws2_rio_request *req;
+    IO_STATUS_BLOCK *iosb;
+    NTSTATUS status;
+    int fd, n;
+
+    if (!rq || count > 1 || (count && !data))
+    {
+        SetLastError( WSAEINVAL );
+        return FALSE;
+    }
+    if (flags & RIO_MSG_COMMIT_ONLY) return TRUE;
+    if (flags & RIO_MSG_WAITALL) FIXME( "RIO_MSG_WAITALL not supported\n" );
+
+    if (InterlockedIncrement( outstanding ) > (send ? rq->max_send : rq->max_recv))
+    {
+        InterlockedDecrement( outstanding );
+        SetLastError( WSAENOBUFS );
+        return FALSE;
+    }
+    if (!(req = (struct ws2_rio_request *)alloc_async_io( sizeof(*req),
+                                                          send ? WS2_async_rio_send : WS2_async_rio_recv )))
+    {
+        InterlockedDecrement( outstanding );
+        SetLastError( WSAENOBUFS );
+        return FALSE;
+    }
+
+    req->rq      = rq;
+    req->context = (ULONG_PTR)context;
+    req->flags   = flags;
+    req->send    = send;
+    req->wsa.hSocket         = SOCKET2HANDLE(rq->socket);
+    req->wsa.user_overlapped = NULL;
+    req->wsa.completion_func = NULL;
+    req->wsa.addr            = NULL;
+    req->wsa.flags           = 0;
+    req->wsa.lpFlags         = &req->flags;
+    req->wsa.control         = NULL;
+    req->wsa.n_iovecs        = count;
+    req->wsa.first_iovec     = 0;
+    if (count)
+    {
+        if (!(req->wsa.iovec[0].iov_base = WS2_rio_buffer( data ))) goto invalid;
+        req->wsa.iovec[0].iov_len = data->Length;
+    }
+    if (remote)
+    {
+        if (!(req->wsa.addr = WS2_rio_buffer( remote ))) goto invalid;
+        req->addrlen = remote->Length;
+        if (send) req->wsa.addrlen.val = req->addrlen;
+        else req->wsa.addrlen.ptr = &req->addrlen;
+    }
+
+    InterlockedIncrement( &rq->refs );
+    iosb = &req->wsa.local_iosb;
+    iosb->u.Status = STATUS_PENDING;
+    iosb->Information = 0;
+
+    if ((fd = get_sock_fd( rq->socket, send ? FILE_WRITE_DATA : FILE_READ_DATA, NULL )) == -1)
+    {
+        iosb->u.Status = STATUS_INVALID_HANDLE;
+        WS2_rio_complete( req, iosb );
+        return TRUE;
+    }
+    n = send ? WS2_send( fd, &req->wsa, 0 ) : WS2_recv( fd, &req->wsa, 0 );
+    release_sock_fd( rq->socket, fd );
+
+    if (n >= 0 && (!send || req->wsa.first_iovec >= req->wsa.n_iovecs))
+    {
+        iosb->u.Status = STATUS_SUCCESS;
+        iosb->Information = n;
+        if (!send) _enable_event( req->wsa.hSocket, FD_READ, 0, 0 );
+        WS2_rio_complete( req, iosb );
+        return TRUE;
+    }
+    if (n == -1 && errno != EAGAIN)
+    {
+        iosb->u.Status = wsaErrStatus();
+        WS2_rio_complete( req, iosb );
+        return TRUE;
+    }
+    if (n > 0) iosb->Information = n;
+
+    status = register_socket_async( send ? ASYNC_TYPE_WRITE : ASYNC_TYPE_READ, req->wsa.hSocket,
+                                    &req->wsa.io, NULL, NULL, iosb );
+    if (status == STATUS_PENDING)
+    {
+        if (send) _enable_event( req->wsa.hSocket, FD_WRITE, 0, 0 );
+        return TRUE;
+    }
+    InterlockedDecrement( outstanding );
+    HeapFree( GetProcessHeap(), 0, req );
+    WS2_rio_release_rq( rq );
+    SetLastError( NtStatusToWSAError( status ));
+    return FALSE;
+
+invalid:
+    InterlockedDecrement( outstanding );
+    HeapFree( GetProcessHeap(), 0, req );
+    SetLastError( WSAEINVAL );
+    return FALSE;
+}
+
+/***********************************************************************
+ *     RIOReceive
+ */
+static BOOL WINAPI WS2_RIOReceive( RIO_RQ rq, PRIO_BUF data, ULONG count, DWORD flags, PVOID context )
+{
+    TRACE( "(%p, %p, %u, %#x, %p)\n", rq, data, count, flags, context );
+
+    return WS2_rio_start( rq, data, count, NULL, flags, context, FALSE );
+}
+
+/***********************************************************************
+ *     RIOReceiveEx
+ */
+static int WINAPI WS2_RIOReceiveEx( RIO_RQ rq, PRIO_BUF data, ULONG count, PRIO_BUF local, PRIO_BUF remote,
+                                    PRIO_BUF control, PRIO_BUF flags_buf, DWORD flags, PVOID context )
+{
+    TRACE( "(%p, %p, %u, %p, %p, %p, %p, %#x, %p)\n", rq, data, count, local, remote,
+           control, flags_buf, flags, context );
+
+    if (local || control || flags_buf)
+        FIXME( "local address, control and flags buffers not supported\n" );
+    return WS2_rio_start( rq, data, count, remote, flags, context, FALSE );
+}
+
+/***********************************************************************
+ *     RIOSend
+ */
+static BOOL WINAPI WS2_RIOSend( RIO_RQ rq, PRIO_BUF data, ULONG count, DWORD flags, PVOID context )
+{
+    TRACE( "(%p, %p, %u, %#x, %p)\n", rq, data, count, flags, context );
+
+    return WS2_rio_start( rq, data, count, NULL, flags, context, TRUE );
+}
+
+/***********************************************************************
+ *     RIOSendEx
+ */
+static BOOL WINAPI WS2_RIOSendEx( RIO_RQ rq, PRIO_BUF data, ULONG count, PRIO_BUF local, PRIO_BUF remote,
+                                  PRIO_BUF control, PRIO_BUF flags_buf, DWORD flags, PVOID context )
+{
+    TRACE( "(%p, %p, %u, %p, %p, %p, %p, %#x, %p)\n", rq, data, count, local, remote,
+           control, flags_buf, flags, context );
+
+    if (local || control || flags_buf)
+        FIXME( "local address, control and flags buffers not supported\n" );
+    return WS2_rio_start( rq, data, count, remote, flags, context, TRUE );
+}
+
+/***********************************************************************
+ *     RIOCreateCompletionQueue
+ */
+static RIO_CQ WINAPI WS2_RIOCreateCompletionQueue( DWORD size, PRIO_NOTIFICATION_COMPLETION notify )
+{
+    struct ws2_rio_cq *cq;
+
+    TRACE( "(%u, %p)\n", size, notify );
+
+    if (!size || (notify && notify->Type != RIO_EVENT_COMPLETION && notify->Type != RIO_IOCP_COMPLETION))
+    {
+        SetLastError( WSAEINVAL );
+        return RIO_INVALID_CQ;
+    }
+    if (!(cq = heap_alloc_zero( sizeof(*cq) )) || !(cq->results = heap_alloc( size * sizeof(*cq->results) )))
+    {
+        heap_free( cq );
+        SetLastError( WSAENOBUFS );
+        return RIO_INVALID_CQ;
+    }
+    InitializeCriticalSection( &cq->cs );
+    cq->cs.DebugInfo->Spare[0] = (DWORD_PTR)(__FILE__ ": ws2_rio_cq.cs");
+    cq->refs = 1;
+    cq->size = size;
+    if ((cq->has_notify = notify != NULL)) cq->notify = *notify;
+    return (RIO_CQ)cq;
+}
+
+/***********************************************************************
+ *     RIOCloseCompletionQueue
+ */
+static void WINAPI WS2_RIOCloseCompletionQueue( RIO_CQ queue )
+{
+    struct ws2_rio_cq *cq = (struct ws2_rio_cq *)queue;
+
+    TRACE( "(%p)\n", queue );
+
+    if (!cq) return;
+    /* the request queues still using it keep it alive, without notifications */
+    EnterCriticalSection( &cq->cs );
+    cq->closed = TRUE;
+    cq->armed = FALSE;
+    LeaveCriticalSection( &cq->cs );
+    WS2_rio_release_cq( cq );
+}
+
+/***********************************************************************
+ *     RIOResizeCompletionQueue
+ */
+static BOOL WINAPI WS2_RIOResizeCompletionQueue( RIO_CQ queue, DWORD size )
+{
+    struct ws2_rio_cq *cq = (struct ws2_rio_cq *)queue;
+    RIORESULT *results;
+    DWORD i;
+
+    TRACE( "(%p, %u)\n", queue, size );
+
+    if (!cq)
+    {
+        SetLastError( WSAEINVAL );
+        return FALSE;
+    }
+    EnterCriticalSection( &cq->cs );
+    if (size < cq->count || size < cq->reserved)
+    {
+        LeaveCriticalSection( &cq->cs );
+        SetLastError( WSAEINVAL );
+        return FALSE;
+    }
+    if (!(results = heap_alloc( size * sizeof(*results) )))
+    {
+        LeaveCriticalSection( &cq->cs );
+        SetLastError( WSAENOBUFS );
+        return FALSE;
+    }
+    for (i = 0; i < cq->count; i++) results[i] = cq->results[(cq->head + i) % cq->size];
+    heap_free( cq->results );
+    cq->results = results;
+    cq->size = size;
+    cq->head = 0;
+    LeaveCriticalSection( &cq->cs );
+    return TRUE;
+}
+
+/***********************************************************************
+ *     RIODequeueCompletion
+ */
+static ULONG WINAPI WS2_RIODequeueCompletion( RIO_CQ queue, PRIORESULT results, ULONG count )
+{
+    struct ws2_rio_cq *cq = (struct ws2_rio_cq *)queue;
+    ULONG i;
+
+    TRACE( "(%p, %p, %u)\n", queue, results, count );
+
+    if (!cq || !results) return RIO_CORRUPT_CQ;
+
+    EnterCriticalSection( &cq->cs );
+    if (cq->overflow)
+    {
+        LeaveCriticalSection( &cq->cs );
+        return RIO_CORRUPT_CQ;
+    }
+    count = min( count, cq->count );
+    for (i = 0; i < count; i++) results[i] = cq->results[(cq->head + i) % cq->size];
+    cq->head = (cq->head + count) % cq->size;
+    cq->count -= count;
+    LeaveCriticalSection( &cq->cs );
+    return count;
+}
+
+/***********************************************************************
+ *     RIONotify
+ */
+static INT WINAPI WS2_RIONotify( RIO_CQ queue )
+{
+    struct ws2_rio_cq *cq = (struct ws2_rio_cq *)queue;
+    INT ret = 0;
+
+    TRACE( "(%p)\n", queue );
+
+    if (!cq) return WSAEINVAL;
+
+    EnterCriticalSection( &cq->cs );
+    if (!cq->has_notify) ret = WSAEINVAL;
+    else if (cq->armed) ret = WSAEALREADY;
+    else
+    {
+        if (cq->notify.Type == RIO_EVENT_COMPLETION && cq->notify.u.Event.NotifyReset)
+            ResetEvent( cq->notify.u.Event.EventHandle );
+        cq->armed = TRUE;
+        if (cq->count) WS2_rio_notify( cq );
+    }
+    LeaveCriticalSection( &cq->cs );
+    return ret;
+}
+
+/* reserve room in a completion queue for the requests of a request queue */
+static BOOL WS2_rio_reserve( struct ws2_rio_cq *cq, LONG count )
+{
+    BOOL ret;
+
+    EnterCriticalSection( &cq->cs );
+    if ((ret = cq->reserved + count <= cq->size)) cq->reserved += count;
+    LeaveCriticalSection( &cq->cs );
+    return ret;
+}
+
+/***********************************************************************
+ *     RIOCreateRequestQueue
+ */
+static RIO_RQ WINAPI WS2_RIOCreateRequestQueue( SOCKET s, ULONG max_recv, ULONG max_recv_bufs,
+                                                ULONG max_send, ULONG max_send_bufs,
+                                                RIO_CQ recv_cq, RIO_CQ send_cq, PVOID context )
+{
+    struct ws2_rio_rq *rq;
+    int fd;
+
+    TRACE( "(%04lx, %u, %u, %u, %u, %p, %p, %p)\n", s, max_recv, max_recv_bufs,
+           max_send, max_send_bufs, recv_cq, send_cq, context );
+
+    if (!recv_cq || !send_cq || max_recv_bufs > 1 || max_send_bufs > 1)
+    {
+        SetLastError( WSAEINVAL );
+        return RIO_INVALID_RQ;
+    }
+    if ((fd = get_sock_fd( s, 0, NULL )) == -1) return RIO_INVALID_RQ;
+    release_sock_fd( s, fd );
+
+    if (!(rq = heap_alloc_zero( sizeof(*rq) )))
+    {
+        SetLastError( WSAENOBUFS );
+        return RIO_INVALID_RQ;
+    }
+    rq->refs     = 1;
+    rq->socket   = s;
+    rq->context  = (ULONG_PTR)context;
+    rq->recv_cq  = (struct ws2_rio_cq *)recv_cq;
+    rq->send_cq  = (struct ws2_rio_cq *)send_cq;
+
+    if (!WS2_rio_reserve( rq->recv_cq, max_recv ))
+    {
+        heap_free( rq );
+        SetLastError( WSAENOBUFS );
+        return RIO_INVALID_RQ;
+    }
+    if (!WS2_rio_reserve( rq->send_cq, max_send ))
+    {
+        WS2_rio_reserve( rq->recv_cq, -(LONG)max_recv );
+        heap_free( rq );
+        SetLastError( WSAENOBUFS );
+        return RIO_INVALID_RQ;
+    }
+    rq->max_recv = max_recv;
+    rq->max_send = max_send;
+    InterlockedIncrement( &rq->recv_cq->refs );
+    InterlockedIncrement( &rq->send_cq->refs );
+
+    EnterCriticalSection( &rio_cs );
+    list_add_tail( &rio_queues, &rq->entry );
+    LeaveCriticalSection( &rio_cs );
+    return (RIO_RQ)rq;
+}
+
+/***********************************************************************
+ *     RIOResizeRequestQueue
+ */
+static BOOL WINAPI WS2_RIOResizeRequestQueue( RIO_RQ queue, DWORD max_recv, DWORD max_send )
+{
+    struct ws2_rio_rq *rq = (struct ws2_rio_rq *)queue;
+
+    TRACE( "(%p, %u, %u)\n", queue, max_recv, max_send );
+
+    if (!rq || max_recv < rq->recv_count || max_send < rq->send_count)
+    {
+        SetLastError( WSAEINVAL );
+        return FALSE;
+    }
+    if (!WS2_rio_reserve( rq->recv_cq, (LONG)(max_recv - rq->max_recv) ))
+    {
+        SetLastError( WSAENOBUFS );
+        return FALSE;
+    }
+    if (!WS2_rio_reserve( rq->send_cq, (LONG)(max_send - rq->max_send) ))
+    {
+        WS2_rio_reserve( rq->recv_cq, (LONG)(rq->max_recv - max_recv) );
+        SetLastError( WSAENOBUFS );
+        return FALSE;
+    }
+    rq->max_recv = max_recv;
+    rq->max_send = max_send;
+    return TRUE;
+}
+
+/***********************************************************************
+ *     RIORegisterBuffer
  */
-static int WINAPI WS2_WSARecvMsg( SOCKET s, LPWSAMSG msg, LPDWORD lpNumberOfBytesRecvd,
-                                  LPWSAOVERLAPPED lpOverlapped,
-                                  LPWSAOVERLAPPED_COMPLETION_ROUTINE lpCompletionRoutine )
+static RIO_BUFFERID WINAPI WS2_RIORegisterBuffer( PCHAR data, DWORD size )
 {
-    if (!msg)
+    struct ws2_rio_buffer *buffer;
+
+    TRACE( "(%p, %u)\n", data, size );
+
+    if (!data || IsBadWritePtr( data, size ))
     {
         SetLastError( WSAEFAULT );
-        return SOCKET_ERROR;
+        return RIO_INVALID_BUFFERID;
+    }
+    if (!(buffer = heap_alloc( sizeof(*buffer) )))
+    {
+        SetLastError( WSAENOBUFS );
+        return RIO_INVALID_BUFFERID;
     }
+    buffer->data = data;
+    buffer->size = size;
+    return (RIO_BUFFERID)buffer;
+}
 
-    return WS2_recv_base( s, msg->lpBuffers, msg->dwBufferCount, lpNumberOfBytesRecvd,
-                          &msg->dwFlags, msg->name, &msg->namelen,
-                          lpOverlapped, lpCompletionRoutine, &msg->Control );
+/***********************************************************************
+ *     RIODeregisterBuffer
+ */
+static void WINAPI WS2_RIODeregisterBuffer( RIO_BUFFERID id )
+{
+    TRACE( "(%p)\n", id );
+
+    if (id != RIO_INVALID_BUFFERID) heap_free( id );
+}
+
+static const RIO_EXTENSION_FUNCTION_TABLE rio_functions =
+{
+    sizeof(RIO_EXTENSION_FUNCTION_TABLE),
+    WS2_RIOReceive,
+    WS2_RIOReceiveEx,
+    WS2_RIOSend,
+    WS2_RIOSendEx,
+    WS2_RIOCloseCompletionQueue,
+    WS2_RIOCreateCompletionQueue,
+    WS2_RIOCreateRequestQueue,
+    WS2_RIODequeueCompletion,
+    WS2_RIODeregisterBuffer,
+    WS2_RIONotify,
+    WS2_RIORegisterBuffer,
+    WS2_RIOResizeCompletionQueue,
+    WS2_RIOResizeRequestQueue,
+};
+
+/* let ntdll hand several ready reads or writes of a socket to recvmmsg() and sendmmsg() */
+static void WS2_register_batch_handlers(void)
+{
+#ifdef HAVE_RECVMMSG
+    __wine_set_socket_batch_handler( WS2_async_recv, WS2_async_recv_batch );
+    __wine_set_socket_batch_handler( WS2_async_rio_recv, WS2_async_rio_recv_batch );
+#endif
+#ifdef HAVE_SENDMMSG
+    __wine_set_socket_batch_handler( WS2_async_send, WS2_async_send_batch );
+    __wine_set_socket_batch_handler( WS2_async_rio_send, WS2_async_rio_send_batch );
+#endif
 }
 
 /***********************************************************************
@@ -3422,6 +4470,7 @@ int WINAPI WS_closesocket(SOCKET s)
             release_sock_fd(s, fd);
             if (CloseHandle(SOCKET2HANDLE(s)))
                 res = 0;
+            WS2_rio_close_socket(s);
         }
         else
             SetLastError(WSAENOTSOCK);
@@ -4491,6 +5540,7 @@ static const char *debugstr_wsaioctl(DWORD code)
         IOCTL_NAME(WS_SIO_FLUSH);
         IOCTL_NAME(WS_SIO_GET_BROADCAST_ADDRESS);
         IOCTL_NAME(WS_SIO_GET_EXTENSION_FUNCTION_POINTER);
+        IOCTL_NAME(WS_SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER);
         IOCTL_NAME(WS_SIO_GET_GROUP_QOS);
         IOCTL_NAME(WS_SIO_GET_INTERFACE_LIST);
         /* IOCTL_NAME(WS_SIO_GET_INTERFACE_LIST_EX); */
@@ -4923,7 +5973,7 @@ INT WINAPI WSAIoctl(SOCKET s, DWORD code, LPVOID in_buff, DWORD in_size, LPVOID
             EXTENSION_FUNCTION(WSAID_ACCEPTEX, WS2_AcceptEx)
             EXTENSION_FUNCTION(WSAID_GETACCEPTEXSOCKADDRS, WS2_GetAcceptExSockaddrs)
             EXTENSION_FUNCTION(WSAID_TRANSMITFILE, WS2_TransmitFile)
-            /* EXTENSION_FUNCTION(WSAID_TRANSMITPACKETS, WS2_TransmitPackets) */
+            EXTENSION_FUNCTION(WSAID_TRANSMITPACKETS, WS2_TransmitPackets)
             EXTENSION_FUNCTION(WSAID_WSARECVMSG, WS2_WSARecvMsg)
             EXTENSION_FUNCTION(WSAID_WSASENDMSG, WSASendMsg)
         };
@@ -4952,6 +6002,27 @@ INT WINAPI WSAIoctl(SOCKET s, DWORD code, LPVOID in_buff, DWORD in_size, LPVOID
         status = WSAEOPNOTSUPP;
         break;
     }
+    case WS_SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER:
+    {
+        static const GUID rio_guid = WSAID_MULTIPLE_RIO;
+
+        if (!in_buff || in_size < sizeof(GUID) || !IsEqualGUID(&rio_guid, in_buff))
+        {
+            FIXME("SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER %s: stub\n",
+                  in_buff ? debugstr_guid(in_buff) : "(null)");
+            status = WSAEOPNOTSUPP;
+            break;
+        }
+        if (!out_buff || out_size < sizeof(rio_functions))
+        {
+            status = WSAEFAULT;
+            break;
+        }
+        TRACE("-> got RIO function table\n");
+        memcpy(out_buff, &rio_functions, sizeof(rio_functions));
+        total = sizeof(rio_functions);
+        break;
+    }
     case WS_SIO_KEEPALIVE_VALS:
     {
         struct tcp_keepalive *k;
@@ -5188,13 +6259,39 @@ int WINAPI WS_recvfrom(SOCKET s, char *buf, INT len, int flags,
         return n;
 }
 
+#define POLL_FD_CLOSE    0x01  /* the fd is a copy that must be closed */
+#define POLL_FD_CHECKED  0x02  /* the socket state was checked during this call */
+
+/* get the per-thread poll array, with room for count descriptors */
+static struct pollfd *get_poll_fds( unsigned int count, unsigned char **flags )
+{
+    struct per_thread_data *ptb = get_per_thread_data();
+    struct pollfd *fds;
+
+    /* check if the cache can hold all descriptors, if not do the resizing */
+    if (ptb->fd_count < count)
+    {
+        if (!(fds = HeapAlloc( GetProcessHeap(), 0, count * (sizeof(fds[0]) + sizeof(**flags)) )))
+            return NULL;
+        HeapFree( GetProcessHeap(), 0, ptb->fd_cache );
+        ptb->fd_cache = fds;
+        ptb->fd_flags = (unsigned char *)(fds + count);
+        ptb->fd_count = count;
+    }
+    *flags = ptb->fd_flags;
+    return ptb->fd_cache;
+}
+
 /* allocate a poll array for the corresponding fd sets */
+/* the state of the sockets is only checked once they are signaled, see check_poll_results */
 static struct pollfd *fd_sets_to_poll( const WS_fd_set *readfds, const WS_fd_set *writefds,
-                                       const WS_fd_set *exceptfds, int *count_ptr )
+                                       const WS_fd_set *exceptfds, BOOL copy, int *count_ptr,
+                                       unsigned char **flags_ptr )
 {
     unsigned int i, j = 0, count = 0;
+    unsigned char *flags;
     struct pollfd *fds;
-    struct per_thread_data *ptb = get_per_thread_data();
+    int needs_close;
 
     if (readfds) count += readfds->fd_count;
     if (writefds) count += writefds->fd_count;
@@ -5206,139 +6303,144 @@ static struct pollfd *fd_sets_to_poll( const WS_fd_set *readfds, const WS_fd_set
         return NULL;
     }
 
-    /* check if the cache can hold all descriptors, if not do the resizing */
-    if (ptb->fd_count < count)
+    if (!(fds = get_poll_fds( count, &flags )))
     {
-        if (!(fds = HeapAlloc(GetProcessHeap(), 0, count * sizeof(fds[0]))))
-        {
-            SetLastError( ERROR_NOT_ENOUGH_MEMORY );
-            return NULL;
-        }
-        HeapFree(GetProcessHeap(), 0, ptb->fd_cache);
-        ptb->fd_cache = fds;
-        ptb->fd_count = count;
+        SetLastError( ERROR_NOT_ENOUGH_MEMORY );
+        return NULL;
     }
-    else
-        fds = ptb->fd_cache;
 
     if (readfds)
         for (i = 0; i < readfds->fd_count; i++, j++)
         {
-            fds[j].fd = get_sock_fd( readfds->fd_array[i], FILE_READ_DATA, NULL );
+            fds[j].fd = get_poll_sock_fd( readfds->fd_array[i], FILE_READ_DATA, copy, &needs_close );
             if (fds[j].fd == -1) goto failed;
+            fds[j].events = POLLIN;
             fds[j].revents = 0;
-            if (is_fd_bound(fds[j].fd, NULL, NULL) == 1)
-            {
-                fds[j].events = POLLIN;
-            }
-            else
-            {
-                release_sock_fd( readfds->fd_array[i], fds[j].fd );
-                fds[j].fd = -1;
-                fds[j].events = 0;
-            }
+            flags[j] = needs_close ? POLL_FD_CLOSE : 0;
         }
     if (writefds)
         for (i = 0; i < writefds->fd_count; i++, j++)
         {
-            fds[j].fd = get_sock_fd( writefds->fd_array[i], FILE_WRITE_DATA, NULL );
+            fds[j].fd = get_poll_sock_fd( writefds->fd_array[i], FILE_WRITE_DATA, copy, &needs_close );
             if (fds[j].fd == -1) goto failed;
+            fds[j].events = POLLOUT;
             fds[j].revents = 0;
-            if (is_fd_bound(fds[j].fd, NULL, NULL) == 1 ||
-                _get_fd_type(fds[j].fd) == SOCK_DGRAM)
-            {
-                fds[j].events = POLLOUT;
-            }
-            else
-            {
-                release_sock_fd( writefds->fd_array[i], fds[j].fd );
-                fds[j].fd = -1;
-                fds[j].events = 0;
-            }
+            flags[j] = needs_close ? POLL_FD_CLOSE : 0;
         }
     if (exceptfds)
         for (i = 0; i < exceptfds->fd_count; i++, j++)
         {
-            fds[j].fd = get_sock_fd( exceptfds->fd_array[i], 0, NULL );
+            fds[j].fd = get_poll_sock_fd( exceptfds->fd_array[i], 0, copy, &needs_close );
             if (fds[j].fd == -1) goto failed;
+            fds[j].events = POLLHUP | POLLPRI;
             fds[j].revents = 0;
-            if (is_fd_bound(fds[j].fd, NULL, NULL) == 1)
-            {
-                int oob_inlined = 0;
-                socklen_t olen = sizeof(oob_inlined);
+            flags[j] = needs_close ? POLL_FD_CLOSE : 0;
+        }
+    *flags_ptr = flags;
+    return fds;
 
-                fds[j].events = POLLHUP;
+failed:
+    for (i = 0; i < j; i++) release_cached_sock_fd( fds[i].fd, flags[i] & POLL_FD_CLOSE );
+    return NULL;
+}
 
-                /* Check if we need to test for urgent data or not */
-                getsockopt(fds[j].fd, SOL_SOCKET, SO_OOBINLINE, (char*) &oob_inlined, &olen);
-                if (!oob_inlined)
-                    fds[j].events |= POLLPRI;
-            }
-            else
+/* check the state of the sockets that got signaled, and stop polling the ones that can't be selected */
+/* returns the number of signaled descriptors that are left */
+static int check_poll_results( const WS_fd_set *readfds, const WS_fd_set *writefds,
+                               const WS_fd_set *exceptfds, struct pollfd *fds, unsigned char *flags )
+{
+    unsigned int write_start = readfds ? readfds->fd_count : 0;
+    unsigned int except_start = write_start + (writefds ? writefds->fd_count : 0);
+    unsigned int j, count = except_start + (exceptfds ? exceptfds->fd_count : 0);
+    int total = 0;
+
+    for (j = 0; j < count; j++)
+    {
+        if (!fds[j].revents) continue;
+        if (!(flags[j] & POLL_FD_CHECKED))
+        {
+            flags[j] |= POLL_FD_CHECKED;
+            if (is_fd_bound( fds[j].fd, NULL, NULL ) != 1 &&
+                !(j >= write_start && j < except_start && _get_fd_type( fds[j].fd ) == SOCK_DGRAM))
             {
-                release_sock_fd( exceptfds->fd_array[i], fds[j].fd );
+                release_cached_sock_fd( fds[j].fd, flags[j] & POLL_FD_CLOSE );
                 fds[j].fd = -1;
-                fds[j].events = 0;
+                fds[j].events = fds[j].revents = 0;
+                continue;
             }
-        }
-    return fds;
+            if (j >= except_start && (fds[j].revents & POLLPRI))
+            {
+                int oob_inlined = 0;
+                socklen_t olen = sizeof(oob_inlined);
 
-failed:
-    count = j;
-    j = 0;
-    if (readfds)
-        for (i = 0; i < readfds->fd_count && j < count; i++, j++)
-            if (fds[j].fd != -1) release_sock_fd( readfds->fd_array[i], fds[j].fd );
-    if (writefds)
-        for (i = 0; i < writefds->fd_count && j < count; i++, j++)
-            if (fds[j].fd != -1) release_sock_fd( writefds->fd_array[i], fds[j].fd );
-    if (exceptfds)
-        for (i = 0; i < exceptfds->fd_count && j < count; i++, j++)
-            if (fds[j].fd != -1) release_sock_fd( exceptfds->fd_array[i], fds[j].fd );
-    return NULL;
+                /* urgent data only counts when it isn't inlined */
+                getsockopt( fds[j].fd, SOL_SOCKET, SO_OOBINLINE, (char *)&oob_inlined, &olen );
+                if (oob_inlined)
+                {
+                    fds[j].events &= ~POLLPRI;
+                    fds[j].revents &= ~POLLPRI;
+                }
+            }
+        }
+        if (fds[j].revents) total++;
+    }
+    return total;
 }
 
 /* release the file descriptor obtained in fd_sets_to_poll */
 /* must be called with the original fd_set arrays, before calling get_poll_results */
 static void release_poll_fds( const WS_fd_set *readfds, const WS_fd_set *writefds,
-                              const WS_fd_set *exceptfds, struct pollfd *fds )
+                              const WS_fd_set *exceptfds, struct pollfd *fds, const unsigned char *flags )
 {
-    unsigned int i, j = 0;
+    unsigned int i, j = 0, count = 0;
+    int fd, needs_close;
+
+    if (readfds) count += readfds->fd_count;
+    if (writefds) count += writefds->fd_count;
+    if (exceptfds) count += exceptfds->fd_count;
+
+    for (j = 0; j < count; j++)
+        if (fds[j].fd != -1) release_cached_sock_fd( fds[j].fd, flags[j] & POLL_FD_CLOSE );
 
-    if (readfds)
-    {
-        for (i = 0; i < readfds->fd_count; i++, j++)
-            if (fds[j].fd != -1) release_sock_fd( readfds->fd_array[i], fds[j].fd );
-    }
-    if (writefds)
-    {
-        for (i = 0; i < writefds->fd_count; i++, j++)
-            if (fds[j].fd != -1) release_sock_fd( writefds->fd_array[i], fds[j].fd );
-    }
     if (exceptfds)
     {
+        j = count - exceptfds->fd_count;
         for (i = 0; i < exceptfds->fd_count; i++, j++)
         {
-            if (fds[j].fd == -1) continue;
-            release_sock_fd( exceptfds->fd_array[i], fds[j].fd );
-            if (fds[j].revents & POLLHUP)
-            {
-                int fd = get_sock_fd( exceptfds->fd_array[i], 0, NULL );
-                if (fd != -1)
-                    release_sock_fd( exceptfds->fd_array[i], fd );
-                else
-                    fds[j].revents = 0;
-            }
+            if (fds[j].fd == -1 || !(fds[j].revents & POLLHUP)) continue;
+            fd = get_cached_sock_fd( exceptfds->fd_array[i], 0, &needs_close );
+            if (fd != -1)
+                release_cached_sock_fd( fd, needs_close );
+            else
+                fds[j].revents = 0;
         }
     }
 }
 
+/* compute what is left of a timeout in milliseconds that started at the given time */
+static int get_timeout_left( const struct timeval *start, int timeout )
+{
+    struct timeval now;
+
+    gettimeofday( &now, 0 );
+
+    now.tv_sec  -= start->tv_sec;
+    now.tv_usec -= start->tv_usec;
+    if (now.tv_usec < 0)
+    {
+        now.tv_usec += 1000000;
+        now.tv_sec  -= 1;
+    }
+
+    return timeout - (now.tv_sec * 1000) - (now.tv_usec + 999) / 1000;
+}
+
 static int do_poll(struct pollfd *pollfds, int count, int timeout)
 {
-    struct timeval tv1, tv2;
+    struct timeval start;
     int ret, torig = timeout;
 
-    if (timeout > 0) gettimeofday( &tv1, 0 );
+    if (timeout > 0) gettimeofday( &start, 0 );
 
     while ((ret = poll( pollfds, count, timeout )) < 0)
     {
@@ -5346,22 +6448,246 @@ static int do_poll(struct pollfd *pollfds, int count, int timeout)
         if (timeout < 0) continue;
         if (timeout == 0) return 0;
 
-        gettimeofday( &tv2, 0 );
+        timeout = get_timeout_left( &start, torig );
+        if (timeout <= 0) return 0;
+    }
+    return ret;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+
+#define WS_EPOLL_MIN_FDS  64
+
+static const int ws_epoll_map[][2] =
+{
+    { POLLIN,     EPOLLIN },
+    { POLLPRI,    EPOLLPRI },
+    { POLLOUT,    EPOLLOUT },
+    { POLLRDNORM, EPOLLRDNORM },
+    { POLLWRNORM, EPOLLWRNORM },
+    { POLLWRBAND, EPOLLWRBAND },
+    { POLLERR,    EPOLLERR },
+    { POLLHUP,    EPOLLHUP }
+};
+
+/* registration of a Unix fd in the epoll set */
+struct poll_epoll_fd
+{
+    unsigned int serial;   /* last call that used the fd, 0 if it isn't registered */
+    unsigned int index;    /* index of the fd in the poll array of that call */
+    unsigned int events;   /* registered epoll events */
+};
+
+/* epoll set kept across the WSAPoll calls of a thread, so that a call
+ * only has to change the registrations that differ from the last one */
+struct poll_epoll
+{
+    int                   fd;          /* epoll instance, -1 if it must be recreated */
+    unsigned int          generation;  /* socket fd generation that the registrations are valid for */
+    unsigned int          serial;      /* WSAPoll call counter */
+    struct poll_epoll_fd *fds;         /* registrations indexed by Unix fd */
+    unsigned int          size;        /* size of the fds array */
+    int                  *registered;  /* Unix fds that are registered */
+    unsigned int          count;       /* number of registered fds */
+    struct epoll_event   *events;      /* buffer for epoll_wait */
+    unsigned int          max;         /* size of the registered and events arrays */
+};
+
+static BOOL use_epoll(void)
+{
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINEWSAPOLLEPOLL" );
+        enabled = env && atoi( env );
+    }
+    return enabled;
+}
+
+static int convert_poll_u2e( int events )
+{
+    int i, ret = 0;
+    for (i = 0; i < ARRAY_SIZE(ws_epoll_map); i++)
+        if (events & ws_epoll_map[i][0]) ret |= ws_epoll_map[i][1];
+    return ret;
+}
+
+static int convert_poll_e2u( int events )
+{
+    int i, ret = 0;
+    for (i = 0; i < ARRAY_SIZE(ws_epoll_map); i++)
+        if (events & ws_epoll_map[i][1]) ret |= ws_epoll_map[i][0];
+    return ret;
+}
+
+static void free_poll_epoll( struct poll_epoll *epoll )
+{
+    if (!epoll) return;
+    if (epoll->fd != -1) close( epoll->fd );
+    HeapFree( GetProcessHeap(), 0, epoll->fds );
+    HeapFree( GetProcessHeap(), 0, epoll->registered );
+    HeapFree( GetProcessHeap(), 0, epoll->events );
+    HeapFree( GetProcessHeap(), 0, epoll );
+}
+
+/* make room for count new registrations and for Unix fds up to max_fd */
+static BOOL grow_poll_epoll( struct poll_epoll *epoll, unsigned int count, int max_fd )
+{
+    if (epoll->count + count > epoll->max)
+    {
+        unsigned int max = max( epoll->max * 2, epoll->count + count );
+        struct epoll_event *events;
+        int *registered;
 
-        tv2.tv_sec  -= tv1.tv_sec;
-        tv2.tv_usec -= tv1.tv_usec;
-        if (tv2.tv_usec < 0)
+        if (!(events = HeapAlloc( GetProcessHeap(), 0, max * sizeof(*events) ))) return FALSE;
+        if (epoll->registered)
+            registered = HeapReAlloc( GetProcessHeap(), 0, epoll->registered, max * sizeof(*registered) );
+        else
+            registered = HeapAlloc( GetProcessHeap(), 0, max * sizeof(*registered) );
+        if (!registered)
         {
-            tv2.tv_usec += 1000000;
-            tv2.tv_sec  -= 1;
+            HeapFree( GetProcessHeap(), 0, events );
+            return FALSE;
         }
+        HeapFree( GetProcessHeap(), 0, epoll->events );
+        epoll->events = events;
+        epoll->registered = registered;
+        epoll->max = max;
+    }
+    if (max_fd >= epoll->size)
+    {
+        unsigned int size = max( epoll->size * 2, max_fd + 1 );
+        struct poll_epoll_fd *fds;
 
-        timeout = torig - (tv2.tv_sec * 1000) - (tv2.tv_usec + 999) / 1000;
-        if (timeout <= 0) return 0;
+        if (epoll->fds)
+            fds = HeapReAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, epoll->fds, size * sizeof(*fds) );
+        else
+            fds = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, size * sizeof(*fds) );
+        if (!fds) return FALSE;
+        epoll->fds = fds;
+        epoll->size = size;
     }
-    return ret;
+    return TRUE;
+}
+
+/* wait on a poll array with the epoll set of the thread */
+/* generation must be retrieved before looking up the fds; returns FALSE if poll must be used instead */
+static BOOL do_epoll( struct pollfd *pollfds, unsigned int count, int timeout,
+                      unsigned int generation, int *ret )
+{
+    struct per_thread_data *ptb = get_per_thread_data();
+    struct poll_epoll *epoll = ptb->epoll;
+    struct epoll_event event;
+    struct timeval start;
+    int i, n, max_fd = -1, torig = timeout;
+
+    if (count < WS_EPOLL_MIN_FDS || !use_epoll()) return FALSE;
+
+    if (!epoll)
+    {
+        if (!(epoll = HeapAlloc( GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(*epoll) ))) return FALSE;
+        epoll->fd = -1;
+        ptb->epoll = epoll;
+    }
+
+    /* the Unix fds may have been reused if sockets were closed since the last call */
+    if (epoll->fd == -1 || epoll->generation != generation || !++epoll->serial)
+    {
+        if (epoll->fd != -1) close( epoll->fd );
+        if ((epoll->fd = epoll_create1( EPOLL_CLOEXEC )) == -1) return FALSE;
+        if (epoll->fds) memset( epoll->fds, 0, epoll->size * sizeof(*epoll->fds) );
+        epoll->generation = generation;
+        epoll->serial = 1;
+        epoll->count = 0;
+    }
+
+    for (i = 0; i < count; i++) max_fd = max( max_fd, pollfds[i].fd );
+    if (!grow_poll_epoll( epoll, count, max_fd )) return FALSE;
+
+    for (i = 0; i < count; i++)
+    {
+        struct poll_epoll_fd *reg;
+
+        if (pollfds[i].fd == -1) continue;
+        reg = &epoll->fds[pollfds[i].fd];
+        /* the same socket is present twice, epoll can't report it with different events */
+        if (reg->serial == epoll->serial) return FALSE;
+
+        memset( &event, 0, sizeof(event) );
+        event.events = convert_poll_u2e( pollfds[i].events );
+        event.data.fd = pollfds[i].fd;
+        if (!reg->serial)
+        {
+            if (epoll_ctl( epoll->fd, EPOLL_CTL_ADD, pollfds[i].fd, &event )) goto failed;
+            epoll->registered[epoll->count++] = pollfds[i].fd;
+        }
+        else if (reg->events != event.events &&
+                 epoll_ctl( epoll->fd, EPOLL_CTL_MOD, pollfds[i].fd, &event ))
+            goto failed;
+
+        reg->serial = epoll->serial;
+        reg->index  = i;
+        reg->events = event.events;
+    }
+
+    /* remove the fds that aren't polled anymore */
+    for (i = 0; i < epoll->count;)
+    {
+        int fd = epoll->registered[i];
+
+        if (epoll->fds[fd].serial == epoll->serial)
+        {
+            i++;
+            continue;
+        }
+        epoll_ctl( epoll->fd, EPOLL_CTL_DEL, fd, NULL );
+        epoll->fds[fd].serial = 0;
+        epoll->registered[i] = epoll->registered[--epoll->count];
+    }
+
+    if (timeout > 0) gettimeofday( &start, 0 );
+
+    while ((n = epoll_wait( epoll->fd, epoll->events, count, timeout )) < 0)
+    {
+        if (errno != EINTR) break;
+        if (timeout < 0) continue;
+        if (timeout == 0 || (timeout = get_timeout_left( &start, torig )) <= 0)
+        {
+            n = 0;
+            break;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        struct poll_epoll_fd *reg = &epoll->fds[epoll->events[i].data.fd];
+        pollfds[reg->index].revents = convert_poll_e2u( epoll->events[i].events );
+    }
+    *ret = n;
+    return TRUE;
+
+failed:
+    WARN( "epoll_ctl failed: %s\n", strerror( errno ));
+    close( epoll->fd );
+    epoll->fd = -1;
+    return FALSE;
+}
+
+#else  /* HAVE_SYS_EPOLL_H */
+
+static void free_poll_epoll( struct poll_epoll *epoll )
+{
+}
+
+static BOOL do_epoll( struct pollfd *pollfds, unsigned int count, int timeout,
+                      unsigned int generation, int *ret )
+{
+    return FALSE;
 }
 
+#endif  /* HAVE_SYS_EPOLL_H */
+
 /* map the poll results back into the Windows fd sets */
 static int get_poll_results( WS_fd_set *readfds, WS_fd_set *writefds, WS_fd_set *exceptfds,
                              const struct pollfd *fds )
@@ -5411,21 +6737,46 @@ int WINAPI WS_select(int nfds, WS_fd_set *ws_readfds,
                      const struct WS_timeval* ws_timeout)
 {
     struct pollfd *pollfds;
-    int count, ret, timeout = -1;
+    unsigned char *flags;
+    struct timeval start;
+    unsigned int generation;
+    int i, count, ret, err = 0, timeout = -1, torig;
+    BOOL copy = FALSE;
 
     TRACE("read %p, write %p, excp %p timeout %p\n",
           ws_readfds, ws_writefds, ws_exceptfds, ws_timeout);
 
-    if (!(pollfds = fd_sets_to_poll( ws_readfds, ws_writefds, ws_exceptfds, &count )))
-        return SOCKET_ERROR;
-
     if (ws_timeout)
         timeout = (ws_timeout->tv_sec * 1000) + (ws_timeout->tv_usec + 999) / 1000;
+    torig = timeout;
+    if (timeout > 0) gettimeofday( &start, 0 );
 
-    ret = do_poll(pollfds, count, timeout);
-    release_poll_fds( ws_readfds, ws_writefds, ws_exceptfds, pollfds );
+    for (;;)
+    {
+        generation = __wine_server_socket_fd_generation();
+        if (!(pollfds = fd_sets_to_poll( ws_readfds, ws_writefds, ws_exceptfds, copy, &count, &flags )))
+            return SOCKET_ERROR;
 
-    if (ret == -1) SetLastError(wsaErrno());
+        for (;;)
+        {
+            ret = do_poll(pollfds, count, timeout);
+            if (ret == -1) err = wsaErrno();
+            if (ret <= 0 || (ret = check_poll_results( ws_readfds, ws_writefds, ws_exceptfds, pollfds, flags )))
+                break;
+            /* only sockets that can't be selected were signaled, wait again for the others */
+            if (timeout > 0 && (timeout = get_timeout_left( &start, torig )) <= 0) break;
+        }
+        if (copy || __wine_server_socket_fd_generation() == generation) break;
+
+        /* a cached fd may have been closed and reused while polling, poll again on copies */
+        for (i = 0; i < count; i++)
+            if (pollfds[i].fd != -1) release_cached_sock_fd( pollfds[i].fd, flags[i] & POLL_FD_CLOSE );
+        if (timeout > 0) timeout = max( 0, get_timeout_left( &start, torig ) );
+        copy = TRUE;
+    }
+    release_poll_fds( ws_readfds, ws_writefds, ws_exceptfds, pollfds, flags );
+
+    if (ret == -1) SetLastError(err);
     else ret = get_poll_results( ws_readfds, ws_writefds, ws_exceptfds, pollfds );
     return ret;
 }
@@ -5435,8 +6786,12 @@ int WINAPI WS_select(int nfds, WS_fd_set *ws_readfds,
  */
 int WINAPI WSAPoll(WSAPOLLFD *wfds, ULONG count, int timeout)
 {
-    int i, ret;
+    int i, ret, fd, needs_close, copied, torig = timeout;
+    unsigned int generation;
+    unsigned char *flags;
     struct pollfd *ufds;
+    struct timeval start;
+    BOOL copy = FALSE;
 
     if (!count)
     {
@@ -5449,34 +6804,53 @@ int WINAPI WSAPoll(WSAPOLLFD *wfds, ULONG count, int timeout)
         return SOCKET_ERROR;
     }
 
-    if (!(ufds = HeapAlloc(GetProcessHeap(), 0, count * sizeof(ufds[0]))))
+    if (!(ufds = get_poll_fds( count, &flags )))
     {
         SetLastError(WSAENOBUFS);
         return SOCKET_ERROR;
     }
 
-    for (i = 0; i < count; i++)
+    if (timeout > 0) gettimeofday( &start, 0 );
+
+    for (;;)
     {
-        ufds[i].fd = get_sock_fd(wfds[i].fd, 0, NULL);
-        ufds[i].events = convert_poll_w2u(wfds[i].events);
-        ufds[i].revents = 0;
-    }
+        generation = __wine_server_socket_fd_generation();
+        copied = 0;
+        for (i = 0; i < count; i++)
+        {
+            ufds[i].fd = get_poll_sock_fd(wfds[i].fd, 0, copy, &needs_close);
+            ufds[i].events = convert_poll_w2u(wfds[i].events);
+            ufds[i].revents = 0;
+            flags[i] = needs_close ? POLL_FD_CLOSE : 0;
+            copied |= needs_close;
+        }
+
+        /* the epoll set can only keep the fds that remain valid across calls */
+        if (copied || !do_epoll( ufds, count, timeout, generation, &ret ))
+            ret = do_poll(ufds, count, timeout);
 
-    ret = do_poll(ufds, count, timeout);
+        if (copy || __wine_server_socket_fd_generation() == generation) break;
+
+        /* a cached fd may have been closed and reused while polling, poll again on copies */
+        for (i = 0; i < count; i++)
+            if (ufds[i].fd != -1) release_cached_sock_fd(ufds[i].fd, flags[i] & POLL_FD_CLOSE);
+        if (timeout > 0) timeout = max( 0, get_timeout_left( &start, torig ) );
+        copy = TRUE;
+    }
 
     for (i = 0; i < count; i++)
     {
         if (ufds[i].fd != -1)
         {
-            release_sock_fd(wfds[i].fd, ufds[i].fd);
+            release_cached_sock_fd(ufds[i].fd, flags[i] & POLL_FD_CLOSE);
             if (ufds[i].revents & POLLHUP)
             {
                 /* Check if the socket still exists */
-                int fd = get_sock_fd(wfds[i].fd, 0, NULL);
+                fd = get_cached_sock_fd(wfds[i].fd, 0, &needs_close);
                 if (fd != -1)
                 {
                     wfds[i].revents = WS_POLLHUP;
-                    release_sock_fd(wfds[i].fd, fd);
+                    release_cached_sock_fd(fd, needs_close);
                 }
                 else
                     wfds[i].revents = WS_POLLNVAL;
@@ -5488,7 +6862,6 @@ int WINAPI WSAPoll(WSAPOLLFD *wfds, ULONG count, int timeout)
             wfds[i].revents = WS_POLLNVAL;
     }
 
-    HeapFree(GetProcessHeap(), 0, ufds);
     return ret;
 }
 
@@ -5630,8 +7003,8 @@ static int WS2_sendto( SOCKET s, LPWSABUF lpBuffers, DWORD dwBufferCount,
                 err = register_async( ASYNC_TYPE_WRITE, wsa->hSocket, &wsa->io, NULL,
                                       ws2_async_apc, wsa, iosb );
             else
-                err = register_async( ASYNC_TYPE_WRITE, wsa->hSocket, &wsa->io, lpOverlapped->hEvent,
-                                      NULL, (void *)cvalue, iosb );
+                err = register_socket_async( ASYNC_TYPE_WRITE, wsa->hSocket, &wsa->io, lpOverlapped->hEvent,
+                                             (void *)cvalue, iosb );
 
             /* Enable the event only after starting the async. The server will deliver it as soon as
                the async is done. */
@@ -7611,6 +8984,9 @@ SOCKET WINAPI WSASocketW(int af, int type, int protocol,
         goto done;
     }
 
+    /* registered I/O requests are always completed asynchronously */
+    if (dwFlags & WSA_FLAG_REGISTERED_IO) dwFlags |= WSA_FLAG_OVERLAPPED;
+
     SERVER_START_REQ( create_socket )
     {
         req->family     = unixaf;
@@ -8048,8 +9424,8 @@ static int WS2_recv_base( SOCKET s, LPWSABUF lpBuffers, DWORD dwBufferCount,
                     err = register_async( ASYNC_TYPE_READ, wsa->hSocket, &wsa->io, NULL,
                                           ws2_async_apc, wsa, iosb );
                 else
-                    err = register_async( ASYNC_TYPE_READ, wsa->hSocket, &wsa->io, lpOverlapped->hEvent,
-                                          NULL, (void *)cvalue, iosb );
+                    err = register_socket_async( ASYNC_TYPE_READ, wsa->hSocket, &wsa->io, lpOverlapped->hEvent,
+                                                 (void *)cvalue, iosb );
 
                 if (err != STATUS_PENDING) HeapFree( GetProcessHeap(), 0, wsa );
                 SetLastError(NtStatusToWSAError( err ));
@@ -6745,6 +6745,67 @@ static void WINAPI io_completion(DWORD error, DWORD transferred, WSAOVERLAPPED *
     completion_called++;
 }
 
+#define ORDER_SENDS      8
+#define ORDER_SEND_SIZE  65536
+
+static void test_WSASend_order(void)
+{
+    static const unsigned int total = ORDER_SENDS * ORDER_SEND_SIZE;
+    OVERLAPPED ov[ORDER_SENDS];
+    WSABUF wsabuf[ORDER_SENDS];
+    unsigned int i, len;
+    char *data, *buf;
+    DWORD size, flags;
+    SOCKET src, dst;
+    int ret, bufsize;
+
+    ret = tcp_socketpair_ovl(&src, &dst);
+    ok(!ret, "creating socket pair failed\n");
+    if (ret) return;
+
+    /* small buffers so that the writes only complete partially at first */
+    bufsize = 4096;
+    setsockopt(src, SOL_SOCKET, SO_SNDBUF, (char *)&bufsize, sizeof(bufsize));
+    setsockopt(dst, SOL_SOCKET, SO_RCVBUF, (char *)&bufsize, sizeof(bufsize));
+
+    data = HeapAlloc(GetProcessHeap(), 0, total);
+    buf = HeapAlloc(GetProcessHeap(), 0, total);
+    for (i = 0; i < total; i++) data[i] = i % 251;
+
+    for (i = 0; i < ORDER_SENDS; i++)
+    {
+        memset(&ov[i], 0, sizeof(ov[i]));
+        ov[i].hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        wsabuf[i].buf = data + i * ORDER_SEND_SIZE;
+        wsabuf[i].len = ORDER_SEND_SIZE;
+        ret = WSASend(src, &wsabuf[i], 1, &size, 0, &ov[i], NULL);
+        ok(!ret || WSAGetLastError() == ERROR_IO_PENDING, "WSASend %u failed, error %u\n", i, WSAGetLastError());
+    }
+
+    for (len = 0; len < total; len += ret)
+    {
+        ret = recv(dst, buf + len, total - len, 0);
+        ok(ret > 0, "recv failed, ret %d, error %u\n", ret, WSAGetLastError());
+        if (ret <= 0) break;
+    }
+    ok(len == total, "received %u bytes\n", len);
+    for (i = 0; i < len; i++) if (buf[i] != data[i]) break;
+    ok(i == len, "data differs at offset %u\n", i);
+
+    for (i = 0; i < ORDER_SENDS; i++)
+    {
+        ret = WSAGetOverlappedResult(src, &ov[i], &size, TRUE, &flags);
+        ok(ret, "WSASend %u failed, error %u\n", i, WSAGetLastError());
+        ok(size == ORDER_SEND_SIZE, "WSASend %u sent %u bytes\n", i, size);
+        CloseHandle(ov[i].hEvent);
+    }
+
+    closesocket(src);
+    closesocket(dst);
+    HeapFree(GetProcessHeap(), 0, buf);
+    HeapFree(GetProcessHeap(), 0, data);
+}
+
 static void test_WSARecv(void)
 {
     SOCKET src, dest, server = INVALID_SOCKET;
@@ -7332,6 +7393,83 @@ todo_wine
 #undef POLL_ISSET
 #undef POLL_CLEAR
 
+#define POLL_MANY_PAIRS 40
+
+static void test_WSAPoll_many(void)
+{
+    SOCKET src[POLL_MANY_PAIRS], dst[POLL_MANY_PAIRS];
+    WSAPOLLFD fds[POLL_MANY_PAIRS * 2];
+    char buf[16];
+    int i, ret;
+
+    if (!pWSAPoll)
+    {
+        skip("WSAPoll is unsupported, some tests will be skipped.\n");
+        return;
+    }
+
+    for (i = 0; i < POLL_MANY_PAIRS; i++)
+    {
+        if (tcp_socketpair(&src[i], &dst[i])) break;
+        fds[2 * i].fd = src[i];
+        fds[2 * i + 1].fd = dst[i];
+    }
+    ok(i == POLL_MANY_PAIRS, "creating socket pairs failed\n");
+    if (i < POLL_MANY_PAIRS)
+    {
+        while (i--)
+        {
+            closesocket(src[i]);
+            closesocket(dst[i]);
+        }
+        return;
+    }
+
+    for (i = 0; i < POLL_MANY_PAIRS * 2; i++) fds[i].events = POLLRDNORM;
+    ret = pWSAPoll(fds, POLL_MANY_PAIRS * 2, 0);
+    ok(ret == 0, "expected 0, got %d\n", ret);
+
+    send(src[5], "a", 1, 0);
+    send(dst[30], "b", 1, 0);
+    ret = pWSAPoll(fds, POLL_MANY_PAIRS * 2, 1000);
+    ok(ret == 2, "expected 2, got %d\n", ret);
+    ok(fds[11].revents == POLLRDNORM, "got events %#x\n", fds[11].revents);
+    ok(fds[60].revents == POLLRDNORM, "got events %#x\n", fds[60].revents);
+    ok(!fds[10].revents, "got events %#x\n", fds[10].revents);
+
+    /* the same sockets with different events */
+    for (i = 0; i < POLL_MANY_PAIRS * 2; i++) fds[i].events = POLLWRNORM;
+    ret = pWSAPoll(fds, POLL_MANY_PAIRS * 2, 0);
+    ok(ret == POLL_MANY_PAIRS * 2, "expected %d, got %d\n", POLL_MANY_PAIRS * 2, ret);
+    ok(fds[11].revents == POLLWRNORM, "got events %#x\n", fds[11].revents);
+
+    /* replace a pair, the new sockets may reuse the handles and file descriptors */
+    recv(dst[5], buf, sizeof(buf), 0);
+    recv(src[30], buf, sizeof(buf), 0);
+    closesocket(src[7]);
+    closesocket(dst[7]);
+    ok(!tcp_socketpair(&src[7], &dst[7]), "creating socket pair failed\n");
+    fds[14].fd = src[7];
+    fds[15].fd = dst[7];
+    for (i = 0; i < POLL_MANY_PAIRS * 2; i++) fds[i].events = POLLRDNORM;
+    send(src[7], "c", 1, 0);
+    ret = pWSAPoll(fds, POLL_MANY_PAIRS * 2, 1000);
+    ok(ret == 1, "expected 1, got %d\n", ret);
+    ok(fds[15].revents == POLLRDNORM, "got events %#x\n", fds[15].revents);
+    ok(!fds[14].revents, "got events %#x\n", fds[14].revents);
+
+    /* a closed socket is reported as invalid */
+    closesocket(src[0]);
+    pWSAPoll(fds, POLL_MANY_PAIRS * 2, 0);
+    ok(fds[0].revents == POLLNVAL, "got events %#x\n", fds[0].revents);
+
+    for (i = 0; i < POLL_MANY_PAIRS; i++)
+    {
+        if (i) closesocket(src[i]);
+        closesocket(dst[i]);
+    }
+}
+
 static void test_GetAddrInfoW(void)
 {
     static const WCHAR port[] = {'8','0',0};
@@ -9083,6 +9221,307 @@ cleanup:
     closesocket(server);
 }
 
+static void test_TransmitPackets(void)
+{
+    GUID transmitPacketsGuid = WSAID_TRANSMITPACKETS;
+    LPFN_TRANSMITPACKETS pTransmitPackets = NULL;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    char header_msg[] = "hello world";
+    char footer_msg[] = "goodbye!!!";
+    char system_ini_path[MAX_PATH];
+    TRANSMIT_PACKETS_ELEMENT elements[3];
+    struct sockaddr_in bindAddress;
+    SOCKET client, server, dest = INVALID_SOCKET;
+    DWORD num_bytes, err, file_size, total_sent;
+    char *file_data = NULL, *recv_data = NULL;
+    WSAOVERLAPPED ov;
+    char buf[256];
+    int iret, len, i;
+    BOOL bret;
+
+    memset( &ov, 0, sizeof(ov) );
+
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    server = socket(AF_INET, SOCK_STREAM, 0);
+    if (client == INVALID_SOCKET || server == INVALID_SOCKET)
+    {
+        skip("could not create acceptor socket, error %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+    iret = WSAIoctl(client, SIO_GET_EXTENSION_FUNCTION_POINTER, &transmitPacketsGuid, sizeof(transmitPacketsGuid),
+                    &pTransmitPackets, sizeof(pTransmitPackets), &num_bytes, NULL, NULL);
+    if (iret)
+    {
+        skip("WSAIoctl failed to get TransmitPackets with ret %d + errno %d\n", iret, WSAGetLastError());
+        goto cleanup;
+    }
+    GetSystemWindowsDirectoryA(system_ini_path, MAX_PATH );
+    strcat(system_ini_path, "\\system.ini");
+    file = CreateFileA(system_ini_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_ALWAYS, 0x0, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        skip("Unable to open a file to transmit.\n");
+        goto cleanup;
+    }
+    file_size = GetFileSize(file, NULL);
+
+    /* Test TransmitPackets without a connected socket */
+    bret = pTransmitPackets(client, NULL, 0, 0, NULL, 0);
+    err = WSAGetLastError();
+    ok(!bret, "TransmitPackets succeeded unexpectedly.\n");
+    ok(err == WSAENOTCONN, "TransmitPackets triggered unexpected errno (%d != %d)\n", err, WSAENOTCONN);
+
+    memset(&bindAddress, 0, sizeof(bindAddress));
+    bindAddress.sin_family = AF_INET;
+    bindAddress.sin_port = 0;
+    bindAddress.sin_addr.s_addr = inet_addr("127.0.0.1");
+    iret = bind(server, (struct sockaddr*)&bindAddress, sizeof(bindAddress));
+    if (iret != 0)
+    {
+        skip("failed to bind(), error %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+    len = sizeof(bindAddress);
+    getsockname(server, (struct sockaddr*)&bindAddress, &len);
+    iret = listen(server, 1);
+    if (iret != 0)
+    {
+        skip("failed to listen(), error %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+    iret = connect(client, (struct sockaddr*)&bindAddress, sizeof(bindAddress));
+    if (iret != 0)
+    {
+        skip("failed to connect(), error %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+    len = sizeof(bindAddress);
+    dest = accept(server, (struct sockaddr*)&bindAddress, &len);
+    if (dest == INVALID_SOCKET)
+    {
+        skip("failed to accept(), error %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+    if (set_blocking(dest, FALSE))
+    {
+        skip("couldn't make socket non-blocking, error %d\n", WSAGetLastError());
+        goto cleanup;
+    }
+
+    /* Test TransmitPackets with memory and file elements */
+    elements[0].dwElFlags = TP_ELEMENT_MEMORY;
+    elements[0].cLength = sizeof(header_msg);
+    elements[0].pBuffer = header_msg;
+    elements[1].dwElFlags = TP_ELEMENT_FILE;
+    elements[1].cLength = 0;
+    elements[1].nFileOffset.QuadPart = 0;
+    elements[1].hFile = file;
+    elements[2].dwElFlags = TP_ELEMENT_MEMORY;
+    elements[2].cLength = sizeof(footer_msg);
+    elements[2].pBuffer = footer_msg;
+    bret = pTransmitPackets(client, elements, 3, 0, NULL, 0);
+    ok(bret, "TransmitPackets failed unexpectedly.\n");
+    iret = recv(dest, buf, sizeof(header_msg), 0);
+    ok(memcmp(buf, &header_msg[0], sizeof(header_msg)) == 0,
+       "TransmitPackets header buffer did not match!\n");
+    compare_file(file, dest, 0);
+    iret = recv(dest, buf, sizeof(footer_msg), 0);
+    ok(memcmp(buf, &footer_msg[0], sizeof(footer_msg)) == 0,
+       "TransmitPackets footer buffer did not match!\n");
+
+    /* Test overlapped TransmitPackets with a file offset and length */
+    ov.hEvent = CreateEventW(NULL, FALSE, FALSE, NULL);
+    elements[0].dwElFlags = TP_ELEMENT_FILE;
+    elements[0].cLength = file_size - 20;
+    elements[0].nFileOffset.QuadPart = 10;
+    elements[0].hFile = file;
+    bret = pTransmitPackets(client, elements, 1, 0, &ov, 0);
+    err = WSAGetLastError();
+    ok(!bret, "TransmitPackets succeeded unexpectedly.\n");
+    ok(err == ERROR_IO_PENDING, "TransmitPackets triggered unexpected errno (%d != %d)\n", err, ERROR_IO_PENDING);
+    iret = WaitForSingleObject(ov.hEvent, 2000);
+    ok(iret == WAIT_OBJECT_0, "Overlapped TransmitPackets failed.\n");
+    WSAGetOverlappedResult(client, &ov, &total_sent, FALSE, NULL);
+    ok(total_sent == file_size - 20,
+       "Overlapped TransmitPackets sent an unexpected number of bytes (%d != %d).\n",
+       total_sent, file_size - 20);
+
+    file_data = HeapAlloc(GetProcessHeap(), 0, file_size);
+    recv_data = HeapAlloc(GetProcessHeap(), 0, file_size);
+    SetFilePointer(file, 0, NULL, FILE_BEGIN);
+    bret = ReadFile(file, file_data, file_size, &num_bytes, NULL);
+    ok(bret && num_bytes == file_size, "Failed to read from file.\n");
+    for (len = 0, i = 0; len < file_size - 20 && i < 100; i++)
+    {
+        iret = recv(dest, recv_data + len, file_size - 20 - len, 0);
+        if (!iret) break;
+        if (iret > 0) len += iret;
+        else Sleep(10);
+    }
+    ok(len == file_size - 20, "received %d bytes, expected %d\n", len, file_size - 20);
+    ok(!memcmp(recv_data, file_data + 10, len), "TransmitPackets file data did not match!\n");
+
+cleanup:
+    HeapFree(GetProcessHeap(), 0, file_data);
+    HeapFree(GetProcessHeap(), 0, recv_data);
+    CloseHandle(file);
+    CloseHandle(ov.hEvent);
+    closesocket(client);
+    closesocket(server);
+    if (dest != INVALID_SOCKET) closesocket(dest);
+}
+
+static ULONG rio_dequeue(RIO_EXTENSION_FUNCTION_TABLE *rio, RIO_CQ cq, RIORESULT *results, ULONG count)
+{
+    ULONG ret, total = 0;
+    int i;
+
+    for (i = 0; i < 100 && total < count; i++)
+    {
+        ret = rio->RIODequeueCompletion(cq, results + total, count - total);
+        if (ret == RIO_CORRUPT_CQ) break;
+        if (!(total += ret)) Sleep(10);
+    }
+    return total;
+}
+
+static void test_RIO(void)
+{
+    static const GUID rio_guid = WSAID_MULTIPLE_RIO;
+    RIO_EXTENSION_FUNCTION_TABLE rio;
+    RIO_NOTIFICATION_COMPLETION notify;
+    RIO_BUF bufs[4], send_buf, addr_buf;
+    SOCKET server, client;
+    struct sockaddr_in addr;
+    RIORESULT results[8];
+    char buffer[1024], msg[16];
+    RIO_BUFFERID id;
+    HANDLE event;
+    RIO_CQ cq;
+    RIO_RQ rq;
+    DWORD size;
+    ULONG count;
+    int ret, len, i;
+    BOOL bret;
+
+    server = WSASocketA(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+    client = WSASocketA(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, WSA_FLAG_REGISTERED_IO);
+    ok(server != INVALID_SOCKET && client != INVALID_SOCKET, "failed to create sockets, error %d\n", WSAGetLastError());
+
+    memset(&rio, 0, sizeof(rio));
+    ret = WSAIoctl(server, SIO_GET_MULTIPLE_EXTENSION_FUNCTION_POINTER, (void *)&rio_guid, sizeof(rio_guid),
+                   &rio, sizeof(rio), &size, NULL, NULL);
+    if (ret)
+    {
+        win_skip("registered I/O not supported, error %d\n", WSAGetLastError());
+        closesocket(server);
+        closesocket(client);
+        return;
+    }
+    ok(size == sizeof(rio), "got size %u\n", size);
+    ok(rio.cbSize == sizeof(rio), "got cbSize %u\n", rio.cbSize);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    ret = bind(server, (struct sockaddr *)&addr, sizeof(addr));
+    ok(!ret, "bind failed, error %d\n", WSAGetLastError());
+    len = sizeof(addr);
+    getsockname(server, (struct sockaddr *)&addr, &len);
+    ret = connect(client, (struct sockaddr *)&addr, sizeof(addr));
+    ok(!ret, "connect failed, error %d\n", WSAGetLastError());
+
+    id = rio.RIORegisterBuffer(buffer, sizeof(buffer));
+    ok(id != RIO_INVALID_BUFFERID, "RIORegisterBuffer failed, error %d\n", WSAGetLastError());
+
+    event = CreateEventA(NULL, FALSE, FALSE, NULL);
+    notify.Type = RIO_EVENT_COMPLETION;
+    notify.Event.EventHandle = event;
+    notify.Event.NotifyReset = FALSE;
+    cq = rio.RIOCreateCompletionQueue(ARRAY_SIZE(results), &notify);
+    ok(cq != RIO_INVALID_CQ, "RIOCreateCompletionQueue failed, error %d\n", WSAGetLastError());
+
+    rq = rio.RIOCreateRequestQueue(server, ARRAY_SIZE(bufs), 1, 1, 1, cq, cq, (void *)0xdeadbeef);
+    ok(rq != RIO_INVALID_RQ, "RIOCreateRequestQueue failed, error %d\n", WSAGetLastError());
+
+    for (i = 0; i < ARRAY_SIZE(bufs); i++)
+    {
+        bufs[i].BufferId = id;
+        bufs[i].Offset = i * 128;
+        bufs[i].Length = 128;
+        bret = rio.RIOReceive(rq, &bufs[i], 1, 0, (void *)(ULONG_PTR)i);
+        ok(bret, "RIOReceive %d failed, error %d\n", i, WSAGetLastError());
+    }
+    WSASetLastError(0xdeadbeef);
+    bret = rio.RIOReceive(rq, &bufs[0], 1, 0, NULL);
+    ok(!bret, "RIOReceive succeeded\n");
+    ok(WSAGetLastError() == WSAENOBUFS, "got error %d\n", WSAGetLastError());
+
+    count = rio.RIODequeueCompletion(cq, results, ARRAY_SIZE(results));
+    ok(!count, "got %u completions\n", count);
+    ret = rio.RIONotify(cq);
+    ok(!ret, "RIONotify failed, error %d\n", ret);
+
+    for (i = 0; i < ARRAY_SIZE(bufs); i++)
+    {
+        sprintf(msg, "datagram %d", i);
+        ret = send(client, msg, strlen(msg), 0);
+        ok(ret == strlen(msg), "send failed, error %d\n", WSAGetLastError());
+    }
+    ret = WaitForSingleObject(event, 1000);
+    ok(ret == WAIT_OBJECT_0, "wait failed, ret %d\n", ret);
+
+    count = rio_dequeue(&rio, cq, results, ARRAY_SIZE(bufs));
+    ok(count == ARRAY_SIZE(bufs), "got %u completions\n", count);
+    for (i = 0; i < count; i++)
+    {
+        sprintf(msg, "datagram %d", i);
+        ok(!results[i].Status, "%d: got status %d\n", i, results[i].Status);
+        ok(results[i].BytesTransferred == strlen(msg), "%d: got size %u\n", i, results[i].BytesTransferred);
+        ok(results[i].SocketContext == 0xdeadbeef, "%d: got socket context %s\n", i,
+           wine_dbgstr_longlong(results[i].SocketContext));
+        ok(results[i].RequestContext == i, "%d: got request context %s\n", i,
+           wine_dbgstr_longlong(results[i].RequestContext));
+        ok(!memcmp(buffer + i * 128, msg, strlen(msg)), "%d: got %.16s\n", i, buffer + i * 128);
+    }
+
+    len = sizeof(addr);
+    getsockname(client, (struct sockaddr *)&addr, &len);
+    memset(buffer + 512, 0, sizeof(SOCKADDR_INET));
+    memcpy(buffer + 512, &addr, sizeof(addr));
+    addr_buf.BufferId = id;
+    addr_buf.Offset = 512;
+    addr_buf.Length = sizeof(SOCKADDR_INET);
+    memcpy(buffer + 768, "reply", 5);
+    send_buf.BufferId = id;
+    send_buf.Offset = 768;
+    send_buf.Length = 5;
+    bret = rio.RIOSendEx(rq, &send_buf, 1, NULL, &addr_buf, NULL, NULL, 0, (void *)0xcafe);
+    ok(bret, "RIOSendEx failed, error %d\n", WSAGetLastError());
+
+    ret = recv(client, msg, sizeof(msg), 0);
+    ok(ret == 5 && !memcmp(msg, "reply", 5), "got %d\n", ret);
+    count = rio_dequeue(&rio, cq, results, 1);
+    ok(count == 1, "got %u completions\n", count);
+    ok(!results[0].Status, "got status %d\n", results[0].Status);
+    ok(results[0].BytesTransferred == 5, "got size %u\n", results[0].BytesTransferred);
+    ok(results[0].RequestContext == 0xcafe, "got request context %s\n",
+       wine_dbgstr_longlong(results[0].RequestContext));
+
+    /* the completion queue can be closed while a request queue still reports to it */
+    bret = rio.RIOReceive(rq, &bufs[0], 1, 0, (void *)0xbeef);
+    ok(bret, "RIOReceive failed, error %d\n", WSAGetLastError());
+    rio.RIOCloseCompletionQueue(cq);
+    ret = send(client, "late", 4, 0);
+    ok(ret == 4, "send failed, error %d\n", WSAGetLastError());
+    Sleep(100);
+
+    closesocket(server);
+    closesocket(client);
+    rio.RIODeregisterBuffer(id);
+    CloseHandle(event);
+}
+
 static void test_getpeername(void)
 {
     SOCKET sock;
@@ -11514,9 +11953,370 @@ static void test_iocp(void)
     closesocket(dst);
 }
 
+static void test_iocp_send_recv_cancel(void)
+{
+    char data[16];
+    OVERLAPPED ov, *ovl;
+    SOCKET src, dst;
+    ULONG_PTR key;
+    DWORD bytes, flags;
+    HANDLE port;
+    WSABUF buf;
+    int ret;
+
+    ret = tcp_socketpair_ovl(&src, &dst);
+    ok(!ret, "creating socket pair failed\n");
+    if (ret) return;
+
+    port = CreateIoCompletionPort((HANDLE)src, NULL, 0x12345678, 0);
+    ok(port != NULL, "CreateIoCompletionPort failed, error %u\n", GetLastError());
+
+    /* receive */
+    memset(&ov, 0, sizeof(ov));
+    memset(data, 0, sizeof(data));
+    buf.buf = data;
+    buf.len = sizeof(data);
+    flags = 0;
+    ret = WSARecv(src, &buf, 1, &bytes, &flags, &ov, NULL);
+    ok(ret == SOCKET_ERROR && WSAGetLastError() == ERROR_IO_PENDING, "WSARecv returned %d, error %u\n",
+       ret, WSAGetLastError());
+
+    ovl = (void *)0xdeadbeef;
+    ret = GetQueuedCompletionStatus(port, &bytes, &key, &ovl, 100);
+    ok(!ret && GetLastError() == WAIT_TIMEOUT, "GetQueuedCompletionStatus returned %d, error %u\n",
+       ret, GetLastError());
+    ok(!ovl, "got ovl %p\n", ovl);
+
+    ret = send(dst, "Hello World!", 12, 0);
+    ok(ret == 12, "send returned %d\n", ret);
+
+    bytes = 0xdeadbeef;
+    key = 0xdeadbeef;
+    ovl = NULL;
+    ret = GetQueuedCompletionStatus(port, &bytes, &key, &ovl, 1000);
+    ok(ret, "GetQueuedCompletionStatus failed, error %u\n", GetLastError());
+    ok(bytes == 12, "got bytes %u\n", bytes);
+    ok(key == 0x12345678, "got key %#lx\n", key);
+    ok(ovl == &ov, "got ovl %p\n", ovl);
+    ok(!memcmp(data, "Hello World!", 12), "got %u bytes (%.12s)\n", bytes, data);
+
+    /* send */
+    memset(&ov, 0, sizeof(ov));
+    buf.buf = (char *)"Goodbye!";
+    buf.len = 8;
+    ret = WSASend(src, &buf, 1, &bytes, 0, &ov, NULL);
+    ok(!ret || WSAGetLastError() == ERROR_IO_PENDING, "WSASend failed, error %u\n", WSAGetLastError());
+
+    bytes = 0xdeadbeef;
+    key = 0xdeadbeef;
+    ovl = NULL;
+    ret = GetQueuedCompletionStatus(port, &bytes, &key, &ovl, 1000);
+    ok(ret, "GetQueuedCompletionStatus failed, error %u\n", GetLastError());
+    ok(bytes == 8, "got bytes %u\n", bytes);
+    ok(key == 0x12345678, "got key %#lx\n", key);
+    ok(ovl == &ov, "got ovl %p\n", ovl);
+
+    memset(data, 0, sizeof(data));
+    ret = recv(dst, data, sizeof(data), 0);
+    ok(ret == 8, "recv returned %d\n", ret);
+    ok(!memcmp(data, "Goodbye!", 8), "got %d bytes (%.8s)\n", ret, data);
+
+    /* cancel */
+    memset(&ov, 0, sizeof(ov));
+    buf.buf = data;
+    buf.len = sizeof(data);
+    flags = 0;
+    ret = WSARecv(src, &buf, 1, &bytes, &flags, &ov, NULL);
+    ok(ret == SOCKET_ERROR && WSAGetLastError() == ERROR_IO_PENDING, "WSARecv returned %d, error %u\n",
+       ret, WSAGetLastError());
+
+    ret = CancelIo((HANDLE)src);
+    ok(ret, "CancelIo failed, error %u\n", GetLastError());
+
+    bytes = 0xdeadbeef;
+    key = 0xdeadbeef;
+    ovl = NULL;
+    ret = GetQueuedCompletionStatus(port, &bytes, &key, &ovl, 1000);
+    ok(!ret && GetLastError() == ERROR_OPERATION_ABORTED, "GetQueuedCompletionStatus returned %d, error %u\n",
+       ret, GetLastError());
+    ok(!bytes, "got bytes %u\n", bytes);
+    ok(key == 0x12345678, "got key %#lx\n", key);
+    ok(ovl == &ov, "got ovl %p\n", ovl);
+
+    ret = WSAGetOverlappedResult(src, &ov, &bytes, FALSE, &flags);
+    ok(!ret && WSAGetLastError() == WSA_OPERATION_ABORTED, "WSAGetOverlappedResult returned %d, error %u\n",
+       ret, WSAGetLastError());
+
+    /* the data sent after the cancellation is still received */
+    ret = send(dst, "Hello World!", 12, 0);
+    ok(ret == 12, "send returned %d\n", ret);
+    memset(data, 0, sizeof(data));
+    ret = recv(src, data, sizeof(data), 0);
+    ok(ret == 12, "recv returned %d\n", ret);
+    ok(!memcmp(data, "Hello World!", 12), "got %d bytes (%.12s)\n", ret, data);
+
+    ovl = (void *)0xdeadbeef;
+    ret = GetQueuedCompletionStatus(port, &bytes, &key, &ovl, 100);
+    ok(!ret && GetLastError() == WAIT_TIMEOUT, "GetQueuedCompletionStatus returned %d, error %u\n",
+       ret, GetLastError());
+    ok(!ovl, "got ovl %p\n", ovl);
+
+    closesocket(src);
+    closesocket(dst);
+    CloseHandle(port);
+}
+
+static int recv_apc_called;
+
+static void WINAPI recv_apc(DWORD error, DWORD transferred, WSAOVERLAPPED *overlapped, DWORD flags)
+{
+    ok(!error, "got error %u\n", error);
+    ok(transferred == 4, "got %u bytes\n", transferred);
+    recv_apc_called++;
+}
+
+/* a receive with a completion routine between two overlapped ones gets its data in order */
+static void test_recv_apc_order(void)
+{
+    char data[3][4];
+    OVERLAPPED ov[3];
+    SOCKET src, dst;
+    DWORD bytes, flags;
+    WSABUF buf[3];
+    int i, ret;
+
+    ret = tcp_socketpair_ovl(&src, &dst);
+    ok(!ret, "creating socket pair failed\n");
+    if (ret) return;
+
+    memset(ov, 0, sizeof(ov));
+    memset(data, 0, sizeof(data));
+    for (i = 0; i < 3; i++)
+    {
+        buf[i].buf = data[i];
+        buf[i].len = sizeof(data[i]);
+        if (i != 1) ov[i].hEvent = CreateEventA(NULL, FALSE, FALSE, NULL);
+        flags = 0;
+        ret = WSARecv(src, &buf[i], 1, &bytes, &flags, &ov[i], i == 1 ? recv_apc : NULL);
+        ok(ret == SOCKET_ERROR && WSAGetLastError() == ERROR_IO_PENDING, "%u: WSARecv returned %d, error %u\n",
+           i, ret, WSAGetLastError());
+    }
+
+    ret = send(dst, "aaaabbbbcccc", 12, 0);
+    ok(ret == 12, "send returned %d\n", ret);
+
+    ret = WaitForSingleObject(ov[0].hEvent, 1000);
+    ok(!ret, "wait failed\n");
+    ret = WaitForSingleObject(ov[2].hEvent, 1000);
+    ok(!ret, "wait failed\n");
+    recv_apc_called = 0;
+    SleepEx(0, TRUE);
+    ok(recv_apc_called == 1, "completion routine called %u times\n", recv_apc_called);
+
+    ok(!memcmp(data[0], "aaaa", 4), "got %.4s\n", data[0]);
+    ok(!memcmp(data[1], "bbbb", 4), "got %.4s\n", data[1]);
+    ok(!memcmp(data[2], "cccc", 4), "got %.4s\n", data[2]);
+
+    /* further overlapped receives still work */
+    flags = 0;
+    ret = WSARecv(src, &buf[0], 1, &bytes, &flags, &ov[0], NULL);
+    ok(ret == SOCKET_ERROR && WSAGetLastError() == ERROR_IO_PENDING, "WSARecv returned %d, error %u\n",
+       ret, WSAGetLastError());
+    ret = send(dst, "dddd", 4, 0);
+    ok(ret == 4, "send returned %d\n", ret);
+    ret = WaitForSingleObject(ov[0].hEvent, 1000);
+    ok(!ret, "wait failed\n");
+    ok(!memcmp(data[0], "dddd", 4), "got %.4s\n", data[0]);
+
+    closesocket(src);
+    closesocket(dst);
+    CloseHandle(ov[0].hEvent);
+    CloseHandle(ov[2].hEvent);
+}
+
+#define ECHO_CONNECTIONS  16
+#define ECHO_CLIENTS      4
+#define ECHO_WORKERS      2
+#define ECHO_REQUESTS     50
+#define ECHO_SIZE         64
+
+struct echo_conn
+{
+    OVERLAPPED ov;
+    SOCKET     server;
+    SOCKET     client;
+    WSABUF     wsabuf;
+    BOOL       sending;
+    char       buf[ECHO_SIZE];
+};
+
+struct echo_client
+{
+    struct echo_conn *conns;
+    unsigned int      count;
+};
+
+static BOOL echo_post(struct echo_conn *conn, BOOL send)
+{
+    DWORD size, flags = 0;
+    int ret;
+
+    memset(&conn->ov, 0, sizeof(conn->ov));
+    conn->sending = send;
+    if (send) ret = WSASend(conn->server, &conn->wsabuf, 1, &size, 0, &conn->ov, NULL);
+    else
+    {
+        conn->wsabuf.len = sizeof(conn->buf);
+        ret = WSARecv(conn->server, &conn->wsabuf, 1, &size, &flags, &conn->ov, NULL);
+    }
+    return !ret || WSAGetLastError() == ERROR_IO_PENDING;
+}
+
+static DWORD WINAPI echo_worker(void *port)
+{
+    struct echo_conn *conn;
+    OVERLAPPED *ovl;
+    ULONG_PTR key;
+    DWORD size, failures = 0;
+    BOOL ret;
+
+    for (;;)
+    {
+        ret = GetQueuedCompletionStatus(port, &size, &key, &ovl, INFINITE);
+        if (!ovl) break;
+        conn = (struct echo_conn *)key;
+        ok(ret, "%s failed, error %u\n", conn->sending ? "WSASend" : "WSARecv", GetLastError());
+        ok(!ret || size, "connection closed while %s\n", conn->sending ? "sending" : "receiving");
+        if (ret && size)
+        {
+            if (!conn->sending) conn->wsabuf.len = size;
+            ret = echo_post(conn, !conn->sending);
+            ok(ret, "%s failed, error %u\n", conn->sending ? "WSASend" : "WSARecv", WSAGetLastError());
+            if (ret) continue;
+        }
+        /* the client is waiting for the echo, make it fail instead of hanging */
+        closesocket(conn->server);
+        conn->server = 0;
+        failures++;
+    }
+    return failures;
+}
+
+static DWORD WINAPI echo_client(void *arg)
+{
+    struct echo_client *client = arg;
+    char buf[ECHO_SIZE], reply[ECHO_SIZE];
+    unsigned int i, j;
+    int ret, len;
+
+    for (i = 0; i < ECHO_REQUESTS; i++)
+    {
+        for (j = 0; j < client->count; j++)
+        {
+            memset(buf, 'a' + (i + j) % 26, sizeof(buf));
+            ret = send(client->conns[j].client, buf, sizeof(buf), 0);
+            for (len = 0; ret > 0 && len < sizeof(reply); len += ret)
+                ret = recv(client->conns[j].client, reply + len, sizeof(reply) - len, 0);
+            if (ret <= 0 || memcmp(buf, reply, sizeof(buf))) return 1;
+        }
+    }
+    return 0;
+}
+
+/* several connections echoed by worker threads through a completion port */
+static void test_iocp_echo(void)
+{
+    struct echo_client clients[ECHO_CLIENTS];
+    HANDLE threads[ECHO_CLIENTS], workers[ECHO_WORKERS], port;
+    struct echo_conn *conns;
+    unsigned int i, per_client = ECHO_CONNECTIONS / ECHO_CLIENTS;
+    DWORD exit_code;
+    int ret;
+
+    conns = HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, ECHO_CONNECTIONS * sizeof(*conns));
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+    ok(port != NULL, "CreateIoCompletionPort failed, error %u\n", GetLastError());
+
+    for (i = 0; i < ECHO_CONNECTIONS; i++)
+    {
+        ret = tcp_socketpair_ovl(&conns[i].client, &conns[i].server);
+        ok(!ret, "creating socket pair %u failed\n", i);
+        if (ret) break;
+        conns[i].wsabuf.buf = conns[i].buf;
+        CreateIoCompletionPort((HANDLE)conns[i].server, port, (ULONG_PTR)&conns[i], 0);
+        ok(echo_post(&conns[i], FALSE), "WSARecv failed, error %u\n", WSAGetLastError());
+    }
+
+    if (i == ECHO_CONNECTIONS)
+    {
+        for (i = 0; i < ECHO_WORKERS; i++)
+            workers[i] = CreateThread(NULL, 0, echo_worker, port, 0, NULL);
+        for (i = 0; i < ECHO_CLIENTS; i++)
+        {
+            clients[i].conns = conns + i * per_client;
+            clients[i].count = per_client;
+            threads[i] = CreateThread(NULL, 0, echo_client, &clients[i], 0, NULL);
+        }
+        WaitForMultipleObjects(ECHO_CLIENTS, threads, TRUE, INFINITE);
+        for (i = 0; i < ECHO_CLIENTS; i++)
+        {
+            GetExitCodeThread(threads[i], &exit_code);
+            ok(!exit_code, "client %u got a wrong echo\n", i);
+            CloseHandle(threads[i]);
+        }
+        for (i = 0; i < ECHO_WORKERS; i++) PostQueuedCompletionStatus(port, 0, 0, NULL);
+        WaitForMultipleObjects(ECHO_WORKERS, workers, TRUE, INFINITE);
+        for (i = 0; i < ECHO_WORKERS; i++)
+        {
+            GetExitCodeThread(workers[i], &exit_code);
+            ok(!exit_code, "worker %u failed on %u connections\n", i, exit_code);
+            CloseHandle(workers[i]);
+        }
+    }
+
+    for (i = 0; i < ECHO_CONNECTIONS; i++)
+    {
+        if (conns[i].client) closesocket(conns[i].client);
+        if (conns[i].server) closesocket(conns[i].server);
+    }
+    CloseHandle(port);
+    HeapFree(GetProcessHeap(), 0, conns);
+}
+
+/* run the overlapped tests again with the asyncs queued in-process */
+static void test_sockpoll(char **argv)
+{
+    PROCESS_INFORMATION pi;
+    STARTUPINFOA si = { sizeof(si) };
+    char cmdline[MAX_PATH];
+    BOOL ret;
+
+    SetEnvironmentVariableA("WINESOCKPOLL", "1");
+    sprintf(cmdline, "%s %s sockpoll", argv[0], argv[1]);
+    ret = CreateProcessA(NULL, cmdline, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi);
+    ok(ret, "CreateProcess failed, last error %u.\n", GetLastError());
+    SetEnvironmentVariableA("WINESOCKPOLL", NULL);
+    if (!ret) return;
+    winetest_wait_child_process(pi.hProcess);
+    CloseHandle(pi.hProcess);
+    CloseHandle(pi.hThread);
+}
+
 START_TEST( sock )
 {
-    int i;
+    char **argv;
+    int i, argc;
+
+    argc = winetest_get_mainargs(&argv);
+    if (argc >= 3 && !strcmp(argv[2], "sockpoll"))
+    {
+        Init();
+        test_iocp_send_recv_cancel();
+        test_recv_apc_order();
+        test_iocp_echo();
+        Exit();
+        return;
+    }
 
 /* Leave these tests at the beginning. They depend on WSAStartup not having been
  * called, which is done by Init() below. */
@@ -11568,16 +12368,22 @@ START_TEST( sock )
 
     test_WSASendMsg();
     test_WSASendTo();
+    test_WSASend_order();
     test_WSARecv();
     test_WSAPoll();
+    test_WSAPoll_many();
     test_write_watch();
     test_iocp();
+    test_iocp_send_recv_cancel();
+    test_recv_apc_order();
 
     test_events(0);
     test_events(1);
 
     test_ipv6only();
     test_TransmitFile();
+    test_TransmitPackets();
+    test_RIO();
     test_GetAddrInfoW();
     test_GetAddrInfoExW();
     test_getaddrinfo();
@@ -11601,6 +12407,8 @@ START_TEST( sock )
     /* this is an io heavy test, do it at the end so the kernel doesn't start dropping packets */
     test_send();
     test_synchronous_WSAIoctl();
+    test_iocp_echo();
+    test_sockpoll(argv);
 
     Exit();
 }
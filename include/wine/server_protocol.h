@@ -195,10 +195,42 @@ struct wake_up_reply
 };
 
 
+struct esync_mutex_state
+{
+    thread_id_t  tid;
+    unsigned int count;
+    int          abandoned;
+    int          __pad;
+};
+#define ESYNC_SHM_MUTEXES 65536
+
+
+struct request_shm
+{
+    unsigned int req_seq;
+    unsigned int reply_seq;
+    int          client_waiting;
+    int          server_polling;
+};
+#define REQUEST_SHM_SIZE  0x20000
+#define REQUEST_SHM_REQ   0x00040
+#define REQUEST_SHM_REPLY 0x10000
+
+
 typedef __int64 timeout_t;
 #define TIMEOUT_INFINITE (((timeout_t)0x7fffffff) << 32 | 0xffffffff)
 
 
+struct queue_shared
+{
+    timeout_t    last_get_msg;
+    unsigned int wake_bits;
+    unsigned int wake_mask;
+    unsigned int changed_bits;
+    unsigned int changed_mask;
+};
+
+
 typedef struct
 {
     unsigned int debug_flags;
@@ -1124,6 +1156,38 @@ struct close_handle_reply
 
 
 
+struct get_request_shm_request
+{
+    struct request_header __header;
+    unsigned int spin;
+};
+struct get_request_shm_reply
+{
+    struct reply_header __header;
+    data_size_t  size;
+    char __pad_12[4];
+};
+
+
+
+
+struct batch_requests_request
+{
+    struct request_header __header;
+    /* VARARG(requests,bytes); */
+    char __pad_12[4];
+};
+struct batch_requests_reply
+{
+    struct reply_header __header;
+    int          count;
+    /* VARARG(replies,bytes); */
+    char __pad_12[4];
+};
+#define BATCH_DATA_ALIGN(size) (((size) + 7) & ~7)
+
+
+
 struct set_handle_info_request
 {
     struct request_header __header;
@@ -1165,6 +1229,21 @@ struct dup_handle_reply
 
 
 
+struct get_handle_table_info_request
+{
+    struct request_header __header;
+    obj_handle_t handle;
+};
+struct get_handle_table_info_reply
+{
+    struct reply_header __header;
+    unsigned int count;
+    unsigned int entries;
+    mem_size_t   size;
+};
+
+
+
 struct open_process_request
 {
     struct request_header __header;
@@ -1436,6 +1515,44 @@ struct open_semaphore_reply
 
 
 
+struct get_esync_fd_request
+{
+    struct request_header __header;
+    obj_handle_t handle;
+};
+struct get_esync_fd_reply
+{
+    struct reply_header __header;
+    int          type;
+    unsigned int access;
+    unsigned int shm_idx;
+    char __pad_20[4];
+};
+enum esync_type
+{
+    ESYNC_NONE,
+    ESYNC_AUTO_EVENT,
+    ESYNC_MANUAL_EVENT,
+    ESYNC_SEMAPHORE,
+    ESYNC_MUTEX
+};
+
+
+
+struct get_esync_shm_request
+{
+    struct request_header __header;
+    char __pad_12[4];
+};
+struct get_esync_shm_reply
+{
+    struct reply_header __header;
+    data_size_t  size;
+    char __pad_12[4];
+};
+
+
+
 struct create_file_request
 {
     struct request_header __header;
@@ -1518,6 +1635,10 @@ struct get_handle_fd_reply
     int          cacheable;
     unsigned int access;
     unsigned int options;
+    unsigned int cache_slot;
+    unsigned int cache_generation;
+    int          completion;
+    char __pad_36[4];
 };
 enum server_fd_type
 {
@@ -1530,11 +1651,27 @@ enum server_fd_type
     FD_TYPE_MAILSLOT,
     FD_TYPE_CHAR,
     FD_TYPE_DEVICE,
+    FD_TYPE_MSG_PIPE,
     FD_TYPE_NB_TYPES
 };
 
 
 
+struct get_fd_cache_info_request
+{
+    struct request_header __header;
+    char __pad_12[4];
+};
+struct get_fd_cache_info_reply
+{
+    struct reply_header __header;
+    obj_handle_t handle;
+    unsigned int process_slot;
+};
+#define FD_CACHE_SLOTS 16384
+
+
+
 struct get_directory_cache_entry_request
 {
     struct request_header __header;
@@ -2290,7 +2427,9 @@ struct get_mapping_info_reply
     mem_size_t   size;
     unsigned int flags;
     obj_handle_t shared_file;
+    obj_handle_t image_file;
     /* VARARG(image,pe_image_info); */
+    char __pad_28[4];
 };
 
 
@@ -3061,6 +3200,20 @@ struct get_queue_status_reply
 
 
 
+struct get_queue_shared_request
+{
+    struct request_header __header;
+    char __pad_12[4];
+};
+struct get_queue_shared_reply
+{
+    struct reply_header __header;
+    obj_handle_t handle;
+    char __pad_12[4];
+};
+
+
+
 struct get_process_idle_event_request
 {
     struct request_header __header;
@@ -3438,6 +3591,7 @@ struct create_named_pipe_reply
 #define NAMED_PIPE_MESSAGE_STREAM_WRITE 0x0001
 #define NAMED_PIPE_MESSAGE_STREAM_READ  0x0002
 #define NAMED_PIPE_NONBLOCKING_MODE     0x0004
+#define NAMED_PIPE_DIRECT               0x0008
 #define NAMED_PIPE_SERVER_END           0x8000
 
 
@@ -5690,8 +5844,11 @@ enum request
     REQ_queue_apc,
     REQ_get_apc_result,
     REQ_close_handle,
+    REQ_get_request_shm,
+    REQ_batch_requests,
     REQ_set_handle_info,
     REQ_dup_handle,
+    REQ_get_handle_table_info,
     REQ_open_process,
     REQ_open_thread,
     REQ_select,
@@ -5709,11 +5866,14 @@ enum request
     REQ_release_semaphore,
     REQ_query_semaphore,
     REQ_open_semaphore,
+    REQ_get_esync_fd,
+    REQ_get_esync_shm,
     REQ_create_file,
     REQ_open_file_object,
     REQ_alloc_file_handle,
     REQ_get_handle_unix_name,
     REQ_get_handle_fd,
+    REQ_get_fd_cache_info,
     REQ_get_directory_cache_entry,
     REQ_flush,
     REQ_get_file_info,
@@ -5804,6 +5964,7 @@ enum request
     REQ_set_queue_fd,
     REQ_set_queue_mask,
     REQ_get_queue_status,
+    REQ_get_queue_shared,
     REQ_get_process_idle_event,
     REQ_send_message,
     REQ_post_quit_message,
@@ -5988,8 +6149,11 @@ union generic_request
     struct queue_apc_request queue_apc_request;
     struct get_apc_result_request get_apc_result_request;
     struct close_handle_request close_handle_request;
+    struct get_request_shm_request get_request_shm_request;
+    struct batch_requests_request batch_requests_request;
     struct set_handle_info_request set_handle_info_request;
     struct dup_handle_request dup_handle_request;
+    struct get_handle_table_info_request get_handle_table_info_request;
     struct open_process_request open_process_request;
     struct open_thread_request open_thread_request;
     struct select_request select_request;
@@ -6007,11 +6171,14 @@ union generic_request
     struct release_semaphore_request release_semaphore_request;
     struct query_semaphore_request query_semaphore_request;
     struct open_semaphore_request open_semaphore_request;
+    struct get_esync_fd_request get_esync_fd_request;
+    struct get_esync_shm_request get_esync_shm_request;
     struct create_file_request create_file_request;
     struct open_file_object_request open_file_object_request;
     struct alloc_file_handle_request alloc_file_handle_request;
     struct get_handle_unix_name_request get_handle_unix_name_request;
     struct get_handle_fd_request get_handle_fd_request;
+    struct get_fd_cache_info_request get_fd_cache_info_request;
     struct get_directory_cache_entry_request get_directory_cache_entry_request;
     struct flush_request flush_request;
     struct get_file_info_request get_file_info_request;
@@ -6102,6 +6269,7 @@ union generic_request
     struct set_queue_fd_request set_queue_fd_request;
     struct set_queue_mask_request set_queue_mask_request;
     struct get_queue_status_request get_queue_status_request;
+    struct get_queue_shared_request get_queue_shared_request;
     struct get_process_idle_event_request get_process_idle_event_request;
     struct send_message_request send_message_request;
     struct post_quit_message_request post_quit_message_request;
@@ -6284,8 +6452,11 @@ union generic_reply
     struct queue_apc_reply queue_apc_reply;
     struct get_apc_result_reply get_apc_result_reply;
     struct close_handle_reply close_handle_reply;
+    struct get_request_shm_reply get_request_shm_reply;
+    struct batch_requests_reply batch_requests_reply;
     struct set_handle_info_reply set_handle_info_reply;
     struct dup_handle_reply dup_handle_reply;
+    struct get_handle_table_info_reply get_handle_table_info_reply;
     struct open_process_reply open_process_reply;
     struct open_thread_reply open_thread_reply;
     struct select_reply select_reply;
@@ -6303,11 +6474,14 @@ union generic_reply
     struct release_semaphore_reply release_semaphore_reply;
     struct query_semaphore_reply query_semaphore_reply;
     struct open_semaphore_reply open_semaphore_reply;
+    struct get_esync_fd_reply get_esync_fd_reply;
+    struct get_esync_shm_reply get_esync_shm_reply;
     struct create_file_reply create_file_reply;
     struct open_file_object_reply open_file_object_reply;
     struct alloc_file_handle_reply alloc_file_handle_reply;
     struct get_handle_unix_name_reply get_handle_unix_name_reply;
     struct get_handle_fd_reply get_handle_fd_reply;
+    struct get_fd_cache_info_reply get_fd_cache_info_reply;
     struct get_directory_cache_entry_reply get_directory_cache_entry_reply;
     struct flush_reply flush_reply;
     struct get_file_info_reply get_file_info_reply;
@@ -6398,6 +6572,7 @@ union generic_reply
     struct set_queue_fd_reply set_queue_fd_reply;
     struct set_queue_mask_reply set_queue_mask_reply;
     struct get_queue_status_reply get_queue_status_reply;
+    struct get_queue_shared_reply get_queue_shared_reply;
     struct get_process_idle_event_reply get_process_idle_event_reply;
     struct send_message_reply send_message_reply;
     struct post_quit_message_reply post_quit_message_reply;
@@ -6554,6 +6729,6 @@ union generic_reply
     struct terminate_job_reply terminate_job_reply;
 };
 
-#define SERVER_PROTOCOL_VERSION 572
+#define SERVER_PROTOCOL_VERSION 582
 
 #endif /* __WINE_WINE_SERVER_PROTOCOL_H */
@@ -874,7 +874,10 @@ typedef enum _PROCESSINFOCLASS {
     ProcessThreadStackAllocation = 41,
     ProcessWorkingSetWatchEx = 42,
     ProcessImageFileNameWin32 = 43,
-    MaxProcessInfoClass
+    MaxProcessInfoClass,
+#ifdef __WINESRC__
+    ProcessWineHandleTableInformation = 1000
+#endif
 } PROCESSINFOCLASS, PROCESS_INFORMATION_CLASS;
 
 #define MEM_EXECUTE_OPTION_DISABLE   0x01
@@ -1240,6 +1243,15 @@ typedef struct __OBJECT_TYPE_INFORMATION {
     ULONG Reserved [22];
 } OBJECT_TYPE_INFORMATION, *POBJECT_TYPE_INFORMATION;
 
+#ifdef __WINESRC__
+/* Wine extension: usage of the server handle table of a process */
+typedef struct _PROCESS_WINE_HANDLE_TABLE_INFORMATION {
+    ULONG     HandleCount;
+    ULONG     TableEntries;
+    ULONGLONG TableSize;
+} PROCESS_WINE_HANDLE_TABLE_INFORMATION, *PPROCESS_WINE_HANDLE_TABLE_INFORMATION;
+#endif
+
 typedef struct _PROCESS_BASIC_INFORMATION {
 #ifdef __WINESRC__
     DWORD_PTR ExitStatus;
@@ -1275,6 +1287,39 @@ typedef struct _RTL_HEAP_DEFINITION {
     ULONG Unknown[11];
 } RTL_HEAP_DEFINITION, *PRTL_HEAP_DEFINITION;
 
+/* Wine specific heap information class, enabled with WINEHEAPSTATS */
+#define HeapWineStatistics  ((HEAP_INFORMATION_CLASS)0x100)
+
+#define HEAP_WINE_STATS_ENABLED     0x00000001
+#define HEAP_WINE_MAX_FREE_LISTS    64
+#define HEAP_WINE_STACK_DEPTH       16
+
+typedef struct _HEAP_WINE_STACK_SAMPLE {
+    ULONGLONG Count;     /* number of sampled allocations from this stack */
+    ULONGLONG Bytes;     /* total size of the sampled allocations */
+    ULONG     Depth;     /* number of valid entries in Frames */
+    PVOID     Frames[HEAP_WINE_STACK_DEPTH];
+} HEAP_WINE_STACK_SAMPLE, *PHEAP_WINE_STACK_SAMPLE;
+
+typedef struct _HEAP_WINE_STATISTICS {
+    ULONG     Flags;
+    ULONG     SampleInterval;  /* bytes allocated between two stack samples */
+    ULONGLONG AllocCount;
+    ULONGLONG FreeCount;
+    ULONGLONG ReAllocCount;
+    ULONGLONG BytesInUse;
+    ULONGLONG PeakBytesInUse;
+    ULONGLONG LockCount;
+    ULONGLONG LockContentionCount;
+    ULONGLONG FreeBytes;
+    ULONG     FreeListCount;
+    ULONG     FreeListMaxSize[HEAP_WINE_MAX_FREE_LISTS];
+    ULONG     FreeListLength[HEAP_WINE_MAX_FREE_LISTS];
+    ULONG     TotalStackCount; /* number of distinct sampled stacks */
+    ULONG     StackCount;      /* number of entries returned in Stacks */
+    HEAP_WINE_STACK_SAMPLE Stacks[1];
+} HEAP_WINE_STATISTICS, *PHEAP_WINE_STATISTICS;
+
 typedef struct _RTL_RWLOCK {
     RTL_CRITICAL_SECTION rtlCS;
 
@@ -2585,6 +2630,7 @@ NTSYSAPI BOOLEAN   WINAPI RtlAreAllAccessesGranted(ACCESS_MASK,ACCESS_MASK);
 NTSYSAPI BOOLEAN   WINAPI RtlAreAnyAccessesGranted(ACCESS_MASK,ACCESS_MASK);
 NTSYSAPI BOOLEAN   WINAPI RtlAreBitsSet(PCRTL_BITMAP,ULONG,ULONG);
 NTSYSAPI BOOLEAN   WINAPI RtlAreBitsClear(PCRTL_BITMAP,ULONG,ULONG);
+NTSYSAPI USHORT    WINAPI RtlCaptureStackBackTrace(ULONG,ULONG,PVOID*,ULONG*);
 NTSYSAPI NTSTATUS  WINAPI RtlCharToInteger(PCSZ,ULONG,PULONG);
 NTSYSAPI NTSTATUS  WINAPI RtlCheckRegistryKey(ULONG, PWSTR);
 NTSYSAPI void      WINAPI RtlClearAllBits(PRTL_BITMAP);
@@ -0,0 +1,500 @@
+/*
+ * Wine server in-process synchronization (esync)
+ *
+ * Events, semaphores and mutexes can be backed by an eventfd that is
+ * shared with the clients, so that waiting on them and signaling them
+ * doesn't require a server round trip. The server keeps the eventfd in
+ * sync with its own operations on the objects, and polls it while
+ * server-side waits are pending.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#include "config.h"
+#include "wine/port.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include <unistd.h>
+
+#include "ntstatus.h"
+#define WIN32_NO_STATUS
+#include "windef.h"
+#include "winternl.h"
+
+#include "handle.h"
+#include "thread.h"
+#include "request.h"
+#include "file.h"
+#include "esync.h"
+
+struct esync
+{
+    struct object        obj;       /* object header */
+    struct fd           *fd;        /* eventfd shared with the clients */
+    struct object       *owner;     /* object using this esync (not referenced) */
+    enum esync_type      type;      /* type of the owner object */
+    unsigned int         shm_idx;   /* index of the mutex state in the shared area */
+    struct timeout_user *rearm;     /* timeout for re-enabling polling on the fd */
+    struct list          entry;     /* entry in the list of esync mutexes */
+};
+
+static void esync_dump( struct object *obj, int verbose );
+static void esync_destroy( struct object *obj );
+
+static const struct object_ops esync_ops =
+{
+    sizeof(struct esync),      /* size */
+    esync_dump,                /* dump */
+    no_get_type,               /* get_type */
+    no_add_queue,              /* add_queue */
+    NULL,                      /* remove_queue */
+    NULL,                      /* signaled */
+    NULL,                      /* satisfied */
+    no_signal,                 /* signal */
+    no_get_fd,                 /* get_fd */
+    no_map_access,             /* map_access */
+    default_get_sd,            /* get_sd */
+    default_set_sd,            /* set_sd */
+    no_lookup_name,            /* lookup_name */
+    no_link_name,              /* link_name */
+    NULL,                      /* unlink_name */
+    no_open_file,              /* open_file */
+    no_close_handle,           /* close_handle */
+    esync_destroy              /* destroy */
+};
+
+static void esync_poll_event( struct fd *fd, int event );
+
+static const struct fd_ops esync_fd_ops =
+{
+    NULL,                      /* get_poll_events */
+    esync_poll_event,          /* poll_event */
+    NULL,                      /* get_fd_type */
+    no_fd_read,                /* read */
+    no_fd_write,               /* write */
+    no_fd_flush,               /* flush */
+    no_fd_get_file_info,       /* get_file_info */
+    no_fd_get_volume_info,     /* get_volume_info */
+    no_fd_ioctl,               /* ioctl */
+    NULL,                      /* queue_async */
+    NULL                       /* reselect_async */
+};
+
+#define ESYNC_SHM_SIZE (ESYNC_SHM_MUTEXES * sizeof(struct esync_mutex_state))
+
+static struct list esync_mutexes = LIST_INIT( esync_mutexes );
+
+static int shm_fd = -1;                          /* fd of the shared mutex state area */
+static struct esync_mutex_state *shm_mutexes;    /* server mapping of the shared area */
+static unsigned int *shm_free_slots;             /* stack of free mutex slots */
+static unsigned int shm_free_count;              /* number of entries in the free stack */
+static unsigned int shm_used;                    /* number of slots ever allocated */
+
+int do_esync(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    static int enabled = -1;
+
+    if (enabled == -1)
+    {
+        const char *env = getenv( "WINEESYNC" );
+        enabled = env && atoi( env );
+    }
+    return enabled;
+#else
+    return 0;
+#endif
+}
+
+/* map the shared area holding the mutex state */
+static int init_esync_shm(void)
+{
+    void *ptr;
+
+    if (shm_mutexes) return 1;
+    if (!(shm_free_slots = mem_alloc( ESYNC_SHM_MUTEXES * sizeof(*shm_free_slots) ))) return 0;
+    if ((shm_fd = create_temp_file( ESYNC_SHM_SIZE )) == -1) goto error;
+    ptr = mmap( NULL, ESYNC_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0 );
+    if (ptr == MAP_FAILED)
+    {
+        close( shm_fd );
+        shm_fd = -1;
+        goto error;
+    }
+    shm_mutexes = ptr;
+    return 1;
+
+error:
+    free( shm_free_slots );
+    shm_free_slots = NULL;
+    return 0;
+}
+
+static int alloc_mutex_slot( unsigned int *idx )
+{
+    if (!init_esync_shm()) return 0;
+    if (shm_free_count) *idx = shm_free_slots[--shm_free_count];
+    else if (shm_used < ESYNC_SHM_MUTEXES) *idx = shm_used++;
+    else return 0;
+    memset( &shm_mutexes[*idx], 0, sizeof(shm_mutexes[*idx]) );
+    return 1;
+}
+
+static void free_mutex_slot( unsigned int idx )
+{
+    shm_free_slots[shm_free_count++] = idx;
+}
+
+/* create the esync backing an object; returns NULL if esync can't be used for it */
+struct esync *create_esync( struct object *owner, enum esync_type type, unsigned int initval )
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    struct esync *esync;
+    unsigned int error = get_error(), idx = 0;
+    int unix_fd, flags = EFD_CLOEXEC | EFD_NONBLOCK;
+
+    if (!do_esync()) return NULL;
+
+    /* the object falls back to server-side waits on failure, so don't report errors */
+    if (type == ESYNC_SEMAPHORE) flags |= EFD_SEMAPHORE;
+    if (type == ESYNC_MUTEX && !alloc_mutex_slot( &idx )) goto failed;
+    if ((unix_fd = eventfd( initval, flags )) == -1)
+    {
+        if (type == ESYNC_MUTEX) free_mutex_slot( idx );
+        goto failed;
+    }
+    if (!(esync = alloc_object( &esync_ops )))
+    {
+        close( unix_fd );
+        if (type == ESYNC_MUTEX) free_mutex_slot( idx );
+        goto failed;
+    }
+    esync->owner   = owner;
+    esync->type    = type;
+    esync->shm_idx = idx;
+    esync->rearm   = NULL;
+    esync->fd      = NULL;
+    if (type == ESYNC_MUTEX) list_add_tail( &esync_mutexes, &esync->entry );
+    else list_init( &esync->entry );
+
+    if (!(esync->fd = create_anonymous_fd( &esync_fd_ops, unix_fd, &esync->obj, 0 )))
+    {
+        release_object( esync );
+        goto failed;
+    }
+    return esync;
+
+failed:
+    set_error( error );
+#endif
+    return NULL;
+}
+
+static void esync_dump( struct object *obj, int verbose )
+{
+    struct esync *esync = (struct esync *)obj;
+    assert( obj->ops == &esync_ops );
+    fprintf( stderr, "Esync type=%u fd=%p\n", esync->type, esync->fd );
+}
+
+static void esync_destroy( struct object *obj )
+{
+    struct esync *esync = (struct esync *)obj;
+    assert( obj->ops == &esync_ops );
+
+    if (esync->rearm) remove_timeout_user( esync->rearm );
+    if (esync->type == ESYNC_MUTEX)
+    {
+        list_remove( &esync->entry );
+        free_mutex_slot( esync->shm_idx );
+    }
+    if (esync->fd) release_object( esync->fd );
+}
+
+/* consume one unit of the eventfd count; return 1 if successful */
+static int esync_grab( struct esync *esync )
+{
+    unsigned __int64 value;
+    return read( get_unix_fd( esync->fd ), &value, sizeof(value) ) == sizeof(value);
+}
+
+/* add count units to the eventfd count */
+void esync_wake( struct esync *esync, unsigned int count )
+{
+    unsigned __int64 value = count;
+
+    if (write( get_unix_fd( esync->fd ), &value, sizeof(value) ) == -1 && errno != EAGAIN)
+        fprintf( stderr, "wineserver: esync write: %s\n", strerror( errno ));
+}
+
+/* reset the eventfd count to zero */
+void esync_clear( struct esync *esync )
+{
+    unsigned __int64 value;
+
+    /* semaphore eventfds only decrement by one on each read */
+    while (read( get_unix_fd( esync->fd ), &value, sizeof(value) ) == sizeof(value) &&
+           esync->type == ESYNC_SEMAPHORE);
+}
+
+/* check whether the eventfd count is non-zero, without consuming it */
+int esync_is_signaled( struct esync *esync )
+{
+    struct pollfd pfd;
+
+    pfd.fd = get_unix_fd( esync->fd );
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll( &pfd, 1, 0 ) > 0 && (pfd.revents & POLLIN);
+}
+
+/* retrieve the current eventfd count, without consuming it */
+unsigned int esync_get_count( struct esync *esync )
+{
+    char path[40], buffer[256];
+    unsigned int count = 0;
+    FILE *f;
+
+    sprintf( path, "/proc/self/fdinfo/%d", get_unix_fd( esync->fd ));
+    if (!(f = fopen( path, "r" ))) return esync_is_signaled( esync );
+    while (fgets( buffer, sizeof(buffer), f ))
+        if (sscanf( buffer, "eventfd-count: %x", &count ) == 1) break;
+    fclose( f );
+    return count;
+}
+
+static void esync_rearm( void *private )
+{
+    struct esync *esync = private;
+
+    esync->rearm = NULL;
+    if (!list_empty( &esync->owner->wait_queue )) set_fd_events( esync->fd, POLLIN );
+}
+
+/* the eventfd became readable while server-side waits are pending */
+static void esync_poll_event( struct fd *fd, int event )
+{
+    struct esync *esync = get_fd_user( fd );
+    struct object *owner = grab_object( esync->owner );
+
+    wake_up( owner, 0 );
+
+    /* waiters that couldn't be satisfied (e.g. a wait for all objects) would make
+     * us spin on the readable fd, so only look at it again a bit later */
+    if (!list_empty( &owner->wait_queue ) && !esync->rearm && esync_is_signaled( esync ))
+    {
+        set_fd_events( esync->fd, 0 );
+        esync->rearm = add_timeout_user( -TICKS_PER_SEC / 100, esync_rearm, esync );
+    }
+    release_object( owner );
+}
+
+int esync_add_queue( struct esync *esync, struct wait_queue_entry *entry )
+{
+    if (!add_queue( esync->owner, entry )) return 0;
+    if (!esync->rearm) set_fd_events( esync->fd, POLLIN );
+    return 1;
+}
+
+void esync_remove_queue( struct esync *esync, struct wait_queue_entry *entry )
+{
+    remove_queue( esync->owner, entry );
+    if (list_empty( &esync->owner->wait_queue ))
+    {
+        set_fd_events( esync->fd, 0 );
+        if (esync->rearm) remove_timeout_user( esync->rearm );
+        esync->rearm = NULL;
+    }
+}
+
+struct esync_mutex_state *esync_get_mutex_state( struct esync *esync )
+{
+    assert( esync->type == ESYNC_MUTEX );
+    return &shm_mutexes[esync->shm_idx];
+}
+
+/* server-side wait check; a wait for any object is satisfied by the first
+ * signaled one, so in that case the object is consumed right away */
+int esync_signaled( struct esync *esync, struct wait_queue_entry *entry )
+{
+    struct thread *thread = get_wait_queue_thread( entry );
+
+    if (esync->type == ESYNC_MUTEX && esync_get_mutex_state( esync )->tid == thread->id) return 1;
+    if (esync->type == ESYNC_MANUAL_EVENT || get_wait_queue_select_op( entry ) == SELECT_WAIT_ALL)
+        return esync_is_signaled( esync );
+    if (!esync_grab( esync )) return 0;
+    if (esync->type == ESYNC_MUTEX)
+    {
+        struct esync_mutex_state *state = esync_get_mutex_state( esync );
+        state->tid = thread->id;
+        state->count = 0;  /* incremented in esync_satisfied */
+    }
+    return 1;
+}
+
+void esync_satisfied( struct esync *esync, struct wait_queue_entry *entry )
+{
+    struct thread *thread = get_wait_queue_thread( entry );
+    struct esync_mutex_state *state;
+
+    if (esync->type == ESYNC_MANUAL_EVENT) return;
+
+    if (esync->type != ESYNC_MUTEX) return;
+    state = esync_get_mutex_state( esync );
+    if (state->tid != thread->id) return;
+    state->count++;
+    if (state->abandoned)
+    {
+        make_wait_abandoned( entry );
+        state->abandoned = 0;
+    }
+}
+
+/* release a mutex on behalf of a thread */
+int esync_release_mutex( struct esync *esync, thread_id_t tid, unsigned int *prev_count )
+{
+    struct esync_mutex_state *state = esync_get_mutex_state( esync );
+
+    if (!state->count || state->tid != tid)
+    {
+        set_error( STATUS_MUTANT_NOT_OWNED );
+        return 0;
+    }
+    if (prev_count) *prev_count = state->count;
+    if (!--state->count)
+    {
+        state->tid = 0;
+        esync_wake( esync, 1 );
+    }
+    return 1;
+}
+
+/* release the mutexes owned by a dying thread */
+void esync_abandon_mutexes( struct thread *thread )
+{
+    struct esync *esync;
+
+    LIST_FOR_EACH_ENTRY( esync, &esync_mutexes, struct esync, entry )
+    {
+        struct esync_mutex_state *state = esync_get_mutex_state( esync );
+
+        if (state->tid != thread->id) continue;
+        state->tid = 0;
+        state->count = 0;
+        state->abandoned = 1;
+        esync_wake( esync, 1 );
+    }
+}
+
+static struct esync *get_object_esync( struct object *obj )
+{
+    struct esync *esync;
+
+    if ((esync = get_event_esync( obj ))) return esync;
+    if ((esync = get_semaphore_esync( obj ))) return esync;
+    return get_mutex_esync( obj );
+}
+
+/* consume the esync objects of a wait for all objects at once, when they all look
+ * signaled; if a client raced us for one of them, put back what was already
+ * grabbed and return 0 so that the thread keeps waiting */
+int esync_grab_wait_all( struct wait_queue_entry *entries, unsigned int count )
+{
+    struct esync *grabbed[MAXIMUM_WAIT_OBJECTS];
+    unsigned int i, j, nb_grabbed = 0;
+    struct thread *thread;
+    struct esync *esync;
+
+    if (!do_esync() || !count) return 1;
+    thread = get_wait_queue_thread( entries );
+
+    for (i = 0; i < count; i++)
+    {
+        if (!(esync = get_object_esync( entries[i].obj ))) continue;
+        if (esync->type == ESYNC_MANUAL_EVENT) continue;
+        if (esync->type == ESYNC_MUTEX && esync_get_mutex_state( esync )->tid == thread->id) continue;
+        for (j = 0; j < nb_grabbed; j++) if (grabbed[j] == esync) break;
+        if (j < nb_grabbed) continue;
+        if (!esync_grab( esync ))
+        {
+            while (nb_grabbed) esync_wake( grabbed[--nb_grabbed], 1 );
+            return 0;
+        }
+        grabbed[nb_grabbed++] = esync;
+    }
+
+    for (i = 0; i < nb_grabbed; i++)
+    {
+        struct esync_mutex_state *state;
+
+        if (grabbed[i]->type != ESYNC_MUTEX) continue;
+        state = esync_get_mutex_state( grabbed[i] );
+        state->tid = thread->id;
+        state->count = 0;  /* incremented in esync_satisfied */
+    }
+    return 1;
+}
+
+/* retrieve the in-process wait fd of an event, semaphore or mutex */
+DECL_HANDLER(get_esync_fd)
+{
+    struct object *obj;
+    struct esync *esync;
+
+    if (!do_esync())
+    {
+        set_error( STATUS_NOT_IMPLEMENTED );
+        return;
+    }
+    if (!(obj = get_handle_obj( current->process, req->handle, 0, NULL ))) return;
+
+    if ((esync = get_object_esync( obj )))
+    {
+        reply->type    = esync->type;
+        reply->access  = get_handle_access( current->process, req->handle );
+        reply->shm_idx = esync->shm_idx;
+        send_client_fd( current->process, get_unix_fd( esync->fd ), req->handle );
+    }
+    else reply->type = ESYNC_NONE;
+
+    release_object( obj );
+}
+
+/* retrieve the shared area holding the esync mutex state */
+DECL_HANDLER(get_esync_shm)
+{
+    if (!do_esync())
+    {
+        set_error( STATUS_NOT_IMPLEMENTED );
+        return;
+    }
+    if (!init_esync_shm()) return;
+    reply->size = ESYNC_SHM_SIZE;
+    send_client_fd( current->process, shm_fd, 0 );
+}
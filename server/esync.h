@@ -0,0 +1,46 @@
+/*
+ * Wine server in-process synchronization (esync)
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA
+ */
+
+#ifndef __WINE_SERVER_ESYNC_H
+#define __WINE_SERVER_ESYNC_H
+
+#include "object.h"
+
+struct esync;
+
+extern int do_esync(void);
+extern struct esync *create_esync( struct object *owner, enum esync_type type, unsigned int initval );
+extern void esync_wake( struct esync *esync, unsigned int count );
+extern void esync_clear( struct esync *esync );
+extern int esync_is_signaled( struct esync *esync );
+extern unsigned int esync_get_count( struct esync *esync );
+extern int esync_add_queue( struct esync *esync, struct wait_queue_entry *entry );
+extern void esync_remove_queue( struct esync *esync, struct wait_queue_entry *entry );
+extern int esync_signaled( struct esync *esync, struct wait_queue_entry *entry );
+extern void esync_satisfied( struct esync *esync, struct wait_queue_entry *entry );
+extern int esync_grab_wait_all( struct wait_queue_entry *entries, unsigned int count );
+extern struct esync_mutex_state *esync_get_mutex_state( struct esync *esync );
+extern int esync_release_mutex( struct esync *esync, thread_id_t tid, unsigned int *prev_count );
+extern void esync_abandon_mutexes( struct thread *thread );
+
+/* retrieve the esync of an object, NULL if it doesn't have one */
+extern struct esync *get_event_esync( struct object *obj );
+extern struct esync *get_semaphore_esync( struct object *obj );
+extern struct esync *get_mutex_esync( struct object *obj );
+
+#endif  /* __WINE_SERVER_ESYNC_H */
@@ -35,28 +35,33 @@
 #include "thread.h"
 #include "request.h"
 #include "security.h"
+#include "esync.h"
 
 struct event
 {
     struct object  obj;             /* object header */
     int            manual_reset;    /* is it a manual reset event? */
     int            signaled;        /* event has been signaled */
+    struct esync  *esync;           /* in-process wait fd, if any */
 };
 
 static void event_dump( struct object *obj, int verbose );
 static struct object_type *event_get_type( struct object *obj );
+static int event_add_queue( struct object *obj, struct wait_queue_entry *entry );
+static void event_remove_queue( struct object *obj, struct wait_queue_entry *entry );
 static int event_signaled( struct object *obj, struct wait_queue_entry *entry );
 static void event_satisfied( struct object *obj, struct wait_queue_entry *entry );
 static unsigned int event_map_access( struct object *obj, unsigned int access );
 static int event_signal( struct object *obj, unsigned int access);
+static void event_destroy( struct object *obj );
 
 static const struct object_ops event_ops =
 {
     sizeof(struct event),      /* size */
     event_dump,                /* dump */
     event_get_type,            /* get_type */
-    add_queue,                 /* add_queue */
-    remove_queue,              /* remove_queue */
+    event_add_queue,           /* add_queue */
+    event_remove_queue,        /* remove_queue */
     event_signaled,            /* signaled */
     event_satisfied,           /* satisfied */
     event_signal,              /* signal */
@@ -69,7 +74,7 @@ static const struct object_ops event_ops =
     default_unlink_name,       /* unlink_name */
     no_open_file,              /* open_file */
     no_close_handle,           /* close_handle */
-    no_destroy                 /* destroy */
+    event_destroy              /* destroy */
 };
 
 
@@ -119,6 +124,9 @@ struct event *create_event( struct object *root, const struct unicode_str *name,
             /* initialize it if it didn't already exist */
             event->manual_reset = manual_reset;
             event->signaled     = initial_state;
+            event->esync        = create_esync( &event->obj,
+                                                manual_reset ? ESYNC_MANUAL_EVENT : ESYNC_AUTO_EVENT,
+                                                initial_state );
         }
     }
     return event;
@@ -129,8 +137,22 @@ struct event *get_event_obj( struct process *process, obj_handle_t handle, unsig
     return (struct event *)get_handle_obj( process, handle, access, &event_ops );
 }
 
+struct esync *get_event_esync( struct object *obj )
+{
+    if (obj->ops != &event_ops) return NULL;
+    return ((struct event *)obj)->esync;
+}
+
 void pulse_event( struct event *event )
 {
+    if (event->esync)
+    {
+        /* in-process waiters may miss the pulse, which is allowed */
+        esync_wake( event->esync, 1 );
+        wake_up( &event->obj, !event->manual_reset );
+        esync_clear( event->esync );
+        return;
+    }
     event->signaled = 1;
     /* wake up all waiters if manual reset, a single one otherwise */
     wake_up( &event->obj, !event->manual_reset );
@@ -139,6 +161,12 @@ void pulse_event( struct event *event )
 
 void set_event( struct event *event )
 {
+    if (event->esync)
+    {
+        esync_wake( event->esync, 1 );
+        wake_up( &event->obj, !event->manual_reset );
+        return;
+    }
     event->signaled = 1;
     /* wake up all waiters if manual reset, a single one otherwise */
     wake_up( &event->obj, !event->manual_reset );
@@ -146,15 +174,22 @@ void set_event( struct event *event )
 
 void reset_event( struct event *event )
 {
+    if (event->esync) esync_clear( event->esync );
     event->signaled = 0;
 }
 
+static int event_is_signaled( struct event *event )
+{
+    if (event->esync) return esync_is_signaled( event->esync );
+    return event->signaled;
+}
+
 static void event_dump( struct object *obj, int verbose )
 {
     struct event *event = (struct event *)obj;
     assert( obj->ops == &event_ops );
     fprintf( stderr, "Event manual=%d signaled=%d\n",
-             event->manual_reset, event->signaled );
+             event->manual_reset, event_is_signaled( event ));
 }
 
 static struct object_type *event_get_type( struct object *obj )
@@ -164,10 +199,27 @@ static struct object_type *event_get_type( struct object *obj )
     return get_object_type( &str );
 }
 
+static int event_add_queue( struct object *obj, struct wait_queue_entry *entry )
+{
+    struct event *event = (struct event *)obj;
+    assert( obj->ops == &event_ops );
+    if (event->esync) return esync_add_queue( event->esync, entry );
+    return add_queue( obj, entry );
+}
+
+static void event_remove_queue( struct object *obj, struct wait_queue_entry *entry )
+{
+    struct event *event = (struct event *)obj;
+    assert( obj->ops == &event_ops );
+    if (event->esync) esync_remove_queue( event->esync, entry );
+    else remove_queue( obj, entry );
+}
+
 static int event_signaled( struct object *obj, struct wait_queue_entry *entry )
 {
     struct event *event = (struct event *)obj;
     assert( obj->ops == &event_ops );
+    if (event->esync) return esync_signaled( event->esync, entry );
     return event->signaled;
 }
 
@@ -175,6 +227,11 @@ static void event_satisfied( struct object *obj, struct wait_queue_entry *entry
 {
     struct event *event = (struct event *)obj;
     assert( obj->ops == &event_ops );
+    if (event->esync)
+    {
+        esync_satisfied( event->esync, entry );
+        return;
+    }
     /* Reset if it's an auto-reset event */
     if (!event->manual_reset) event->signaled = 0;
 }
@@ -202,6 +259,13 @@ static int event_signal( struct object *obj, unsigned int access )
     return 1;
 }
 
+static void event_destroy( struct object *obj )
+{
+    struct event *event = (struct event *)obj;
+    assert( obj->ops == &event_ops );
+    if (event->esync) release_object( event->esync );
+}
+
 struct keyed_event *create_keyed_event( struct object *root, const struct unicode_str *name,
                                         unsigned int attr, const struct security_descriptor *sd )
 {
@@ -337,7 +401,7 @@ DECL_HANDLER(query_event)
     if (!(event = get_event_obj( current->process, req->handle, EVENT_QUERY_STATE ))) return;
 
     reply->manual_reset = event->manual_reset;
-    reply->state = event->signaled;
+    reply->state = event_is_signaled( event );
 
     release_object( event );
 }
@@ -188,6 +188,7 @@ struct fd
     unsigned int         cacheable :1;/* can the fd be cached on the client side? */
     unsigned int         signaled :1; /* is the fd signaled? */
     unsigned int         fs_locks :1; /* can we use filesystem locks for this fd? */
+    unsigned int         cache_slot;  /* generation counter for client-side caching, 0 if none */
     int                  poll_index;  /* index of fd in poll array */
     struct async_queue   read_q;      /* async readers of this fd */
     struct async_queue   write_q;     /* async writers of this fd */
@@ -359,15 +360,29 @@ static file_pos_t max_unix_offset = OFF_T_MAX;
 
 struct timeout_user
 {
-    struct list           entry;      /* entry in sorted timeout list */
+    struct list           entry;      /* entry in expired list while callbacks are running */
+    int                   index;      /* index in the timeout heap, -1 once expired */
     timeout_t             when;       /* timeout expiry (absolute time) */
     timeout_callback      callback;   /* callback function */
     void                 *private;    /* callback private data */
 };
 
-static struct list timeout_list = LIST_INIT(timeout_list);   /* sorted timeouts list */
+static struct timeout_user **timeout_heap;  /* binary min-heap of pending timeouts */
+static int timeout_count;                    /* number of pending timeouts */
+static int timeout_alloc;                    /* allocated size of the heap */
 timeout_t current_time;
 
+/* timeout statistics, dumped on SIGHUP */
+static struct
+{
+    int              max_pending;     /* highest number of pending timeouts */
+    unsigned int     added;           /* number of timeouts added */
+    unsigned int     expired;         /* number of timeouts that expired */
+    unsigned int     calls;           /* number of calls to get_next_timeout with pending timeouts */
+    unsigned __int64 total_ns;        /* total time spent in get_next_timeout */
+    unsigned __int64 max_ns;          /* longest time spent in a single call */
+} timeout_stats;
+
 static inline void set_current_time(void)
 {
     static const timeout_t ticks_1601_to_1970 = (timeout_t)86400 * (369 * 365 + 89) * TICKS_PER_SEC;
@@ -376,35 +391,118 @@ static inline void set_current_time(void)
     current_time = (timeout_t)now.tv_sec * TICKS_PER_SEC + now.tv_usec * 10 + ticks_1601_to_1970;
 }
 
+static inline void set_heap_entry( int index, struct timeout_user *user )
+{
+    timeout_heap[index] = user;
+    user->index = index;
+}
+
+/* move a heap entry up until its parent expires before it */
+static void timeout_heap_up( int index, struct timeout_user *user )
+{
+    while (index)
+    {
+        int parent = (index - 1) / 2;
+        if (timeout_heap[parent]->when <= user->when) break;
+        set_heap_entry( index, timeout_heap[parent] );
+        index = parent;
+    }
+    set_heap_entry( index, user );
+}
+
+/* move a heap entry down until its children expire after it */
+static void timeout_heap_down( int index, struct timeout_user *user )
+{
+    for (;;)
+    {
+        int child = 2 * index + 1;
+        if (child >= timeout_count) break;
+        if (child + 1 < timeout_count && timeout_heap[child + 1]->when < timeout_heap[child]->when)
+            child++;
+        if (user->when <= timeout_heap[child]->when) break;
+        set_heap_entry( index, timeout_heap[child] );
+        index = child;
+    }
+    set_heap_entry( index, user );
+}
+
+/* remove an entry from the heap */
+static void timeout_heap_remove( struct timeout_user *user )
+{
+    int index = user->index;
+    struct timeout_user *last = timeout_heap[--timeout_count];
+
+    user->index = -1;
+    if (last == user) return;
+    if (index && timeout_heap[(index - 1) / 2]->when > last->when) timeout_heap_up( index, last );
+    else timeout_heap_down( index, last );
+}
+
 /* add a timeout user */
 struct timeout_user *add_timeout_user( timeout_t when, timeout_callback func, void *private )
 {
     struct timeout_user *user;
-    struct list *ptr;
+
+    if (timeout_count == timeout_alloc)
+    {
+        int new_alloc = max( 64, timeout_alloc * 2 );
+        struct timeout_user **new_heap;
+
+        if (!(new_heap = realloc( timeout_heap, new_alloc * sizeof(*new_heap) )))
+        {
+            set_error( STATUS_NO_MEMORY );
+            return NULL;
+        }
+        timeout_heap = new_heap;
+        timeout_alloc = new_alloc;
+    }
 
     if (!(user = mem_alloc( sizeof(*user) ))) return NULL;
     user->when     = (when > 0) ? when : current_time - when;
     user->callback = func;
     user->private  = private;
 
-    /* Now insert it in the linked list */
+    timeout_heap_up( timeout_count++, user );
 
-    LIST_FOR_EACH( ptr, &timeout_list )
-    {
-        struct timeout_user *timeout = LIST_ENTRY( ptr, struct timeout_user, entry );
-        if (timeout->when >= user->when) break;
-    }
-    list_add_before( ptr, &user->entry );
+    timeout_stats.added++;
+    if (timeout_count > timeout_stats.max_pending) timeout_stats.max_pending = timeout_count;
     return user;
 }
 
 /* remove a timeout user */
 void remove_timeout_user( struct timeout_user *user )
 {
-    list_remove( &user->entry );
+    if (user->index == -1) list_remove( &user->entry );  /* already expired */
+    else timeout_heap_remove( user );
     free( user );
 }
 
+#ifdef HAVE_CLOCK_GETTIME
+static inline unsigned __int64 get_stats_time(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime( CLOCK_MONOTONIC, &ts )) return 0;
+    return (unsigned __int64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#else
+static inline unsigned __int64 get_stats_time(void)
+{
+    return 0;
+}
+#endif
+
+/* dump the timeout statistics, to monitor the timer load */
+void dump_timeout_stats(void)
+{
+    fprintf( stderr, "timeouts: pending=%d max_pending=%d added=%u expired=%u\n",
+             timeout_count, timeout_stats.max_pending, timeout_stats.added, timeout_stats.expired );
+    fprintf( stderr, "get_next_timeout: calls=%u total=%.3fms avg=%.0fns max=%.0fns\n",
+             timeout_stats.calls, timeout_stats.total_ns / 1000000.0,
+             timeout_stats.calls ? (double)timeout_stats.total_ns / timeout_stats.calls : 0.0,
+             (double)timeout_stats.max_ns );
+}
+
 /* return a text description of a timeout for debugging purposes */
 const char *get_timeout_str( timeout_t timeout )
 {
@@ -552,6 +650,7 @@ static inline void main_loop_epoll(void)
             int user = events[i].data.u32;
             if (pollfd[user].revents) fd_poll_event( poll_users[user], pollfd[user].revents );
         }
+        flush_parallel_requests();
     }
 }
 
@@ -675,6 +774,7 @@ static inline void main_loop_epoll(void)
             if (pollfd[user].revents) fd_poll_event( poll_users[user], pollfd[user].revents );
             pollfd[user].revents = 0;
         }
+        flush_parallel_requests();
     }
 }
 
@@ -847,23 +947,23 @@ static void remove_poll_user( struct fd *fd, int user )
 /* process pending timeouts and return the time until the next timeout, in milliseconds */
 static int get_next_timeout(void)
 {
-    if (!list_empty( &timeout_list ))
+    int ret = -1;  /* no pending timeouts */
+
+    if (timeout_count)
     {
+        unsigned __int64 start = get_stats_time(), elapsed;
         struct list expired_list, *ptr;
 
-        /* first remove all expired timers from the list */
+        /* first remove all expired timers from the heap */
 
         list_init( &expired_list );
-        while ((ptr = list_head( &timeout_list )) != NULL)
+        while (timeout_count && timeout_heap[0]->when <= current_time)
         {
-            struct timeout_user *timeout = LIST_ENTRY( ptr, struct timeout_user, entry );
+            struct timeout_user *timeout = timeout_heap[0];
 
-            if (timeout->when <= current_time)
-            {
-                list_remove( &timeout->entry );
-                list_add_tail( &expired_list, &timeout->entry );
-            }
-            else break;
+            timeout_heap_remove( timeout );
+            list_add_tail( &expired_list, &timeout->entry );
+            timeout_stats.expired++;
         }
 
         /* now call the callback for all the removed timers */
@@ -876,15 +976,19 @@ static int get_next_timeout(void)
             free( timeout );
         }
 
-        if ((ptr = list_head( &timeout_list )) != NULL)
+        if (timeout_count)
         {
-            struct timeout_user *timeout = LIST_ENTRY( ptr, struct timeout_user, entry );
-            int diff = (timeout->when - current_time + 9999) / 10000;
+            int diff = (timeout_heap[0]->when - current_time + 9999) / 10000;
             if (diff < 0) diff = 0;
-            return diff;
+            ret = diff;
         }
+
+        elapsed = get_stats_time() - start;
+        timeout_stats.calls++;
+        timeout_stats.total_ns += elapsed;
+        if (elapsed > timeout_stats.max_ns) timeout_stats.max_ns = elapsed;
     }
-    return -1;  /* no pending timeouts */
+    return ret;
 }
 
 /* server main poll() loop */
@@ -917,6 +1021,7 @@ void main_loop(void)
                     if (!--ret) break;
                 }
             }
+            flush_parallel_requests();
         }
     }
 }
@@ -1010,6 +1115,38 @@ static void device_destroy( struct object *obj )
 }
 
 
+/****************************************************************/
+/* client-side fd cache generation counters */
+
+static struct object *fd_cache_mapping;                 /* mapping shared with the clients */
+static volatile unsigned int *fd_cache_generations;     /* counters in the shared mapping */
+static unsigned int fd_cache_free_slots[FD_CACHE_SLOTS];
+static unsigned int fd_cache_nb_free;
+static unsigned int fd_cache_next_slot = 1;             /* slot 0 means no counter */
+
+/* allocate a generation counter, return 0 if none is available */
+unsigned int alloc_fd_cache_slot(void)
+{
+    if (!fd_cache_generations) return 0;
+    if (fd_cache_nb_free) return fd_cache_free_slots[--fd_cache_nb_free];
+    if (fd_cache_next_slot < FD_CACHE_SLOTS) return fd_cache_next_slot++;
+    return 0;
+}
+
+/* free a generation counter, invalidating the entries that still use it */
+void free_fd_cache_slot( unsigned int slot )
+{
+    fd_cache_generations[slot]++;
+    fd_cache_free_slots[fd_cache_nb_free++] = slot;
+}
+
+/* bump a generation counter */
+void invalidate_fd_cache_slot( unsigned int slot )
+{
+    fd_cache_generations[slot]++;
+}
+
+
 /****************************************************************/
 /* inode functions */
 
@@ -1479,6 +1616,7 @@ static void fd_destroy( struct object *obj )
     free_async_queue( &fd->wait_q );
 
     if (fd->completion) release_object( fd->completion );
+    if (fd->cache_slot) free_fd_cache_slot( fd->cache_slot );
     remove_fd_locks( fd );
     list_remove( &fd->inode_entry );
     if (fd->poll_index != -1) remove_poll_user( fd, fd->poll_index );
@@ -1574,6 +1712,7 @@ static inline void unmount_fd( struct fd *fd )
     if (fd->poll_index != -1) set_fd_events( fd, -1 );
 
     if (fd->unix_fd != -1) close( fd->unix_fd );
+    invalidate_fd_cache( fd );
 
     fd->unix_fd = -1;
     fd->no_fd_status = STATUS_VOLUME_DISMOUNTED;
@@ -1603,6 +1742,7 @@ static struct fd *alloc_fd_object(void)
     fd->cacheable  = 0;
     fd->signaled   = 1;
     fd->fs_locks   = 1;
+    fd->cache_slot = 0;
     fd->poll_index = -1;
     fd->completion = NULL;
     fd->comp_flags = 0;
@@ -1639,6 +1779,7 @@ struct fd *alloc_pseudo_fd( const struct fd_ops *fd_user_ops, struct object *use
     fd->cacheable  = 0;
     fd->signaled   = 0;
     fd->fs_locks   = 0;
+    fd->cache_slot = 0;
     fd->poll_index = -1;
     fd->completion = NULL;
     fd->comp_flags = 0;
@@ -1955,6 +2096,12 @@ void allow_fd_caching( struct fd *fd )
     fd->cacheable = 1;
 }
 
+/* invalidate the client-side cached copies of an fd */
+void invalidate_fd_cache( struct fd *fd )
+{
+    if (fd->cache_slot) fd_cache_generations[fd->cache_slot]++;
+}
+
 /* check if fd is on a removable device */
 int is_fd_removable( struct fd *fd )
 {
@@ -2519,6 +2666,18 @@ DECL_HANDLER(get_handle_fd)
     {
         int unix_fd = get_unix_fd( fd );
         reply->cacheable = fd->cacheable;
+        /* the client can still cache it, as long as the generation counter doesn't change;
+         * overlapped fds need one too so that a later completion port association is noticed */
+        if (!fd->cache_slot && (!fd->cacheable || (is_fd_overlapped( fd ) && !fd->completion)))
+            fd->cache_slot = alloc_fd_cache_slot();
+        if (fd->cache_slot)
+        {
+            reply->cache_slot = fd->cache_slot;
+            reply->cache_generation = fd_cache_generations[fd->cache_slot];
+        }
+        /* without a counter the client wouldn't notice a later association */
+        else if (is_fd_overlapped( fd ) && !fd->completion) reply->cacheable = 0;
+        reply->completion = (fd->completion != NULL);
         if (unix_fd != -1)
         {
             reply->type = fd->fd_ops->get_fd_type( fd );
@@ -2530,6 +2689,25 @@ DECL_HANDLER(get_handle_fd)
     }
 }
 
+/* get the generation counters used to validate the client-side fd cache */
+DECL_HANDLER(get_fd_cache_info)
+{
+    struct process *process = current->process;
+
+    if (!fd_cache_mapping)
+    {
+        void *ptr;
+
+        if (!(fd_cache_mapping = create_shared_mapping( FD_CACHE_SLOTS * sizeof(*fd_cache_generations), &ptr )))
+            return;
+        make_object_static( fd_cache_mapping );
+        fd_cache_generations = ptr;
+    }
+    if (!process->fd_cache_slot) process->fd_cache_slot = alloc_fd_cache_slot();
+    reply->process_slot = process->fd_cache_slot;
+    reply->handle = alloc_handle( process, fd_cache_mapping, SECTION_MAP_READ | SECTION_QUERY, 0 );
+}
+
 /* perform a read on a file object */
 DECL_HANDLER(read)
 {
@@ -2624,6 +2802,8 @@ DECL_HANDLER(set_completion_info)
         {
             fd->completion = get_completion_obj( current->process, req->chandle, IO_COMPLETION_MODIFY_STATE );
             fd->comp_key = req->ckey;
+            /* cached copies of the fd in all processes may assume that there is no port */
+            if (fd->completion) invalidate_fd_cache( fd );
         }
         else set_error( STATUS_INVALID_PARAMETER );
         release_object( fd );
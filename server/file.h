@@ -98,6 +98,10 @@ extern void set_fd_events( struct fd *fd, int events );
 extern obj_handle_t lock_fd( struct fd *fd, file_pos_t offset, file_pos_t count, int shared, int wait );
 extern void unlock_fd( struct fd *fd, file_pos_t offset, file_pos_t count );
 extern void allow_fd_caching( struct fd *fd );
+extern void invalidate_fd_cache( struct fd *fd );
+extern unsigned int alloc_fd_cache_slot(void);
+extern void free_fd_cache_slot( unsigned int slot );
+extern void invalidate_fd_cache_slot( unsigned int slot );
 extern void set_fd_signaled( struct fd *fd, int signaled );
 extern int is_fd_signaled( struct fd *fd );
 extern char *dup_fd_name( struct fd *root, const char *name );
@@ -137,6 +141,7 @@ typedef void (*timeout_callback)( void *private );
 extern struct timeout_user *add_timeout_user( timeout_t when, timeout_callback func, void *private );
 extern void remove_timeout_user( struct timeout_user *user );
 extern const char *get_timeout_str( timeout_t timeout );
+extern void dump_timeout_stats(void);
 
 /* file functions */
 
@@ -158,6 +163,8 @@ extern struct file *get_mapping_file( struct process *process, client_ptr_t base
                                       unsigned int access, unsigned int sharing );
 extern void free_mapped_views( struct process *process );
 extern int get_page_size(void);
+extern int create_temp_file( file_pos_t size );
+extern struct object *create_shared_mapping( mem_size_t size, void **ptr );
 
 /* device functions */
 
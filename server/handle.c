@@ -33,6 +33,7 @@
 #include "windef.h"
 #include "winternl.h"
 
+#include "file.h"
 #include "handle.h"
 #include "process.h"
 #include "thread.h"
@@ -42,17 +43,24 @@
 struct handle_entry
 {
     struct object *ptr;       /* object */
-    unsigned int   access;    /* access rights */
+    unsigned int   access;    /* access rights, or index of the next free entry if ptr is NULL */
 };
 
+#define MIN_HANDLE_ENTRIES  32
+#define MAX_HANDLE_ENTRIES  0x00ffffff
+
+/* the entries are allocated in segments that never move, the first two segments
+ * have MIN_HANDLE_ENTRIES entries and each following one is twice as large */
+#define HANDLE_SEGMENTS     20  /* enough for MAX_HANDLE_ENTRIES */
+
 struct handle_table
 {
     struct object        obj;         /* object header */
     struct process      *process;     /* process owning this table */
     int                  count;       /* number of allocated entries */
-    int                  last;        /* last used entry */
-    int                  free;        /* first entry that may be free */
-    struct handle_entry *entries;     /* handle entries */
+    int                  last;        /* last entry that has been used */
+    int                  free;        /* first entry in the list of free entries, or -1 */
+    struct handle_entry *segments[HANDLE_SEGMENTS];  /* handle entries */
 };
 
 static struct handle_table *global_table;
@@ -63,9 +71,6 @@ static struct handle_table *global_table;
 #define RESERVED_CLOSE_PROTECT (HANDLE_FLAG_PROTECT_FROM_CLOSE << RESERVED_SHIFT)
 #define RESERVED_ALL           (RESERVED_INHERIT | RESERVED_CLOSE_PROTECT)
 
-#define MIN_HANDLE_ENTRIES  32
-#define MAX_HANDLE_ENTRIES  0x00ffffff
-
 
 /* handle to table index conversion */
 
@@ -79,6 +84,39 @@ static inline int handle_to_index( obj_handle_t handle )
     return (handle >> 2) - 1;
 }
 
+/* table index to segment conversion */
+
+static inline int get_highest_bit( unsigned int x )
+{
+#ifdef __GNUC__
+    return 31 - __builtin_clz( x );
+#else
+    int ret = 0;
+    while (x >>= 1) ret++;
+    return ret;
+#endif
+}
+static inline int get_segment( int index )
+{
+    if (index < MIN_HANDLE_ENTRIES) return 0;
+    return get_highest_bit( index / MIN_HANDLE_ENTRIES ) + 1;
+}
+static inline int get_segment_start( int segment )
+{
+    return segment ? MIN_HANDLE_ENTRIES << (segment - 1) : 0;
+}
+static inline int get_segment_size( int segment )
+{
+    return segment ? MIN_HANDLE_ENTRIES << (segment - 1) : MIN_HANDLE_ENTRIES;
+}
+
+/* the entry must have been allocated already */
+static inline struct handle_entry *get_table_entry( struct handle_table *table, int index )
+{
+    int segment = get_segment( index );
+    return table->segments[segment] + index - get_segment_start( segment );
+}
+
 /* global handle conversion */
 
 #define HANDLE_OBFUSCATOR 0x544a4def
@@ -149,9 +187,9 @@ static void handle_table_dump( struct object *obj, int verbose )
     fprintf( stderr, "Handle table last=%d count=%d process=%p\n",
              table->last, table->count, table->process );
     if (!verbose) return;
-    entry = table->entries;
-    for (i = 0; i <= table->last; i++, entry++)
+    for (i = 0; i <= table->last; i++)
     {
+        entry = get_table_entry( table, i );
         if (!entry->ptr) continue;
         fprintf( stderr, "    %04x: %p %08x ",
                  index_to_handle(i), entry->ptr, entry->access );
@@ -172,20 +210,22 @@ static void handle_table_destroy( struct object *obj )
     /* first notify all objects that handles are being closed */
     if (table->process)
     {
-        for (i = 0, entry = table->entries; i <= table->last; i++, entry++)
+        for (i = 0; i <= table->last; i++)
         {
-            struct object *obj = entry->ptr;
+            struct object *obj = get_table_entry( table, i )->ptr;
             if (obj) obj->ops->close_handle( obj, table->process, index_to_handle(i) );
         }
     }
 
-    for (i = 0, entry = table->entries; i <= table->last; i++, entry++)
+    for (i = 0; i <= table->last; i++)
     {
-        struct object *obj = entry->ptr;
+        struct object *obj;
+        entry = get_table_entry( table, i );
+        obj = entry->ptr;
         entry->ptr = NULL;
         if (obj) release_object_from_handle( obj );
     }
-    free( table->entries );
+    for (i = 0; i < HANDLE_SEGMENTS; i++) free( table->segments[i] );
 }
 
 /* close all the process handles and free the handle table */
@@ -197,60 +237,85 @@ void close_process_handles( struct process *process )
     if (table) release_object( table );
 }
 
+/* grow a handle table by allocating its next segment */
+/* the existing entries don't move, so lookups don't need to be protected against growing */
+static int grow_handle_table( struct handle_table *table )
+{
+    struct handle_entry *entries;
+    int segment = get_segment( table->count );
+
+    if (segment >= HANDLE_SEGMENTS ||
+        !(entries = calloc( get_segment_size( segment ), sizeof(*entries) )))
+    {
+        set_error( STATUS_INSUFFICIENT_RESOURCES );
+        return 0;
+    }
+    interlocked_xchg_ptr( (void **)&table->segments[segment], entries );
+    table->count += get_segment_size( segment );
+    return 1;
+}
+
 /* allocate a new handle table */
 struct handle_table *alloc_handle_table( struct process *process, int count )
 {
     struct handle_table *table;
 
-    if (count < MIN_HANDLE_ENTRIES) count = MIN_HANDLE_ENTRIES;
     if (!(table = alloc_object( &handle_table_ops )))
         return NULL;
     table->process = process;
-    table->count   = count;
+    table->count   = 0;
     table->last    = -1;
-    table->free    = 0;
-    if ((table->entries = mem_alloc( count * sizeof(*table->entries) ))) return table;
-    release_object( table );
-    return NULL;
-}
-
-/* grow a handle table */
-static int grow_handle_table( struct handle_table *table )
-{
-    struct handle_entry *new_entries;
-    int count = min( table->count * 2, MAX_HANDLE_ENTRIES );
-
-    if (count == table->count ||
-        !(new_entries = realloc( table->entries, count * sizeof(struct handle_entry) )))
+    table->free    = -1;
+    memset( table->segments, 0, sizeof(table->segments) );
+    while (table->count < max( count, MIN_HANDLE_ENTRIES ))
     {
-        set_error( STATUS_INSUFFICIENT_RESOURCES );
-        return 0;
+        if (!grow_handle_table( table ))
+        {
+            release_object( table );
+            return NULL;
+        }
     }
-    table->entries = new_entries;
-    table->count   = count;
-    return 1;
+    return table;
 }
 
-/* allocate the first free entry in the handle table */
+/* allocate a free entry in the handle table */
 static obj_handle_t alloc_entry( struct handle_table *table, void *obj, unsigned int access )
 {
-    struct handle_entry *entry = table->entries + table->free;
+    struct handle_entry *entry;
     int i;
 
-    for (i = table->free; i <= table->last; i++, entry++) if (!entry->ptr) goto found;
-    if (i >= table->count)
+    if ((i = table->free) != -1)  /* reuse the last freed entry */
     {
-        if (!grow_handle_table( table )) return 0;
-        entry = table->entries + i;  /* the entries may have moved */
+        entry = get_table_entry( table, i );
+        table->free = entry->access;
+    }
+    else
+    {
+        i = table->last + 1;
+        if (i >= MAX_HANDLE_ENTRIES)
+        {
+            set_error( STATUS_INSUFFICIENT_RESOURCES );
+            return 0;
+        }
+        if (i >= table->count && !grow_handle_table( table )) return 0;
+        entry = get_table_entry( table, i );
+        table->last = i;
     }
-    table->last = i;
- found:
-    table->free = i + 1;
-    entry->ptr    = grab_object_for_handle( obj );
     entry->access = access;
+    entry->ptr    = grab_object_for_handle( obj );
     return index_to_handle(i);
 }
 
+/* add an entry to the free list */
+static void free_entry( struct handle_table *table, int index )
+{
+    struct handle_entry *entry = get_table_entry( table, index );
+
+    entry->ptr = NULL;
+    entry->access = table->free;
+    table->free = index;
+}
+
 /* allocate a handle for an object, incrementing its refcount */
 static obj_handle_t alloc_handle_entry( struct process *process, void *ptr,
                                         unsigned int access, unsigned int attr )
@@ -326,32 +391,11 @@ static struct handle_entry *get_handle( struct process *process, obj_handle_t ha
     index = handle_to_index( handle );
     if (index < 0) return NULL;
     if (index > table->last) return NULL;
-    entry = table->entries + index;
+    entry = get_table_entry( table, index );
     if (!entry->ptr) return NULL;
     return entry;
 }
 
-/* attempt to shrink a table */
-static void shrink_handle_table( struct handle_table *table )
-{
-    struct handle_entry *entry = table->entries + table->last;
-    struct handle_entry *new_entries;
-    int count = table->count;
-
-    while (table->last >= 0)
-    {
-        if (entry->ptr) break;
-        table->last--;
-        entry--;
-    }
-    if (table->last >= count / 4) return;  /* no need to shrink */
-    if (count < MIN_HANDLE_ENTRIES * 2) return;  /* too small to shrink */
-    count /= 2;
-    if (!(new_entries = realloc( table->entries, count * sizeof(*new_entries) ))) return;
-    table->count   = count;
-    table->entries = new_entries;
-}
-
 /* copy the handle table of the parent process */
 /* return 1 if OK, 0 on error */
 struct handle_table *copy_handle_table( struct process *process, struct process *parent )
@@ -363,22 +407,29 @@ struct handle_table *copy_handle_table( struct process *process, struct process
     assert( parent_table );
     assert( parent_table->obj.ops == &handle_table_ops );
 
-    if (!(table = alloc_handle_table( process, parent_table->count )))
+    if (!(table = alloc_handle_table( process, 0 )))
         return NULL;
 
-    if ((table->last = parent_table->last) >= 0)
+    for (i = 0; i <= parent_table->last; i++)
     {
-        struct handle_entry *ptr = table->entries;
-        memcpy( ptr, parent_table->entries, (table->last + 1) * sizeof(struct handle_entry) );
-        for (i = 0; i <= table->last; i++, ptr++)
+        struct handle_entry *ptr = get_table_entry( parent_table, i );
+
+        if (!ptr->ptr || !(ptr->access & RESERVED_INHERIT)) continue;  /* don't inherit this entry */
+        while (i >= table->count)
         {
-            if (!ptr->ptr) continue;
-            if (ptr->access & RESERVED_INHERIT) grab_object_for_handle( ptr->ptr );
-            else ptr->ptr = NULL; /* don't inherit this entry */
+            if (!grow_handle_table( table ))
+            {
+                release_object( table );
+                return NULL;
+            }
         }
+        *get_table_entry( table, i ) = *ptr;
+        grab_object_for_handle( ptr->ptr );
+        table->last = i;
     }
-    /* attempt to shrink the table */
-    shrink_handle_table( table );
+    /* the free list starts with the lowest entries */
+    for (i = table->last; i >= 0; i--)
+        if (!get_table_entry( table, i )->ptr) free_entry( table, i );
     return table;
 }
 
@@ -388,15 +439,26 @@ unsigned int close_handle( struct process *process, obj_handle_t handle )
     struct handle_table *table;
     struct handle_entry *entry;
     struct object *obj;
+    int index;
 
     if (!(entry = get_handle( process, handle ))) return STATUS_INVALID_HANDLE;
     if (entry->access & RESERVED_CLOSE_PROTECT) return STATUS_HANDLE_NOT_CLOSABLE;
     obj = entry->ptr;
     if (!obj->ops->close_handle( obj, process, handle )) return STATUS_HANDLE_NOT_CLOSABLE;
-    entry->ptr = NULL;
-    table = handle_is_global(handle) ? global_table : process->handles;
-    if (entry < table->entries + table->free) table->free = entry - table->entries;
-    if (entry == table->entries + table->last) shrink_handle_table( table );
+    /* the process doesn't know about it, make it drop its cached fds */
+    if (process->fd_cache_slot && (!current || current->process != process))
+        invalidate_fd_cache_slot( process->fd_cache_slot );
+    if (handle_is_global(handle))
+    {
+        table = global_table;
+        index = handle_to_index( handle_global_to_local(handle) );
+    }
+    else
+    {
+        table = process->handles;
+        index = handle_to_index( handle );
+    }
+    free_entry( table, index );
     release_object_from_handle( obj );
     return STATUS_SUCCESS;
 }
@@ -476,8 +538,9 @@ obj_handle_t find_inherited_handle( struct process *process, const struct object
 
     if (!table) return 0;
 
-    for (i = 0, ptr = table->entries; i <= table->last; i++, ptr++)
+    for (i = 0; i <= table->last; i++)
     {
+        ptr = get_table_entry( table, i );
         if (!ptr->ptr) continue;
         if (ptr->ptr->ops != ops) continue;
         if (ptr->access & RESERVED_INHERIT) return index_to_handle(i);
@@ -496,8 +559,9 @@ obj_handle_t enumerate_handles( struct process *process, const struct object_ops
 
     if (!table) return 0;
 
-    for (i = *index, entry = &table->entries[i]; i <= table->last; i++, entry++)
+    for (i = *index; (int)i <= table->last; i++)
     {
+        entry = get_table_entry( table, i );
         if (!entry->ptr) continue;
         if (entry->ptr->ops != ops) continue;
         *index = i + 1;
@@ -618,6 +682,24 @@ unsigned int get_handle_table_count( struct process *process )
     return process->handles->count;
 }
 
+/* retrieve the handle table usage of a process */
+DECL_HANDLER(get_handle_table_info)
+{
+    struct process *process;
+    struct handle_table *table;
+    int i;
+
+    if (!(process = get_process_from_handle( req->handle, PROCESS_QUERY_LIMITED_INFORMATION ))) return;
+    if ((table = process->handles))
+    {
+        for (i = 0; i <= table->last; i++)
+            if (get_table_entry( table, i )->ptr) reply->count++;
+        reply->entries = table->count;
+        reply->size = sizeof(*table) + table->count * sizeof(struct handle_entry);
+    }
+    release_object( process );
+}
+
 /* close a handle */
 DECL_HANDLER(close_handle)
 {
@@ -794,8 +876,9 @@ static int enum_handles( struct process *process, void *user )
     if (!table)
         return 0;
 
-    for (i = 0, entry = table->entries; i <= table->last; i++, entry++)
+    for (i = 0; (int)i <= table->last; i++)
     {
+        entry = get_table_entry( table, i );
         if (!entry->ptr) continue;
         if (!info->handle)
         {
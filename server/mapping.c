@@ -117,6 +117,45 @@ static const struct object_ops shared_map_ops =
 
 static struct list shared_map_list = LIST_INIT( shared_map_list );
 
+/* page-aligned copy of the sections of a PE image that are not page-aligned in the file */
+struct image_layout
+{
+    struct object   obj;             /* object header */
+    struct file    *file;            /* temp file holding the sections at their RVA */
+    dev_t           dev;             /* device of the PE file */
+    ino_t           ino;             /* inode of the PE file */
+    time_t          mtime;           /* modification time of the PE file */
+    off_t           size;            /* size of the PE file */
+    struct list     entry;           /* entry in global image layouts list */
+};
+
+static void image_layout_dump( struct object *obj, int verbose );
+static void image_layout_destroy( struct object *obj );
+
+static const struct object_ops image_layout_ops =
+{
+    sizeof(struct image_layout), /* size */
+    image_layout_dump,           /* dump */
+    no_get_type,                 /* get_type */
+    no_add_queue,                /* add_queue */
+    NULL,                        /* remove_queue */
+    NULL,                        /* signaled */
+    NULL,                        /* satisfied */
+    no_signal,                   /* signal */
+    no_get_fd,                   /* get_fd */
+    no_map_access,               /* map_access */
+    default_get_sd,              /* get_sd */
+    default_set_sd,              /* set_sd */
+    no_lookup_name,              /* lookup_name */
+    no_link_name,                /* link_name */
+    NULL,                        /* unlink_name */
+    no_open_file,                /* open_file */
+    no_close_handle,             /* close_handle */
+    image_layout_destroy         /* destroy */
+};
+
+static struct list image_layout_list = LIST_INIT( image_layout_list );
+
 /* memory view mapped in client address space */
 struct memory_view
 {
@@ -124,6 +163,7 @@ struct memory_view
     struct fd      *fd;              /* fd for mapped file */
     struct ranges  *committed;       /* list of committed ranges in this mapping */
     struct shared_map *shared;       /* temp file for shared PE mapping */
+    struct image_layout *layout;     /* page-aligned layout of the PE sections */
     unsigned int    flags;           /* SEC_* flags */
     client_ptr_t    base;            /* view base address (in process addr space) */
     mem_size_t      size;            /* view size */
@@ -139,6 +179,7 @@ struct mapping
     pe_image_info_t image;           /* image info (for PE image mapping) */
     struct ranges  *committed;       /* list of committed ranges in this mapping */
     struct shared_map *shared;       /* temp file for shared PE mapping */
+    struct image_layout *layout;     /* page-aligned layout of the PE sections */
 };
 
 static void mapping_dump( struct object *obj, int verbose );
@@ -217,6 +258,21 @@ static void shared_map_destroy( struct object *obj )
     list_remove( &shared->entry );
 }
 
+static void image_layout_dump( struct object *obj, int verbose )
+{
+    struct image_layout *layout = (struct image_layout *)obj;
+    fprintf( stderr, "Image layout file=%p dev=%lx ino=%lx\n", layout->file,
+             (unsigned long)layout->dev, (unsigned long)layout->ino );
+}
+
+static void image_layout_destroy( struct object *obj )
+{
+    struct image_layout *layout = (struct image_layout *)obj;
+
+    release_object( layout->file );
+    list_remove( &layout->entry );
+}
+
 /* extend a file beyond the current end of file */
 static int grow_file( int unix_fd, file_pos_t new_size )
 {
@@ -259,7 +315,7 @@ static int check_current_dir_for_exec(void)
 }
 
 /* create a temp file for anonymous mappings */
-static int create_temp_file( file_pos_t size )
+int create_temp_file( file_pos_t size )
 {
     static int temp_dir_fd = -1;
     char tmpfn[] = "anonmap.XXXXXX";
@@ -313,6 +369,7 @@ static void free_memory_view( struct memory_view *view )
     if (view->fd) release_object( view->fd );
     if (view->committed) release_object( view->committed );
     if (view->shared) release_object( view->shared );
+    if (view->layout) release_object( view->layout );
     list_remove( &view->entry );
     free( view );
 }
@@ -522,6 +579,113 @@ static int build_shared_mapping( struct mapping *mapping, int fd,
     return 0;
 }
 
+/* find a cached image layout for a given PE file */
+static struct image_layout *get_image_layout( const struct stat *st )
+{
+    struct image_layout *ptr;
+
+    LIST_FOR_EACH_ENTRY( ptr, &image_layout_list, struct image_layout, entry )
+        if (ptr->dev == st->st_dev && ptr->ino == st->st_ino &&
+            ptr->mtime == st->st_mtime && ptr->size == st->st_size)
+            return (struct image_layout *)grab_object( ptr );
+    return NULL;
+}
+
+/* check if a section can be mapped directly from the PE file */
+static inline int is_section_page_aligned( const IMAGE_SECTION_HEADER *sec )
+{
+    size_t map_size, file_size;
+    off_t file_start;
+
+    if ((sec->Characteristics & IMAGE_SCN_MEM_SHARED) &&
+        (sec->Characteristics & IMAGE_SCN_MEM_WRITE)) return 1;  /* uses the shared mapping */
+    get_section_sizes( sec, &map_size, &file_start, &file_size );
+    if (!sec->PointerToRawData || !file_size) return 1;
+    return !(file_start & page_mask);
+}
+
+/* copy the sections that are not page-aligned in the file into a temp file at their RVA,
+ * so that all processes mapping the image share the same pages instead of reading them */
+static void build_image_layout( struct mapping *mapping, int fd,
+                                IMAGE_SECTION_HEADER *sec, unsigned int nb_sec )
+{
+    static const unsigned int sector_align = 0x1ff;
+    struct image_layout *layout;
+    struct file *file;
+    struct stat st;
+    unsigned int i;
+    size_t file_size, map_size, max_size;
+    off_t file_start, end, read_pos;
+    char *buffer = NULL;
+    int layout_fd;
+    long toread;
+
+    if (mapping->image.image_flags & IMAGE_FLAGS_ImageMappedFlat) return;
+    if (fstat( fd, &st ) == -1) return;
+
+    max_size = 0;
+    for (i = 0; i < nb_sec; i++)
+    {
+        if (is_section_page_aligned( &sec[i] )) continue;
+        get_section_sizes( &sec[i], &map_size, &file_start, &file_size );
+        end = file_start + file_size;
+        /* leave invalid images to the client, it will report the error */
+        if (sec[i].VirtualAddress > mapping->image.map_size ||
+            file_size > mapping->image.map_size - sec[i].VirtualAddress) return;
+        if (sec[i].PointerToRawData >= st.st_size ||
+            end > ((st.st_size + sector_align) & ~sector_align) || end < file_start) return;
+        if (file_size > max_size) max_size = file_size;
+    }
+    if (!max_size) return;  /* nothing to do */
+
+    if ((mapping->layout = get_image_layout( &st ))) return;
+
+    if ((layout_fd = create_temp_file( mapping->image.map_size )) == -1 ||
+        !(file = create_file_for_fd( layout_fd, FILE_GENERIC_READ, 0 )))
+    {
+        clear_error();
+        return;
+    }
+
+    if (!(buffer = malloc( max_size ))) goto error;
+
+    for (i = 0; i < nb_sec; i++)
+    {
+        if (is_section_page_aligned( &sec[i] )) continue;
+        get_section_sizes( &sec[i], &map_size, &read_pos, &file_size );
+        toread = file_size;
+        while (toread)
+        {
+            long res = pread( fd, buffer + file_size - toread, toread, read_pos );
+            if (!res && toread < 0x200)  /* partial sector at EOF is not an error */
+            {
+                file_size -= toread;
+                break;
+            }
+            if (res <= 0) goto error;
+            toread -= res;
+            read_pos += res;
+        }
+        if (pwrite( layout_fd, buffer, file_size, sec[i].VirtualAddress ) != file_size) goto error;
+    }
+
+    if (!(layout = alloc_object( &image_layout_ops ))) goto error;
+    layout->file  = file;
+    layout->dev   = st.st_dev;
+    layout->ino   = st.st_ino;
+    layout->mtime = st.st_mtime;
+    layout->size  = st.st_size;
+    list_add_head( &image_layout_list, &layout->entry );
+    mapping->layout = layout;
+    free( buffer );
+    return;
+
+ error:  /* not fatal, the client will read the sections itself */
+    release_object( file );
+    free( buffer );
+    clear_error();
+}
+
 /* load the CLR header from its section */
 static int load_clr_header( IMAGE_COR20_HEADER *hdr, size_t va, size_t size, int unix_fd,
                             IMAGE_SECTION_HEADER *sec, unsigned int nb_sec )
@@ -732,6 +896,7 @@ static unsigned int get_image_params( struct mapping *mapping, file_pos_t file_s
     if (!build_shared_mapping( mapping, unix_fd, sec, nt.FileHeader.NumberOfSections ))
         return STATUS_INVALID_FILE_FOR_SECTION;
 
+    build_image_layout( mapping, unix_fd, sec, nt.FileHeader.NumberOfSections );
     return STATUS_SUCCESS;
 }
 
@@ -793,6 +958,7 @@ static struct object *create_mapping( struct object *root, const struct unicode_
     mapping->size        = size;
     mapping->fd          = NULL;
     mapping->shared      = NULL;
+    mapping->layout      = NULL;
     mapping->committed   = NULL;
 
     if (!(mapping->flags = get_mapping_flags( handle, flags ))) goto error;
@@ -870,6 +1036,23 @@ static struct object *create_mapping( struct object *root, const struct unicode_
     return NULL;
 }
 
+/* create an anonymous mapping that is also mapped read/write in the server address space */
+struct object *create_shared_mapping( mem_size_t size, void **ptr )
+{
+    struct mapping *mapping;
+
+    if (!(mapping = (struct mapping *)create_mapping( NULL, NULL, 0, size, SEC_COMMIT, 0, 0, NULL )))
+        return NULL;
+    *ptr = mmap( NULL, mapping->size, PROT_READ | PROT_WRITE, MAP_SHARED, get_unix_fd( mapping->fd ), 0 );
+    if (*ptr == MAP_FAILED)
+    {
+        file_set_error();
+        release_object( mapping );
+        return NULL;
+    }
+    return &mapping->obj;
+}
+
 struct mapping *get_mapping_obj( struct process *process, obj_handle_t handle, unsigned int access )
 {
     return (struct mapping *)get_handle_obj( process, handle, access, &mapping_ops );
@@ -923,6 +1106,7 @@ static void mapping_destroy( struct object *obj )
     if (mapping->fd) release_object( mapping->fd );
     if (mapping->committed) release_object( mapping->committed );
     if (mapping->shared) release_object( mapping->shared );
+    if (mapping->layout) release_object( mapping->layout );
 }
 
 static enum server_fd_type mapping_get_fd_type( struct fd *fd )
@@ -991,6 +1175,8 @@ DECL_HANDLER(get_mapping_info)
     if (mapping->shared)
         reply->shared_file = alloc_handle( current->process, mapping->shared->file,
                                            GENERIC_READ|GENERIC_WRITE, 0 );
+    if (mapping->layout)
+        reply->image_file = alloc_handle( current->process, mapping->layout->file, GENERIC_READ, 0 );
     release_object( mapping );
 }
 
@@ -1042,6 +1228,7 @@ DECL_HANDLER(map_view)
         view->fd        = !is_fd_removable( mapping->fd ) ? (struct fd *)grab_object( mapping->fd ) : NULL;
         view->committed = mapping->committed ? (struct ranges *)grab_object( mapping->committed ) : NULL;
         view->shared    = mapping->shared ? (struct shared_map *)grab_object( mapping->shared ) : NULL;
+        view->layout    = mapping->layout ? (struct image_layout *)grab_object( mapping->layout ) : NULL;
         list_add_tail( &current->process->views, &view->entry );
     }
 
@@ -24,10 +24,20 @@
 #include "wine/port.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#include <sys/ioctl.h>
+#ifdef HAVE_SYS_FILIO_H
+# include <sys/filio.h>
+#endif
+#include <unistd.h>
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -63,6 +73,7 @@ struct pipe_end
     process_id_t         client_pid; /* process that created the client */
     process_id_t         server_pid; /* process that created the server */
     data_size_t          buffer_size;/* size of buffered data that doesn't block caller */
+    int                  direct;     /* data is exchanged through a socket instead of the queue */
     struct list          message_queue;
     struct async_queue   read_q;     /* read queue */
     struct async_queue   write_q;    /* write queue */
@@ -86,6 +97,7 @@ struct named_pipe
     unsigned int        insize;
     unsigned int        instances;
     timeout_t           timeout;
+    int                 direct;      /* connect the ends with a socketpair */
     struct list         servers;     /* list of servers using this pipe */
     struct async_queue  waiters;     /* list of clients waiting to connect */
 };
@@ -143,6 +155,7 @@ static int pipe_end_read( struct fd *fd, struct async *async, file_pos_t pos );
 static int pipe_end_write( struct fd *fd, struct async *async_data, file_pos_t pos );
 static int pipe_end_flush( struct fd *fd, struct async *async );
 static void pipe_end_get_volume_info( struct fd *fd, unsigned int info_class );
+static void pipe_end_queue_async( struct fd *fd, struct async *async, int type, int count );
 static void pipe_end_reselect_async( struct fd *fd, struct async_queue *queue );
 static void pipe_end_get_file_info( struct fd *fd, obj_handle_t handle, unsigned int info_class );
 
@@ -184,7 +197,7 @@ static const struct fd_ops pipe_server_fd_ops =
     pipe_end_get_file_info,       /* get_file_info */
     pipe_end_get_volume_info,     /* get_volume_info */
     pipe_server_ioctl,            /* ioctl */
-    no_fd_queue_async,            /* queue_async */
+    pipe_end_queue_async,         /* queue_async */
     pipe_end_reselect_async       /* reselect_async */
 };
 
@@ -225,7 +238,7 @@ static const struct fd_ops pipe_client_fd_ops =
     pipe_end_get_file_info,       /* get_file_info */
     pipe_end_get_volume_info,     /* get_volume_info */
     pipe_client_ioctl,            /* ioctl */
-    no_fd_queue_async,            /* queue_async */
+    pipe_end_queue_async,         /* queue_async */
     pipe_end_reselect_async       /* reselect_async */
 };
 
@@ -378,6 +391,58 @@ static void free_message( struct pipe_message *message )
     free( message );
 }
 
+/* switch a pipe end to a new fd, a socket for direct transfers or a pseudo fd if unix_fd is -1 */
+static int set_pipe_end_fd( struct pipe_end *pipe_end, int unix_fd )
+{
+    const struct fd_ops *ops = pipe_end->obj.ops == &pipe_server_ops ? &pipe_server_fd_ops : &pipe_client_fd_ops;
+    struct fd *fd;
+
+    if (unix_fd != -1) fd = create_anonymous_fd( ops, unix_fd, &pipe_end->obj, get_fd_options( pipe_end->fd ) );
+    else fd = alloc_pseudo_fd( ops, &pipe_end->obj, get_fd_options( pipe_end->fd ) );
+    if (!fd) return 0;
+
+    fd_copy_completion( pipe_end->fd, fd );
+    set_fd_signaled( fd, is_fd_signaled( pipe_end->fd ));
+    /* the client-side caches must not keep using the old fd */
+    invalidate_fd_cache( pipe_end->fd );
+    release_object( pipe_end->fd );
+    pipe_end->fd = fd;
+    pipe_end->direct = (unix_fd != -1);
+    return 1;
+}
+
+/* connect the ends of a direct pipe through a socketpair, leaving them alone on failure */
+static void connect_direct_pipe( struct pipe_end *server, struct pipe_end *client )
+{
+    static const int buffer_size = 256 * 1024;
+    int fds[2];
+
+    if (socketpair( PF_UNIX, server->pipe->message_mode ? SOCK_SEQPACKET : SOCK_STREAM, 0, fds ) == -1)
+        return;
+
+    fcntl( fds[0], F_SETFL, O_NONBLOCK );
+    fcntl( fds[1], F_SETFL, O_NONBLOCK );
+    /* the send buffer size also limits the size of a message */
+    setsockopt( fds[0], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size) );
+    setsockopt( fds[1], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size) );
+
+    if (!set_pipe_end_fd( server, fds[0] ))
+    {
+        close( fds[1] );
+        return;
+    }
+    if (!set_pipe_end_fd( client, fds[1] )) set_pipe_end_fd( server, -1 );
+}
+
+/* stop a direct pipe end from transferring data and switch it back to a pseudo fd */
+static void disconnect_direct_pipe( struct pipe_end *pipe_end, unsigned int status )
+{
+    shutdown( get_unix_fd( pipe_end->fd ), SHUT_RDWR );
+    fd_async_wake_up( pipe_end->fd, ASYNC_TYPE_READ, status );
+    fd_async_wake_up( pipe_end->fd, ASYNC_TYPE_WRITE, status );
+    set_pipe_end_fd( pipe_end, -1 );
+}
+
 static void pipe_end_disconnect( struct pipe_end *pipe_end, unsigned int status )
 {
     struct pipe_end *connection = pipe_end->connection;
@@ -388,6 +453,8 @@ static void pipe_end_disconnect( struct pipe_end *pipe_end, unsigned int status
 
     pipe_end->state = status == STATUS_PIPE_DISCONNECTED
         ? FILE_PIPE_DISCONNECTED_STATE : FILE_PIPE_CLOSING_STATE;
+    /* on a broken pipe, the data already sent can still be read from the socket */
+    if (pipe_end->direct && status == STATUS_PIPE_DISCONNECTED) disconnect_direct_pipe( pipe_end, status );
     fd_async_wake_up( pipe_end->fd, ASYNC_TYPE_WAIT, status );
     async_wake_up( &pipe_end->read_q, status );
     LIST_FOR_EACH_ENTRY_SAFE( message, next, &pipe_end->message_queue, struct pipe_message, entry )
@@ -412,6 +479,8 @@ static void pipe_end_destroy( struct object *obj )
     struct pipe_end *pipe_end = (struct pipe_end *)obj;
     struct pipe_message *message;
 
+    /* let the other end see the end of the stream, even if a copy of our socket is still open */
+    if (pipe_end->direct) shutdown( get_unix_fd( pipe_end->fd ), SHUT_RDWR );
     pipe_end_disconnect( pipe_end, STATUS_PIPE_BROKEN );
 
     while (!list_empty( &pipe_end->message_queue ))
@@ -899,10 +968,24 @@ static int pipe_end_write( struct fd *fd, struct async *async, file_pos_t pos )
     return 1;
 }
 
+static void pipe_end_queue_async( struct fd *fd, struct async *async, int type, int count )
+{
+    struct pipe_end *pipe_end = get_fd_user( fd );
+
+    /* direct pipe ends wait for the socket, the others go through pipe_end_read/write */
+    if (pipe_end->direct) default_fd_queue_async( fd, async, type, count );
+    else no_fd_queue_async( fd, async, type, count );
+}
+
 static void pipe_end_reselect_async( struct fd *fd, struct async_queue *queue )
 {
     struct pipe_end *pipe_end = get_fd_user( fd );
 
+    if (pipe_end->direct)
+    {
+        default_fd_reselect_async( fd, queue );
+        return;
+    }
     if (ignore_reselect) return;
 
     if (&pipe_end->write_q == queue)
@@ -913,9 +996,60 @@ static void pipe_end_reselect_async( struct fd *fd, struct async_queue *queue )
 
 static enum server_fd_type pipe_end_get_fd_type( struct fd *fd )
 {
+    struct pipe_end *pipe_end = get_fd_user( fd );
+
+    if (pipe_end->direct && pipe_end->pipe && pipe_end->pipe->message_mode) return FD_TYPE_MSG_PIPE;
     return FD_TYPE_PIPE;
 }
 
+/* peek at the data waiting in the socket of a direct pipe end */
+static int direct_pipe_peek( struct pipe_end *pipe_end, data_size_t reply_size )
+{
+    int unix_fd = get_unix_fd( pipe_end->fd );
+    FILE_PIPE_PEEK_BUFFER *buffer;
+    data_size_t message_length = 0;
+    int avail = 0, ret = 0;
+    char *data = NULL;
+
+    if (unix_fd == -1) return 0;
+    if (ioctl( unix_fd, FIONREAD, &avail ) == -1) avail = 0;
+    if (!avail && pipe_end->state == FILE_PIPE_CLOSING_STATE)
+    {
+        set_error( STATUS_PIPE_BROKEN );
+        return 0;
+    }
+
+    reply_size = min( reply_size, avail );
+    if (avail && pipe_end->pipe->message_mode)
+    {
+        message_length = avail;
+#ifdef MSG_TRUNC
+        /* FIONREAD counts all the pending messages, Linux can tell the size of the first one */
+        if ((ret = recv( unix_fd, NULL, 0, MSG_PEEK | MSG_TRUNC )) > 0) message_length = ret;
+#endif
+        reply_size = min( reply_size, message_length );
+    }
+
+    if (reply_size)
+    {
+        if (!(data = mem_alloc( reply_size ))) return 0;
+        if ((ret = recv( unix_fd, data, reply_size, MSG_PEEK )) == -1) ret = 0;
+        reply_size = ret;
+    }
+
+    if ((buffer = set_reply_data_size( offsetof( FILE_PIPE_PEEK_BUFFER, Data[reply_size] ))))
+    {
+        buffer->NamedPipeState    = pipe_end->state;
+        buffer->ReadDataAvailable = avail;
+        buffer->NumberOfMessages  = 0;  /* FIXME */
+        buffer->MessageLength     = message_length;
+        if (reply_size) memcpy( buffer->Data, data, reply_size );
+        if (message_length > reply_size) set_error( STATUS_BUFFER_OVERFLOW );
+    }
+    free( data );
+    return buffer != NULL;
+}
+
 static int pipe_end_peek( struct pipe_end *pipe_end )
 {
     unsigned reply_size = get_reply_max_size();
@@ -944,6 +1078,8 @@ static int pipe_end_peek( struct pipe_end *pipe_end )
         return 0;
     }
 
+    if (pipe_end->direct) return direct_pipe_peek( pipe_end, reply_size );
+
     LIST_FOR_EACH_ENTRY( message, &pipe_end->message_queue, struct pipe_message, entry )
         avail += message->iosb->in_size - message->read_pos;
     reply_size = min( reply_size, avail );
@@ -994,6 +1130,13 @@ static int pipe_end_transceive( struct pipe_end *pipe_end, struct async *async )
         return 0;
     }
 
+    /* transactions on direct pipes are done on the client side */
+    if (pipe_end->direct)
+    {
+        set_error( STATUS_NOT_SUPPORTED );
+        return 0;
+    }
+
     /* not allowed if we already have read data buffered */
     if (!list_empty( &pipe_end->message_queue ))
     {
@@ -1142,6 +1285,7 @@ static void init_pipe_end( struct pipe_end *pipe_end, struct named_pipe *pipe,
     pipe_end->flags = pipe_flags;
     pipe_end->connection = NULL;
     pipe_end->buffer_size = buffer_size;
+    pipe_end->direct = 0;
     init_async_queue( &pipe_end->read_q );
     init_async_queue( &pipe_end->write_q );
     list_init( &pipe_end->message_queue );
@@ -1168,7 +1312,8 @@ static struct pipe_server *create_pipe_server( struct named_pipe *pipe, unsigned
         release_object( server );
         return NULL;
     }
-    allow_fd_caching( server->pipe_end.fd );
+    /* the fd of a direct pipe is replaced on connection, so it can't be cached permanently */
+    if (!pipe->direct) allow_fd_caching( server->pipe_end.fd );
     set_fd_signaled( server->pipe_end.fd, 1 );
     return server;
 }
@@ -1191,7 +1336,7 @@ static struct pipe_end *create_pipe_client( struct named_pipe *pipe, data_size_t
         release_object( client );
         return NULL;
     }
-    allow_fd_caching( client->fd );
+    if (!pipe->direct) allow_fd_caching( client->fd );
     set_fd_signaled( client->fd, 1 );
 
     return client;
@@ -1263,6 +1408,7 @@ static struct object *named_pipe_open_file( struct object *obj, unsigned int acc
         client->connection = &server->pipe_end;
         server->pipe_end.client_pid = client->client_pid;
         client->server_pid = server->pipe_end.server_pid;
+        if (pipe->direct) connect_direct_pipe( &server->pipe_end, client );
     }
     release_object( server );
     return &client->obj;
@@ -1359,6 +1505,7 @@ DECL_HANDLER(create_named_pipe)
         pipe->maxinstances = req->maxinstances;
         pipe->timeout = req->timeout;
         pipe->message_mode = (req->flags & NAMED_PIPE_MESSAGE_STREAM_WRITE) != 0;
+        pipe->direct = (req->flags & NAMED_PIPE_DIRECT) != 0;
         pipe->sharing = req->sharing;
         if (sd) default_set_sd( &pipe->obj, sd, OWNER_SECURITY_INFORMATION |
                                                 GROUP_SECURITY_INFORMATION |
@@ -1382,7 +1529,7 @@ DECL_HANDLER(create_named_pipe)
         clear_error(); /* clear the name collision */
     }
 
-    server = create_pipe_server( pipe, req->options, req->flags );
+    server = create_pipe_server( pipe, req->options, req->flags & ~NAMED_PIPE_DIRECT );
     if (server)
     {
         reply->handle = alloc_handle( current->process, server, req->access, objattr->attributes );
@@ -411,7 +411,7 @@ struct object *grab_object( void *ptr )
 {
     struct object *obj = (struct object *)ptr;
     assert( obj->refcount < INT_MAX );
-    obj->refcount++;
+    interlocked_xchg_add( (int *)&obj->refcount, 1 );
     return obj;
 }
 
@@ -420,7 +420,7 @@ void release_object( void *ptr )
 {
     struct object *obj = (struct object *)ptr;
     assert( obj->refcount );
-    if (!--obj->refcount)
+    if (interlocked_xchg_add( (int *)&obj->refcount, -1 ) == 1)
     {
         assert( !obj->handle_count );
         /* if the refcount is 0, nobody can be in the wait queue */
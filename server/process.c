@@ -517,6 +517,7 @@ struct process *create_process( int fd, struct process *parent, int inherit_all,
     process->peb             = 0;
     process->ldt_copy        = 0;
     process->dir_cache       = NULL;
+    process->fd_cache_slot   = 0;
     process->winstation      = 0;
     process->desktop         = 0;
     process->token           = NULL;
@@ -619,6 +620,7 @@ static void process_destroy( struct object *obj )
     if (process->exe_file) release_object( process->exe_file );
     if (process->id) free_ptid( process->id );
     if (process->token) release_object( process->token );
+    if (process->fd_cache_slot) free_fd_cache_slot( process->fd_cache_slot );
     free( process->dir_cache );
 }
 
@@ -28,6 +28,9 @@
 #ifdef HAVE_POLL_H
 # include <poll.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -140,6 +143,8 @@ struct msg_queue
     struct thread_input   *input;           /* thread input descriptor */
     struct hook_table     *hooks;           /* hook table */
     timeout_t              last_get_msg;    /* time of last get message call */
+    struct object         *shared_mapping;  /* mapping for the state shared with the client */
+    volatile struct queue_shared *shared;   /* state shared with the client */
 };
 
 struct hotkey
@@ -298,6 +303,8 @@ static struct msg_queue *create_msg_queue( struct thread *thread, struct thread_
         queue->input           = (struct thread_input *)grab_object( input );
         queue->hooks           = NULL;
         queue->last_get_msg    = current_time;
+        queue->shared_mapping  = NULL;
+        queue->shared          = NULL;
         list_init( &queue->send_result );
         list_init( &queue->callback_result );
         list_init( &queue->pending_timers );
@@ -440,6 +447,19 @@ void set_queue_hooks( struct thread *thread, struct hook_table *hooks )
     queue->hooks = hooks;
 }
 
+/* publish the queue state to the client side */
+static void update_shared_queue( struct msg_queue *queue )
+{
+    volatile struct queue_shared *shared = queue->shared;
+
+    if (!shared) return;
+    shared->last_get_msg = queue->last_get_msg;
+    shared->wake_bits    = queue->wake_bits;
+    shared->wake_mask    = queue->wake_mask;
+    shared->changed_bits = queue->changed_bits;
+    shared->changed_mask = queue->changed_mask;
+}
+
 /* check the queue status */
 static inline int is_signaled( struct msg_queue *queue )
 {
@@ -451,6 +471,7 @@ static inline void set_queue_bits( struct msg_queue *queue, unsigned int bits )
 {
     queue->wake_bits |= bits;
     queue->changed_bits |= bits;
+    update_shared_queue( queue );
     if (is_signaled( queue )) wake_up( &queue->obj, 0 );
 }
 
@@ -459,6 +480,7 @@ static inline void clear_queue_bits( struct msg_queue *queue, unsigned int bits
 {
     queue->wake_bits &= ~bits;
     queue->changed_bits &= ~bits;
+    update_shared_queue( queue );
 }
 
 /* check whether msg is a keyboard message */
@@ -968,6 +990,7 @@ static void msg_queue_satisfied( struct object *obj, struct wait_queue_entry *en
     struct msg_queue *queue = (struct msg_queue *)obj;
     queue->wake_mask = 0;
     queue->changed_mask = 0;
+    update_shared_queue( queue );
 }
 
 static void msg_queue_destroy( struct object *obj )
@@ -1006,6 +1029,11 @@ static void msg_queue_destroy( struct object *obj )
     release_object( queue->input );
     if (queue->hooks) release_object( queue->hooks );
     if (queue->fd) release_object( queue->fd );
+    if (queue->shared)
+    {
+        munmap( (void *)queue->shared, sizeof(*queue->shared) );
+        release_object( queue->shared_mapping );
+    }
 }
 
 static void msg_queue_poll_event( struct fd *fd, int event )
@@ -2223,6 +2251,7 @@ DECL_HANDLER(set_queue_mask)
             if (req->skip_wait) queue->wake_mask = queue->changed_mask = 0;
             else wake_up( &queue->obj, 0 );
         }
+        update_shared_queue( queue );
     }
 }
 
@@ -2236,6 +2265,7 @@ DECL_HANDLER(get_queue_status)
         reply->wake_bits    = queue->wake_bits;
         reply->changed_bits = queue->changed_bits;
         queue->changed_bits &= ~req->clear_bits;
+        update_shared_queue( queue );
     }
     else reply->wake_bits = reply->changed_bits = 0;
 }
@@ -2412,6 +2442,7 @@ DECL_HANDLER(get_message)
     }
     if (filter & QS_INPUT) queue->changed_bits &= ~QS_INPUT;
     if (filter & QS_PAINT) queue->changed_bits &= ~QS_PAINT;
+    update_shared_queue( queue );
 
     /* then check for posted messages */
     if ((filter & QS_POSTMESSAGE) &&
@@ -2466,10 +2497,29 @@ DECL_HANDLER(get_message)
     if (get_win == -1 && current->process->idle_event) set_event( current->process->idle_event );
     queue->wake_mask = req->wake_mask;
     queue->changed_mask = req->changed_mask;
+    update_shared_queue( queue );
     set_error( STATUS_PENDING );  /* FIXME */
 }
 
 
+/* get a section mapping the current message queue state */
+DECL_HANDLER(get_queue_shared)
+{
+    struct msg_queue *queue = get_current_queue();
+
+    if (!queue) return;
+    if (!queue->shared)
+    {
+        void *ptr;
+
+        if (!(queue->shared_mapping = create_shared_mapping( sizeof(*queue->shared), &ptr ))) return;
+        queue->shared = ptr;
+        update_shared_queue( queue );
+    }
+    reply->handle = alloc_handle( current->process, queue->shared_mapping, SECTION_MAP_READ | SECTION_QUERY, 0 );
+}
+
+
 /* reply to a sent message */
 DECL_HANDLER(reply_message)
 {
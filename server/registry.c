@@ -34,8 +34,15 @@
 #include <stdarg.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
 #include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 #include "ntstatus.h"
 #define WIN32_NO_STATUS
@@ -72,9 +79,15 @@ struct key
     int               last_subkey; /* last in use subkey */
     int               nb_subkeys;  /* count of allocated subkeys */
     struct key      **subkeys;     /* subkeys array */
+    int               sorted_subkeys; /* number of subkeys at the start of the array that are sorted */
+    struct key      **subkey_hash; /* hash table of subkeys, for keys with many subkeys */
+    unsigned int      hash_size;   /* size of the hash table */
+    struct key       *hash_next;   /* next key in the parent hash bucket */
     int               last_value;  /* last in use value */
     int               nb_values;   /* count of allocated values in array */
     struct key_value *values;      /* values array */
+    FILE             *values_file; /* file to load the values from, if they haven't been loaded yet */
+    long              values_offset; /* offset of the values in that file */
     unsigned int      flags;       /* flags */
     timeout_t         modif;       /* last modification time */
     struct list       notify_list; /* list of notifications */
@@ -87,6 +100,7 @@ struct key
 #define KEY_SYMLINK  0x0008  /* key is a symbolic link */
 #define KEY_WOW64    0x0010  /* key contains a Wow6432Node subkey */
 #define KEY_WOWSHARE 0x0020  /* key is a Wow64 shared key (used for Software\Classes) */
+#define KEY_CHANGED  0x0040  /* key itself (not only its subkeys) has been modified */
 
 /* a key value */
 struct key_value
@@ -100,6 +114,7 @@ struct key_value
 
 #define MIN_SUBKEYS  8   /* min. number of allocated subkeys per key */
 #define MIN_VALUES   8   /* min. number of allocated values per key */
+#define MIN_HASHED_SUBKEYS 32  /* number of subkeys above which they are hashed */
 
 #define MAX_NAME_LEN  256    /* max. length of a key name */
 #define MAX_VALUE_LEN 16383  /* max. length of a value name */
@@ -119,12 +134,35 @@ static const struct unicode_str symlink_str = { symlink_value, sizeof(symlink_va
 
 static void set_periodic_save_timer(void);
 static struct key_value *find_value( const struct key *key, const struct unicode_str *name, int *index );
+static void load_values( struct key *key );
+static void sort_subkeys( struct key *key );
+static void copy_lazy_values( const struct key *key, FILE *f );
+static void log_deleted_key( const struct key *key );
+
+/* read-only requests can be dispatched on several threads, so the lazy
+ * sorting and loading of a key must be serialized */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t lazy_key_mutex = PTHREAD_MUTEX_INITIALIZER;
+static inline void lock_lazy_key(void)   { pthread_mutex_lock( &lazy_key_mutex ); }
+static inline void unlock_lazy_key(void) { pthread_mutex_unlock( &lazy_key_mutex ); }
+#else
+static inline void lock_lazy_key(void)   { }
+static inline void unlock_lazy_key(void) { }
+#endif
 
 /* information about where to save a registry branch */
 struct save_branch_info
 {
     struct key  *key;
     const char  *path;
+    char        *hive_path;   /* binary hive file, if enabled */
+    char        *log_path;    /* write-ahead log of the binary hive */
+    int          log_fd;      /* fd of the log, opened for appending */
+    file_pos_t   log_size;    /* current size of the log */
+    file_pos_t   hive_size;   /* size of the hive when it was last written */
+    unsigned int generation;  /* generation of the hive, that the log must match */
+    int          hive_valid;  /* is the hive up to date, apart from what the log contains? */
+    int          text_dirty;  /* does the text file need to be saved on exit? */
 };
 
 #define MAX_SAVE_BRANCH_INFO 3
@@ -256,14 +294,16 @@ static void dump_value( const struct key_value *value, FILE *f )
 }
 
 /* save a registry and all its subkeys to a text file */
-static void save_subkeys( const struct key *key, const struct key *base, FILE *f )
+static void save_subkeys( struct key *key, const struct key *base, FILE *f )
 {
     int i;
 
     if (key->flags & KEY_VOLATILE) return;
+    sort_subkeys( key );
     /* save key if it has either some values or no subkeys, or needs special options */
     /* keys with no values but subkeys are saved implicitly by saving the subkeys */
-    if ((key->last_value >= 0) || (key->last_subkey == -1) || key->class || (key->flags & KEY_SYMLINK))
+    if ((key->last_value >= 0) || key->values_file || (key->last_subkey == -1) ||
+        key->class || (key->flags & KEY_SYMLINK))
     {
         fprintf( f, "\n[" );
         if (key != base) dump_path( key, base, f );
@@ -276,6 +316,7 @@ static void save_subkeys( const struct key *key, const struct key *base, FILE *f
             fprintf( f, "\"\n" );
         }
         if (key->flags & KEY_SYMLINK) fputs( "#link\n", f );
+        if (key->values_file) copy_lazy_values( key, f );
         for (i = 0; i <= key->last_value; i++) dump_value( &key->values[i], f );
     }
     for (i = 0; i <= key->last_subkey; i++) save_subkeys( key->subkeys[i], base, f );
@@ -424,6 +465,7 @@ static void key_destroy( struct object *obj )
         release_object( key->subkeys[i] );
     }
     free( key->subkeys );
+    free( key->subkey_hash );
     /* unconditionally notify everything waiting on this key */
     while ((ptr = list_head( &key->notify_list )))
     {
@@ -487,9 +529,15 @@ static struct key *alloc_key( const struct unicode_str *name, timeout_t modif )
         key->last_subkey = -1;
         key->nb_subkeys  = 0;
         key->subkeys     = NULL;
+        key->sorted_subkeys = 0;
+        key->subkey_hash = NULL;
+        key->hash_size   = 0;
+        key->hash_next   = NULL;
         key->nb_values   = 0;
         key->last_value  = -1;
         key->values      = NULL;
+        key->values_file = NULL;
+        key->values_offset = 0;
         key->modif       = modif;
         key->parent      = NULL;
         list_init( &key->notify_list );
@@ -520,10 +568,21 @@ static void make_clean( struct key *key )
 
     if (key->flags & KEY_VOLATILE) return;
     if (!(key->flags & KEY_DIRTY)) return;
-    key->flags &= ~KEY_DIRTY;
+    key->flags &= ~(KEY_DIRTY | KEY_CHANGED);
     for (i = 0; i <= key->last_subkey; i++) make_clean( key->subkeys[i] );
 }
 
+/* mark a key and all its subkeys as changed, after they have been loaded from a file */
+static void mark_changed( struct key *key )
+{
+    int i;
+
+    if (key->flags & KEY_VOLATILE) return;
+    key->flags |= KEY_CHANGED;
+    make_dirty( key );
+    for (i = 0; i <= key->last_subkey; i++) mark_changed( key->subkeys[i] );
+}
+
 /* go through all the notifications and send them if necessary */
 static void check_notify( struct key *key, unsigned int change, int not_subtree )
 {
@@ -543,6 +602,7 @@ static void touch_key( struct key *key, unsigned int change )
     struct key *k;
 
     key->modif = current_time;
+    key->flags |= KEY_CHANGED;
     make_dirty( key );
 
     /* do notifications */
@@ -576,6 +636,99 @@ static int grow_subkeys( struct key *key )
     return 1;
 }
 
+/* compare a subkey name, in the order used for the subkeys array */
+static int compare_subkey_name( const struct key *key, const WCHAR *name, data_size_t namelen )
+{
+    int res = memicmpW( key->name, name, min( key->namelen, namelen ) / sizeof(WCHAR) );
+    if (!res) res = key->namelen - namelen;
+    return res;
+}
+
+static int compare_subkeys( const void *p1, const void *p2 )
+{
+    const struct key *key1 = *(const struct key * const *)p1;
+    const struct key *key2 = *(const struct key * const *)p2;
+    return compare_subkey_name( key1, key2->name, key2->namelen );
+}
+
+static unsigned int hash_subkey_name( const WCHAR *name, data_size_t len )
+{
+    unsigned int i, hash = 0;
+
+    for (i = 0; i < len / sizeof(WCHAR); i++) hash = hash * 65599 + tolowerW( name[i] );
+    return hash;
+}
+
+static void hash_subkey( struct key *parent, struct key *key )
+{
+    unsigned int bucket = hash_subkey_name( key->name, key->namelen ) & (parent->hash_size - 1);
+
+    key->hash_next = parent->subkey_hash[bucket];
+    parent->subkey_hash[bucket] = key;
+}
+
+static void unhash_subkey( struct key *parent, struct key *key )
+{
+    unsigned int bucket = hash_subkey_name( key->name, key->namelen ) & (parent->hash_size - 1);
+    struct key **ptr;
+
+    for (ptr = &parent->subkey_hash[bucket]; *ptr; ptr = &(*ptr)->hash_next)
+    {
+        if (*ptr != key) continue;
+        *ptr = key->hash_next;
+        break;
+    }
+    key->hash_next = NULL;
+}
+
+/* grow the subkeys hash table, creating it if needed; return 1 if OK, 0 on error */
+static int grow_subkey_hash( struct key *key )
+{
+    unsigned int size = key->hash_size ? key->hash_size * 2 : 2 * MIN_HASHED_SUBKEYS;
+    struct key **hash;
+    int i;
+
+    if (!(hash = calloc( size, sizeof(*hash) ))) return 0;
+    free( key->subkey_hash );
+    key->subkey_hash = hash;
+    key->hash_size = size;
+    for (i = 0; i <= key->last_subkey; i++) hash_subkey( key, key->subkeys[i] );
+    return 1;
+}
+
+/* sort the subkeys that have been appended to the array since it was last sorted */
+static void sort_subkeys( struct key *key )
+{
+    struct key **merged;
+    int i, j, k, count;
+
+    if (interlocked_cmpxchg( &key->sorted_subkeys, 0, 0 ) > key->last_subkey) return;
+
+    lock_lazy_key();
+    count = key->last_subkey + 1;
+    if (key->sorted_subkeys < count)
+    {
+        qsort( key->subkeys + key->sorted_subkeys, count - key->sorted_subkeys,
+               sizeof(*key->subkeys), compare_subkeys );
+        if ((merged = malloc( count * sizeof(*merged) )))
+        {
+            for (i = 0, j = key->sorted_subkeys, k = 0; k < count; k++)
+            {
+                if (j == count || (i < key->sorted_subkeys &&
+                                   compare_subkeys( &key->subkeys[i], &key->subkeys[j] ) < 0))
+                    merged[k] = key->subkeys[i++];
+                else
+                    merged[k] = key->subkeys[j++];
+            }
+            memcpy( key->subkeys, merged, count * sizeof(*merged) );
+            free( merged );
+        }
+        else qsort( key->subkeys, count, sizeof(*key->subkeys), compare_subkeys );
+        interlocked_xchg( &key->sorted_subkeys, count );
+    }
+    unlock_lazy_key();
+}
+
 /* allocate a subkey for a given key, and return its index */
 static struct key *alloc_subkey( struct key *parent, const struct unicode_str *name,
                                  int index, timeout_t modif )
@@ -596,9 +749,25 @@ static struct key *alloc_subkey( struct key *parent, const struct unicode_str *n
     if ((key = alloc_key( name, modif )) != NULL)
     {
         key->parent = parent;
-        for (i = ++parent->last_subkey; i > index; i--)
-            parent->subkeys[i] = parent->subkeys[i-1];
-        parent->subkeys[index] = key;
+        if (parent->subkey_hash)
+        {
+            /* append it, the array is sorted again when needed */
+            assert( index == parent->last_subkey + 1 );
+            if (parent->sorted_subkeys == index &&
+                (!index || compare_subkeys( &parent->subkeys[index - 1], &key ) < 0))
+                parent->sorted_subkeys++;  /* still sorted, as when loading a file */
+            parent->subkeys[++parent->last_subkey] = key;
+            if (parent->last_subkey < parent->hash_size || !grow_subkey_hash( parent ))
+                hash_subkey( parent, key );
+        }
+        else
+        {
+            for (i = ++parent->last_subkey; i > index; i--)
+                parent->subkeys[i] = parent->subkeys[i-1];
+            parent->subkeys[index] = key;
+            parent->sorted_subkeys++;
+            if (parent->last_subkey >= MIN_HASHED_SUBKEYS) grow_subkey_hash( parent );
+        }
         if (is_wow6432node( key->name, key->namelen ) && !is_wow6432node( parent->name, parent->namelen ))
             parent->flags |= KEY_WOW64;
     }
@@ -615,8 +784,10 @@ static void free_subkey( struct key *parent, int index )
     assert( index <= parent->last_subkey );
 
     key = parent->subkeys[index];
+    if (parent->subkey_hash) unhash_subkey( parent, key );
     for (i = index; i < parent->last_subkey; i++) parent->subkeys[i] = parent->subkeys[i + 1];
     parent->last_subkey--;
+    if (index < parent->sorted_subkeys) parent->sorted_subkeys--;
     key->flags |= KEY_DELETED;
     key->parent = NULL;
     if (is_wow6432node( key->name, key->namelen )) parent->flags &= ~KEY_WOW64;
@@ -636,19 +807,33 @@ static void free_subkey( struct key *parent, int index )
 }
 
 /* find the named child of a given key and return its index */
+/* the index is only meaningful as an insertion point if the key isn't found */
 static struct key *find_subkey( const struct key *key, const struct unicode_str *name, int *index )
 {
     int i, min, max, res;
-    data_size_t len;
+
+    if (key->subkey_hash)
+    {
+        unsigned int hash = hash_subkey_name( name->str, name->len );
+        struct key *subkey;
+
+        for (subkey = key->subkey_hash[hash & (key->hash_size - 1)]; subkey; subkey = subkey->hash_next)
+        {
+            if (subkey->namelen != name->len) continue;
+            if (memicmpW( subkey->name, name->str, name->len / sizeof(WCHAR) )) continue;
+            *index = -1;
+            return subkey;
+        }
+        *index = key->last_subkey + 1;  /* new subkeys are appended */
+        return NULL;
+    }
 
     min = 0;
     max = key->last_subkey;
     while (min <= max)
     {
         i = (min + max) / 2;
-        len = min( key->subkeys[i]->namelen, name->len );
-        res = memicmpW( key->subkeys[i]->name, name->str, len / sizeof(WCHAR) );
-        if (!res) res = key->subkeys[i]->namelen - name->len;
+        res = compare_subkey_name( key->subkeys[i], name->str, name->len );
         if (!res)
         {
             *index = i;
@@ -686,6 +871,7 @@ static struct key *follow_symlink( struct key *key, int iteration )
 
     if (iteration > 16) return NULL;
     if (!(key->flags & KEY_SYMLINK)) return key;
+    load_values( key );
     if (!(value = find_value( key, &symlink_str, &index ))) return NULL;
 
     path.str = value->data;
@@ -816,7 +1002,7 @@ static struct key *create_key( struct key *key, const struct unicode_str *name,
 
     if (options & REG_OPTION_CREATE_LINK) key->flags |= KEY_SYMLINK;
     if (options & REG_OPTION_VOLATILE) key->flags |= KEY_VOLATILE;
-    else key->flags |= KEY_DIRTY;
+    else key->flags |= KEY_DIRTY | KEY_CHANGED;
 
     if (sd) default_set_sd( &key->obj, sd, OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION |
                             DACL_SECURITY_INFORMATION | SACL_SECURITY_INFORMATION );
@@ -877,7 +1063,7 @@ static struct key *create_key_recursive( struct key *key, const struct unicode_s
 }
 
 /* query information about a key or a subkey */
-static void enum_key( const struct key *key, int index, int info_class,
+static void enum_key( struct key *key, int index, int info_class,
                       struct enum_key_reply *reply )
 {
     static const WCHAR backslash[] = { '\\' };
@@ -895,6 +1081,7 @@ static void enum_key( const struct key *key, int index, int info_class,
             set_error( STATUS_NO_MORE_ENTRIES );
             return;
         }
+        sort_subkeys( key );
         key = key->subkeys[index];
     }
 
@@ -921,6 +1108,8 @@ static void enum_key( const struct key *key, int index, int info_class,
         break;
     case KeyFullInformation:
     case KeyCachedInformation:
+        sort_subkeys( key );
+        load_values( key );
         for (i = 0; i <= key->last_subkey; i++)
         {
             if (key->subkeys[i]->namelen > max_subkey) max_subkey = key->subkeys[i]->namelen;
@@ -1012,6 +1201,7 @@ static int delete_key( struct key *key, int recurse )
     }
 
     if (debug_level > 1) dump_operation( key, NULL, "Delete" );
+    log_deleted_key( key );
     free_subkey( parent, index );
     touch_key( parent, REG_NOTIFY_CHANGE_NAME );
     return 0;
@@ -1102,6 +1292,7 @@ static void set_value( struct key *key, const struct unicode_str *name,
     void *ptr = NULL;
     int index;
 
+    load_values( key );
     if ((value = find_value( key, name, &index )))
     {
         /* check if the new value is identical to the existing one */
@@ -1148,6 +1339,7 @@ static void get_value( struct key *key, const struct unicode_str *name, int *typ
     struct key_value *value;
     int index;
 
+    load_values( key );
     if ((value = find_value( key, name, &index )))
     {
         *type = value->type;
@@ -1167,6 +1359,7 @@ static void enum_value( struct key *key, int i, int info_class, struct enum_key_
 {
     struct key_value *value;
 
+    load_values( key );
     if (i < 0 || i > key->last_value) set_error( STATUS_NO_MORE_ENTRIES );
     else
     {
@@ -1219,6 +1412,7 @@ static void delete_value( struct key *key, const struct unicode_str *name )
     struct key_value *value;
     int i, index, nb_values;
 
+    load_values( key );
     if (!(value = find_value( key, name, &index )))
     {
         set_error( STATUS_OBJECT_NAME_NOT_FOUND );
@@ -1594,6 +1788,95 @@ static int load_value( struct key *key, const char *buffer, struct file_load_inf
     return 0;
 }
 
+/* read the next line of the values of a key that haven't been loaded yet; return 0 when done */
+static int read_lazy_value_line( struct file_load_info *info, const char **line )
+{
+    const char *p;
+
+    while (read_next_line( info ) == 1)
+    {
+        p = info->buffer;
+        while (*p && isspace(*p)) p++;
+        if (*p == '[') return 0;  /* next key */
+        if (!*p || *p == '#' || *p == ';') continue;  /* options are loaded with the key */
+        *line = p;
+        return 1;
+    }
+    return 0;
+}
+
+/* load the values of a key from its registry file, if not done yet */
+static void load_values( struct key *key )
+{
+    struct file_load_info info;
+    unsigned int error;
+    const char *p;
+    long pos;
+
+    if (!interlocked_cmpxchg_ptr( (void **)&key->values_file, NULL, NULL )) return;
+
+    lock_lazy_key();
+    if (key->values_file)
+    {
+        error = get_error();
+        memset( &info, 0, sizeof(info) );
+        info.file = key->values_file;
+        info.len = 512;
+        info.tmplen = 512;
+        info.buffer = mem_alloc( info.len );
+        info.tmp = mem_alloc( info.tmplen );
+        /* the file may still be parsed by load_keys if the key section is repeated */
+        pos = ftell( info.file );
+        if (info.buffer && info.tmp && !fseek( info.file, key->values_offset, SEEK_SET ))
+        {
+            while (read_lazy_value_line( &info, &p ))
+            {
+                /* continuation lines are read by load_value itself */
+                if (*p == '@' || *p == '\"') load_value( key, p, &info );
+            }
+        }
+        if (pos != -1) fseek( info.file, pos, SEEK_SET );
+        free( info.buffer );
+        free( info.tmp );
+        set_error( error );
+        interlocked_xchg_ptr( (void **)&key->values_file, NULL );
+    }
+    unlock_lazy_key();
+}
+
+/* copy the values that haven't been loaded yet as is when saving a key */
+static void copy_lazy_values( const struct key *key, FILE *f )
+{
+    struct file_load_info info;
+    const char *p;
+    long pos;
+
+    memset( &info, 0, sizeof(info) );
+    info.file = key->values_file;
+    info.len = 512;
+    if (!(info.buffer = mem_alloc( info.len ))) return;
+    pos = ftell( info.file );
+    if (!fseek( info.file, key->values_offset, SEEK_SET ))
+    {
+        while (read_lazy_value_line( &info, &p ))
+        {
+            fputs( info.buffer, f );
+            fputc( '\n', f );
+        }
+    }
+    if (pos != -1) fseek( info.file, pos, SEEK_SET );
+    free( info.buffer );
+}
+
+/* load all the values of a branch, before its registry file gets overwritten */
+static void load_all_values( struct key *key )
+{
+    int i;
+
+    load_values( key );
+    for (i = 0; i <= key->last_subkey; i++) load_all_values( key->subkeys[i] );
+}
+
 /* return the length (in path elements) of name that is part of the key name */
 /* for instance if key is USER\foo\bar and name is foo\bar\baz, return 2 */
 static int get_prefix_len( struct key *key, const char *name, struct file_load_info *info )
@@ -1623,11 +1906,14 @@ static int get_prefix_len( struct key *key, const char *name, struct file_load_i
 
 /* load all the keys from the input file */
 /* prefix_len is the number of key name prefixes to skip, or -1 for autodetection */
-static void load_keys( struct key *key, const char *filename, FILE *f, int prefix_len )
+/* if lazy is set, the values are only loaded when a key is accessed, and the file must be kept open */
+static void load_keys( struct key *key, const char *filename, FILE *f, int prefix_len, int lazy )
 {
     struct key *subkey = NULL;
     struct file_load_info info;
     timeout_t modif = current_time;
+    long offset = 0;
+    int lazy_values = 0;
     char *p;
 
     info.filename = filename;
@@ -1649,8 +1935,10 @@ static void load_keys( struct key *key, const char *filename, FILE *f, int prefi
         goto done;
     }
 
-    while (read_next_line( &info ) == 1)
+    for (;;)
     {
+        if (lazy) offset = ftell( f );
+        if (read_next_line( &info ) != 1) break;
         p = info.buffer;
         while (*p && isspace(*p)) p++;
         switch(*p)
@@ -1664,11 +1952,19 @@ static void load_keys( struct key *key, const char *filename, FILE *f, int prefi
             if (prefix_len == -1) prefix_len = get_prefix_len( key, p + 1, &info );
             if (!(subkey = load_key( key, p + 1, prefix_len, &info, &modif )))
                 file_read_error( "Error creating key", &info );
+            /* values can only be loaded lazily if the key doesn't have any yet */
+            lazy_values = lazy && subkey && subkey->last_value == -1 && !subkey->values_file;
+            if (subkey && !lazy_values) load_values( subkey );
             break;
         case '@':   /* default value */
         case '\"':  /* value */
-            if (subkey) load_value( subkey, p, &info );
-            else file_read_error( "Value without key", &info );
+            if (!subkey) file_read_error( "Value without key", &info );
+            else if (!lazy_values) load_value( subkey, p, &info );
+            else if (!subkey->values_file)
+            {
+                subkey->values_file = f;
+                subkey->values_offset = offset;
+            }
             break;
         case '#':   /* option */
             if (subkey) load_key_option( subkey, p, &info );
@@ -1678,7 +1974,8 @@ static void load_keys( struct key *key, const char *filename, FILE *f, int prefi
         case 0:     /* empty line */
             break;
         default:
-            file_read_error( "Unrecognized input", &info );
+            /* continuation lines of values that are loaded lazily */
+            if (!subkey || !subkey->values_file) file_read_error( "Unrecognized input", &info );
             break;
         }
     }
@@ -1707,35 +2004,721 @@ static void load_registry( struct key *key, obj_handle_t handle )
         FILE *f = fdopen( fd, "r" );
         if (f)
         {
-            load_keys( key, NULL, f, -1 );
+            load_keys( key, NULL, f, -1, 0 );
             fclose( f );
         }
         else file_set_error();
     }
 }
 
+/*
+ * The binary hive format is an optional alternative to the text files for
+ * the initial registry branches, enabled with WINEBINARYREGISTRY=1:
+ * - the hive file contains a header followed by one record per key, parents first,
+ *   and is loaded by mapping it and checking the records;
+ * - the changes are appended to a write-ahead log, as records describing the full
+ *   state of each modified key and records for deleted keys;
+ * - the log is merged into a new hive when it grows too large, and the text file
+ *   is still written on exit, so that it remains usable by other tools.
+ */
+
+#define HIVE_VERSION 1
+#define HIVE_RECORD_KEY    1  /* full contents of a key, replacing any existing values */
+#define HIVE_RECORD_DELETE 2  /* deletion of a key and its subkeys */
+#define HIVE_KEY_SYMLINK   0x0001
+#define HIVE_MIN_LOG_SIZE  (1024 * 1024)  /* log size above which the hive may be written again */
+
+static const char hive_magic[8] = "WineHive";
+static const char hive_log_magic[8] = "WineHLog";
+
+struct hive_header
+{
+    char          magic[8];     /* hive_magic */
+    unsigned int  version;      /* HIVE_VERSION */
+    unsigned int  header_size;  /* size of this header */
+    unsigned int  prefix_type;  /* architecture of the prefix */
+    unsigned int  generation;   /* generation number, that the log must match */
+    unsigned int  text_current; /* was the text file saved with the same contents? */
+    unsigned int  reserved;
+    file_pos_t    data_size;    /* size of the records following the header */
+    file_pos_t    text_size;    /* size of the text file when the hive was written */
+    file_pos_t    text_inode;   /* inode of the text file */
+    timeout_t     text_mtime;   /* modification time of the text file */
+};
+
+struct hive_log_header
+{
+    char          magic[8];     /* hive_log_magic */
+    unsigned int  version;      /* HIVE_VERSION */
+    unsigned int  generation;   /* generation of the hive that the log applies to */
+};
+
+struct hive_record
+{
+    unsigned int  size;         /* size of the whole record, aligned to 8 bytes */
+    unsigned int  checksum;     /* checksum of the record, computed with this field set to 0 */
+    unsigned int  type;         /* HIVE_RECORD_KEY or HIVE_RECORD_DELETE */
+    unsigned int  flags;        /* HIVE_KEY_* flags */
+    timeout_t     modif;        /* key modification time */
+    unsigned int  pathlen;      /* length in bytes of the key path, relative to the branch */
+    unsigned int  classlen;     /* length in bytes of the key class */
+    unsigned int  value_count;  /* number of values */
+    unsigned int  reserved;
+    /* followed by the path, the class and the values, each aligned to 4 bytes */
+};
+
+struct hive_value
+{
+    unsigned int  type;         /* value type */
+    unsigned int  namelen;      /* length in bytes of the value name */
+    data_size_t   len;          /* length in bytes of the value data */
+    /* followed by the name and the data */
+};
+
+/* buffer to build the records before writing them */
+struct hive_writer
+{
+    char         *buffer;       /* records data */
+    size_t        size;         /* size used in the buffer */
+    size_t        alloc;        /* allocated size of the buffer */
+    WCHAR        *path;         /* path of the current key */
+    data_size_t   pathlen;      /* length in bytes of the current path */
+    data_size_t   path_alloc;   /* allocated size of the path buffer */
+    FILE         *file;         /* file to flush the buffer to, if any */
+};
+
+/* a deleted key that hasn't been written to the log yet */
+struct deleted_key
+{
+    struct list   entry;        /* entry in deleted_keys list */
+    int           branch;       /* index of the branch in save_branch_info */
+    data_size_t   len;          /* length in bytes of the path */
+    WCHAR         path[1];      /* path of the key, relative to the branch */
+};
+
+static int use_binary_hive;  /* is the binary hive format enabled? */
+static int hive_logging;     /* are the changes being logged? */
+static struct list deleted_keys = LIST_INIT( deleted_keys );
+
+static inline size_t hive_align( size_t size, size_t align )
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/* checksum of a record, covering everything after the checksum field */
+static unsigned int get_record_checksum( const struct hive_record *rec )
+{
+    const unsigned int *p = &rec->type;
+    unsigned int size = (rec->size - offsetof( struct hive_record, type )) / sizeof(*p);
+    unsigned int sum = 0x811c9dc5 ^ rec->size;
+
+    while (size--) sum = (sum ^ *p++) * 0x01000193;
+    return sum;
+}
+
+/* build the name of a file next to the text file of a branch */
+static char *get_hive_file_name( const char *path, const char *ext )
+{
+    const char *dot = strrchr( path, '.' );
+    int len = dot ? dot - path : strlen( path );
+    char *ret;
+
+    if ((ret = malloc( len + strlen( ext ) + 1 ))) sprintf( ret, "%.*s%s", len, path, ext );
+    return ret;
+}
+
+/* find the branch that contains a key */
+static int get_key_branch( const struct key *key )
+{
+    int i;
+
+    for ( ; key; key = key->parent)
+        for (i = 0; i < save_branch_count; i++)
+            if (save_branch_info[i].key == key) return i;
+    return -1;
+}
+
+/* remember a deleted key, to log its deletion on the next save */
+static void log_deleted_key( const struct key *key )
+{
+    const struct key *base, *k;
+    struct deleted_key *deleted;
+    data_size_t len = 0;
+    WCHAR *p;
+    int branch;
+
+    if (!hive_logging || (key->flags & KEY_VOLATILE)) return;
+    if ((branch = get_key_branch( key )) == -1) return;
+    base = save_branch_info[branch].key;
+    if (key == base) return;
+
+    for (k = key; k != base; k = k->parent) len += k->namelen + (k->parent != base ? sizeof(WCHAR) : 0);
+    if (!(deleted = mem_alloc( offsetof( struct deleted_key, path[len / sizeof(WCHAR)] )))) return;
+    deleted->branch = branch;
+    deleted->len = len;
+    p = deleted->path + len / sizeof(WCHAR);
+    for (k = key; k != base; k = k->parent)
+    {
+        p -= k->namelen / sizeof(WCHAR);
+        memcpy( p, k->name, k->namelen );
+        if (k->parent != base) *--p = '\\';
+    }
+    list_add_tail( &deleted_keys, &deleted->entry );
+}
+
+/* forget the deleted keys of a branch once they have been saved */
+static void flush_deleted_keys( int branch )
+{
+    struct deleted_key *deleted, *next;
+
+    LIST_FOR_EACH_ENTRY_SAFE( deleted, next, &deleted_keys, struct deleted_key, entry )
+    {
+        if (deleted->branch != branch) continue;
+        list_remove( &deleted->entry );
+        free( deleted );
+    }
+}
+
+/* make sure there is enough space in the writer buffer */
+static void *reserve_hive_buffer( struct hive_writer *writer, size_t size )
+{
+    char *new_buffer;
+    size_t new_alloc;
+
+    if (writer->alloc - writer->size < size)
+    {
+        new_alloc = max( writer->alloc * 2, writer->size + size );
+        new_alloc = max( new_alloc, 65536 );
+        if (!(new_buffer = realloc( writer->buffer, new_alloc )))
+        {
+            set_error( STATUS_NO_MEMORY );
+            return NULL;
+        }
+        writer->buffer = new_buffer;
+        writer->alloc = new_alloc;
+    }
+    return writer->buffer + writer->size;
+}
+
+/* append a name to the current path of the writer */
+static int push_hive_path( struct hive_writer *writer, const struct key *key )
+{
+    data_size_t len = writer->pathlen + key->namelen + sizeof(WCHAR);
+    WCHAR *new_path;
+
+    if (len > writer->path_alloc)
+    {
+        if (!(new_path = realloc( writer->path, len * 2 )))
+        {
+            set_error( STATUS_NO_MEMORY );
+            return 0;
+        }
+        writer->path = new_path;
+        writer->path_alloc = len * 2;
+    }
+    if (writer->pathlen)
+    {
+        writer->path[writer->pathlen / sizeof(WCHAR)] = '\\';
+        writer->pathlen += sizeof(WCHAR);
+    }
+    memcpy( (char *)writer->path + writer->pathlen, key->name, key->namelen );
+    writer->pathlen += key->namelen;
+    return 1;
+}
+
+/* add a record to the writer buffer; key is NULL for a deletion */
+static int add_hive_record( struct hive_writer *writer, struct key *key,
+                            const WCHAR *path, data_size_t pathlen )
+{
+    struct hive_record *rec;
+    struct hive_value *val;
+    size_t size, pos;
+    int i;
+
+    if (key) load_values( key );
+    size = hive_align( sizeof(*rec) + pathlen, 4 );
+    if (key)
+    {
+        size = hive_align( size + key->classlen, 4 );
+        for (i = 0; i <= key->last_value; i++)
+            size = hive_align( size + sizeof(*val) + key->values[i].namelen + key->values[i].len, 4 );
+    }
+    size = hive_align( size, 8 );
+    if (size > UINT_MAX)
+    {
+        set_error( STATUS_BUFFER_OVERFLOW );
+        return 0;
+    }
+
+    if (!(rec = reserve_hive_buffer( writer, size ))) return 0;
+    memset( rec, 0, size );
+    rec->size = size;
+    rec->type = key ? HIVE_RECORD_KEY : HIVE_RECORD_DELETE;
+    rec->pathlen = pathlen;
+    memcpy( rec + 1, path, pathlen );
+    pos = hive_align( sizeof(*rec) + pathlen, 4 );
+    if (key)
+    {
+        if (key->flags & KEY_SYMLINK) rec->flags |= HIVE_KEY_SYMLINK;
+        rec->modif = key->modif;
+        rec->classlen = key->classlen;
+        rec->value_count = key->last_value + 1;
+        memcpy( (char *)rec + pos, key->class, key->classlen );
+        pos = hive_align( pos + key->classlen, 4 );
+        for (i = 0; i <= key->last_value; i++)
+        {
+            val = (struct hive_value *)((char *)rec + pos);
+            val->type = key->values[i].type;
+            val->namelen = key->values[i].namelen;
+            val->len = key->values[i].len;
+            memcpy( val + 1, key->values[i].name, val->namelen );
+            memcpy( (char *)(val + 1) + val->namelen, key->values[i].data, val->len );
+            pos = hive_align( pos + sizeof(*val) + val->namelen + val->len, 4 );
+        }
+    }
+    rec->checksum = get_record_checksum( rec );
+    writer->size += size;
+
+    if (writer->file && writer->size >= 65536)
+    {
+        if (fwrite( writer->buffer, writer->size, 1, writer->file ) != 1) return 0;
+        writer->size = 0;
+    }
+    return 1;
+}
+
+/* add the records of a key and its subkeys, or only the changed ones */
+static int add_hive_key_records( struct hive_writer *writer, struct key *key, int changed_only )
+{
+    data_size_t pathlen = writer->pathlen;
+    int i;
+
+    if (key->flags & KEY_VOLATILE) return 1;
+    if (!changed_only || (key->flags & KEY_CHANGED))
+    {
+        if (!add_hive_record( writer, key, writer->path, writer->pathlen )) return 0;
+    }
+    if (!changed_only) sort_subkeys( key );
+    for (i = 0; i <= key->last_subkey; i++)
+    {
+        struct key *subkey = key->subkeys[i];
+
+        if (changed_only && !(subkey->flags & KEY_DIRTY)) continue;
+        if (!push_hive_path( writer, subkey )) return 0;
+        if (!add_hive_key_records( writer, subkey, changed_only )) return 0;
+        writer->pathlen = pathlen;
+    }
+    return 1;
+}
+
+static void free_hive_writer( struct hive_writer *writer )
+{
+    free( writer->buffer );
+    free( writer->path );
+}
+
+/* get the information about the text file that is stored in the hive header */
+static void get_text_file_stamp( const char *path, struct hive_header *header )
+{
+    struct stat st;
+
+    if (stat( path, &st )) return;
+    header->text_size = st.st_size;
+    header->text_inode = st.st_ino;
+    header->text_mtime = st.st_mtime;
+}
+
+/* flush the directory entry of a file that was just renamed to the disk */
+static void sync_parent_dir( const char *path )
+{
+    const char *p = strrchr( path, '/' );
+    char *dir;
+    int fd;
+
+    if (!p) fd = open( ".", O_RDONLY );
+    else
+    {
+        if (!(dir = malloc( p - path + 2 ))) return;
+        memcpy( dir, path, p - path + 1 );
+        dir[p - path + 1] = 0;
+        fd = open( dir, O_RDONLY );
+        free( dir );
+    }
+    if (fd == -1) return;
+    fsync( fd );
+    close( fd );
+}
+
+/* create a new empty log for the current hive generation */
+static int reset_hive_log( struct save_branch_info *info )
+{
+    struct hive_log_header header;
+
+    if (info->log_fd != -1) close( info->log_fd );
+    if ((info->log_fd = open( info->log_path, O_WRONLY | O_CREAT | O_TRUNC, 0666 )) == -1) return 0;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, hive_log_magic, sizeof(header.magic) );
+    header.version = HIVE_VERSION;
+    header.generation = info->generation;
+    if (write( info->log_fd, &header, sizeof(header) ) != sizeof(header) || fsync( info->log_fd ))
+    {
+        close( info->log_fd );
+        info->log_fd = -1;
+        return 0;
+    }
+    sync_parent_dir( info->log_path );
+    info->log_size = sizeof(header);
+    return 1;
+}
+
+/* write the whole branch to a new hive file, and start a new log */
+static int write_hive( struct save_branch_info *info, int branch, int text_current )
+{
+    struct hive_writer writer;
+    struct hive_header header;
+    char *tmp;
+    int fd, ret = 0;
+
+    if (!(tmp = malloc( strlen( info->hive_path ) + 5 ))) return 0;
+    sprintf( tmp, "%s.tmp", info->hive_path );
+    if ((fd = open( tmp, O_CREAT | O_TRUNC | O_WRONLY, 0666 )) == -1)
+    {
+        free( tmp );
+        return 0;
+    }
+
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, hive_magic, sizeof(header.magic) );
+    header.version = HIVE_VERSION;
+    header.header_size = sizeof(header);
+    header.prefix_type = prefix_type;
+    header.generation = info->generation + 1;
+    header.text_current = text_current;
+    get_text_file_stamp( info->path, &header );
+
+    memset( &writer, 0, sizeof(writer) );
+    if (!(writer.file = fdopen( fd, "w" )))
+    {
+        close( fd );
+        goto done;
+    }
+    if (fwrite( &header, sizeof(header), 1, writer.file ) != 1) goto done;
+    if (!add_hive_key_records( &writer, info->key, 0 )) goto done;
+    if (writer.size && fwrite( writer.buffer, writer.size, 1, writer.file ) != 1) goto done;
+    header.data_size = ftell( writer.file ) - sizeof(header);
+    if (fseek( writer.file, 0, SEEK_SET ) || fwrite( &header, sizeof(header), 1, writer.file ) != 1) goto done;
+    /* the new hive must be on disk before it replaces the old one */
+    if (fflush( writer.file ) || fsync( fd )) goto done;
+    ret = !fclose( writer.file );
+    writer.file = NULL;
+    if (ret) ret = !rename( tmp, info->hive_path );
+    if (ret) sync_parent_dir( info->hive_path );
+
+done:
+    if (writer.file) fclose( writer.file );
+    if (!ret) unlink( tmp );
+    free( tmp );
+    free_hive_writer( &writer );
+    if (!ret) return 0;
+
+    if (debug_level > 1)
+    {
+        fprintf( stderr, "%s: ", info->hive_path );
+        dump_operation( info->key, NULL, "saving" );
+    }
+    /* the log of the previous generation is ignored even if resetting it fails */
+    info->generation = header.generation;
+    info->hive_size = header.data_size;
+    info->hive_valid = reset_hive_log( info );
+    flush_deleted_keys( branch );
+    make_clean( info->key );
+    return info->hive_valid;
+}
+
+/* append the changes of a branch since the last save to its log */
+static int write_hive_log( struct save_branch_info *info, int branch )
+{
+    struct hive_writer writer;
+    struct deleted_key *deleted;
+    int ret = 0;
+
+    memset( &writer, 0, sizeof(writer) );
+    LIST_FOR_EACH_ENTRY( deleted, &deleted_keys, struct deleted_key, entry )
+    {
+        if (deleted->branch != branch) continue;
+        if (!add_hive_record( &writer, NULL, deleted->path, deleted->len )) goto done;
+    }
+    if (!add_hive_key_records( &writer, info->key, 1 )) goto done;
+    /* the changes are only considered saved once they are on disk */
+    if (write( info->log_fd, writer.buffer, writer.size ) != writer.size || fsync( info->log_fd ))
+    {
+        /* don't leave a partial batch behind */
+        ftruncate( info->log_fd, info->log_size );
+        goto done;
+    }
+    if (debug_level > 1)
+    {
+        fprintf( stderr, "%s: ", info->log_path );
+        dump_operation( info->key, NULL, "logging" );
+    }
+    info->log_size += writer.size;
+    flush_deleted_keys( branch );
+    make_clean( info->key );
+    ret = 1;
+done:
+    free_hive_writer( &writer );
+    return ret;
+}
+
+/* check that a record is valid; return its size or 0 if invalid */
+static size_t check_hive_record( const struct hive_record *rec, size_t avail )
+{
+    const struct hive_value *val;
+    size_t pos;
+    unsigned int i;
+
+    if (avail < sizeof(*rec)) return 0;
+    if (rec->size < sizeof(*rec) || rec->size > avail || rec->size % 8) return 0;
+    if (rec->checksum != get_record_checksum( rec )) return 0;
+    if (rec->type != HIVE_RECORD_KEY && rec->type != HIVE_RECORD_DELETE) return 0;
+    if ((rec->pathlen | rec->classlen) % sizeof(WCHAR)) return 0;
+    if (rec->pathlen > rec->size - sizeof(*rec)) return 0;
+    if (rec->type == HIVE_RECORD_DELETE) return rec->size;
+
+    pos = hive_align( sizeof(*rec) + rec->pathlen, 4 );
+    if (rec->classlen > rec->size - pos) return 0;
+    pos = hive_align( pos + rec->classlen, 4 );
+    for (i = 0; i < rec->value_count; i++)
+    {
+        if (pos > rec->size || rec->size - pos < sizeof(*val)) return 0;
+        val = (const struct hive_value *)((const char *)rec + pos);
+        if (val->namelen % sizeof(WCHAR) || val->namelen > MAX_VALUE_LEN * sizeof(WCHAR)) return 0;
+        if (val->len > rec->size - pos - sizeof(*val) - val->namelen) return 0;
+        pos = hive_align( pos + sizeof(*val) + val->namelen + val->len, 4 );
+    }
+    if (pos > rec->size) return 0;
+    return rec->size;
+}
+
+/* find an existing key from its path relative to the branch */
+static struct key *find_hive_key( struct key *key, const struct unicode_str *path )
+{
+    struct unicode_str token;
+    int index;
+
+    token.str = NULL;
+    if (!get_path_token( path, &token )) return NULL;
+    while (key && token.len)
+    {
+        key = find_subkey( key, &token, &index );
+        get_path_token( path, &token );
+    }
+    return key;
+}
+
+/* apply a checked record to a branch */
+static void apply_hive_record( struct key *base, const struct hive_record *rec )
+{
+    const struct hive_value *val;
+    struct key_value *value;
+    struct unicode_str name;
+    struct key *key;
+    size_t pos;
+    unsigned int i;
+
+    name.str = (const WCHAR *)(rec + 1);
+    name.len = rec->pathlen;
+
+    if (rec->type == HIVE_RECORD_DELETE)
+    {
+        if (!name.len || !(key = find_hive_key( base, &name ))) return;
+        grab_object( key );
+        delete_key( key, 1 );
+        release_object( key );
+        return;
+    }
+
+    if (!name.len) key = (struct key *)grab_object( base );
+    else if (!(key = create_key_recursive( base, &name, 0 ))) return;
+
+    /* the record replaces the whole contents of the key */
+    load_values( key );
+    for (i = 0; (int)i <= key->last_value; i++)
+    {
+        free( key->values[i].name );
+        free( key->values[i].data );
+    }
+    key->last_value = -1;
+    free( key->class );
+    key->class = NULL;
+    key->classlen = 0;
+    pos = hive_align( sizeof(*rec) + rec->pathlen, 4 );
+    if (rec->classlen && (key->class = memdup( (const char *)rec + pos, rec->classlen )))
+        key->classlen = rec->classlen;
+    if (rec->flags & HIVE_KEY_SYMLINK) key->flags |= KEY_SYMLINK;
+    else key->flags &= ~KEY_SYMLINK;
+
+    pos = hive_align( pos + rec->classlen, 4 );
+    for (i = 0; i < rec->value_count; i++)
+    {
+        val = (const struct hive_value *)((const char *)rec + pos);
+        name.str = (const WCHAR *)(val + 1);
+        name.len = val->namelen;
+        /* the values are saved in order, so they can be appended */
+        if (!(value = insert_value( key, &name, key->last_value + 1 ))) break;
+        value->type = val->type;
+        if (val->len && (value->data = memdup( (const char *)(val + 1) + val->namelen, val->len )))
+            value->len = val->len;
+        pos = hive_align( pos + sizeof(*val) + val->namelen + val->len, 4 );
+    }
+    key->modif = rec->modif;
+    update_key_time( key->parent, rec->modif );
+    release_object( key );
+}
+
+/* replay the log of a branch after its hive has been loaded */
+static void load_hive_log( struct save_branch_info *info )
+{
+    const struct hive_log_header *header;
+    struct stat st;
+    size_t pos, size;
+    char *data = NULL;
+    int fd;
+
+    if ((fd = open( info->log_path, O_RDWR )) == -1) goto reset;
+    if (fstat( fd, &st ) || st.st_size < sizeof(*header)) goto reset;
+    if (!(data = malloc( st.st_size ))) goto reset;
+    if (read( fd, data, st.st_size ) != st.st_size) goto reset;
+    header = (const struct hive_log_header *)data;
+    if (memcmp( header->magic, hive_log_magic, sizeof(header->magic) ) ||
+        header->version != HIVE_VERSION || header->generation != info->generation)
+        goto reset;
+
+    for (pos = sizeof(*header); pos < st.st_size; pos += size)
+    {
+        /* a partial record at the end is left from an interrupted save */
+        if (!(size = check_hive_record( (const struct hive_record *)(data + pos), st.st_size - pos ))) break;
+        apply_hive_record( info->key, (const struct hive_record *)(data + pos) );
+    }
+    if (pos < st.st_size) ftruncate( fd, pos );
+    if (lseek( fd, pos, SEEK_SET ) == -1) goto reset;
+    free( data );
+    info->log_fd = fd;
+    info->log_size = pos;
+    return;
+
+reset:
+    free( data );
+    if (fd != -1) close( fd );
+    if (!reset_hive_log( info )) info->hive_valid = 0;
+}
+
+/* load a branch from its binary hive; return 0 if the text file must be used instead */
+static int load_hive( struct save_branch_info *info )
+{
+    const struct hive_header *header;
+    struct hive_header stamp;
+    struct stat st;
+    size_t pos, size, end;
+    void *ptr;
+    int fd, ret = 0;
+
+    if ((fd = open( info->hive_path, O_RDONLY )) == -1) return 0;
+    if (fstat( fd, &st ) || st.st_size < sizeof(*header) || st.st_size != (size_t)st.st_size)
+    {
+        close( fd );
+        return 0;
+    }
+    ptr = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if (ptr == MAP_FAILED) return 0;
+
+    header = ptr;
+    if (memcmp( header->magic, hive_magic, sizeof(header->magic) )) goto done;
+    if (header->version != HIVE_VERSION || header->header_size != sizeof(*header)) goto done;
+    info->generation = header->generation;  /* make sure a stale log never matches a new hive */
+    if (header->data_size != st.st_size - sizeof(*header)) goto done;
+    if (header->prefix_type != PREFIX_32BIT && header->prefix_type != PREFIX_64BIT) goto done;
+    if (prefix_type != PREFIX_UNKNOWN && header->prefix_type != prefix_type) goto done;
+
+    /* if the text file has been modified by something else, it takes precedence */
+    memset( &stamp, 0, sizeof(stamp) );
+    get_text_file_stamp( info->path, &stamp );
+    if (stamp.text_size != header->text_size || stamp.text_inode != header->text_inode ||
+        stamp.text_mtime != header->text_mtime)
+        goto done;
+
+    /* check all the records before changing anything */
+    end = st.st_size;
+    for (pos = sizeof(*header); pos < end; pos += size)
+        if (!(size = check_hive_record( (const struct hive_record *)((char *)ptr + pos), end - pos )))
+            goto done;
+
+    prefix_type = header->prefix_type;
+    for (pos = sizeof(*header); pos < end; pos += size)
+    {
+        const struct hive_record *rec = (const struct hive_record *)((char *)ptr + pos);
+        size = rec->size;
+        apply_hive_record( info->key, rec );
+    }
+
+    info->hive_size = header->data_size;
+    info->hive_valid = 1;
+    load_hive_log( info );
+    info->text_dirty = !header->text_current || info->log_size > sizeof(struct hive_log_header);
+    make_clean( info->key );
+    ret = 1;
+
+done:
+    munmap( ptr, st.st_size );
+    return ret;
+}
+
 /* load one of the initial registry files */
 static int load_init_registry_from_file( const char *filename, struct key *key )
 {
-    FILE *f;
+    struct save_branch_info *info;
+    FILE *f = NULL;
+
+    assert( save_branch_count < MAX_SAVE_BRANCH_INFO );
+    info = &save_branch_info[save_branch_count];
+    info->key = key;
+    info->path = filename;
+    info->log_fd = -1;
+    info->generation = time( NULL );
+
+    if (use_binary_hive)
+    {
+        info->hive_path = get_hive_file_name( filename, ".hive" );
+        info->log_path = get_hive_file_name( filename, ".hive.log" );
+        if (!info->hive_path || !info->log_path)
+        {
+            free( info->hive_path );
+            free( info->log_path );
+            info->hive_path = info->log_path = NULL;
+        }
+        else if (load_hive( info )) goto done;
+    }
 
     if ((f = fopen( filename, "r" )))
     {
-        load_keys( key, filename, f, 0 );
-        fclose( f );
+        /* the file is kept open to load the values of the keys when they are accessed */
+        load_keys( key, filename, f, 0, 1 );
         if (get_error() == STATUS_NOT_REGISTRY_FILE)
         {
             fprintf( stderr, "%s is not a valid registry file\n", filename );
+            fclose( f );
+            free( info->hive_path );
+            free( info->log_path );
             return 1;
         }
     }
 
-    assert( save_branch_count < MAX_SAVE_BRANCH_INFO );
-
-    save_branch_info[save_branch_count].path = filename;
-    save_branch_info[save_branch_count++].key = (struct key *)grab_object( key );
+done:
+    save_branch_count++;
+    grab_object( key );
     make_object_static( &key->obj );
-    return (f != NULL);
+    return (f != NULL || info->hive_valid);
 }
 
 static WCHAR *format_user_registry_path( const SID *sid, struct unicode_str *path )
@@ -1807,6 +2790,8 @@ void init_registry(void)
     struct key *key, *hklm, *hkcu;
     char *p;
 
+    if ((p = getenv( "WINEBINARYREGISTRY" )) && atoi( p )) use_binary_hive = 1;
+
     /* switch to the config dir */
 
     if (fchdir( config_dir_fd ) == -1) fatal_error( "chdir to config dir: %s\n", strerror( errno ));
@@ -1864,6 +2849,7 @@ void init_registry(void)
     release_object( hkcu );
 
     /* start the periodic save timer */
+    hive_logging = use_binary_hive;
     set_periodic_save_timer();
 
     /* create windows directories */
@@ -1924,20 +2910,14 @@ static void save_registry( struct key *key, obj_handle_t handle )
     }
 }
 
-/* save a registry branch to a file */
-static int save_branch( struct key *key, const char *path )
+/* save a registry branch to a text file */
+static int save_text_branch( struct key *key, const char *path )
 {
     struct stat st;
     char *p, *tmp = NULL;
     int fd, count = 0, ret = 0;
     FILE *f;
 
-    if (!(key->flags & KEY_DIRTY))
-    {
-        if (debug_level > 1) dump_operation( key, NULL, "Not saving clean" );
-        return 1;
-    }
-
     /* test the file type */
 
     if ((fd = open( path, O_WRONLY )) != -1)
@@ -1946,6 +2926,7 @@ static int save_branch( struct key *key, const char *path )
          * via symbolic links, write directly into it; otherwise use a temp file */
         if (!lstat( path, &st ) && (!S_ISREG(st.st_mode) || st.st_nlink > 1))
         {
+            load_all_values( key );  /* the values may still need to be read from that file */
             ftruncate( fd, 0 );
             goto save;
         }
@@ -1994,10 +2975,60 @@ static int save_branch( struct key *key, const char *path )
 
 done:
     free( tmp );
-    if (ret) make_clean( key );
     return ret;
 }
 
+/* save a branch in binary hive mode */
+static int save_hive_branch( struct save_branch_info *info, int branch, int flush )
+{
+    struct key *key = info->key;
+    int ret = 1;
+
+    if (!info->hive_valid)
+    {
+        /* the branch was loaded from the text file */
+        if (key->flags & KEY_DIRTY) info->text_dirty = 1;
+        ret = write_hive( info, branch, !info->text_dirty );
+    }
+    else if (key->flags & KEY_DIRTY)
+    {
+        /* merge the log into a new hive once it has grown too much */
+        if (info->log_size > max( HIVE_MIN_LOG_SIZE, info->hive_size / 4 ))
+            ret = write_hive( info, branch, 0 );
+        else if (!(ret = write_hive_log( info, branch )))
+            ret = write_hive( info, branch, 0 );
+        info->text_dirty = 1;
+    }
+    else if (debug_level > 1) dump_operation( key, NULL, "Not saving clean" );
+
+    if (ret && flush && info->text_dirty)
+    {
+        /* keep the text file up to date for other tools, the hive records its new state */
+        if ((ret = save_text_branch( key, info->path )) && (ret = write_hive( info, branch, 1 )))
+            info->text_dirty = 0;
+    }
+    return ret;
+}
+
+
+/* save a registry branch to its files */
+static int save_branch( int branch, int flush )
+{
+    struct save_branch_info *info = &save_branch_info[branch];
+    struct key *key = info->key;
+
+    if (info->hive_path) return save_hive_branch( info, branch, flush );
+
+    if (!(key->flags & KEY_DIRTY))
+    {
+        if (debug_level > 1) dump_operation( key, NULL, "Not saving clean" );
+        return 1;
+    }
+    if (!save_text_branch( key, info->path )) return 0;
+    make_clean( key );
+    return 1;
+}
+
 /* periodic saving of the registry */
 static void periodic_save( void *arg )
 {
@@ -2005,8 +3036,7 @@ static void periodic_save( void *arg )
 
     if (fchdir( config_dir_fd ) == -1) return;
     save_timeout_user = NULL;
-    for (i = 0; i < save_branch_count; i++)
-        save_branch( save_branch_info[i].key, save_branch_info[i].path );
+    for (i = 0; i < save_branch_count; i++) save_branch( i, 0 );
     if (fchdir( server_dir_fd ) == -1) fatal_error( "chdir to server dir: %s\n", strerror( errno ));
     set_periodic_save_timer();
 }
@@ -2026,7 +3056,7 @@ void flush_registry(void)
     if (fchdir( config_dir_fd ) == -1) return;
     for (i = 0; i < save_branch_count; i++)
     {
-        if (!save_branch( save_branch_info[i].key, save_branch_info[i].path ))
+        if (!save_branch( i, 1 ))
         {
             fprintf( stderr, "wineserver: could not save registry branch to %s",
                      save_branch_info[i].path );
@@ -2230,6 +3260,7 @@ DECL_HANDLER(load_registry)
         if ((key = create_key( parent, &name, NULL, 0, KEY_WOW64_64KEY, 0, sd, &dummy )))
         {
             load_registry( key, req->file );
+            if (hive_logging) mark_changed( key );
             release_object( key );
         }
         release_object( parent );
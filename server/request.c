@@ -38,6 +38,15 @@
 #ifdef HAVE_SYS_SOCKET_H
 # include <sys/socket.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_SYSCALL_H
+# include <sys/syscall.h>
+#endif
 #ifdef HAVE_SYS_WAIT_H
 # include <sys/wait.h>
 #endif
@@ -51,6 +60,9 @@
 #ifdef HAVE_POLL_H
 #include <poll.h>
 #endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 #ifdef __APPLE__
 # include <mach/mach_time.h>
 #endif
@@ -123,8 +135,8 @@ static const struct fd_ops master_socket_fd_ops =
 };
 
 
-struct thread *current = NULL;  /* thread handling the current request */
-unsigned int global_error = 0;  /* global error code for when no thread is current */
+DECLSPEC_DISPATCH_TLS struct thread *current = NULL;  /* thread handling the current request */
+DECLSPEC_DISPATCH_TLS unsigned int global_error = 0;  /* global error code for when no thread is current */
 timeout_t server_start_time = 0;  /* server startup time */
 int server_dir_fd = -1;    /* file descriptor for the server dir */
 int config_dir_fd = -1;    /* file descriptor for the config dir */
@@ -250,11 +262,19 @@ void write_reply( struct thread *thread )
         fatal_protocol_error( thread, "reply write: %s\n", strerror( errno ));
 }
 
+static void send_shm_reply( union generic_reply *reply );
+
 /* send a reply to the current thread */
 static void send_reply( union generic_reply *reply )
 {
     int ret;
 
+    if (current->shm_reply)
+    {
+        send_shm_reply( reply );
+        return;
+    }
+
     if (!current->reply_size)
     {
         if ((ret = write( get_unix_fd( current->reply_fd ),
@@ -292,6 +312,27 @@ static void send_reply( union generic_reply *reply )
         fatal_protocol_error( current, "reply write: %s\n", strerror( errno ));
 }
 
+/* send the reply to the request handled by the current thread */
+static void reply_to_request( enum request req, union generic_reply *reply )
+{
+    if (current)
+    {
+        if (current->reply_fd)
+        {
+            reply->reply_header.error = current->error;
+            reply->reply_header.reply_size = current->reply_size;
+            if (debug_level) trace_reply( req, reply );
+            send_reply( reply );
+        }
+        else
+        {
+            current->exit_code = 1;
+            kill_thread( current, 1 );  /* no way to continue without reply fd */
+        }
+    }
+    current = NULL;
+}
+
 /* call a request handler */
 static void call_req_handler( struct thread *thread )
 {
@@ -310,24 +351,467 @@ static void call_req_handler( struct thread *thread )
     else
         set_error( STATUS_NOT_IMPLEMENTED );
 
-    if (current)
+    reply_to_request( req, &reply );
+}
+
+/* requests that can be part of a batch */
+static const enum request batch_requests[] =
+{
+    REQ_close_handle,
+    REQ_get_key_value,
+    REQ_enum_key,
+    REQ_enum_key_value,
+    REQ_get_object_info,
+    REQ_get_object_type,
+    REQ_get_handle_unix_name,
+};
+
+static int is_batch_request( enum request req )
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(batch_requests); i++) if (batch_requests[i] == req) return 1;
+    return 0;
+}
+
+/* perform several requests in a single round trip */
+DECL_HANDLER(batch_requests)
+{
+    const union generic_request batch_req = current->req;
+    void *batch_data = current->req_data;
+    const char *data = get_req_data();
+    data_size_t size = get_req_data_size(), pos, reply_pos = 0, reply_max = 0;
+    const union generic_request *sub_req;
+    union generic_reply sub_reply;
+    char *replies;
+    int count = 0;
+
+    /* validate the requests before performing any of them */
+    for (pos = 0; pos < size; pos += sizeof(*sub_req) + BATCH_DATA_ALIGN( sub_req->request_header.request_size ))
     {
-        if (current->reply_fd)
+        sub_req = (const union generic_request *)(data + pos);
+        if (size - pos < sizeof(*sub_req) ||
+            sub_req->request_header.request_size > size - pos - sizeof(*sub_req) ||
+            !is_batch_request( sub_req->request_header.req ))
         {
-            reply.reply_header.error = current->error;
-            reply.reply_header.reply_size = current->reply_size;
-            if (debug_level) trace_reply( req, &reply );
-            send_reply( &reply );
+            set_error( STATUS_INVALID_PARAMETER );
+            return;
         }
+        reply_max += sizeof(sub_reply) + BATCH_DATA_ALIGN( sub_req->request_header.reply_size );
+    }
+    if (reply_max > get_reply_max_size())
+    {
+        set_error( STATUS_BUFFER_TOO_SMALL );
+        return;
+    }
+    if (!(replies = mem_alloc( reply_max ))) return;
+
+    for (pos = 0; pos < size; pos += sizeof(*sub_req) + BATCH_DATA_ALIGN( sub_req->request_header.request_size ))
+    {
+        sub_req = (const union generic_request *)(data + pos);
+        current->req = *sub_req;
+        current->req_data = (void *)(sub_req + 1);
+        current->reply_data = NULL;
+        current->reply_size = 0;
+        clear_error();
+        memset( &sub_reply, 0, sizeof(sub_reply) );
+
+        if (debug_level) trace_request();
+        req_handlers[current->req.request_header.req]( &current->req, &sub_reply );
+
+        sub_reply.reply_header.error = current->error;
+        sub_reply.reply_header.reply_size = current->reply_size;
+        if (debug_level) trace_reply( current->req.request_header.req, &sub_reply );
+        memcpy( replies + reply_pos, &sub_reply, sizeof(sub_reply) );
+        if (current->reply_size)
+            memcpy( replies + reply_pos + sizeof(sub_reply), current->reply_data, current->reply_size );
+        reply_pos += sizeof(sub_reply) + BATCH_DATA_ALIGN( current->reply_size );
+        free( current->reply_data );
+        count++;
+    }
+
+    current->req = batch_req;
+    current->req_data = batch_data;
+    current->reply_data = NULL;
+    current->reply_size = 0;
+    clear_error();
+    reply->count = count;
+    set_reply_data_ptr( replies, reply_pos );
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+
+/* Parallel request dispatch
+ *
+ * Requests that only look at the server state are not handled right away,
+ * they are collected while the main loop processes a batch of poll events
+ * and then handled concurrently by the dispatch worker threads. Nothing
+ * else runs in the server while they are being handled, so the only shared
+ * state they modify is the object refcounts, which are updated atomically.
+ * The replies are then sent from the main thread.
+ */
+
+#define MAX_PARALLEL_REQUESTS 128
+
+static const enum request parallel_requests[] =
+{
+    REQ_get_key_value,          /* registry reads */
+    REQ_enum_key,
+    REQ_enum_key_value,
+    REQ_get_object_info,        /* object and file information queries */
+    REQ_get_object_type,
+    REQ_get_handle_unix_name,
+};
+
+static struct thread *parallel_threads[MAX_PARALLEL_REQUESTS];        /* threads with a pending request */
+static union generic_reply parallel_replies[MAX_PARALLEL_REQUESTS];   /* replies to the pending requests */
+static int parallel_count;      /* number of pending requests */
+static int parallel_next;       /* index of the next request to handle */
+static int nb_dispatch_workers = -1;  /* number of worker threads, -1 if not initialized yet */
+static int nb_idle_workers;     /* number of workers done with the current batch */
+static unsigned int dispatch_batch;   /* sequence number of the current batch */
+static unsigned char is_parallel_request[REQ_NB_REQUESTS];
+
+static pthread_mutex_t dispatch_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dispatch_start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t dispatch_done_cond = PTHREAD_COND_INITIALIZER;
+
+/* handle pending requests until there are none left in the batch */
+static void handle_parallel_requests(void)
+{
+    int i;
+
+    while ((i = interlocked_xchg_add( &parallel_next, 1 )) < parallel_count)
+    {
+        struct thread *thread = parallel_threads[i];
+
+        current = thread;
+        current->reply_size = 0;
+        clear_error();
+        memset( &parallel_replies[i], 0, sizeof(parallel_replies[i]) );
+        req_handlers[thread->req.request_header.req]( &thread->req, &parallel_replies[i] );
+    }
+    current = NULL;
+}
+
+static void *dispatch_worker( void *arg )
+{
+    unsigned int batch = 0;
+
+    pthread_mutex_lock( &dispatch_mutex );
+    for (;;)
+    {
+        while (batch == dispatch_batch) pthread_cond_wait( &dispatch_start_cond, &dispatch_mutex );
+        batch = dispatch_batch;
+        pthread_mutex_unlock( &dispatch_mutex );
+
+        handle_parallel_requests();
+
+        pthread_mutex_lock( &dispatch_mutex );
+        if (++nb_idle_workers == nb_dispatch_workers) pthread_cond_signal( &dispatch_done_cond );
+    }
+    return NULL;
+}
+
+/* start the worker threads, as requested by the WINESERVER_THREADS variable */
+static void init_dispatch_workers(void)
+{
+    const char *env = getenv( "WINESERVER_THREADS" );
+    sigset_t sigset, old_sigset;
+    unsigned int i;
+    pthread_t id;
+    int count;
+
+    nb_dispatch_workers = 0;
+    if (!env || (count = atoi( env )) <= 1) return;
+    count = min( count, 64 ) - 1;  /* the main thread handles requests too */
+
+    /* signals must always be handled by the main thread */
+    sigfillset( &sigset );
+    pthread_sigmask( SIG_BLOCK, &sigset, &old_sigset );
+    while (nb_dispatch_workers < count)
+    {
+        if (pthread_create( &id, NULL, dispatch_worker, NULL )) break;
+        pthread_detach( id );
+        nb_dispatch_workers++;
+    }
+    pthread_sigmask( SIG_SETMASK, &old_sigset, NULL );
+
+    for (i = 0; i < ARRAY_SIZE(parallel_requests); i++) is_parallel_request[parallel_requests[i]] = 1;
+    if (debug_level) fprintf( stderr, "wineserver: using %d request dispatch threads\n", nb_dispatch_workers + 1 );
+}
+
+/* defer the request of a thread until the current batch is flushed, return 0 if not possible */
+static int defer_request( struct thread *thread )
+{
+    enum request req = thread->req.request_header.req;
+
+    if (nb_dispatch_workers == -1) init_dispatch_workers();
+    if (!nb_dispatch_workers || debug_level) return 0;
+    if (req >= REQ_NB_REQUESTS || !is_parallel_request[req]) return 0;
+
+    if (parallel_count == MAX_PARALLEL_REQUESTS) flush_parallel_requests();
+    parallel_threads[parallel_count++] = (struct thread *)grab_object( thread );
+    return 1;
+}
+
+/* handle all the deferred requests */
+void flush_parallel_requests(void)
+{
+    struct thread *thread;
+    int i, count = 0;
+
+    /* threads may have been killed while their request was pending */
+    for (i = 0; i < parallel_count; i++)
+    {
+        thread = parallel_threads[i];
+        if (thread->state != TERMINATED) parallel_threads[count++] = thread;
         else
         {
-            current->exit_code = 1;
-            kill_thread( current, 1 );  /* no way to continue without reply fd */
+            free( thread->req_data );
+            thread->req_data = NULL;
+            release_object( thread );
         }
     }
-    current = NULL;
+    if (!(parallel_count = count)) return;
+
+    parallel_next = 0;
+    if (count > 1)
+    {
+        pthread_mutex_lock( &dispatch_mutex );
+        nb_idle_workers = 0;
+        dispatch_batch++;
+        pthread_cond_broadcast( &dispatch_start_cond );
+        pthread_mutex_unlock( &dispatch_mutex );
+
+        handle_parallel_requests();
+
+        pthread_mutex_lock( &dispatch_mutex );
+        while (nb_idle_workers < nb_dispatch_workers)
+            pthread_cond_wait( &dispatch_done_cond, &dispatch_mutex );
+        pthread_mutex_unlock( &dispatch_mutex );
+    }
+    else handle_parallel_requests();
+
+    parallel_count = 0;
+    for (i = 0; i < count; i++)
+    {
+        thread = parallel_threads[i];
+        current = thread;
+        reply_to_request( thread->req.request_header.req, &parallel_replies[i] );
+        free( thread->req_data );
+        thread->req_data = NULL;
+        release_object( thread );
+    }
+}
+
+#else  /* HAVE_PTHREAD_H && __GNUC__ */
+
+static inline int defer_request( struct thread *thread )
+{
+    return 0;
+}
+
+void flush_parallel_requests(void)
+{
+}
+
+#endif  /* HAVE_PTHREAD_H && __GNUC__ */
+
+#if defined(HAVE_SYS_EVENTFD_H) && defined(__linux__)
+
+/* Shared memory requests
+ *
+ * A client can ask for a shared memory area and a doorbell eventfd. It then
+ * writes its request in the shared memory, bumps the request sequence number
+ * and signals the doorbell. The reply is written back in the shared memory,
+ * and the client is woken through a futex on the reply sequence number if it
+ * went to sleep waiting for it. If the client asked for it, the server then
+ * busy-polls the request sequence number for a short while, and the client
+ * doesn't signal the doorbell while it does, so that a request following
+ * closely the previous one doesn't need any system call. The main loop is
+ * single-threaded, so the polling is kept short, and a thread only gets a
+ * few requests in a row before the other clients get their turn.
+ */
+
+#define MAX_SHM_SPIN   256  /* upper bound of the server busy-polling iterations */
+#define MAX_SHM_BATCH  16   /* requests handled in a row before going back to the main loop */
+
+static void doorbell_poll_event( struct fd *fd, int event );
+
+static const struct fd_ops doorbell_fd_ops =
+{
+    NULL,                      /* get_poll_events */
+    doorbell_poll_event,       /* poll_event */
+    NULL,                      /* get_fd_type */
+    no_fd_read,                /* read */
+    no_fd_write,               /* write */
+    no_fd_flush,               /* flush */
+    no_fd_get_file_info,       /* get_file_info */
+    no_fd_get_volume_info,     /* get_volume_info */
+    no_fd_ioctl,               /* ioctl */
+    NULL,                      /* queue_async */
+    NULL                       /* reselect_async */
+};
+
+/* handle a request that was written in the shared memory, return 0 if there was none */
+static int read_shm_request( struct thread *thread )
+{
+    volatile struct request_shm *shm = thread->request_shm;
+    const union generic_request *req = (const union generic_request *)((char *)shm + REQUEST_SHM_REQ);
+    data_size_t size;
+
+    if (!shm || thread->shm_reply || shm->req_seq == shm->reply_seq) return 0;  /* nothing new */
+
+    thread->req = *req;
+    if ((size = thread->req.request_header.request_size))
+    {
+        if (size > REQUEST_SHM_REPLY - REQUEST_SHM_REQ - sizeof(*req))
+        {
+            fatal_protocol_error( thread, "shared memory request too large %u\n", size );
+            return 0;
+        }
+        if (!(thread->req_data = malloc( size )))
+        {
+            fatal_protocol_error( thread, "no memory for %u bytes request %d\n",
+                                  size, thread->req.request_header.req );
+            return 0;
+        }
+        memcpy( thread->req_data, req + 1, size );
+    }
+    thread->shm_reply = 1;
+    if (defer_request( thread )) return 1;
+    call_req_handler( thread );
+    free( thread->req_data );
+    thread->req_data = NULL;
+    return 1;
+}
+
+/* busy-poll for the next request of a thread, return 1 if one is ready */
+static int poll_shm_request( struct thread *thread )
+{
+    volatile struct request_shm *shm = thread->request_shm;
+    unsigned int i;
+
+    if (!shm || !thread->shm_spin || thread->shm_reply) return 0;
+
+    shm->server_polling = 1;
+    for (i = 0; i < thread->shm_spin && shm->req_seq == shm->reply_seq; i++)
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        __asm__ __volatile__( "rep;nop" : : : "memory" );
+#else
+        __asm__ __volatile__( "" : : : "memory" );
+#endif
+    }
+    /* the client checks server_polling after updating req_seq, so either it
+     * signals the doorbell or we see the new request here */
+    interlocked_xchg( (int *)&shm->server_polling, 0 );
+    return shm->req_seq != shm->reply_seq;
+}
+
+static void doorbell_poll_event( struct fd *fd, int event )
+{
+    struct thread *thread = get_fd_user( fd );
+    uint64_t value;
+    int i;
+
+    if (read( get_unix_fd( fd ), &value, sizeof(value) ) != sizeof(value)) return;
+
+    grab_object( thread );
+    for (i = 0; i < MAX_SHM_BATCH; i++)
+        if (!read_shm_request( thread ) || !poll_shm_request( thread )) break;
+
+    /* a request is pending that the client didn't signal, ring the doorbell ourselves */
+    if (i == MAX_SHM_BATCH && thread->doorbell_fd)
+    {
+        value = 1;
+        write( get_unix_fd( thread->doorbell_fd ), &value, sizeof(value) );
+    }
+    release_object( thread );
 }
 
+/* send a reply through the shared memory */
+static void send_shm_reply( union generic_reply *reply )
+{
+    volatile struct request_shm *shm = current->request_shm;
+    char *ptr = (char *)shm + REQUEST_SHM_REPLY;
+
+    memcpy( ptr, reply, sizeof(*reply) );
+    if (current->reply_size) memcpy( ptr + sizeof(*reply), current->reply_data, current->reply_size );
+    free( current->reply_data );
+    current->reply_data = NULL;
+    current->shm_reply = 0;
+
+    interlocked_xchg( (int *)&shm->reply_seq, shm->req_seq );
+    if (shm->client_waiting)
+        syscall( __NR_futex, &shm->reply_seq, 1 /* FUTEX_WAKE */, 1, NULL, 0, 0 );
+}
+
+/* free the shared memory request resources of a thread */
+void free_request_shm( struct thread *thread )
+{
+    if (thread->request_shm) munmap( (void *)thread->request_shm, REQUEST_SHM_SIZE );
+    if (thread->doorbell_fd) release_object( thread->doorbell_fd );
+    thread->request_shm = NULL;
+    thread->doorbell_fd = NULL;
+    thread->shm_reply = 0;
+    thread->shm_spin = 0;
+}
+
+/* retrieve the shared memory and doorbell for passing requests */
+DECL_HANDLER(get_request_shm)
+{
+    int shm_fd, doorbell;
+    void *ptr;
+
+    if (current->request_shm)
+    {
+        set_error( STATUS_INVALID_PARAMETER );
+        return;
+    }
+    if ((shm_fd = create_temp_file( REQUEST_SHM_SIZE )) == -1) return;
+    if ((ptr = mmap( NULL, REQUEST_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0 )) == MAP_FAILED)
+    {
+        file_set_error();
+        close( shm_fd );
+        return;
+    }
+    if ((doorbell = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK )) == -1 ||
+        !(current->doorbell_fd = create_anonymous_fd( &doorbell_fd_ops, doorbell, &current->obj, 0 )))
+    {
+        if (doorbell == -1) file_set_error();
+        munmap( ptr, REQUEST_SHM_SIZE );
+        close( shm_fd );
+        return;
+    }
+    current->request_shm = ptr;
+    current->shm_spin = min( req->spin, MAX_SHM_SPIN );
+    set_fd_events( current->doorbell_fd, POLLIN );
+
+    send_client_fd( current->process, shm_fd, 0 );
+    send_client_fd( current->process, doorbell, 0 );
+    close( shm_fd );
+    reply->size = REQUEST_SHM_SIZE;
+}
+
+#else  /* HAVE_SYS_EVENTFD_H && __linux__ */
+
+static void send_shm_reply( union generic_reply *reply )
+{
+}
+
+void free_request_shm( struct thread *thread )
+{
+}
+
+DECL_HANDLER(get_request_shm)
+{
+    set_error( STATUS_NOT_IMPLEMENTED );
+}
+
+#endif  /* HAVE_SYS_EVENTFD_H && __linux__ */
+
 /* read a request from a thread */
 void read_request( struct thread *thread )
 {
@@ -340,7 +824,7 @@ void read_request( struct thread *thread )
         if (!(thread->req_toread = thread->req.request_header.request_size))
         {
             /* no data, handle request at once */
-            call_req_handler( thread );
+            if (!defer_request( thread )) call_req_handler( thread );
             return;
         }
         if (!(thread->req_data = malloc( thread->req_toread )))
@@ -361,6 +845,7 @@ void read_request( struct thread *thread )
         if (ret <= 0) break;
         if (!(thread->req_toread -= ret))
         {
+            if (defer_request( thread )) return;
             call_req_handler( thread );
             free( thread->req_data );
             thread->req_data = NULL;
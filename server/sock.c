@@ -805,6 +805,7 @@ static int accept_into_socket( struct sock *sock, struct sock *acceptsock )
     acceptsock->deferred = NULL;
     acceptsock->connect_time = current_time;
     fd_copy_completion( acceptsock->fd, newfd );
+    invalidate_fd_cache( acceptsock->fd );
     release_object( acceptsock->fd );
     acceptsock->fd = newfd;
 
@@ -73,6 +73,10 @@ struct thread
     struct fd             *request_fd;    /* fd for receiving client requests */
     struct fd             *reply_fd;      /* fd to send a reply to a client */
     struct fd             *wait_fd;       /* fd to use to wake a sleeping client */
+    volatile struct request_shm *request_shm; /* shared memory for passing requests, if any */
+    struct fd             *doorbell_fd;   /* eventfd signaled when a shared memory request is ready */
+    int                    shm_reply;     /* should the current request be replied in shared memory? */
+    unsigned int           shm_spin;      /* number of iterations to busy-poll for shared memory requests */
     enum run_state         state;         /* running state */
     int                    exit_code;     /* thread exit code */
     int                    unix_pid;      /* Unix pid of client */
@@ -98,7 +102,14 @@ struct thread_snapshot
     int             priority;  /* priority class */
 };
 
-extern struct thread *current;
+/* with parallel request dispatch, each worker thread handles its own current thread */
+#ifdef __GNUC__
+# define DECLSPEC_DISPATCH_TLS __thread
+#else
+# define DECLSPEC_DISPATCH_TLS
+#endif
+
+extern DECLSPEC_DISPATCH_TLS struct thread *current;
 
 /* thread functions */
 
@@ -141,7 +152,7 @@ extern int send_thread_signal( struct thread *thread, int sig );
 extern void get_selector_entry( struct thread *thread, int entry, unsigned int *base,
                                 unsigned int *limit, unsigned char *flags );
 
-extern unsigned int global_error;  /* global error code for when no thread is current */
+extern DECLSPEC_DISPATCH_TLS unsigned int global_error;  /* global error code for when no thread is current */
 
 static inline unsigned int get_error(void)       { return current ? current->error : global_error; }
 static inline void set_error( unsigned int err ) { global_error = err; if (current) current->error = err; }